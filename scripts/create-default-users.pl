@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+#
+#  Create a "users" file with many DEFAULT entries, and requests
+#  which match them, for benchmarking the "files" module.
+#
+#  The DEFAULT entries check NAS-IP-Address, Called-Station-Id, and
+#  Service-Type, which is typical of large users files.  Every tenth
+#  entry uses a regular expression, so it can't be indexed.
+#
+#  Usage: create-default-users.pl <number of entries> [<number of requests>]
+#
+#  Writes "./users.default", and "./requests.default", which is a
+#  radclient input file.  Then, configure the "files" module with
+#  "filename = /path/to/users.default", and run something like:
+#
+#	radclient -q -c 100 -p 64 -f requests.default localhost auth testing123
+#
+#  $Id$
+#
+use strict;
+use warnings;
+
+if (!defined $ARGV[0] || $ARGV[0] !~ /^\d+$/) {
+	print "\n\tUsage:  $0  <number of entries> [<number of requests>]\n\n";
+	exit(1);
+}
+
+my $num_entries = $ARGV[0];
+my $num_requests = defined $ARGV[1] ? $ARGV[1] : 1000;
+my @service_types = ("Framed-User", "Login-User", "Outbound-User");
+
+sub nas_ip {
+	my $n = shift;
+
+	return sprintf("10.%d.%d.%d", ($n >> 16) & 0xff, ($n >> 8) & 0xff, ($n & 0xff) + 1);
+}
+
+sub ap_name {
+	my $n = shift;
+
+	return sprintf("ap-%05d", $n);
+}
+
+open(my $users, ">", "./users.default") || die "Can't open ./users.default: $!";
+open(my $requests, ">", "./requests.default") || die "Can't open ./requests.default: $!";
+
+for (my $i = 0; $i < $num_entries; $i++) {
+	my $service = $service_types[$i % 3];
+
+	if (($i % 10) == 9) {
+		printf $users "DEFAULT\tCalled-Station-Id =~ /^%s\$/, Service-Type == %s\n", ap_name($i), $service;
+	} elsif (($i % 2) == 0) {
+		printf $users "DEFAULT\tNAS-IP-Address == %s, Service-Type == %s\n", nas_ip($i), $service;
+	} else {
+		printf $users "DEFAULT\tCalled-Station-Id == \"%s\", Service-Type == %s\n", ap_name($i), $service;
+	}
+	printf $users "\tReply-Message := \"entry %d\"\n\n", $i;
+}
+
+#
+#  Requests match entries spread evenly through the file.
+#
+for (my $i = 0; $i < $num_requests; $i++) {
+	my $n = int(($i * $num_entries) / $num_requests);
+
+	print $requests "User-Name = \"user$i\"\n";
+	print $requests "User-Password = \"testing\"\n";
+	printf $requests "NAS-IP-Address = %s\n", nas_ip($n);
+	printf $requests "Called-Station-Id = \"%s\"\n", ap_name($n);
+	printf $requests "Service-Type = %s\n", $service_types[$n % 3];
+	print $requests "\n";
+}
+
+close($users);
+close($requests);
@@ -24,6 +24,7 @@ HEADERS	= \
 	hash.h \
 	heap.h \
 	libradius.h \
+	lpm.h \
 	md4.h \
 	md5.h \
 	modules.h \
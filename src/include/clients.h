@@ -41,6 +41,7 @@ typedef struct radclient {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_md5_key_t		secret_key;		//!< Precomputed MD5 states for the secret.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 
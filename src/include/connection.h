@@ -63,6 +63,12 @@ typedef struct fr_connection_pool_state {
 	uint32_t       	num;			//!< Number of connections in the pool.
 	uint32_t	active;	 		//!< Number of currently reserved connections.
 
+	uint32_t	thread_caches;		//!< Number of threads with a connection cache.
+	uint32_t	thread_cached;		//!< Idle connections held in thread caches.  These are
+						//!< included in active.
+	uint64_t	thread_hits;		//!< Reservations satisfied from a thread cache.
+	uint64_t	thread_misses;		//!< Reservations which fell back to the shared pool.
+
 	bool		reconnecting;		//!< We are currently reconnecting the pool.
 } fr_connection_pool_state_t;
 
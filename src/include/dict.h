@@ -78,19 +78,24 @@ typedef struct fr_dict fr_dict_t;
 extern fr_dict_t *fr_dict_internal;
 
 /** Dictionary attribute
+ *
+ * The fields used when decoding come first, and are packed without
+ * holes, so that a lookup of a child only touches one cache line of
+ * the parent.
  */
 struct dict_attr {
-	unsigned int		vendor;				//!< Vendor that defines this attribute.
 	unsigned int		attr;				//!< Attribute number.
 	fr_type_t			type;				//!< Value type.
+	unsigned int		vendor;				//!< Vendor that defines this attribute.
+	unsigned int		depth;				//!< Depth of nesting for this attribute.
 
 	fr_dict_attr_t const	*parent;			//!< Immediate parent of this attribute.
-	fr_dict_attr_t const	**children;			//!< Children of this attribute.
+	fr_dict_attr_t const	**child_index;			//!< Children indexed directly by number.
+	fr_dict_attr_t const	**children;			//!< Children of this attribute, hashed into bins.
 	fr_dict_attr_t const	*next;				//!< Next child in bin.
 
-	unsigned int		depth;				//!< Depth of nesting for this attribute.
-
 	fr_dict_attr_flags_t	flags;				//!< Flags.
+	unsigned int		child_index_len;		//!< Number of entries in child_index.
 	char			name[1];			//!< Attribute name.
 };
 
@@ -28,7 +28,28 @@ RCSIDH(event_h, "$Id$")
 
 #include <freeradius-devel/missing.h>
 #include <stdbool.h>
+
+#ifdef WITH_EVENT_EPOLL
+#include <stdint.h>
+
+/*
+ *	The epoll backend doesn't need libkqueue.  Define just enough of
+ *	struct kevent for EVFILT_USER callbacks, so that the users of
+ *	fr_event_user_handler_t don't need to care which backend is in use.
+ */
+#define EVFILT_USER	(-11)
+
+struct kevent {
+	uintptr_t	ident;		//!< Identifier for this event.
+	int16_t		filter;		//!< Filter for event.
+	uint16_t	flags;		//!< Action flags.
+	uint32_t	fflags;		//!< Filter flag value.
+	intptr_t	data;		//!< Filter data value.
+	void		*udata;		//!< Opaque user data identifier.
+};
+#else
 #include <sys/event.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +67,13 @@ typedef struct fr_event_list_t fr_event_list_t;
  */
 typedef struct fr_event_timer_t fr_event_timer_t;
 
+/** User event ident passed to #fr_event_user_handler_t when the backend can't tell user events apart
+ *
+ * The epoll backend signals all user events via a single eventfd, so the
+ * handler is called with this ident, and should check all of its sources.
+ */
+#define FR_EVENT_USER_ANY	((uintptr_t) -1)
+
 /** Called when a timer event fires
  *
  * @param[in] now	The current time.
@@ -82,6 +110,7 @@ int		fr_event_list_num_fds(fr_event_list_t *el);
 int		fr_event_list_num_elements(fr_event_list_t *el);
 int		fr_event_list_kq(fr_event_list_t *el);
 int		fr_event_list_time(struct timeval *when, fr_event_list_t *el);
+int		fr_event_list_timer_wheel(fr_event_list_t *el);
 
 int		fr_event_fd_delete(fr_event_list_t *el, int fd);
 int		fr_event_fd_insert(fr_event_list_t *el, int fd,
@@ -95,10 +124,14 @@ int		fr_event_timer_insert(fr_event_list_t *el,
 				      fr_event_callback_t callback,
 				      void const *ctx, struct timeval *when, fr_event_timer_t **parent);
 int		fr_event_timer_run(fr_event_list_t *el, struct timeval *when);
+int		fr_event_timer_run_all(fr_event_list_t *el, struct timeval *when);
 
 int		fr_event_user_insert(fr_event_list_t *el, fr_event_user_handler_t user, void *ctx) CC_HINT(nonnull(1,2));
 int		fr_event_user_delete(fr_event_list_t *el, fr_event_user_handler_t user, void *ctx) CC_HINT(nonnull(1,2));
 
+int		fr_event_user_listen(int kq, uintptr_t ident);
+int		fr_event_user_trigger(int kq, uintptr_t ident);
+
 int		fr_event_corral(fr_event_list_t *el, bool wait);
 void		fr_event_service(fr_event_list_t *el);
 
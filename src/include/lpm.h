@@ -0,0 +1,47 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_LPM_H
+#define _FR_LPM_H
+/**
+ * $Id$
+ *
+ * @file include/lpm.h
+ * @brief Longest prefix match tables for IP addresses.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSIDH(lpm_h, "$Id$")
+
+#include <talloc.h>
+#include <freeradius-devel/inet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_lpm_t fr_lpm_t;
+
+fr_lpm_t	*fr_lpm_create(TALLOC_CTX *ctx);
+int		fr_lpm_insert(fr_lpm_t *lpm, fr_ipaddr_t const *ipaddr, void *data);
+void		*fr_lpm_remove(fr_lpm_t *lpm, fr_ipaddr_t const *ipaddr);
+void		*fr_lpm_find(fr_lpm_t const *lpm, fr_ipaddr_t const *ipaddr);
+void		*fr_lpm_find_exact(fr_lpm_t const *lpm, fr_ipaddr_t const *ipaddr);
+uint32_t	fr_lpm_num_entries(fr_lpm_t const *lpm);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_LPM_H */
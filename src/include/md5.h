@@ -36,6 +36,10 @@ extern "C" {
 #  define MD5_DIGEST_LENGTH 16
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * The MD5 code used here and in md5.c was originally retrieved from:
@@ -51,7 +55,6 @@ extern "C" {
  * except that you don't need to include two pages of legalese
  * with every copy.
  */
-#  define MD5_BLOCK_LENGTH 64
 typedef struct FR_MD5Context {
 	uint32_t state[4];			//!< State.
 	uint32_t count[2];			//!< Number of bits, mod 2^64.
@@ -78,14 +81,53 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
 #endif
 
+/** Precomputed MD5 states for a key which is used many times
+ *
+ *  Hashing the HMAC pads, or the key which prefixes a digest, gives
+ *  the same result every time.  So we do it once, and copy the
+ *  states for each message.
+ */
+typedef struct fr_md5_key_t {
+	uint8_t const	*key;				//!< the key.  Not copied.
+	size_t		key_len;			//!< length of the key.
+	FR_MD5_CTX	inner;				//!< state after hashing K XOR ipad.
+	FR_MD5_CTX	outer;				//!< state after hashing K XOR opad.
+	FR_MD5_CTX	prefix;				//!< state after hashing K.
+} fr_md5_key_t;
+
 /* hmac.c */
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
+void	fr_md5_key_init(fr_md5_key_t *mk, uint8_t const *key, size_t key_len);
+void	fr_hmac_md5_key(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			fr_md5_key_t const *mk)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
 
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
 
+/* md5_mb.c */
+#define FR_MD5_MB_MAX_IN	4
+
+/** One message for the multi-buffer MD5 functions
+ *
+ */
+typedef struct fr_md5_mb_job_t {
+	uint8_t const	*in[FR_MD5_MB_MAX_IN];		//!< fragments of the message, in order.
+	size_t		inlen[FR_MD5_MB_MAX_IN];	//!< length of each fragment.
+	int		num_in;				//!< number of fragments.
+	uint32_t const	*iv;				//!< state to start from, or NULL for the MD5 IV.
+	size_t		ivlen;				//!< bytes already hashed into "iv".  A multiple of 64.
+	uint8_t		*out;				//!< where the digest is written.
+} fr_md5_mb_job_t;
+
+void	fr_md5_mb(fr_md5_mb_job_t *jobs, int num);
+void	fr_hmac_md5_mb(uint8_t *digest[], uint8_t const *text[], size_t const text_len[],
+		       uint8_t const *key[], size_t const key_len[], int num);
+char const *fr_md5_mb_engine(void);
+int	fr_md5_mb_engine_set(char const *name);
+
 #ifdef __cplusplus
 }
 #endif
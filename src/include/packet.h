@@ -62,6 +62,8 @@ typedef struct radius_packet {
 	uint8_t			*data;			//!< Packet data (body).
 	size_t			data_len;		//!< Length of packet data.
 	VALUE_PAIR		*vps;			//!< Result of decoding the packet into VALUE_PAIRs.
+	void			*decode_pool;		//!< Pool the decoded VALUE_PAIRs were allocated from.
+	size_t			decode_pool_size;	//!< Size of the decode pool.
 
 	uint32_t       		rounds;			//!< for State[0]
 
@@ -202,6 +202,17 @@ int		fr_pair_update_by_num(TALLOC_CTX *ctx, VALUE_PAIR **list,
 
 void		fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int attr, int8_t tag);
 
+/* Indexed searching */
+typedef struct fr_pair_list_index fr_pair_list_index_t;
+
+fr_pair_list_index_t *fr_pair_list_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **head);
+
+VALUE_PAIR	*fr_pair_list_index_head(fr_pair_list_index_t const *index);
+
+VALUE_PAIR	*fr_pair_list_index_find(fr_pair_list_index_t *index, fr_dict_attr_t const *da, int8_t tag);
+
+void		fr_pair_list_index_invalidate(void);
+
 /* Sorting */
 typedef		int8_t (*fr_cmp_t)(void const *a, void const *b);
 
@@ -545,6 +545,8 @@ void		paircompare_unregister(fr_dict_attr_t const *attr, RAD_COMPARE_FUNC func);
 void		paircompare_unregister_instance(void *instance);
 int		paircompare(REQUEST *request, VALUE_PAIR *req_list,
 			    VALUE_PAIR *check, VALUE_PAIR **rep_list);
+int		paircompare_index(REQUEST *request, fr_pair_list_index_t *index,
+				  VALUE_PAIR *check, VALUE_PAIR **rep_list);
 vp_tmpl_t	*xlat_to_tmpl_attr(TALLOC_CTX *ctx, xlat_exp_t *xlat);
 xlat_exp_t		*xlat_from_tmpl_attr(TALLOC_CTX *ctx, vp_tmpl_t *vpt);
 int		xlat_eval_do(REQUEST *request, VALUE_PAIR *vp);
@@ -577,6 +579,9 @@ int radius_copy_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, char con
 int		thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers);
 int		thread_pool_init(void);
 void		thread_pool_stop(void);
+#ifdef WITH_STATS
+void		thread_pool_queue_stats(uint32_t *queue_len, uint32_t *queue_max, uint32_t *pps_in, uint32_t *pps_out);
+#endif
 
 /*
  *	In threads.c
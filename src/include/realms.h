@@ -96,6 +96,7 @@ typedef struct home_server {
 	fr_socket_limit_t 	limit;
 
 	char const		*secret;
+	fr_md5_key_t		secret_key;		//!< Precomputed MD5 states for the secret.
 
 	fr_event_timer_t		*ev;
 	struct timeval		when;
@@ -26,9 +26,16 @@ RCSID("$Id$")
 
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/control.h>
+#include <freeradius-devel/io/spsc_queue.h>
 #include <freeradius-devel/fr_log.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /*
  *	Debugging, mainly for channel_test
  */
@@ -49,7 +56,7 @@ RCSID("$Id$")
 #define SIGNAL_INTERVAL (1000000)
 
 /**
- *	Size of the atomic queues.
+ *	Size of the message queues.
  *
  *	The queue reader MUST service the queue occasionally,
  *	otherwise the writer will not be able to write.  If it's too
@@ -60,7 +67,7 @@ RCSID("$Id$")
  *	The reader SHOULD service the queues at inter-packet latency.
  *	i.e. at 1M pps, the queue will get serviced every microsecond.
  */
-#define ATOMIC_QUEUE_SIZE (1024)
+#define CHANNEL_QUEUE_SIZE (1024)
 
 typedef enum fr_channel_signal_t {
 	FR_CHANNEL_SIGNAL_ERROR			= FR_CHANNEL_ERROR,
@@ -85,7 +92,7 @@ typedef struct fr_channel_control_t {
 
 /**
  *  One end of a channel, which consists of a kqueue descriptor, and
- *  an atomic queue.  The atomic queue is there to get bulk data
+ *  a message queue.  The message queue is there to get bulk data
  *  through, because it's more efficient than pushing 1M+ events per
  *  second through a kqueue.
  */
@@ -104,6 +111,11 @@ typedef struct fr_channel_end_t {
 
 	size_t			num_kevents;	//!< number of times we've looked at kevents
 
+	size_t			num_coalesced;	//!< number of batches which didn't need a signal
+
+	bool			coalesce;	//!< signal once per batch, via fr_channel_send_flush()
+	bool			signal_pending;	//!< we've sent data, but not signaled
+
 	uint64_t		sequence;	//!< sequence number for this channel.
 	uint64_t		ack;		//!< sequence number of the other end
 	uint64_t		their_view_of_my_sequence;	//!< should be clear
@@ -118,7 +130,7 @@ typedef struct fr_channel_end_t {
 
 	fr_time_t		last_sent_signal; //!< the last time when we signaled the other end
 
-	fr_atomic_queue_t	*aq;		//!< the queue of messages - visible only to this channel
+	fr_spsc_queue_t		*sq;		//!< the queue of messages - visible only to this channel
 } fr_channel_end_t;
 
 /**
@@ -130,6 +142,10 @@ typedef struct fr_channel_t {
 
 	bool			active;		//!< is this channel active?
 
+	_Atomic(uint64_t)	stolen_ack;	//!< highest request sequence stolen by another worker
+
+	atomic_bool		worker_sleeping; //!< the worker may be asleep, and has to be signaled
+
 	fr_channel_end_t	end[2];		//!< two ends of the channel
 } fr_channel_t;
 
@@ -155,14 +171,19 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 		return NULL;
 	}
 
-	ch->end[TO_WORKER].aq = fr_atomic_queue_create(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[TO_WORKER].aq) {
+	/*
+	 *	Each direction has exactly one writer and one reader,
+	 *	so we don't need the MPMC atomic queue.  See
+	 *	fr_channel_stealable() for the one exception.
+	 */
+	ch->end[TO_WORKER].sq = fr_spsc_queue_create(ch, CHANNEL_QUEUE_SIZE);
+	if (!ch->end[TO_WORKER].sq) {
 		talloc_free(ch);
 		goto nomem;
 	}
 
-	ch->end[FROM_WORKER].aq = fr_atomic_queue_create(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[FROM_WORKER].aq) {
+	ch->end[FROM_WORKER].sq = fr_spsc_queue_create(ch, CHANNEL_QUEUE_SIZE);
+	if (!ch->end[FROM_WORKER].sq) {
 		talloc_free(ch);
 		goto nomem;
 	}
@@ -203,14 +224,38 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 
 	ch->active = true;
 
+	/*
+	 *	The worker hasn't started polling the channel, so
+	 *	the first batch always gets a signal.
+	 */
+	atomic_init(&ch->worker_sleeping, true);
+
 	return ch;
 }
 
 
+/** Get the workers ACK for a channel
+ *
+ *  Requests which were stolen by another worker have been received,
+ *  even though the worker which owns the channel never saw them.
+ *
+ * @param[in] ch the channel
+ * @return the highest request sequence which has been taken from the channel.
+ */
+static uint64_t fr_channel_worker_ack(fr_channel_t *ch)
+{
+	uint64_t stolen;
+
+	stolen = atomic_load_explicit(&ch->stolen_ack, memory_order_acquire);
+	if (stolen > ch->end[FROM_WORKER].ack) return stolen;
+
+	return ch->end[FROM_WORKER].ack;
+}
+
 /** Send a message via a kq user signal
  *
  *  Note that the caller doesn't care about data in the event, that is
- *  sent via the atomic queue.  The kevent code takes care of
+ *  sent via the message queue.  The kevent code takes care of
  *  delivering the signal once, even if it's sent by multiple master
  *  threads.
  *
@@ -235,7 +280,7 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	end->num_signals++;
 
 	cc.signal = which;
-	cc.ack = end->ack;
+	cc.ack = (end == &ch->end[FROM_WORKER]) ? fr_channel_worker_ack(ch) : end->ack;
 	cc.ch = ch;
 
 	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
@@ -277,8 +322,8 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	 *	Push the message onto the queue for the other end.  If
 	 *	the push fails, the caller should try another queue.
 	 */
-	if (!fr_atomic_queue_push(master->aq, cd)) {
-		fr_strerror_printf("Failed pushing to atomic queue");
+	if (!fr_spsc_queue_push(master->sq, cd)) {
+		fr_strerror_printf("Failed pushing to message queue");
 		*p_reply = fr_channel_recv_reply(ch);
 		return -1;
 	}
@@ -300,6 +345,16 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 
 	MPRINT("MASTER requests %zd, num_outstanding %zd\n", master->num_packets, master->num_outstanding);
 
+	/*
+	 *	The caller will signal the worker once, after it has
+	 *	sent a whole batch.  We still look for replies.
+	 */
+	if (master->coalesce) {
+		master->signal_pending = true;
+		*p_reply = (master->num_outstanding > 1) ? fr_channel_recv_reply(ch) : NULL;
+		return 0;
+	}
+
 #if ENABLE_SKIPS
 	/*
 	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
@@ -335,6 +390,70 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	return fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
 }
 
+/** Signal the worker, if necessary, after sending a batch of requests
+ *
+ *  Only needed when coalescing is enabled via
+ *  fr_channel_signal_coalesce().  The worker is only signaled if it
+ *  may be asleep.  An awake worker will find the requests the next
+ *  time it polls its channels.
+ *
+ * @param[in] ch the channel
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_send_flush(fr_channel_t *ch)
+{
+	fr_channel_end_t *master;
+
+	master = &(ch->end[TO_WORKER]);
+	if (!master->signal_pending) return 0;
+
+	master->signal_pending = false;
+
+	/*
+	 *	Pairs with the fence in fr_channel_worker_sleeping().
+	 *	Either we see that the worker is going to sleep, or it
+	 *	sees the requests we've just pushed.
+	 *
+	 *	Clearing the flag means that we signal once per sleep,
+	 *	no matter how many batches we send before it wakes up.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_exchange_explicit(&ch->worker_sleeping, false, memory_order_relaxed)) {
+		MPRINT("MASTER SKIPS signal, worker is awake\n");
+		master->num_coalesced++;
+		return 0;
+	}
+
+	MPRINT("MASTER SIGNALS after batch\n");
+	return fr_channel_data_ready(ch, master->last_write, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+}
+
+/** Enable or disable coalesced signaling for requests
+ *
+ *  When enabled, fr_channel_send_request() never signals the worker.
+ *  The caller MUST call fr_channel_send_flush() after each batch of
+ *  requests.
+ *
+ *  MUST only be called by the master.
+ *
+ * @param[in] ch the channel
+ * @param[in] enable whether to coalesce signals
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_signal_coalesce(fr_channel_t *ch, bool enable)
+{
+	int rcode = 0;
+
+	if (!enable) rcode = fr_channel_send_flush(ch);
+	ch->end[TO_WORKER].coalesce = enable;
+
+	return rcode;
+}
+
 /** Receive a reply message from the channel
  *
  * @param[in] ch the channel
@@ -346,15 +465,15 @@ fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch)
 {
 	fr_channel_data_t *cd;
 	fr_channel_end_t *master;
-	fr_atomic_queue_t *aq;
+	fr_spsc_queue_t *sq;
 
-	aq = ch->end[FROM_WORKER].aq;
+	sq = ch->end[FROM_WORKER].sq;
 	master = &(ch->end[TO_WORKER]);
 
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return NULL;
+	if (!fr_spsc_queue_pop(sq, (void **) &cd)) return NULL;
 
 	/*
 	 *	We want an exponential moving average for round trip
@@ -375,6 +494,36 @@ fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch)
 	}
 	ch->cpu_time = cd->reply.cpu_time;
 
+	/*
+	 *	Another worker stole the request from the channel it
+	 *	was sent on, and replied on its own channel.  The
+	 *	request is no longer outstanding on the original
+	 *	channel.  This reply doesn't use a sequence number on
+	 *	this one.
+	 */
+	if (cd->reply.stolen_from) {
+		fr_channel_end_t *victim = &(cd->reply.stolen_from->end[TO_WORKER]);
+
+		rad_assert(victim->num_outstanding > 0);
+		victim->num_outstanding--;
+
+		master->their_view_of_my_sequence = cd->live.ack;
+
+		/*
+		 *	We may have skipped signaling the original
+		 *	worker, because we thought that it was busy
+		 *	with this request.  If it hasn't seen all of
+		 *	our packets, wake it up.
+		 */
+		if (victim->sequence > victim->their_view_of_my_sequence) {
+			victim->num_resignals++;
+			(void) fr_channel_data_ready(cd->reply.stolen_from, cd->m.when, victim,
+						     FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+		}
+
+		return cd;
+	}
+
 	/*
 	 *	Update the outbound channel with the knowledge that
 	 *	we've received one more reply, and with the workers
@@ -406,15 +555,15 @@ fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch)
 {
 	fr_channel_data_t *cd;
 	fr_channel_end_t *worker;
-	fr_atomic_queue_t *aq;
+	fr_spsc_queue_t *sq;
 
-	aq = ch->end[TO_WORKER].aq;
+	sq = ch->end[TO_WORKER].sq;
 	worker = &(ch->end[FROM_WORKER]);
 
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return NULL;
+	if (!fr_spsc_queue_pop(sq, (void **) &cd)) return NULL;
 
 	rad_assert(cd->live.sequence > worker->ack);
 	rad_assert(cd->live.sequence >= worker->sequence); /* must have more requests than replies */
@@ -458,9 +607,10 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	sequence = worker->sequence + 1;
 	cd->live.sequence = sequence;
 	cd->live.ack = worker->ack;
+	cd->reply.stolen_from = NULL;
 
-	if (!fr_atomic_queue_push(worker->aq, cd)) {
-		fr_strerror_printf("Failed pushing to atomic queue");
+	if (!fr_spsc_queue_push(worker->sq, cd)) {
+		fr_strerror_printf("Failed pushing to message queue");
 		*p_request = fr_channel_recv_request(ch);
 		return -1;
 	}
@@ -533,15 +683,132 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 }
 
 
+/** Allow other workers to take requests from a channel
+ *
+ *  The request queue normally has only one reader.  After this call,
+ *  every read from it is a CAS, so that fr_channel_steal_request()
+ *  can be called from other threads.
+ *
+ *  MUST be called by the worker which owns the channel, before the
+ *  channel is made visible to any other worker.
+ *
+ * @param[in] ch the channel
+ */
+void fr_channel_stealable(fr_channel_t *ch)
+{
+	fr_spsc_queue_share(ch->end[TO_WORKER].sq);
+}
+
+/** Take a request out of a channel owned by another worker
+ *
+ *  The channel MUST have been passed to fr_channel_stealable().
+ *
+ *  This function may be called by any worker, at any time.  The
+ *  worker end of the channel isn't updated, as the worker which owns
+ *  it will never see the request.
+ *
+ *  The caller MUST reply to the request via
+ *  fr_channel_send_stolen_reply(), on one of its own channels to the
+ *  same master.
+ *
+ * @param[in] ch the channel to steal from
+ * @return
+ *	- NULL on no data to receive
+ *	- the message on success
+ */
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch)
+{
+	uint64_t stolen;
+	fr_channel_data_t *cd;
+
+	if (!fr_spsc_queue_pop(ch->end[TO_WORKER].sq, (void **) &cd)) return NULL;
+
+	/*
+	 *	Let the owner ACK this request, so that the master
+	 *	doesn't keep waking it up to look for it.
+	 */
+	stolen = atomic_load_explicit(&ch->stolen_ack, memory_order_relaxed);
+	while (stolen < cd->live.sequence) {
+		if (atomic_compare_exchange_weak_explicit(&ch->stolen_ack, &stolen, cd->live.sequence,
+							  memory_order_release, memory_order_relaxed)) break;
+	}
+
+	return cd;
+}
+
+/** Send a reply to a stolen request
+ *
+ *  The master didn't send the request on this channel, so the reply
+ *  doesn't use up a sequence number here.  Instead, it tells the
+ *  master which channel the request was originally sent on.
+ *
+ * @param[in] ch our channel to the same master as "victim"
+ * @param[in] cd the message to send
+ * @param[in] victim the channel the request was stolen from
+ * @param[out] p_request a pointer to a request message
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_send_stolen_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_t *victim,
+				 fr_channel_data_t **p_request)
+{
+	fr_channel_end_t *worker;
+
+	rad_assert(fr_channel_same_master(ch, victim));
+
+	worker = &(ch->end[FROM_WORKER]);
+
+	cd->live.sequence = worker->sequence;
+	cd->live.ack = worker->ack;
+	cd->reply.stolen_from = victim;
+
+	if (!fr_spsc_queue_push(worker->sq, cd)) {
+		fr_strerror_printf("Failed pushing to message queue");
+		*p_request = fr_channel_recv_request(ch);
+		return -1;
+	}
+
+	worker->num_packets++;
+
+	MPRINT("\tWORKER replies to stolen request %zd\n", worker->num_packets);
+
+	*p_request = fr_channel_recv_request(ch);
+
+	/*
+	 *	The master isn't expecting a reply on this channel,
+	 *	so we always have to tell it.
+	 */
+	return fr_channel_data_ready(ch, cd->m.when, worker, FR_CHANNEL_SIGNAL_DATA_DONE_WORKER);
+}
+
+/** Check if two channels have the same master
+ *
+ * @param[in] a the first channel
+ * @param[in] b the second channel
+ * @return
+ *	- true if both channels go to the same master.
+ *	- false otherwise.
+ */
+bool fr_channel_same_master(fr_channel_t const *a, fr_channel_t const *b)
+{
+	return (a->end[FROM_WORKER].control == b->end[FROM_WORKER].control);
+}
+
 /** Signal a channel that the worker is sleeping.
  *
  *  This function should be called from the workers idle loop.
  *  i.e. only when it has nothing else to do.
  *
+ *  If the master sent requests before it saw that we're going to
+ *  sleep, it may not signal us.  So we return 1, and the worker
+ *  MUST read the channel instead of sleeping.
+ *
  * @param[in] ch the channel
  * @return
  *	- <0 on error
  *	- 0 on success
+ *	- 1 if there are requests waiting in the channel
  */
 int fr_channel_worker_sleeping(fr_channel_t *ch)
 {
@@ -550,6 +817,17 @@ int fr_channel_worker_sleeping(fr_channel_t *ch)
 
 	worker = &(ch->end[FROM_WORKER]);
 
+	/*
+	 *	Pairs with the fence in fr_channel_send_flush().
+	 */
+	atomic_store_explicit(&ch->worker_sleeping, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!fr_spsc_queue_empty(ch->end[TO_WORKER].sq)) {
+		atomic_store_explicit(&ch->worker_sleeping, false, memory_order_relaxed);
+		return 1;
+	}
+
 	/*
 	 *	We don't have any outstanding requests to process for
 	 *	this channel, don't signal the network thread that
@@ -560,7 +838,7 @@ int fr_channel_worker_sleeping(fr_channel_t *ch)
 	worker->num_signals++;
 
 	cc.signal = FR_CHANNEL_SIGNAL_WORKER_SLEEPING;
-	cc.ack = worker->ack;
+	cc.ack = fr_channel_worker_ack(ch);
 	cc.ch = ch;
 
 	MPRINT("\tWORKER SLEEPING num_outstanding %zd, packets in %zd, packets out %zd\n", worker->num_outstanding,
@@ -825,11 +1103,30 @@ int fr_channel_signal_open(fr_channel_t *ch)
 	return fr_control_message_send(ch->end[TO_WORKER].control, ch->end[TO_WORKER].rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Check if there are requests waiting in the channel
+ *
+ *  MUST only be called by the worker which owns the channel.
+ *
+ * @param[in] ch the channel
+ * @return
+ *	- true if fr_channel_recv_request() would return a message
+ *	- false otherwise
+ */
+bool fr_channel_recv_ready(fr_channel_t *ch)
+{
+	return !fr_spsc_queue_empty(ch->end[TO_WORKER].sq);
+}
+
 void fr_channel_debug(fr_channel_t *ch, FILE *fp)
 {
 	fprintf(fp, "to worker\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[TO_WORKER].num_signals);
 	fprintf(fp, "\tnum_signals re-sent = %zd\n", ch->end[TO_WORKER].num_resignals);
+	fprintf(fp, "\tnum_signals coalesced = %zd\n", ch->end[TO_WORKER].num_coalesced);
+	if (ch->end[TO_WORKER].num_packets) {
+		fprintf(fp, "\tsignals per message = %.3f\n",
+			(double) ch->end[TO_WORKER].num_signals / ch->end[TO_WORKER].num_packets);
+	}
 	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[TO_WORKER].num_kevents);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[TO_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[TO_WORKER].ack);
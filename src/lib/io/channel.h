@@ -27,9 +27,10 @@ RCSIDH(channel_h, "$Id$")
 
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/control.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/inet.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -82,11 +83,14 @@ typedef struct fr_channel_data_t {
 		struct {
 			fr_channel_t		*ch;		//!< channel where this messages was received
 			int			heap_id;	//!< for the various queues
+			fr_channel_t		*stolen_from;	//!< channel the request was stolen from, if any
 		} channel;
 	};
 
 	void			*packet_ctx;	//!< packet context, for per-packet information
 	void			*io_ctx; 	//!< context for IO
+	fr_ipaddr_t		src_ipaddr;	//!< where the request came from, and where the reply goes
+	uint16_t		src_port;	//!< port the request came from.  0 if unknown
 	uint32_t		transport;	//!< transport ID for this packet
 	uint32_t		priority;	//!< priority of this packet.  0=high, 65535=low.
 
@@ -100,6 +104,7 @@ typedef struct fr_channel_data_t {
 			fr_time_t		cpu_time;	//!<  total CPU time, including predicted work, (only worker -> network)
 			fr_time_t		processing_time;  //!< actual processing time for this packet (only worker -> network)
 			fr_time_t		request_time;	//!< timestamp of the request packet
+			fr_channel_t		*stolen_from;	//!< channel the request was originally sent on (only worker -> network)
 	        } reply;
 	};
 
@@ -108,11 +113,20 @@ typedef struct fr_channel_data_t {
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_control_t *worker) CC_HINT(nonnull);
 
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_reply) CC_HINT(nonnull);
+int fr_channel_send_flush(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_signal_coalesce(fr_channel_t *ch, bool enable) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
+bool fr_channel_recv_ready(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_request) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
+void fr_channel_stealable(fr_channel_t *ch) CC_HINT(nonnull);
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_send_stolen_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_t *victim,
+				 fr_channel_data_t **p_request) CC_HINT(nonnull);
+bool fr_channel_same_master(fr_channel_t const *a, fr_channel_t const *b) CC_HINT(nonnull);
+
 int fr_channel_worker_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
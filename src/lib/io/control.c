@@ -27,9 +27,9 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/fr_log.h>
+#include <freeradius-devel/event.h>
 
 #include <string.h>
-#include <sys/event.h>
 
 #define FR_CONTROL_SIGNAL	(1024)
 #define FR_CONTROL_MAX_IDENT	(32)
@@ -94,7 +94,6 @@ struct fr_control_t {
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 {
 	fr_control_t *c;
-	struct kevent kev;
 
 	c = talloc_zero(ctx, fr_control_t);
 	if (!c) {
@@ -117,8 +116,7 @@ fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 	 *	The implementation here is perhaps a bit less optimal,
 	 *	but it's clean, and it works.
 	 */
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+	if (fr_event_user_listen(kq, FR_CONTROL_SIGNAL) < 0) {
 		talloc_free(c);
 		fr_strerror_printf("Failed opening KQ for control socket: %s", fr_syserror(errno));
 		return NULL;
@@ -297,21 +295,13 @@ int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
  */
 int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size)
 {
-	int rcode;
-	struct kevent kev;
-
 	(void) talloc_get_type_abort(c, fr_control_t);
 
 	if (fr_control_message_push(c, rb, id, data, data_size) < 0) {
 		return -1;
 	}
 
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	rcode = kevent(c->kq, &kev, 1, NULL, 0, NULL);
-	if (rcode >= 0) return rcode;
-
-	fr_strerror_printf("Failed updating KQ: %s", fr_syserror(errno));
-	return rcode;
+	return fr_event_user_trigger(c->kq, FR_CONTROL_SIGNAL);
 }
 
 
@@ -370,7 +360,11 @@ ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data
  */
 int fr_control_message_service_kevent(UNUSED fr_control_t *c, struct kevent const *kev)
 {
-	if (kev->ident != FR_CONTROL_SIGNAL) return 0;
+	/*
+	 *	Coalesced user events may be for us, too.  If the
+	 *	atomic queue is empty, fr_control_service() is cheap.
+	 */
+	if ((kev->ident != FR_CONTROL_SIGNAL) && (kev->ident != FR_EVENT_USER_ANY)) return 0;
 
 	return 1;
 }
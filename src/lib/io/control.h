@@ -28,9 +28,9 @@ RCSIDH(control_h, "$Id$")
 #include <freeradius-devel/io/atomic_queue.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/io/time.h>
+#include <freeradius-devel/event.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -351,6 +351,37 @@ static int fr_message_ring_gc(fr_message_set_t *ms, fr_ring_buffer_t *mr, int ma
 }
 
 
+/** Remove freed entries from an array of ring buffers
+ *
+ *  Several adjacent entries may have been freed, so we can't just
+ *  shift the array down once for each NULL entry.
+ *
+ * @param[in] array of ring buffers
+ * @param[in,out] p_max the highest used entry in the array
+ * @param[in,out] p_current the current entry in the array
+ */
+static void fr_message_array_coalesce(fr_ring_buffer_t **array, int *p_max, int *p_current)
+{
+	int i, j, current;
+
+	current = 0;
+	for (i = 0, j = 0; i <= *p_max; i++) {
+		if (i == *p_current) current = j;
+		if (!array[i]) continue;
+
+		array[j++] = array[i];
+	}
+
+	for (i = j; i <= *p_max; i++) {
+		array[i] = NULL;
+	}
+
+	*p_max = j - 1;
+	if (current > *p_max) current = *p_max;
+	*p_current = current;
+}
+
+
 /** Garbage collect "done" messages.
  *
  *  Called only from the originating thread.  We also clean a limited
@@ -439,22 +470,7 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 	 *	remaining entries.
 	 */
 	if (arrays_freed) {
-		for (i = 0; i < ms->mr_max; i++) {
-			if (ms->mr_array[i] != NULL) continue;
-
-
-			memmove(&ms->mr_array[i], &ms->mr_array[i + 1],
-				sizeof(ms->mr_array[i]) * (ms->mr_max - i + 1));
-
-			if (empty_slot > i) empty_slot--;
-			if (ms->mr_current > i) ms->mr_current--;
-		}
-
-		/*
-		 *	Reset the max, and current to the lowest
-		 *	array entry.
-		 */
-		ms->mr_max -= arrays_freed;
+		fr_message_array_coalesce(ms->mr_array, &ms->mr_max, &ms->mr_current);
 		rad_assert(ms->mr_current <= ms->mr_max);
 
 #ifndef NDEBUG
@@ -509,26 +525,11 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 
 	/*
 	 *	This code is the same as above, except with s/m_/rb_/.
-	 *	We could arguably turn this into a function...
 	 */
 	if (arrays_freed) {
 		MPRINT("TRYING TO FREE %d arrays out of %d empty %d\n", arrays_freed, ms->rb_max + 1, empty_slot);
 
-		for (i = 0; i < ms->rb_max; i++) {
-			if (ms->rb_array[i] != NULL) continue;
-
-			memmove(&ms->rb_array[i], &ms->rb_array[i + 1],
-				sizeof(ms->rb_array[i]) * (ms->rb_max - i + 1));
-
-			if (empty_slot > i) empty_slot--;
-			if (ms->rb_current > i) ms->rb_current--;
-		}
-
-		/*
-		 *	Reset the max, and current to the lowest
-		 *	array entry.
-		 */
-		ms->rb_max -= arrays_freed;
+		fr_message_array_coalesce(ms->rb_array, &ms->rb_max, &ms->rb_current);
 		rad_assert(ms->rb_current <= ms->rb_max);
 
 #ifndef NDEBUG
@@ -1071,7 +1072,6 @@ fr_message_t *fr_message_alloc_reserve(fr_message_set_t *ms, fr_message_t *m, si
 	 *	Mark how much room there is in this message.
 	 */
 	m2->rb = m->rb;
-	m2->data_size = room;
 	m2->rb_size = room;
 
 	/*
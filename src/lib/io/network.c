@@ -32,6 +32,13 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/io/network.h>
+#include <freeradius-devel/io/uring.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
 typedef struct fr_network_worker_t {
 	int			heap_id;		//!< workers are in a heap
@@ -40,8 +47,35 @@ typedef struct fr_network_worker_t {
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
+
+	bool			coalesce;		//!< the channel is coalescing signals
+	bool			pending;		//!< we've sent requests, but haven't signaled
+	struct fr_network_worker_t *next_pending;	//!< next worker to signal
 } fr_network_worker_t;
 
+/*
+ *	The outstanding io_uring multishot read for a socket.
+ */
+typedef struct fr_network_recv_t {
+	fr_uring_op_t		op;			//!< completion callback
+	struct msghdr		msg;			//!< layout of the provided buffers
+	fr_uring_bufs_t		*bufs;			//!< buffers which the kernel reads packets into
+	int			num_errors;		//!< consecutive read errors
+} fr_network_recv_t;
+
+/*
+ *	An io_uring write of a reply.
+ */
+typedef struct fr_network_send_t {
+	fr_uring_op_t		op;			//!< completion callback
+	struct msghdr		msg;
+	struct iovec		iov;			//!< points to the reply data
+	struct sockaddr_storage	dst;			//!< where the reply is going
+
+	fr_channel_data_t	*cd;			//!< the reply, freed when the write completes
+	struct fr_network_send_t *next;			//!< next free entry
+} fr_network_send_t;
+
 typedef struct fr_network_socket_t {
 	int			heap_id;		//!< for the heap
 
@@ -51,8 +85,29 @@ typedef struct fr_network_socket_t {
 
 	fr_message_set_t	*ms;			//!< message buffers for this socket.
 	fr_channel_data_t	*cd;			//!< cached in case of allocation & read error
+	fr_network_recv_t	*recv;			//!< outstanding io_uring read, if any
 } fr_network_socket_t;
 
+/*
+ *	The io_uring queue size, and how many replies we can have in
+ *	flight at once.
+ */
+#define URING_ENTRIES	(256)
+#define URING_SENDS	(128)
+
+/*
+ *	How many packets each socket can have in io_uring buffers, and
+ *	how many read errors in a row we allow before giving up on
+ *	io_uring for the socket.
+ */
+#define URING_BUFS		(64)
+#define URING_MAX_ERRORS	(8)
+
+/*
+ *	The largest batch we read or write at once.
+ */
+#define MAX_BATCH	(64)
+
 
 struct fr_network_t {
 	int			kq;			//!< our KQ
@@ -78,6 +133,12 @@ struct fr_network_t {
 
 	uint32_t		num_transports;		//!< how many transport layers we have
 	fr_transport_t		**transports;		//!< array of active transports.
+
+	fr_uring_t		*ur;			//!< io_uring for datagram sockets, if available
+	fr_network_send_t	*sends;			//!< free list of io_uring writes
+
+	atomic_bool		coalesce;		//!< signal each worker once per batch of requests
+	fr_network_worker_t	*pending;		//!< workers to signal once the batch is done
 };
 
 
@@ -248,6 +309,7 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
  */
 static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 {
+	bool coalesce;
 	fr_network_worker_t *worker;
 	fr_channel_data_t *reply;
 
@@ -264,6 +326,12 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 
 	(void) talloc_get_type_abort(worker, fr_network_worker_t);
 
+	coalesce = atomic_load_explicit(&nr->coalesce, memory_order_relaxed);
+	if (worker->coalesce != coalesce) {
+		(void) fr_channel_signal_coalesce(worker->channel, coalesce);
+		worker->coalesce = coalesce;
+	}
+
 	/*
 	 *	Send the message to the channel.  If we fail, recurse.
 	 *	That's easier than manually tracking the channel we
@@ -303,6 +371,16 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	 */
 	worker->cpu_time += worker->predicted;
 
+	/*
+	 *	The channel didn't signal the worker.  We do that
+	 *	once we've read everything we can.
+	 */
+	if (worker->coalesce && !worker->pending) {
+		worker->pending = true;
+		worker->next_pending = nr->pending;
+		nr->pending = worker;
+	}
+
 	/*
 	 *	Insert the worker back into the heap of workers.
 	 */
@@ -318,9 +396,229 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 }
 
 
+/** Signal the workers which we've sent requests to
+ *
+ *  When coalescing, we signal each worker at most once per pass
+ *  through the event loop, instead of once per request.
+ *
+ * @param nr the network
+ */
+static void fr_network_flush(fr_network_t *nr)
+{
+	fr_network_worker_t *worker;
+
+	while ((worker = nr->pending) != NULL) {
+		nr->pending = worker->next_pending;
+		worker->next_pending = NULL;
+		worker->pending = false;
+
+		if (fr_channel_send_flush(worker->channel) < 0) {
+			fr_log(nr->log, L_ERR, "Failed signaling worker: %s", fr_strerror());
+		}
+	}
+}
+
+
 static fr_time_t start_time = 0;
 
 
+/** Finish with a reply which has been written
+ *
+ *  The transport can keep the reply, e.g. to answer retransmissions
+ *  of the request.  Otherwise, it's freed.
+ *
+ * @param cd the reply
+ */
+static void fr_network_reply_done(fr_channel_data_t *cd)
+{
+	fr_network_socket_t *s = cd->io_ctx;
+
+	if (s->transport->recv_reply && (s->transport->recv_reply(s->ctx, cd) > 0)) return;
+
+	fr_message_done(&cd->m);
+}
+
+
+/** Send a packet which has been read from a socket to a worker
+ *
+ * @param nr the network
+ * @param s the socket the packet was read from
+ * @param cd the allocated message, containing the packet
+ * @param src where the packet came from, or NULL if the transport tracks that itself
+ * @param salen length of src
+ */
+static void fr_network_recv_packet(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd,
+				   struct sockaddr_storage const *src, socklen_t salen)
+{
+	fr_log(nr->log, L_DBG, "got packet size %zd", cd->m.data_size);
+
+	/*
+	 *	Initialize the rest of the fields of the channel data.
+	 */
+	cd->m.when = fr_time();
+	cd->packet_ctx = s->ctx;
+	cd->io_ctx = s;
+
+	if (!src || !salen || (fr_ipaddr_from_sockaddr(src, salen, &cd->src_ipaddr, &cd->src_port) < 0)) {
+		memset(&cd->src_ipaddr, 0, sizeof(cd->src_ipaddr));
+		cd->src_port = 0;
+	}
+
+	cd->transport = 0;	/* @todo - set transport number from the transport */
+	cd->priority = 0;	/* @todo - set priority based on information from the transport layer  */
+	cd->request.start_time = &start_time; /* @todo - set by transport */
+
+	/*
+	 *	The transport may have already answered this packet.
+	 */
+	if (s->transport->recv_packet && (s->transport->recv_packet(s->ctx, s->fd, cd) != 0)) {
+		fr_log(nr->log, L_DBG, "transport discarded packet");
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	start_time = cd->m.when;
+
+	if (!fr_network_send_request(nr, cd)) {
+		fr_log(nr->log, L_ERR, "Failed sending packet to worker");
+		fr_message_done(&cd->m);
+	}
+}
+
+
+/** Stop reading from a socket after a read error
+ *
+ *  The socket stays in the socket heap, so that replies which are
+ *  still in flight can refer to it.  It is no longer serviced by
+ *  the event loop.
+ *
+ * @param nr the network
+ * @param s the socket which failed
+ */
+static void fr_network_read_error(fr_network_t *nr, fr_network_socket_t *s)
+{
+	fr_log(nr->log, L_ERR, "Failed reading from socket %d: %s - no longer reading from it",
+	       s->fd, fr_strerror());
+
+	(void) fr_event_fd_delete(nr->el, s->fd);
+}
+
+
+/** Read a batch of packets from the network.
+ *
+ *  One large message is reserved, and the transport reads up to
+ *  batch_size datagrams into consecutive slots of it.  The packets
+ *  are then packed together, so that the message set only allocates
+ *  what was actually read.  Every packet is allocated before any of
+ *  them is sent to a worker.
+ *
+ * @param nr the network
+ * @param s the socket which is ready to read
+ * @return
+ *	- <0 on read error.  The socket should no longer be read.
+ *	- the number of packets read.  0 if there was nothing to read,
+ *	  or no room to read it.
+ */
+static int fr_network_read_batch(fr_network_t *nr, fr_network_socket_t *s)
+{
+	int i, num, used;
+	unsigned int batch_size;
+	size_t slot, total;
+	fr_channel_data_t *cd;
+	fr_channel_data_t *packets[MAX_BATCH];
+	fr_transport_dgram_t dgram[MAX_BATCH];
+
+	batch_size = s->transport->batch_size;
+	if (batch_size > MAX_BATCH) batch_size = MAX_BATCH;
+
+	slot = s->transport->default_message_size;
+
+	if (!s->cd) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, slot * batch_size);
+		if (!cd) {
+			fr_log(nr->log, L_ERR, "Failed allocating message size %zd!", slot * batch_size);
+			return 0;
+		}
+	} else {
+		cd = s->cd;
+	}
+
+	rad_assert(cd->m.rb_size >= (slot * batch_size));
+
+	for (i = 0; i < (int) batch_size; i++) {
+		dgram[i].iov.iov_base = cd->m.data + (i * slot);
+		dgram[i].iov.iov_len = slot;
+		dgram[i].addrlen = 0;
+	}
+
+	num = s->transport->read_batch(s->fd, s->ctx, dgram, batch_size);
+	if (num < 0) {
+		s->cd = cd;
+		fr_strerror_printf("Failed reading from transport");
+		return -1;
+	}
+
+	/*
+	 *	Pack the packets together, skipping any empty ones.
+	 *	Each packet keeps the address it came from.
+	 */
+	used = 0;
+	total = 0;
+	for (i = 0; i < num; i++) {
+		if (!dgram[i].iov.iov_len) continue;
+
+		if (dgram[i].iov.iov_base != (cd->m.data + total)) {
+			memmove(cd->m.data + total, dgram[i].iov.iov_base, dgram[i].iov.iov_len);
+		}
+		if (used != i) {
+			dgram[used].iov.iov_len = dgram[i].iov.iov_len;
+			if (dgram[i].addrlen) memcpy(&dgram[used].addr, &dgram[i].addr, dgram[i].addrlen);
+			dgram[used].addrlen = dgram[i].addrlen;
+		}
+		total += dgram[i].iov.iov_len;
+		used++;
+	}
+
+	/*
+	 *	Nothing was read.  Keep the reservation for next time.
+	 */
+	if (!used) {
+		s->cd = cd;
+		return 0;
+	}
+	s->cd = NULL;
+
+	fr_log(nr->log, L_DBG, "network read %d packets", used);
+
+	/*
+	 *	Allocate each packet, reserving room for the ones
+	 *	which follow it.
+	 */
+	for (i = 0; i < used; i++) {
+		packets[i] = cd;
+		total -= dgram[i].iov.iov_len;
+
+		if (!total) {
+			(void) fr_message_alloc(s->ms, &cd->m, dgram[i].iov.iov_len);
+			break;
+		}
+
+		cd = (fr_channel_data_t *) fr_message_alloc_reserve(s->ms, &cd->m, dgram[i].iov.iov_len, total);
+		if (!cd) {
+			fr_log(nr->log, L_ERR, "Failed allocating message: %s", fr_strerror());
+			used = i + 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < used; i++) {
+		fr_network_recv_packet(nr, s, packets[i], &dgram[i].addr, dgram[i].addrlen);
+	}
+
+	return used;
+}
+
+
 /** Read a packet from the network.
  *
  * @param el the event list
@@ -336,17 +634,23 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
 
 	rad_assert(s->fd == sockfd);
 
+	if (s->transport->read_batch && (s->transport->batch_size > 1)) {
+		if (fr_network_read_batch(nr, s) < 0) fr_network_read_error(nr, s);
+		return;
+	}
+
 	fr_log(nr->log, L_DBG, "network read");
 
+	/*
+	 *	If we can't allocate a message, leave the packet in
+	 *	the socket.  We'll be called again once the workers
+	 *	have freed up some room.
+	 */
 	if (!s->cd) {
 		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->transport->default_message_size);
 		if (!cd) {
 			fr_log(nr->log, L_ERR, "Failed allocating message size %zd!", s->transport->default_message_size);
-
-			/*
-			 *	@todo - handle errors via transport callback
-			 */
-			_exit(1);
+			return;
 		}
 	} else {
 		cd = s->cd;
@@ -359,46 +663,256 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
 	 *	@todo - transport->read_request
 	 */
 	data_size = s->transport->read(sockfd, s->ctx, cd->m.data, cd->m.rb_size);
-	if (data_size == 0) {
-		fr_log(nr->log, L_DBG_ERR, "got no data from transport read");
-
+	if (data_size <= 0) {
 		s->cd = cd;
 
-		// UDP: ignore
-		// TCP: close socket
-		_exit(1);
+		/*
+		 *	UDP: nothing to read, or the packet was
+		 *	discarded.  Try again later.
+		 *
+		 *	@todo - TCP: close the socket
+		 */
+		if (data_size == 0) {
+			fr_log(nr->log, L_DBG_ERR, "got no data from transport read");
+			return;
+		}
+
+		fr_strerror_printf("Failed reading from transport");
+		fr_network_read_error(nr, s);
+		return;
 	}
+	s->cd = NULL;
+
+	(void) fr_message_alloc(s->ms, &cd->m, data_size);
+
+	fr_network_recv_packet(nr, s, cd, NULL, 0);
+}
+
+static void fr_network_uring_read_done(fr_uring_op_t *op, int res, uint8_t *buffer, bool more);
+
+/** Queue an io_uring read for a socket
+ *
+ *  The read is multishot.  It stays active, and completes once for
+ *  each packet, until there is an error or the socket runs out of
+ *  buffers.
+ *
+ * @param nr the network
+ * @param s the socket to read from
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_network_uring_read(fr_network_t *nr, fr_network_socket_t *s)
+{
+	fr_network_recv_t *r = s->recv;
+
+	r->op.callback = fr_network_uring_read_done;
+	r->op.uctx = s;
 
+	return fr_uring_recvmsg_multishot(nr->ur, s->fd, &r->msg, r->bufs, &r->op);
+}
+
+/** Stop using io_uring to read a socket
+ *
+ *  The socket is read via the event loop instead, which stops
+ *  reading it entirely if the errors continue.
+ *
+ * @param nr the network
+ * @param s the socket
+ */
+static void fr_network_uring_read_stop(fr_network_t *nr, fr_network_socket_t *s)
+{
+	fr_log(nr->log, L_ERR, "Failed reading socket %d via io_uring: %s - using the event loop instead",
+	       s->fd, fr_strerror());
+
+	if (fr_event_fd_insert(nr->el, s->fd, fr_network_read, NULL, NULL, s) < 0) {
+		fr_log(nr->log, L_ERR, "Failed adding socket %d to event loop: %s - no longer reading from it",
+		       s->fd, fr_strerror());
+	}
+}
+
+/** Copy a packet out of an io_uring buffer, and send it to a worker
+ *
+ * @param nr the network
+ * @param s the socket the packet was read from
+ * @param buffer the io_uring buffer holding the packet
+ * @param res the result of recvmsg()
+ */
+static void fr_network_uring_recv(fr_network_t *nr, fr_network_socket_t *s, uint8_t *buffer, int res)
+{
+	fr_network_recv_t *r = s->recv;
+	ssize_t data_size;
+	uint8_t *packet;
+	struct sockaddr_storage *src;
+	socklen_t salen;
+	fr_channel_data_t *cd;
+
+	data_size = fr_uring_recvmsg_parse(&r->msg, buffer, res, &src, &salen, &packet);
 	if (data_size < 0) {
-		fr_log(nr->log, L_DBG_ERR, "error from transport read");
+		fr_log(nr->log, L_DBG_ERR, "Discarding packet: %s", fr_strerror());
+		return;
+	}
+
+	/*
+	 *	Zero-length datagrams are ignored, as are ones the
+	 *	transport doesn't like.
+	 */
+	if (!data_size) return;
+
+	if (s->transport->recv_dgram(s->ctx, packet, data_size, src, salen) < 0) return;
+
+	/*
+	 *	The buffer goes back to the kernel as soon as we
+	 *	return, so if there's no room for the packet, we have
+	 *	to drop it.
+	 */
+	cd = (fr_channel_data_t *) fr_message_reserve(s->ms, data_size);
+	if (!cd) {
+		fr_log(nr->log, L_ERR, "Failed allocating message size %zd - discarding packet", data_size);
+		return;
+	}
+
+	memcpy(cd->m.data, packet, data_size);
+	(void) fr_message_alloc(s->ms, &cd->m, data_size);
+
+	fr_network_recv_packet(nr, s, cd, src, salen);
+}
+
+/** An io_uring read has completed
+ *
+ * @param op the operation which completed
+ * @param res the result of recvmsg()
+ * @param buffer the io_uring buffer holding the packet, if any
+ * @param more whether the read is still active
+ */
+static void fr_network_uring_read_done(fr_uring_op_t *op, int res, uint8_t *buffer, bool more)
+{
+	fr_network_socket_t *s = op->uctx;
+	fr_network_t *nr = talloc_parent(s);
+	fr_network_recv_t *r = s->recv;
+
+	/*
+	 *	The ring is being torn down.
+	 */
+	if (res == -ECANCELED) return;
+
+	fr_log(nr->log, L_DBG, "network read");
+
+	if (buffer) {
+		if (res >= 0) fr_network_uring_recv(nr, s, buffer, res);
+		fr_uring_bufs_return(r->bufs, buffer);
+	}
+
+	/*
+	 *	Running out of buffers isn't an error.  They've all
+	 *	been given back by now, so we just start reading again.
+	 */
+	if (res >= 0) {
+		r->num_errors = 0;
+
+	} else if (res != -ENOBUFS) {
+		fr_strerror_printf("%s", fr_syserror(-res));
+		fr_log(nr->log, L_DBG_ERR, "error from io_uring read: %s", fr_strerror());
 
 		/*
-		 *	@todo - handle errors via transport callback
+		 *	The kernel doesn't support multishot reads.
 		 */
-		_exit(1);
+		if (res == -EINVAL) r->num_errors = URING_MAX_ERRORS;
+		r->num_errors++;
+	}
+
+	if (more) return;
+
+	if (r->num_errors >= URING_MAX_ERRORS) {
+		fr_network_uring_read_stop(nr, s);
+		return;
 	}
-	s->cd = NULL;
 
-	fr_log(nr->log, L_DBG, "got packet size %zd", data_size);
+	if (fr_network_uring_read(nr, s) < 0) fr_network_uring_read_stop(nr, s);
+}
+
+/** An io_uring write has completed
+ *
+ * @param op the operation which completed
+ * @param res the result of sendmsg()
+ */
+static void fr_network_uring_write_done(fr_uring_op_t *op, int res, UNUSED uint8_t *buffer, UNUSED bool more)
+{
+	fr_network_send_t *sn = (fr_network_send_t *) op;
+	fr_network_t *nr = op->uctx;
+
+	if ((res < 0) && (res != -ECANCELED)) {
+		fr_log(nr->log, L_DBG_ERR, "error from io_uring write: %s", fr_syserror(-res));
+	}
+
+	fr_network_reply_done(sn->cd);
+	sn->cd = NULL;
+
+	sn->next = nr->sends;
+	nr->sends = sn;
+}
+
+/** Queue an io_uring write for a reply
+ *
+ *  The write is submitted along with everything else at the end of
+ *  the main loop.
+ *
+ * @param nr the network
+ * @param cd the reply to write
+ * @return
+ *	- <0 if the reply was not queued, and should be written directly.
+ *	- 0 on success
+ */
+static int fr_network_uring_write(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_socket_t *s = cd->io_ctx;
+	fr_network_send_t *sn;
+
+	if (!s->recv) return -1;
+
+	sn = nr->sends;
+	if (!sn) return -1;
 
 	/*
-	 *	Initialize the rest of the fields of the channel data.
+	 *	Send the reply to where the request came from.  If we
+	 *	don't know that, the transport does.
 	 */
-	cd->m.when = fr_time();
-	cd->packet_ctx = s->ctx;
-	cd->io_ctx = s;
-	cd->transport = 0;	/* @todo - set transport number from the transport */
-	cd->priority = 0;	/* @todo - set priority based on information from the transport layer  */
-	cd->request.start_time = &start_time; /* @todo - set by transport */
-
-	start_time = cd->m.when;
+	memset(&sn->msg, 0, sizeof(sn->msg));
+	sn->msg.msg_name = &sn->dst;
+	if (!cd->src_port ||
+	    (fr_ipaddr_to_sockaddr(&cd->src_ipaddr, cd->src_port, &sn->dst, &sn->msg.msg_namelen) < 0)) {
+		sn->msg.msg_namelen = s->transport->send_dgram(s->ctx, &sn->dst);
+	}
+	if (!sn->msg.msg_namelen) return -1;
 
-	(void) fr_message_alloc(s->ms, &cd->m, data_size);
+	sn->iov.iov_base = cd->m.data;
+	sn->iov.iov_len = cd->m.data_size;
+	sn->msg.msg_iov = &sn->iov;
+	sn->msg.msg_iovlen = 1;
+	sn->cd = cd;
 
-	if (!fr_network_send_request(nr, cd)) {
-		fr_log(nr->log, L_ERR, "Failed sending packet to worker");
-		fr_message_done(&cd->m);
+	if (fr_uring_sendmsg(nr->ur, s->fd, &sn->msg, &sn->op) < 0) {
+		sn->cd = NULL;
+		return -1;
 	}
+
+	nr->sends = sn->next;
+	sn->next = NULL;
+
+	return 0;
+}
+
+/** Service io_uring completions
+ *
+ * @param el the event list
+ * @param fd the io_uring eventfd
+ * @param ctx the network
+ */
+static void fr_network_uring_event(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_network_t *nr = talloc_get_type_abort(ctx, fr_network_t);
+
+	(void) fr_uring_service(nr->ur);
 }
 
 /** Handle a network control message callback for a new socket
@@ -412,6 +926,7 @@ static void fr_network_socket_callback(void *ctx, void const *data, size_t data_
 {
 	fr_network_t *nr = ctx;
 	fr_network_socket_t *s;
+	int num_messages;
 
 	rad_assert(data_size == sizeof(*s));
 
@@ -423,12 +938,24 @@ static void fr_network_socket_callback(void *ctx, void const *data, size_t data_
 
 #define MIN_MESSAGES (8)
 
+	/*
+	 *	Batched reads reserve room for a full batch at once,
+	 *	which can be no more than half of the ring buffer.
+	 */
+	num_messages = MIN_MESSAGES;
+	if (s->transport->read_batch) {
+		unsigned int batch_size = s->transport->batch_size;
+
+		if (batch_size > MAX_BATCH) batch_size = MAX_BATCH;
+		while ((unsigned int) num_messages < (batch_size * 2)) num_messages *= 2;
+	}
+
 	/*
 	 *	@todo - make the default number of messages configurable?
 	 */
-	s->ms = fr_message_set_create(s, MIN_MESSAGES,
+	s->ms = fr_message_set_create(s, num_messages,
 				      sizeof(fr_channel_data_t),
-				      s->transport->default_message_size * MIN_MESSAGES);
+				      s->transport->default_message_size * num_messages);
 	if (!s->ms) {
 		fr_log(nr->log, L_ERR, "Failed creating message buffers for network IO.");
 
@@ -438,12 +965,39 @@ static void fr_network_socket_callback(void *ctx, void const *data, size_t data_
 		_exit(1);
 	}
 
+	s->recv = NULL;
+
+	/*
+	 *	Datagram transports can have the reads done via
+	 *	io_uring.  If that fails, we fall back to reading the
+	 *	socket when the event loop says it's readable.
+	 */
+	if (nr->ur && s->transport->recv_dgram && s->transport->send_dgram) {
+		s->recv = talloc_zero(s, fr_network_recv_t);
+		if (s->recv) {
+			/*
+			 *	Each buffer holds the recvmsg() headers,
+			 *	the source address, and the packet.
+			 */
+			s->recv->msg.msg_namelen = sizeof(struct sockaddr_storage);
+			s->recv->bufs = fr_uring_bufs_create(nr->ur, URING_BUFS,
+							     fr_uring_recvmsg_overhead(&s->recv->msg) +
+							     s->transport->default_message_size);
+			if (s->recv->bufs && (fr_network_uring_read(nr, s) == 0)) goto done;
+		}
+
+		fr_log(nr->log, L_DBG_WARN, "Failed queueing io_uring read: %s", fr_strerror());
+		TALLOC_FREE(s->recv);
+	}
+
 	if (fr_event_fd_insert(nr->el, s->fd, fr_network_read, NULL, NULL, s) < 0) {
 		fr_log(nr->log, L_ERR, "Failed adding new socket to event loop: %s", fr_strerror());
 		close(s->fd);
 		return;
 	}
 
+done:
+
 	(void) fr_heap_insert(nr->sockets, s);
 
 	fr_log(nr->log, L_DBG, "Using new socket with FD %d", s->fd);
@@ -604,13 +1158,13 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_log_t *logger, uint32_t num_
 		goto nomem;
 	}
 
-	nr->workers = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	nr->workers = fr_heap_create(worker_cmp, offsetof(fr_network_worker_t, heap_id));
 	if (!nr->workers) {
 		talloc_free(nr);
 		goto nomem;
 	}
 
-	nr->closing = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	nr->closing = fr_heap_create(worker_cmp, offsetof(fr_network_worker_t, heap_id));
 	if (!nr->closing) {
 		talloc_free(nr);
 		goto nomem;
@@ -618,6 +1172,38 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_log_t *logger, uint32_t num_
 
 	nr->num_transports = num_transports;
 	nr->transports = transports;
+	atomic_init(&nr->coalesce, false);
+
+	/*
+	 *	Use io_uring for datagram sockets if we can.  If not,
+	 *	all sockets go through the event loop.
+	 */
+	nr->ur = fr_uring_create(nr, URING_ENTRIES);
+	if (nr->ur) {
+		int i;
+		fr_network_send_t *sends;
+
+		sends = talloc_zero_array(nr, fr_network_send_t, URING_SENDS);
+		if (!sends) {
+			talloc_free(nr);
+			goto nomem;
+		}
+
+		for (i = 0; i < URING_SENDS; i++) {
+			sends[i].op.callback = fr_network_uring_write_done;
+			sends[i].op.uctx = nr;
+			sends[i].next = nr->sends;
+			nr->sends = &sends[i];
+		}
+
+		if (fr_event_fd_insert(nr->el, fr_uring_fd(nr->ur), fr_network_uring_event, NULL, NULL, nr) < 0) {
+			fr_strerror_printf("Failed adding io_uring to event list: %s", fr_strerror());
+			talloc_free(nr);
+			return NULL;
+		}
+	} else {
+		fr_log(nr->log, L_DBG, "Not using io_uring: %s", fr_strerror());
+	}
 
 	return nr;
 }
@@ -661,11 +1247,110 @@ int fr_network_destroy(fr_network_t *nr)
 		fr_message_done(&cd->m);
 	}
 
+	/*
+	 *	Close the io_uring first, so that the kernel cancels
+	 *	any reads into socket buffers before they are freed.
+	 */
+	if (nr->ur) {
+		(void) fr_event_fd_delete(nr->el, fr_uring_fd(nr->ur));
+		TALLOC_FREE(nr->ur);
+	}
+
 	talloc_free(nr);
 
 	return 0;
 }
 
+/** Enable or disable coalesced signaling of workers
+ *
+ *  When enabled, the network thread signals each worker once per
+ *  batch of requests, and only when the worker may be asleep.
+ *
+ *  May be called from any thread.
+ *
+ * @param nr the network
+ * @param enable whether to coalesce signals
+ */
+void fr_network_signal_coalesce(fr_network_t *nr, bool enable)
+{
+	atomic_store_explicit(&nr->coalesce, enable, memory_order_relaxed);
+}
+
+/** Write a batch of replies to one socket
+ *
+ *  Pull any other replies for the same socket off of the reply heap,
+ *  and write them all with one call to the transport.
+ *
+ * @param nr the network
+ * @param cd the first reply to write.
+ */
+static void fr_network_write_batch(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	int i, num;
+	unsigned int batch_size;
+	fr_network_socket_t *s = cd->io_ctx;
+	fr_channel_data_t *replies[MAX_BATCH];
+	fr_transport_dgram_t dgram[MAX_BATCH];
+
+	batch_size = s->transport->batch_size;
+	if (batch_size > MAX_BATCH) batch_size = MAX_BATCH;
+
+	/*
+	 *	Each reply goes back to where its request came from.
+	 */
+	num = 0;
+	do {
+		replies[num] = cd;
+		dgram[num].iov.iov_base = cd->m.data;
+		dgram[num].iov.iov_len = cd->m.data_size;
+		if (!cd->src_port ||
+		    (fr_ipaddr_to_sockaddr(&cd->src_ipaddr, cd->src_port, &dgram[num].addr, &dgram[num].addrlen) < 0)) {
+			dgram[num].addrlen = 0;
+		}
+		num++;
+
+		if ((unsigned int) num >= batch_size) break;
+
+		cd = fr_heap_peek(nr->replies);
+		if (!cd || (cd->io_ctx != s)) break;
+
+		(void) fr_heap_pop(nr->replies);
+	} while (true);
+
+	fr_log(nr->log, L_DBG, "handling %d replies to socket %p", num, s);
+
+	if (s->transport->write_batch(s->fd, s->ctx, dgram, num) < num) {
+		fr_log(nr->log, L_DBG_ERR, "Failed writing all replies");
+	}
+
+	for (i = 0; i < num; i++) {
+		fr_network_reply_done(replies[i]);
+	}
+}
+
+/** Write a reply to its socket
+ *
+ *  If the transport can write in batches, the other replies which
+ *  are waiting for the same socket are written along with it.
+ *
+ * @param nr the network
+ * @param cd the reply to write.
+ */
+static void fr_network_write(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_socket_t *s = cd->io_ctx;
+
+	if (s->transport->write_batch && (s->transport->batch_size > 1)) {
+		fr_network_write_batch(nr, cd);
+		return;
+	}
+
+	s->transport->write(s->fd, s->ctx, cd->m.data, cd->m.data_size);
+
+	fr_log(nr->log, L_DBG, "handling reply to socket %p", cd->io_ctx);
+	fr_network_reply_done(cd);
+}
+
 /** The main network worker function.
  *
  * @param[in] nr the network data structure to run.
@@ -677,7 +1362,6 @@ void fr_network(fr_network_t *nr)
 		int num_events;
 //		fr_time_t now;
 		fr_channel_data_t *cd;
-		fr_network_socket_t *s;
 
 		/*
 		 *	There are runnable requests.  We still service
@@ -702,20 +1386,35 @@ void fr_network(fr_network_t *nr)
 			fr_event_service(nr->el);
 		}
 
-//		now = fr_time();
+		/*
+		 *	Wake up the workers we've sent requests to.
+		 */
+		if (nr->pending) fr_network_flush(nr);
 
-		cd = fr_heap_pop(nr->replies);
-		if (!cd) continue;
+//		now = fr_time();
 
 		/*
-		 *	@todo - call transport "recv reply"
+		 *	With io_uring, queue all of the replies, and
+		 *	submit them along with any new reads in one
+		 *	system call.
 		 */
-		s = cd->io_ctx;
+		if (nr->ur) {
+			while ((cd = fr_heap_pop(nr->replies)) != NULL) {
+				if (fr_network_uring_write(nr, cd) == 0) continue;
 
-		s->transport->write(s->fd, s->ctx, cd->m.data, cd->m.data_size);
+				fr_network_write(nr, cd);
+			}
 
-		fr_log(nr->log, L_DBG, "handling reply to socket %p", cd->io_ctx);
-		fr_message_done(&cd->m);
+			if (fr_uring_submit(nr->ur) < 0) {
+				fr_log(nr->log, L_ERR, "%s", fr_strerror());
+			}
+			continue;
+		}
+
+		cd = fr_heap_pop(nr->replies);
+		if (!cd) continue;
+
+		fr_network_write(nr, cd);
 	}
 }
 
@@ -40,6 +40,7 @@ void fr_network(fr_network_t *nr) CC_HINT(nonnull);
 
 int fr_network_socket_add(fr_network_t *nr, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
 int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+void fr_network_signal_coalesce(fr_network_t *nr, bool enable) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
@@ -137,6 +137,8 @@ struct fr_schedule_t {
 	fr_heap_t	*workers;		//!< heap of workers
 	fr_heap_t	*done_workers;		//!< heap of done workers
 
+	fr_worker_peers_t *peers;		//!< workers which can steal from each other
+
 	fr_schedule_network_t *sn;		//!< pointer to the (one) network thread
 
 	uint32_t	num_transports;		//!< how many transport layers we have
@@ -220,6 +222,11 @@ static void *fr_schedule_worker_thread(void *arg)
 	snprintf(buffer, sizeof(buffer), "thread %d - ", sw->id);
 	fr_worker_name(sw->worker, buffer);
 
+	if (fr_worker_peers_add(sc->peers, sw->id, sw->worker) < 0) {
+		fr_log(sc->log, L_ERR, "Worker %d - Failed adding worker to peers: %s", sw->id, fr_strerror());
+		goto fail;
+	}
+
 	/*
 	 *	@todo make this a registry
 	 */
@@ -254,6 +261,13 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	fr_log(sc->log, L_INFO, "Worker %d finished\n", sw->id);
 
+	/*
+	 *	Other workers can't steal from us any more.  This
+	 *	waits for any which are still looking at us, so
+	 *	that we can be freed.
+	 */
+	fr_worker_peers_remove(sc->peers, sw->worker);
+
 	/*
 	 *	Talloc ordering issues. We want to be independent of
 	 *	how talloc walks it's children, and ensure that some
@@ -441,6 +455,14 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *logger, int max_inp
 		goto nomem;
 	}
 
+	if (sc->max_workers) {
+		sc->peers = fr_worker_peers_create(sc, sc->max_workers);
+		if (!sc->peers) {
+			talloc_free(sc);
+			goto nomem;
+		}
+	}
+
 	memset(&sc->semaphore, 0, sizeof(sc->semaphore));
 	if (sem_init(&sc->semaphore, 0, SEMAPHORE_LOCKED) != 0) {
 		fr_strerror_printf("Failed creating semaphore: %s", fr_syserror(errno));
@@ -611,10 +633,7 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	 *	Pop the "done" workers, and free their contexts here.
 	 */
 	while ((sw = fr_heap_pop(sc->done_workers)) != NULL) {
-		TALLOC_CTX *ctx;
-
-		ctx = talloc_parent(sw);
-		talloc_free(ctx);
+		talloc_free(sw);
 	}
 
 	/*
@@ -639,6 +658,50 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	return 0;
 }
 
+/** Enable or disable work stealing between workers
+ *
+ *  When enabled, an idle worker takes requests which are waiting for
+ *  a worker that is busy running a slow request.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] enable whether workers should steal requests
+ */
+void fr_schedule_work_stealing(fr_schedule_t *sc, bool enable)
+{
+	if (!sc->peers) return;
+
+	fr_worker_peers_steal(sc->peers, enable);
+}
+
+/** Get the number of requests which workers have stolen
+ *
+ * @param[in] sc the scheduler
+ * @return the number of stolen requests
+ */
+uint64_t fr_schedule_num_stolen(fr_schedule_t *sc)
+{
+	if (!sc->peers) return 0;
+
+	return fr_worker_peers_num_stolen(sc->peers);
+}
+
+/** Enable or disable coalesced signaling of workers
+ *
+ *  When enabled, the network thread signals each worker once per
+ *  batch of requests, instead of once per request.  Idle workers
+ *  poll for a while before sleeping, so that they often don't need
+ *  a signal at all.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] enable whether to coalesce signals
+ */
+void fr_schedule_signal_coalesce(fr_schedule_t *sc, bool enable)
+{
+	if (!sc->sn || !sc->sn->rc) return;
+
+	fr_network_signal_coalesce(sc->sn->rc, enable);
+}
+
 /** Add a socket to a scheduler.
  *
  * @param sc the scheduler
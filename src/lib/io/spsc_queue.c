@@ -0,0 +1,359 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Single producer, single consumer queues.
+ * @file io/spsc_queue.c
+ *
+ *  The queue is a ring of pointers.  Unlike the atomic queue, there
+ *  are no per-entry sequence numbers, and no CAS on push or pop.  The
+ *  producer owns "head", and the consumer owns "tail".  Each side
+ *  keeps a private copy of the other sides index, and only reads the
+ *  shared one when its copy says the queue is full (or empty).
+ *
+ *  The consumer publishes "tail" in batches.  The producer may
+ *  therefore see the queue as full when up to "batch" entries have
+ *  been read, but not yet returned.  The consumer always publishes
+ *  "tail" when it finds the queue empty.
+ *
+ *  The consumer side can be shared via fr_spsc_queue_share().  After
+ *  that, every pop does a CAS on "tail", and any number of threads
+ *  may pop from the queue.  There is still only one producer.
+ *
+ * @copyright 2017 The FreeRADIUS Server Project
+ */
+RCSID("$Id$")
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdalign.h>
+
+#include <freeradius-devel/autoconf.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include <freeradius-devel/io/spsc_queue.h>
+
+/*
+ *	Some macros to make our life easier.
+ */
+#define atomic_int64_t _Atomic(int64_t)
+#define atomic_ptr_t _Atomic(void *)
+
+#define load(_var)           atomic_load_explicit(&_var, memory_order_relaxed)
+#define acquire(_var)        atomic_load_explicit(&_var, memory_order_acquire)
+#define store(_store, _var)  atomic_store_explicit(&_store, _var, memory_order_release)
+#define store_relaxed(_store, _var)  atomic_store_explicit(&_store, _var, memory_order_relaxed)
+
+/*
+ *	The producer and consumer fields are on different cache
+ *	lines, so that the two sides don't fight over them.
+ */
+struct fr_spsc_queue_t {
+	alignas(128) atomic_int64_t head;	//!< next entry to write.  Written only by the producer.
+	int64_t		tail_cache;		//!< the producers view of "tail"
+
+	alignas(128) atomic_int64_t tail;	//!< next entry to read.  Written only by the consumer.
+	int64_t		tail_local;		//!< entries read, but not yet published
+	int64_t		head_cache;		//!< the consumers view of "head"
+	bool		shared;			//!< more than one thread may pop
+
+	alignas(128) int size;			//!< power of 2
+	int		mask;			//!< size - 1
+	int		batch;			//!< publish "tail" after this many pops
+
+	atomic_ptr_t	entry[1];
+};
+
+/** Create fixed-size single producer, single consumer queue.
+ *
+ * @param[in] ctx the talloc ctx
+ * @param[in] size the number of entries in the queue.  Rounded up to a power of 2.
+ * @return
+ *     - NULL on error
+ *     - fr_spsc_queue_t *, a pointer to the allocated and initialized queue
+ */
+fr_spsc_queue_t *fr_spsc_queue_create(TALLOC_CTX *ctx, int size)
+{
+	int i;
+	fr_spsc_queue_t *sq;
+
+	if ((size <= 0) || (size > (1 << 30))) return NULL;
+
+	for (i = 1; i < size; i <<= 1) {
+		/* nothing */
+	}
+	size = i;
+
+	/*
+	 *	Allocate a contiguous blob for the header and queue.
+	 *	The entries are packed, so that one cache line holds
+	 *	many of them.
+	 */
+	sq = talloc_zero_size(ctx, sizeof(*sq) + (size - 1) * sizeof(sq->entry[0]));
+	if (!sq) return NULL;
+
+	talloc_set_name(sq, "fr_spsc_queue_t");
+
+	for (i = 0; i < size; i++) {
+		store_relaxed(sq->entry[i], NULL);
+	}
+
+	sq->size = size;
+	sq->mask = size - 1;
+	sq->batch = size / 8;
+	if (!sq->batch) sq->batch = 1;
+
+	sq->tail_cache = 0;
+	sq->tail_local = 0;
+	sq->head_cache = 0;
+	sq->shared = false;
+
+	/*
+	 *	Set the head / tail indexes, and force other CPUs to
+	 *	see the writes.
+	 */
+	store(sq->head, 0);
+	store(sq->tail, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return sq;
+}
+
+
+/** Push a pointer into the queue
+ *
+ *  MUST only be called by the producer.
+ *
+ * @param[in] sq the queue
+ * @param[in] data the data to push
+ * @return
+ *	- true on successful push
+ *	- false on queue full
+ */
+bool fr_spsc_queue_push(fr_spsc_queue_t *sq, void *data)
+{
+	int64_t head;
+
+	if (!data) return false;
+
+	head = load(sq->head);
+
+	/*
+	 *	Only look at the consumers index when we think that
+	 *	the queue is full.
+	 */
+	if ((head - sq->tail_cache) >= sq->size) {
+		sq->tail_cache = acquire(sq->tail);
+		if ((head - sq->tail_cache) >= sq->size) return false;
+	}
+
+	store_relaxed(sq->entry[head & sq->mask], data);
+
+	/*
+	 *	Make the entry visible to the consumer.
+	 */
+	store(sq->head, head + 1);
+	return true;
+}
+
+
+/** Push multiple pointers into the queue, and publish them all at once
+ *
+ *  MUST only be called by the producer.
+ *
+ * @param[in] sq the queue
+ * @param[in] data the array of pointers to push.  None may be NULL.
+ * @param[in] num the number of pointers in the array.
+ * @return the number of pointers which were pushed.
+ */
+int fr_spsc_queue_push_batch(fr_spsc_queue_t *sq, void **data, int num)
+{
+	int i;
+	int64_t head, room;
+
+	if (num <= 0) return 0;
+
+	head = load(sq->head);
+
+	room = sq->size - (head - sq->tail_cache);
+	if (room < num) {
+		sq->tail_cache = acquire(sq->tail);
+		room = sq->size - (head - sq->tail_cache);
+		if (room < num) num = room;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!data[i]) break;
+
+		store_relaxed(sq->entry[(head + i) & sq->mask], data[i]);
+	}
+
+	if (i > 0) store(sq->head, head + i);
+
+	return i;
+}
+
+
+/** Pop a pointer from the queue, when there is more than one consumer
+ *
+ * @param[in] sq the queue
+ * @param[in] p_data where to write the data
+ * @return
+ *	- true on successful pop
+ *	- false on queue empty
+ */
+static bool fr_spsc_queue_pop_shared(fr_spsc_queue_t *sq, void **p_data)
+{
+	int64_t tail;
+	void *data;
+
+	tail = load(sq->tail);
+
+	for (;;) {
+		if (tail >= acquire(sq->head)) return false;
+
+		/*
+		 *	Read the entry BEFORE claiming it.  Once we've
+		 *	moved "tail", the producer may overwrite it.  If
+		 *	another consumer got there first, the CAS fails,
+		 *	and we ignore what we read.
+		 */
+		data = load(sq->entry[tail & sq->mask]);
+
+		if (atomic_compare_exchange_weak_explicit(&sq->tail, &tail, tail + 1,
+							  memory_order_release, memory_order_relaxed)) break;
+	}
+
+	*p_data = data;
+	return true;
+}
+
+
+/** Pop a pointer from the queue
+ *
+ *  MUST only be called by the consumer, unless the queue has been
+ *  shared via fr_spsc_queue_share().
+ *
+ * @param[in] sq the queue
+ * @param[in] p_data where to write the data
+ * @return
+ *	- true on successful pop
+ *	- false on queue empty
+ */
+bool fr_spsc_queue_pop(fr_spsc_queue_t *sq, void **p_data)
+{
+	int64_t tail;
+
+	if (!p_data) return false;
+
+	if (sq->shared) return fr_spsc_queue_pop_shared(sq, p_data);
+
+	tail = sq->tail_local;
+
+	/*
+	 *	Only look at the producers index when we think that
+	 *	the queue is empty.
+	 */
+	if (tail == sq->head_cache) {
+		sq->head_cache = acquire(sq->head);
+
+		if (tail == sq->head_cache) {
+			/*
+			 *	Give the producer back everything we've
+			 *	read, so that it doesn't think that the
+			 *	queue is full.
+			 */
+			if (load(sq->tail) != tail) store(sq->tail, tail);
+			return false;
+		}
+	}
+
+	*p_data = load(sq->entry[tail & sq->mask]);
+
+	sq->tail_local = ++tail;
+	if ((tail - load(sq->tail)) >= sq->batch) store(sq->tail, tail);
+
+	return true;
+}
+
+
+/** Check if the queue is empty, without popping anything
+ *
+ *  MUST only be called by a consumer.
+ *
+ * @param[in] sq the queue
+ * @return
+ *	- true if there is nothing to pop
+ *	- false if there is at least one entry
+ */
+bool fr_spsc_queue_empty(fr_spsc_queue_t *sq)
+{
+	if (sq->shared) return (load(sq->tail) >= acquire(sq->head));
+
+	if (sq->tail_local != sq->head_cache) return false;
+
+	sq->head_cache = acquire(sq->head);
+	return (sq->tail_local == sq->head_cache);
+}
+
+
+/** Allow more than one thread to pop from the queue
+ *
+ *  MUST be called by the consumer, before any other thread can see
+ *  the queue.  The change is permanent.
+ *
+ * @param[in] sq the queue
+ */
+void fr_spsc_queue_share(fr_spsc_queue_t *sq)
+{
+	if (sq->shared) return;
+
+	store(sq->tail, sq->tail_local);
+	sq->shared = true;
+}
+
+#ifndef NDEBUG
+/**  Dump a single producer, single consumer queue.
+ *
+ *  Absolutely NOT thread-safe.
+ *
+ * @param[in] sq the queue
+ * @param[in] fp where the debugging information will be printed.
+ */
+void fr_spsc_queue_debug(fr_spsc_queue_t *sq, FILE *fp)
+{
+	int64_t i, head, tail;
+
+	head = load(sq->head);
+	tail = load(sq->tail);
+
+	fprintf(fp, "SQ %p size %d, head %" PRId64 ", tail %" PRId64 " (local %" PRId64 ")%s\n",
+		sq, sq->size, head, tail, sq->tail_local, sq->shared ? " shared" : "");
+
+	if (!sq->shared) tail = sq->tail_local;
+
+	for (i = tail; i < head; i++) {
+		fprintf(fp, "\t[%d] = { %p }\n", (int) (i & sq->mask), load(sq->entry[i & sq->mask]));
+	}
+}
+#endif
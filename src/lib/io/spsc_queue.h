@@ -0,0 +1,53 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_SPSC_QUEUE_H
+#define _FR_SPSC_QUEUE_H
+/**
+ * $Id$
+ *
+ * @file io/spsc_queue.h
+ * @brief Single producer, single consumer queues.
+ *
+ * @copyright 2017 The FreeRADIUS Server Project
+ */
+RCSIDH(spsc_queue_h, "$Id$")
+
+#include <talloc.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_spsc_queue_t fr_spsc_queue_t;
+
+fr_spsc_queue_t *fr_spsc_queue_create(TALLOC_CTX *ctx, int size);
+bool fr_spsc_queue_push(fr_spsc_queue_t *sq, void *data);
+int fr_spsc_queue_push_batch(fr_spsc_queue_t *sq, void **data, int num);
+bool fr_spsc_queue_pop(fr_spsc_queue_t *sq, void **p_data);
+bool fr_spsc_queue_empty(fr_spsc_queue_t *sq);
+void fr_spsc_queue_share(fr_spsc_queue_t *sq);
+
+#ifndef NDEBUG
+void fr_spsc_queue_debug(fr_spsc_queue_t *sq, FILE *fp);
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_SPSC_QUEUE_H */
@@ -25,86 +25,200 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/track.h>
+#include <freeradius-devel/hash.h>
+#include <freeradius-devel/fr_log.h>
 #include <freeradius-devel/rad_assert.h>
 
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+/**
+ *  A slot in the open addressing table.
+ *
+ *  The slots are small, so that a probe sequence touches as few
+ *  cache lines as possible.  The full hash is stored, so that we
+ *  only look at the entry when the hashes match.
+ */
+typedef struct fr_tracking_slot_t {
+	uint32_t	hash;		//!< hash of src IP, src port, and ID
+	uint32_t	index;		//!< 1 + index into the entry array, or 0 for "unused"
+} fr_tracking_slot_t;
+
 /**
  *  RADIUS-specific tracking table.
  *
- *  It's a fixed-size array of 256 entries, indexed by ID.  Which
- *  means we don't need to store ID in the table.  We also don't
- *  need to store the packet type, as we assume that we have a
- *  unique tracking table per packet type.
+ *  Packets are looked up by (src IP, src port, ID) in a linear
+ *  probing hash table, so that one table can track packets from
+ *  many clients.  The entries themselves live in a fixed-size
+ *  array, which is allocated once, when the table is created.
  *
- *  @todo add a "reply" heap / list, ordered by when we need to
- *  clean up the replies.  The heap should contain nothing more than
- *  the time and the ID of the packet which needs cleaning up.
+ *  The used entries are kept in a list ordered by timestamp, newest
+ *  first.  Expiring old entries is then just a matter of walking
+ *  the list from the tail.  When the table is full, the oldest
+ *  entry is evicted to make room for the new one.
  *
- *  @todo add an "allocation" heap, ordered by when the entry was
- *  freed.  This is so that new allocations are O(1), and use the
- *  oldest unused ID.
+ *  We don't store the packet type, as we assume that we have a
+ *  unique tracking table per packet type.
  */
 struct fr_tracking_t {
-	int		num_entries;	//!< number of used entries.
+	uint32_t	num_entries;	//!< number of used entries.
+	uint32_t	max_entries;	//!< size of the entry array
+	uint32_t	mask;		//!< number of slots - 1
 
-	fr_tracking_entry_t packet[256];
+	fr_dlist_t	time_order;	//!< used entries, newest at the head
+	fr_dlist_t	unused;		//!< unused entries
+
+	fr_tracking_slot_t *slot;	//!< hash table of indexes into "entry"
+	fr_tracking_entry_t *entry;	//!< array of entries
 };
 
+static uint32_t tracking_hash(fr_ipaddr_t const *src_ipaddr, uint16_t src_port, uint8_t id)
+{
+	uint32_t hash;
+
+	if (src_ipaddr->af == AF_INET) {
+		hash = fr_hash(&src_ipaddr->addr.v4, sizeof(src_ipaddr->addr.v4));
+	} else {
+		hash = fr_hash(&src_ipaddr->addr.v6, sizeof(src_ipaddr->addr.v6));
+	}
+
+	hash = fr_hash_update(&src_port, sizeof(src_port), hash);
+	return fr_hash_update(&id, sizeof(id), hash);
+}
+
+static inline bool tracking_match(fr_tracking_entry_t const *entry,
+				  fr_ipaddr_t const *src_ipaddr, uint16_t src_port, uint8_t id)
+{
+	return ((entry->id == id) && (entry->src_port == src_port) &&
+		(fr_ipaddr_cmp(&entry->src_ipaddr, src_ipaddr) == 0));
+}
+
 /** Create a tracking table for one type of RADIUS packets.
  *
  * @param[in] ctx the talloc ctx
+ * @param[in] max_entries the maximum number of packets to track.
  * @return
  *	- NULL on error
  *	- fr_tracking_t * on success
  */
-fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx)
+fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, uint32_t max_entries)
 {
+	uint32_t i, num_slots;
 	fr_tracking_t *ft;
 
 	if (!ctx) return NULL;
 
+	if ((max_entries == 0) || (max_entries > (1 << 24))) {
+		fr_strerror_printf("Invalid number of tracking entries %u", max_entries);
+		return NULL;
+	}
+
+	/*
+	 *	Keep the load factor at or below 50%, so that
+	 *	the probe sequences are short.
+	 */
+	for (num_slots = 1; num_slots < (max_entries * 2); num_slots <<= 1) {
+		/* nothing */
+	}
+
 	ft = talloc_zero(ctx, fr_tracking_t);
 	if (!ft) return NULL;
 
+	ft->slot = talloc_zero_array(ft, fr_tracking_slot_t, num_slots);
+	ft->entry = talloc_zero_array(ft, fr_tracking_entry_t, max_entries);
+	if (!ft->slot || !ft->entry) {
+		talloc_free(ft);
+		return NULL;
+	}
+
 	ft->num_entries = 0;
+	ft->max_entries = max_entries;
+	ft->mask = num_slots - 1;
+
+	FR_DLIST_INIT(ft->time_order);
+	FR_DLIST_INIT(ft->unused);
+
+	for (i = 0; i < max_entries; i++) {
+		fr_dlist_insert_tail(&ft->unused, &ft->entry[i].list);
+	}
+
 	return ft;
 }
 
 /** Delete an entry from the tracking table.
  *
  * @param[in] ft the tracking table
- * @param[in] id the ID of the entry to delete
+ * @param[in] entry the entry to delete
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id)
+int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entry)
 {
-	fr_tracking_entry_t *entry;
+	uint32_t i, j, home, index;
 
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 
-	entry = &ft->packet[id];
 	if (entry->timestamp == 0) return -1;
 
+	index = (entry - ft->entry) + 1;
+	if (!rad_cond_assert((index > 0) && (index <= ft->max_entries))) return -1;
+
+	/*
+	 *	Find the slot which points to this entry.
+	 */
+	i = tracking_hash(&entry->src_ipaddr, entry->src_port, entry->id) & ft->mask;
+	while (ft->slot[i].index != index) {
+		if (!rad_cond_assert(ft->slot[i].index != 0)) return -1;
+		i = (i + 1) & ft->mask;
+	}
+
+	/*
+	 *	Shift later entries in the probe sequence back, so
+	 *	that we don't need tombstones.  An entry can move to
+	 *	slot "i" only if its home slot isn't between "i" and
+	 *	where it is now.
+	 */
+	j = i;
+	for (;;) {
+		j = (j + 1) & ft->mask;
+		if (!ft->slot[j].index) break;
+
+		home = ft->slot[j].hash & ft->mask;
+		if (((j - home) & ft->mask) < ((j - i) & ft->mask)) continue;
+
+		ft->slot[i] = ft->slot[j];
+		i = j;
+	}
+	ft->slot[i].index = 0;
+
 	entry->timestamp = 0;
+	fr_dlist_remove(&entry->list);
+	fr_dlist_insert_head(&ft->unused, &entry->list);
 	ft->num_entries--;
 
 	/*
-	 *	Mark the reply (if any) as done.
+	 *	Free the reply (if any).
 	 */
-	if (entry->reply) {
-		fr_message_done(&entry->reply->m);
-		entry->reply = NULL;
-	}
+	TALLOC_FREE(entry->reply);
+	entry->reply_len = 0;
 
 	return 0;
 }
 
 /** Insert a (possibly new) packet and a timestamp
+ *
+ *  If the packet is a retransmission, the entry returned is the
+ *  original one.  Its "reply" field is the cached reply, if the
+ *  worker has already sent one.  The caller can then send it again
+ *  without involving a worker.
+ *
+ *  The timestamps MUST NOT go backwards between calls.
  *
  * @param[in] ft the tracking table
  * @param[in] packet the packet to insert
  * @param[in] timestamp when this packet was received
+ * @param[in] src_ipaddr where the packet came from
+ * @param[in] src_port the source port of the packet
  * @param[out] p_entry pointer to newly inserted entry.
  * @return
  *	- FR_TRACKING_UNUSED, there was an error inserting the element
@@ -113,76 +227,197 @@ int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id)
  *	- FR_TRACKING_DIFFERENT, the old packet was deleted, and the newer packet inserted
  */
 fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t *packet, fr_time_t timestamp,
+						     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
 						     fr_tracking_entry_t **p_entry)
 {
+	uint32_t i, hash;
+	uint8_t id = packet[1];
+	fr_dlist_t *oldest;
 	fr_tracking_entry_t *entry;
 
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 
-	entry = &ft->packet[packet[1]];
+	if (timestamp == 0) return FR_TRACKING_UNUSED;
 
-	/*
-	 *	The entry is unused, insert it.
-	 */
-	if (entry->timestamp == 0) {
+	hash = tracking_hash(src_ipaddr, src_port, id);
+
+redo:
+	for (i = hash & ft->mask; ft->slot[i].index != 0; i = (i + 1) & ft->mask) {
+		if (ft->slot[i].hash != hash) continue;
+
+		entry = &ft->entry[ft->slot[i].index - 1];
+		if (!tracking_match(entry, src_ipaddr, src_port, id)) continue;
+
+		/*
+		 *	Is it the same packet?  If so, return that.
+		 */
+		if (memcmp(packet + 2, &entry->data[0], 18) == 0) {
+			*p_entry = entry;
+			return FR_TRACKING_SAME;
+		}
+
+		/*
+		 *	It's in use, but the new packet is different.
+		 *	Update the timestamp, so that anyone checking
+		 *	it knows it's no longer relevant.  Any cached
+		 *	reply is for the old packet, so it's gone, too.
+		 */
 		entry->timestamp = timestamp;
+		TALLOC_FREE(entry->reply);
+		entry->reply_len = 0;
+
+		/*
+		 *	Copy the new packet over top of the old one.
+		 */
+		entry->code = packet[0];
 		memcpy(&entry->data[0], packet + 2, 18);
-		*p_entry = entry;
 
-		ft->num_entries++;
-		return FR_TRACKING_NEW;
-	}
+		fr_dlist_remove(&entry->list);
+		fr_dlist_insert_head(&ft->time_order, &entry->list);
 
-	/*
-	 *	Is it the same packet?  If so, return that.
-	 */
-	if (memcmp(packet + 2, &entry->data[0], 18) == 0) {
 		*p_entry = entry;
-		return FR_TRACKING_SAME;
+		return FR_TRACKING_DIFFERENT;
 	}
 
 	/*
-	 *	It's in use, but the new packet is different.  update
-	 *	the timestamp, so that anyone checking it knows it's
-	 *	no longer relevant.
+	 *	No room for a new entry.  Throw away the oldest one.
+	 *	Deleting it may shift other slots around, so we have
+	 *	to look for an empty slot again.
 	 */
-	entry->timestamp = timestamp;
+	if (ft->num_entries == ft->max_entries) {
+		oldest = FR_DLIST_TAIL(ft->time_order);
+		if (!rad_cond_assert(oldest != NULL)) return FR_TRACKING_UNUSED;
+
+		(void) fr_radius_tracking_entry_delete(ft, fr_ptr_to_type(fr_tracking_entry_t, list, oldest));
+		goto redo;
+	}
 
 	/*
-	 *	Copy the new packet over top of the old one.
+	 *	The slot is unused, insert it.
 	 */
+	oldest = FR_DLIST_FIRST(ft->unused);
+	if (!rad_cond_assert(oldest != NULL)) return FR_TRACKING_UNUSED;
+
+	entry = fr_ptr_to_type(fr_tracking_entry_t, list, oldest);
+	fr_dlist_remove(&entry->list);
+
+	entry->timestamp = timestamp;
+	entry->reply = NULL;
+	entry->reply_len = 0;
+	entry->src_ipaddr = *src_ipaddr;
+	entry->src_port = src_port;
+	entry->code = packet[0];
+	entry->id = id;
 	memcpy(&entry->data[0], packet + 2, 18);
+
+	ft->slot[i].hash = hash;
+	ft->slot[i].index = (entry - ft->entry) + 1;
+
+	fr_dlist_insert_head(&ft->time_order, &entry->list);
+	ft->num_entries++;
+
 	*p_entry = entry;
+	return FR_TRACKING_NEW;
+}
+
+/** Find the entry for a packet
+ *
+ *  This is used to find where to cache a reply, which has the same
+ *  ID as the request, and goes back to where the request came from.
+ *
+ * @param[in] ft the tracking table
+ * @param[in] src_ipaddr where the packet came from
+ * @param[in] src_port the source port of the packet
+ * @param[in] id the RADIUS ID of the packet
+ * @return
+ *	- NULL if the packet is not being tracked
+ *	- the entry for the packet
+ */
+fr_tracking_entry_t *fr_radius_tracking_entry_find(fr_tracking_t *ft, fr_ipaddr_t const *src_ipaddr,
+						   uint16_t src_port, uint8_t id)
+{
+	uint32_t i, hash;
+	fr_tracking_entry_t *entry;
+
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
+
+	hash = tracking_hash(src_ipaddr, src_port, id);
+
+	for (i = hash & ft->mask; ft->slot[i].index != 0; i = (i + 1) & ft->mask) {
+		if (ft->slot[i].hash != hash) continue;
 
-	return FR_TRACKING_DIFFERENT;
+		entry = &ft->entry[ft->slot[i].index - 1];
+		if (tracking_match(entry, src_ipaddr, src_port, id)) return entry;
+	}
+
+	return NULL;
 }
 
-/** Insert a (possibly new) packet and a timestamp
+/** Cache a reply for an entry.
+ *
+ *  The reply is copied, so the caller can release its own buffer
+ *  as soon as this function returns.  If the entry has been
+ *  re-used, or deleted, since the request was received, the reply
+ *  is no longer relevant, and is not cached.
  *
  * @param[in] ft the tracking table
- * @param[in] id the ID of the entry which this reply is for
- * @param[in] cd the reply message
+ * @param[in] entry the entry which this reply is for
+ * @param[in] request_time when the request for this reply was received
+ * @param[in] reply the raw reply packet
+ * @param[in] reply_len the length of the reply
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
-				   fr_channel_data_t *cd)
+int fr_radius_tracking_entry_reply(fr_tracking_t *ft, fr_tracking_entry_t *entry, fr_time_t request_time,
+				   uint8_t const *reply, size_t reply_len)
 {
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
+
+	if (entry->timestamp != request_time) return 0;
+
+	rad_assert(entry->reply == NULL);
+
+	entry->reply = talloc_memdup(ft, reply, reply_len);
+	if (!entry->reply) return -1;
+	entry->reply_len = reply_len;
+
+	return 0;
+}
+
+/** Delete all entries which were received before a particular time.
+ *
+ * @param[in] ft the tracking table
+ * @param[in] when delete entries with a timestamp older than this.
+ * @return the number of entries which were deleted.
+ */
+int fr_radius_tracking_expire(fr_tracking_t *ft, fr_time_t when)
+{
+	int num = 0;
+	fr_dlist_t *oldest;
 	fr_tracking_entry_t *entry;
 
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 
-	entry = &ft->packet[id];
+	while ((oldest = FR_DLIST_TAIL(ft->time_order)) != NULL) {
+		entry = fr_ptr_to_type(fr_tracking_entry_t, list, oldest);
+		if (entry->timestamp >= when) break;
 
-	if (entry->timestamp != cd->reply.request_time) {
-		fr_message_done(&cd->m);
-		return 0;
+		(void) fr_radius_tracking_entry_delete(ft, entry);
+		num++;
 	}
 
-	rad_assert(entry->reply == NULL);
+	return num;
+}
 
-	entry->reply = cd;
+/** Return the number of entries in the tracking table.
+ *
+ * @param[in] ft the tracking table
+ * @return the number of used entries.
+ */
+uint32_t fr_radius_tracking_num_entries(fr_tracking_t *ft)
+{
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
 
-	return 0;
+	return ft->num_entries;
 }
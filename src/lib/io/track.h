@@ -26,6 +26,7 @@
 RCSIDH(track_h, "$Id$")
 
 #include <freeradius-devel/io/channel.h>
+#include <freeradius-devel/inet.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,12 +38,20 @@ typedef struct fr_tracking_t fr_tracking_t;
  *  An entry for the tracking table.  It contains the minimum
  *  information required to track RADIUS packets.
  *
- *  @todo include event information, so that this tracking entry can
- *  be cleaned up at an appropriate time.
+ *  Packets are identified by source IP, source port, and ID.  The
+ *  authentication vector is then used to tell a retransmission from
+ *  a new packet which re-uses the same ID.
  */
 typedef struct fr_tracking_entry_t {
 	fr_time_t		timestamp;	//!< when the request was received
-	fr_channel_data_t	*reply;		//!< the reply (if any)
+	uint8_t			*reply;		//!< a copy of the reply (if any)
+	size_t			reply_len;	//!< length of the reply
+	fr_dlist_t		list;		//!< entries, ordered by timestamp
+
+	fr_ipaddr_t		src_ipaddr;	//!< where the packet came from
+	uint16_t		src_port;	//!< source port of the packet
+	uint8_t			code;		//!< RADIUS code of the packet
+	uint8_t			id;		//!< RADIUS ID of the packet
 	uint8_t			data[18];	//!< 2 byte length + authentication vector
 } fr_tracking_entry_t;
 
@@ -56,12 +65,17 @@ typedef enum fr_tracking_status_t {
 	FR_TRACKING_DIFFERENT,
 } fr_tracking_status_t;
 
-fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx);
-int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id) CC_HINT(nonnull);
+fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, uint32_t max_entries);
+int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entry) CC_HINT(nonnull);
 fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t *packet, fr_time_t timestamp,
+						     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
 						     fr_tracking_entry_t **p_entry) CC_HINT(nonnull);
-int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
-				   fr_channel_data_t *cd) CC_HINT(nonnull);
+fr_tracking_entry_t *fr_radius_tracking_entry_find(fr_tracking_t *ft, fr_ipaddr_t const *src_ipaddr,
+						   uint16_t src_port, uint8_t id) CC_HINT(nonnull);
+int fr_radius_tracking_entry_reply(fr_tracking_t *ft, fr_tracking_entry_t *entry, fr_time_t request_time,
+				   uint8_t const *reply, size_t reply_len) CC_HINT(nonnull);
+int fr_radius_tracking_expire(fr_tracking_t *ft, fr_time_t when) CC_HINT(nonnull);
+uint32_t fr_radius_tracking_num_entries(fr_tracking_t *ft) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
@@ -26,6 +26,8 @@
 RCSIDH(transport_h, "$Id$")
 
 #include <talloc.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
@@ -103,9 +105,68 @@ typedef int *(*fr_transport_recv_request_t)(REQUEST *);
 typedef ssize_t (*fr_transport_io_t)(int sockfd, void *packet_ctx, uint8_t *buffer, size_t buffer_len);
 
 /**
- *  Receive a reply in the master thread.
+ *  One datagram in a batched read or write.
  */
-//typedef int (*fr_transport_recv_reply_t)(fr_io_buffer_t *io);
+typedef struct fr_transport_dgram_t {
+	struct iovec		iov;		//!< the datagram
+	struct sockaddr_storage	addr;		//!< source (read) or destination (write) of the datagram
+	socklen_t		addrlen;	//!< length of addr.  0 if unknown
+} fr_transport_dgram_t;
+
+/**
+ *  (Read / write) multiple datagrams from / to a socket in one call.
+ *
+ *  On read, each entry in "dgram" is a buffer for one datagram.  The
+ *  transport updates iov_len of each entry to the size of the
+ *  datagram which was read into it, and fills in the address it
+ *  came from.  A datagram with iov_len of 0 is discarded.
+ *
+ *  On write, each entry is sent to its own address.  If the
+ *  addrlen of an entry is 0, the transport uses the address from
+ *  packet_ctx.
+ *
+ *  Returns the number of datagrams (read / written), or <0 on error.
+ */
+typedef int (*fr_transport_io_batch_t)(int sockfd, void *packet_ctx, fr_transport_dgram_t *dgram, unsigned int num);
+
+/**
+ *  A datagram has been read from the socket on behalf of the
+ *  transport.  Update the packet context with the packet and source
+ *  address.  Return <0 to discard the packet.
+ */
+typedef int (*fr_transport_recv_dgram_t)(void *packet_ctx, uint8_t const *buffer, size_t data_len,
+					 struct sockaddr_storage const *src, socklen_t salen);
+
+/**
+ *  Fill in the destination address for a datagram which will be
+ *  written to the socket on behalf of the transport.  Return the
+ *  length of the address, or 0 on error.
+ */
+typedef socklen_t (*fr_transport_send_dgram_t)(void const *packet_ctx, struct sockaddr_storage *dst);
+
+/**
+ *  A packet has been read in the network thread, and is about to be
+ *  sent to a worker.  The transport can check for duplicates and
+ *  retransmissions here.
+ *
+ *  Return 0 to process the packet, or 1 if the transport has dealt
+ *  with it (e.g. by writing a cached reply), and it should be
+ *  discarded.
+ */
+typedef int (*fr_transport_recv_packet_t)(void *packet_ctx, int sockfd, fr_channel_data_t *cd);
+
+/**
+ *  Receive a reply in the network thread, after it has been written.
+ *
+ *  Return 1 if the transport keeps the reply (e.g. to answer
+ *  retransmissions), in which case it MUST call fr_message_done()
+ *  when it no longer needs it.  Return 0 to have the reply freed.
+ *
+ *  Holding on to a reply also holds on to the worker's message set,
+ *  so transports which cache replies for a long time should copy
+ *  them, and return 0.
+ */
+typedef int (*fr_transport_recv_reply_t)(void *packet_ctx, fr_channel_data_t *cd);
 
 /**
  *  Have a REQUEST, and encode it to a packet
@@ -128,6 +189,13 @@ typedef struct fr_transport_t {
 	size_t				default_message_size; // usually minimum message size
 	fr_transport_io_t		read;		//!< read from a socket to a data buffer
 	fr_transport_io_t		write;		//!< write from a data buffer to a socket
+	unsigned int			batch_size;	//!< maximum datagrams per batched read / write
+	fr_transport_io_batch_t		read_batch;	//!< read multiple datagrams (optional)
+	fr_transport_io_batch_t		write_batch;	//!< write multiple datagrams (optional)
+	fr_transport_recv_dgram_t	recv_dgram;	//!< datagram was read for us (optional)
+	fr_transport_send_dgram_t	send_dgram;	//!< get the address for a datagram write (optional)
+	fr_transport_recv_packet_t	recv_packet;	//!< packet was read, before it goes to a worker (optional)
+	fr_transport_recv_reply_t	recv_reply;	//!< reply was written (optional)
 	fr_transport_recv_request_t	recv_request;	//!< function to receive a request (worker -> master)
 	fr_transport_decode_t		decode;		//!< function to decode packet to request (worker)
 	fr_transport_encode_t		encode;		//!< function to encode request to packet (worker)
@@ -170,8 +238,11 @@ struct rad_request {
 	fr_transport_process_t	process_async;
 	fr_time_tracking_t	tracking;
 	fr_channel_t		*channel;
+	fr_channel_t		*stolen_from;
 	void			*packet_ctx;
 	void			*io_ctx;
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port;
 	fr_transport_t		*transport;
 };
 #endif
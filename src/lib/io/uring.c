@@ -0,0 +1,734 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Asynchronous socket I/O via io_uring
+ * @file io/uring.c
+ *
+ *  This is a minimal interface to the Linux io_uring API.  It only
+ *  does what the network side needs: queue recvmsg() / sendmsg()
+ *  operations, submit them all with one system call, and run a
+ *  callback for each completion.
+ *
+ *  Sockets are read with multishot recvmsg() where the kernel
+ *  supports it.  One queued read then completes once per datagram,
+ *  and the kernel picks a buffer for each datagram from a ring of
+ *  buffers which we provide.
+ *
+ *  The ring is driven from the event loop.  The kernel signals an
+ *  eventfd when operations complete, and the caller adds that FD to
+ *  its event list.  When the FD is readable, the caller runs
+ *  fr_uring_service().
+ *
+ *  We talk to the kernel directly, rather than depending on liburing.
+ *  If the kernel (or the build environment) doesn't support io_uring,
+ *  fr_uring_create() fails, and the caller should fall back to the
+ *  normal read() / write() path.
+ *
+ * @copyright 2017 The FreeRADIUS Server Project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/uring.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <sys/syscall.h>
+#  ifdef __NR_io_uring_setup
+#    define HAVE_IO_URING (1)
+#  endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+/*
+ *	Multishot recvmsg() and provided buffer rings are in Linux 6.0
+ *	and later.
+ */
+#  ifdef IORING_RECV_MULTISHOT
+#    define HAVE_URING_MULTISHOT (1)
+#  endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define aquire(_ptr)		atomic_load_explicit(_ptr, memory_order_acquire)
+#define store(_ptr, _var)	atomic_store_explicit(_ptr, _var, memory_order_release)
+
+typedef _Atomic(unsigned int) fr_uring_index_t;
+
+struct fr_uring_t {
+	int			fd;			//!< the io_uring instance
+	int			event_fd;		//!< signalled by the kernel on completion
+
+	unsigned int		num_entries;		//!< size of the submission queue
+	unsigned int		sq_tail;		//!< our copy of the SQ tail
+	unsigned int		sq_pending;		//!< entries queued, but not yet submitted
+
+	fr_uring_index_t	*sq_khead;		//!< SQ head, updated by the kernel
+	fr_uring_index_t	*sq_ktail;		//!< SQ tail, updated by us
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	fr_uring_index_t	*cq_khead;		//!< CQ head, updated by us
+	fr_uring_index_t	*cq_ktail;		//!< CQ tail, updated by the kernel
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;		//!< mmap()d submission ring
+	size_t			sq_ring_size;
+	void			*cq_ring;		//!< mmap()d completion ring
+	size_t			cq_ring_size;
+	size_t			sqes_size;		//!< size of the mmap()d SQE array
+
+	uint16_t		next_bgid;		//!< next buffer group ID to hand out
+};
+
+#ifdef HAVE_URING_MULTISHOT
+/*
+ *	A ring of buffers which the kernel reads datagrams into.
+ */
+struct fr_uring_bufs_t {
+	fr_uring_t		*ur;			//!< the ring the buffers are registered with
+	uint16_t		bgid;			//!< buffer group ID
+	uint16_t		tail;			//!< our copy of the buffer ring tail
+	bool			registered;		//!< whether the kernel knows about the buffers
+
+	unsigned int		num;			//!< number of buffers, a power of 2
+	size_t			size;			//!< size of each buffer
+	uint8_t			*data;			//!< the buffers
+
+	struct io_uring_buf_ring *ring;			//!< mmap()d ring, used to hand buffers to the kernel
+	size_t			ring_size;
+};
+#endif
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int _uring_free(fr_uring_t *ur)
+{
+	/*
+	 *	Closing the ring cancels all outstanding operations.
+	 */
+	if (ur->sqes) munmap(ur->sqes, ur->sqes_size);
+	if (ur->cq_ring && (ur->cq_ring != ur->sq_ring)) munmap(ur->cq_ring, ur->cq_ring_size);
+	if (ur->sq_ring) munmap(ur->sq_ring, ur->sq_ring_size);
+	if (ur->fd >= 0) close(ur->fd);
+	if (ur->event_fd >= 0) close(ur->event_fd);
+
+	/*
+	 *	Provided buffers are freed after us, and don't need
+	 *	to be unregistered from a closed ring.
+	 */
+	ur->fd = -1;
+	ur->event_fd = -1;
+
+	return 0;
+}
+
+/** Create an io_uring instance
+ *
+ * @param[in] ctx the talloc ctx
+ * @param[in] entries the number of submission queue entries.
+ * @return
+ *	- NULL on error, including when io_uring is not supported.
+ *	- fr_uring_t on success
+ */
+fr_uring_t *fr_uring_create(TALLOC_CTX *ctx, unsigned int entries)
+{
+	fr_uring_t *ur;
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	ur = talloc_zero(ctx, fr_uring_t);
+	if (!ur) {
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+	ur->fd = -1;
+	ur->event_fd = -1;
+	talloc_set_destructor(ur, _uring_free);
+
+	memset(&p, 0, sizeof(p));
+
+	ur->fd = uring_setup(entries, &p);
+	if (ur->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+	error:
+		talloc_free(ur);
+		return NULL;
+	}
+
+	ur->num_entries = p.sq_entries;
+
+	ur->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	ur->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+
+	/*
+	 *	Newer kernels map both rings with one call.
+	 */
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (ur->cq_ring_size > ur->sq_ring_size) ur->sq_ring_size = ur->cq_ring_size;
+		ur->cq_ring_size = ur->sq_ring_size;
+	}
+
+	ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED) {
+		ur->sq_ring = NULL;
+	map_failed:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED) {
+			ur->cq_ring = NULL;
+			goto map_failed;
+		}
+	}
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto map_failed;
+	}
+
+	sq = ur->sq_ring;
+	ur->sq_khead = (fr_uring_index_t *) (sq + p.sq_off.head);
+	ur->sq_ktail = (fr_uring_index_t *) (sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ur->sq_tail = aquire(ur->sq_ktail);
+
+	cq = ur->cq_ring;
+	ur->cq_khead = (fr_uring_index_t *) (cq + p.cq_off.head);
+	ur->cq_ktail = (fr_uring_index_t *) (cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/*
+	 *	Have the kernel tell us about completions via an FD
+	 *	which the event loop can watch.
+	 */
+	ur->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ur->event_fd < 0) {
+		fr_strerror_printf("Failed creating eventfd: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (uring_register(ur->fd, IORING_REGISTER_EVENTFD, &ur->event_fd, 1) < 0) {
+		fr_strerror_printf("Failed registering eventfd with io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	return ur;
+}
+
+/** Return the FD to watch for completions
+ *
+ * @param[in] ur the io_uring
+ * @return the eventfd which becomes readable when operations complete.
+ */
+int fr_uring_fd(fr_uring_t *ur)
+{
+	return ur->event_fd;
+}
+
+/** Get a free submission queue entry
+ *
+ *  If the submission queue is full, we submit everything which is
+ *  pending, and try again.
+ */
+static struct io_uring_sqe *uring_sqe_get(fr_uring_t *ur)
+{
+	unsigned int idx;
+	struct io_uring_sqe *sqe;
+
+	if ((ur->sq_tail - aquire(ur->sq_khead)) >= ur->num_entries) {
+		if (fr_uring_submit(ur) < 0) return NULL;
+
+		if ((ur->sq_tail - aquire(ur->sq_khead)) >= ur->num_entries) {
+			fr_strerror_printf("io_uring submission queue is full");
+			return NULL;
+		}
+	}
+
+	idx = ur->sq_tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	ur->sq_array[idx] = idx;
+	ur->sq_tail++;
+	ur->sq_pending++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static int uring_queue_msg(fr_uring_t *ur, uint8_t opcode, int sockfd, struct msghdr const *msg, fr_uring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe_get(ur);
+	if (!sqe) return -1;
+
+	op->bufs = NULL;
+
+	sqe->opcode = opcode;
+	sqe->fd = sockfd;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+
+	return 0;
+}
+
+/** Queue a recvmsg() operation
+ *
+ *  The operation is not started until fr_uring_submit() is called.
+ *
+ * @param[in] ur the io_uring
+ * @param[in] sockfd the socket to read from
+ * @param[in] msg the message header, which describes the buffers
+ * @param[in] op which is passed to the callback on completion
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_uring_recvmsg(fr_uring_t *ur, int sockfd, struct msghdr *msg, fr_uring_op_t *op)
+{
+	return uring_queue_msg(ur, IORING_OP_RECVMSG, sockfd, msg, op);
+}
+
+/** Queue a sendmsg() operation
+ *
+ *  The operation is not started until fr_uring_submit() is called.
+ *
+ * @param[in] ur the io_uring
+ * @param[in] sockfd the socket to write to
+ * @param[in] msg the message header, which describes the buffers
+ * @param[in] op which is passed to the callback on completion
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_uring_sendmsg(fr_uring_t *ur, int sockfd, struct msghdr const *msg, fr_uring_op_t *op)
+{
+	return uring_queue_msg(ur, IORING_OP_SENDMSG, sockfd, msg, op);
+}
+
+/** Submit all queued operations to the kernel
+ *
+ *  This function does not wait for any operations to complete.
+ *
+ * @param[in] ur the io_uring
+ * @return
+ *	- <0 on error
+ *	- the number of operations submitted.
+ */
+int fr_uring_submit(fr_uring_t *ur)
+{
+	int rcode;
+
+	if (!ur->sq_pending) return 0;
+
+	store(ur->sq_ktail, ur->sq_tail);
+
+redo:
+	rcode = uring_enter(ur->fd, ur->sq_pending, 0, 0);
+	if (rcode < 0) {
+		if (errno == EINTR) goto redo;
+
+		/*
+		 *	The completion queue is full, or the kernel
+		 *	is out of resources.  Leave the entries in the
+		 *	queue, and try again later.
+		 */
+		if ((errno == EAGAIN) || (errno == EBUSY)) return 0;
+
+		fr_strerror_printf("Failed submitting to io_uring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	ur->sq_pending -= rcode;
+	return rcode;
+}
+
+/** Run the callbacks for all completed operations
+ *
+ *  Callbacks may queue new operations.  Those are not submitted
+ *  until the caller runs fr_uring_submit().
+ *
+ * @param[in] ur the io_uring
+ * @return the number of completions which were processed.
+ */
+int fr_uring_service(fr_uring_t *ur)
+{
+	int num = 0;
+	uint64_t count;
+	unsigned int head, tail;
+
+	/*
+	 *	Clear the eventfd first, so that any completions which
+	 *	arrive while we're running the callbacks will wake up
+	 *	the event loop again.
+	 */
+	if (read(ur->event_fd, &count, sizeof(count)) < 0) {
+		/* ignore EAGAIN */
+	}
+
+	head = atomic_load_explicit(ur->cq_khead, memory_order_relaxed);
+
+	while (head != (tail = aquire(ur->cq_ktail))) {
+		while (head != tail) {
+			struct io_uring_cqe *cqe;
+			fr_uring_op_t *op;
+			int res;
+			uint8_t *buffer = NULL;
+			bool more = false;
+
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			op = (fr_uring_op_t *) (uintptr_t) cqe->user_data;
+			res = cqe->res;
+
+#ifdef HAVE_URING_MULTISHOT
+			if (op->bufs && ((cqe->flags & IORING_CQE_F_BUFFER) != 0)) {
+				buffer = op->bufs->data + ((cqe->flags >> IORING_CQE_BUFFER_SHIFT) * op->bufs->size);
+			}
+			more = ((cqe->flags & IORING_CQE_F_MORE) != 0);
+#endif
+
+			/*
+			 *	Release the CQE before running the
+			 *	callback, so that the kernel can re-use it.
+			 */
+			head++;
+			store(ur->cq_khead, head);
+
+			op->callback(op, res, buffer, more);
+			num++;
+		}
+	}
+
+	return num;
+}
+
+#ifdef HAVE_URING_MULTISHOT
+static int _uring_bufs_free(fr_uring_bufs_t *bufs)
+{
+	struct io_uring_buf_reg reg;
+
+	if (bufs->registered && (bufs->ur->fd >= 0)) {
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = bufs->bgid;
+
+		(void) uring_register(bufs->ur->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+
+	if (bufs->ring) munmap(bufs->ring, bufs->ring_size);
+
+	return 0;
+}
+
+/** Create a ring of buffers for multishot reads
+ *
+ *  The buffers are freed along with the io_uring.
+ *
+ * @param[in] ur the io_uring
+ * @param[in] num the number of buffers.  Must be a power of 2.
+ * @param[in] size of each buffer.  This should be large enough for
+ *	the largest datagram, plus fr_uring_recvmsg_overhead().
+ * @return
+ *	- NULL on error, including when the kernel doesn't support provided buffers.
+ *	- fr_uring_bufs_t on success
+ */
+fr_uring_bufs_t *fr_uring_bufs_create(fr_uring_t *ur, unsigned int num, size_t size)
+{
+	unsigned int i;
+	fr_uring_bufs_t *bufs;
+	struct io_uring_buf_reg reg;
+
+	/*
+	 *	Buffer IDs are 16 bits, and the ring size is a power of 2.
+	 */
+	if (!num || (num > 32768) || ((num & (num - 1)) != 0) || !size || (size > UINT32_MAX)) {
+		fr_strerror_printf("Invalid number or size of io_uring buffers");
+		return NULL;
+	}
+
+	bufs = talloc_zero(ur, fr_uring_bufs_t);
+	if (!bufs) {
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+	bufs->ur = ur;
+	bufs->bgid = ur->next_bgid++;
+	bufs->num = num;
+	bufs->size = size;
+	talloc_set_destructor(bufs, _uring_bufs_free);
+
+	bufs->data = talloc_array(bufs, uint8_t, num * size);
+	if (!bufs->data) {
+		fr_strerror_printf("Failed allocating memory");
+	error:
+		talloc_free(bufs);
+		return NULL;
+	}
+
+	bufs->ring_size = num * sizeof(struct io_uring_buf);
+	bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs->ring == MAP_FAILED) {
+		bufs->ring = NULL;
+		fr_strerror_printf("Failed mapping io_uring buffer ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) bufs->ring;
+	reg.ring_entries = num;
+	reg.bgid = bufs->bgid;
+
+	if (uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fr_strerror_printf("Failed registering buffers with io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+	bufs->registered = true;
+
+	/*
+	 *	Give all of the buffers to the kernel.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_uring_bufs_return(bufs, bufs->data + (i * size));
+	}
+
+	return bufs;
+}
+
+/** Give a buffer back to the kernel, so that it can be read into again
+ *
+ * @param[in] bufs the buffer ring
+ * @param[in] buffer which was passed to a completion callback
+ */
+void fr_uring_bufs_return(fr_uring_bufs_t *bufs, uint8_t *buffer)
+{
+	struct io_uring_buf *buf;
+
+	/*
+	 *	The first entry overlaps the ring tail, so we only
+	 *	set the fields we need, and never clear the entry.
+	 */
+	buf = &bufs->ring->bufs[bufs->tail & (bufs->num - 1)];
+	buf->addr = (uint64_t) (uintptr_t) buffer;
+	buf->len = bufs->size;
+	buf->bid = (buffer - bufs->data) / bufs->size;
+
+	bufs->tail++;
+	store((_Atomic(uint16_t) *) &bufs->ring->tail, bufs->tail);
+}
+
+/** How much of each buffer is used by the recvmsg() headers
+ *
+ * @param[in] msg which will be passed to fr_uring_recvmsg_multishot()
+ * @return the number of bytes in each buffer before the datagram.
+ */
+size_t fr_uring_recvmsg_overhead(struct msghdr const *msg)
+{
+	return sizeof(struct io_uring_recvmsg_out) + msg->msg_namelen + msg->msg_controllen;
+}
+
+/** Queue a multishot recvmsg() operation
+ *
+ *  The operation completes once for each datagram, until there is
+ *  an error, or until no buffers are left.  The callback is then run
+ *  with "more" set to false, and the caller should queue the read
+ *  again.
+ *
+ *  msg_namelen and msg_controllen say how much room to leave in
+ *  each buffer for the address and control data.  msg_iov is not used.
+ *
+ * @param[in] ur the io_uring
+ * @param[in] sockfd the socket to read from
+ * @param[in] msg the message header, which MUST stay valid while the read is active
+ * @param[in] bufs the buffers to read into
+ * @param[in] op which is passed to the callback on each completion
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_uring_recvmsg_multishot(fr_uring_t *ur, int sockfd, struct msghdr *msg,
+			       fr_uring_bufs_t *bufs, fr_uring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe_get(ur);
+	if (!sqe) return -1;
+
+	op->bufs = bufs;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sockfd;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bufs->bgid;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+
+	return 0;
+}
+
+/** Find the source address and datagram in a multishot read buffer
+ *
+ * @param[in] msg which was passed to fr_uring_recvmsg_multishot()
+ * @param[in] buffer which was passed to the callback
+ * @param[in] res which was passed to the callback
+ * @param[out] src where the datagram came from
+ * @param[out] salen the length of src
+ * @param[out] payload the datagram
+ * @return
+ *	- <0 if the buffer is invalid, or the datagram was truncated
+ *	- the length of the datagram
+ */
+ssize_t fr_uring_recvmsg_parse(struct msghdr const *msg, uint8_t *buffer, int res,
+			       struct sockaddr_storage **src, socklen_t *salen, uint8_t **payload)
+{
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buffer;
+	size_t hdr_len = fr_uring_recvmsg_overhead(msg);
+	size_t data_len;
+
+	if ((res < 0) || ((size_t) res < hdr_len)) {
+		fr_strerror_printf("Invalid io_uring recvmsg result");
+		return -1;
+	}
+
+	if ((out->flags & MSG_TRUNC) != 0) {
+		fr_strerror_printf("Datagram was larger than the io_uring buffer");
+		return -1;
+	}
+
+	*src = (struct sockaddr_storage *) (buffer + sizeof(*out));
+	*salen = out->namelen;
+	if (*salen > msg->msg_namelen) *salen = msg->msg_namelen;
+
+	*payload = buffer + hdr_len;
+	data_len = out->payloadlen;
+	if (data_len > ((size_t) res - hdr_len)) data_len = (size_t) res - hdr_len;
+
+	return data_len;
+}
+#endif
+
+#else
+/*
+ *	No io_uring.  The caller should use the normal socket API.
+ */
+fr_uring_t *fr_uring_create(UNUSED TALLOC_CTX *ctx, UNUSED unsigned int entries)
+{
+	fr_strerror_printf("io_uring is not supported on this system");
+	return NULL;
+}
+
+int fr_uring_fd(UNUSED fr_uring_t *ur)
+{
+	return -1;
+}
+
+int fr_uring_recvmsg(UNUSED fr_uring_t *ur, UNUSED int sockfd, UNUSED struct msghdr *msg, UNUSED fr_uring_op_t *op)
+{
+	fr_strerror_printf("io_uring is not supported on this system");
+	return -1;
+}
+
+int fr_uring_sendmsg(UNUSED fr_uring_t *ur, UNUSED int sockfd, UNUSED struct msghdr const *msg,
+		     UNUSED fr_uring_op_t *op)
+{
+	fr_strerror_printf("io_uring is not supported on this system");
+	return -1;
+}
+
+int fr_uring_submit(UNUSED fr_uring_t *ur)
+{
+	return 0;
+}
+
+int fr_uring_service(UNUSED fr_uring_t *ur)
+{
+	return 0;
+}
+#endif
+
+#ifndef HAVE_URING_MULTISHOT
+/*
+ *	No multishot reads.  The caller should use single reads, or the
+ *	normal socket API.
+ */
+fr_uring_bufs_t *fr_uring_bufs_create(UNUSED fr_uring_t *ur, UNUSED unsigned int num, UNUSED size_t size)
+{
+	fr_strerror_printf("io_uring multishot reads are not supported on this system");
+	return NULL;
+}
+
+void fr_uring_bufs_return(UNUSED fr_uring_bufs_t *bufs, UNUSED uint8_t *buffer)
+{
+}
+
+size_t fr_uring_recvmsg_overhead(UNUSED struct msghdr const *msg)
+{
+	return 0;
+}
+
+int fr_uring_recvmsg_multishot(UNUSED fr_uring_t *ur, UNUSED int sockfd, UNUSED struct msghdr *msg,
+			       UNUSED fr_uring_bufs_t *bufs, UNUSED fr_uring_op_t *op)
+{
+	fr_strerror_printf("io_uring multishot reads are not supported on this system");
+	return -1;
+}
+
+ssize_t fr_uring_recvmsg_parse(UNUSED struct msghdr const *msg, UNUSED uint8_t *buffer, UNUSED int res,
+			       UNUSED struct sockaddr_storage **src, UNUSED socklen_t *salen,
+			       UNUSED uint8_t **payload)
+{
+	fr_strerror_printf("io_uring multishot reads are not supported on this system");
+	return -1;
+}
+#endif
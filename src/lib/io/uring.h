@@ -0,0 +1,87 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_URING_H
+#define _FR_URING_H
+/**
+ * $Id$
+ *
+ * @file io/uring.h
+ * @brief Asynchronous socket I/O via io_uring
+ *
+ * @copyright 2017 The FreeRADIUS Server Project
+ */
+RCSIDH(uring_h, "$Id$")
+
+#include <talloc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_uring_t fr_uring_t;
+typedef struct fr_uring_op_t fr_uring_op_t;
+typedef struct fr_uring_bufs_t fr_uring_bufs_t;
+
+/**
+ *  Called when a queued operation completes.  "res" is the return
+ *  value of the underlying system call, or -errno on error.
+ *
+ *  For multishot reads, "buffer" is the provided buffer which the
+ *  data was read into, or NULL.  The caller MUST give it back via
+ *  fr_uring_bufs_return().  "more" is true if the operation is still
+ *  active, and will complete again.
+ */
+typedef void (*fr_uring_callback_t)(fr_uring_op_t *op, int res, uint8_t *buffer, bool more);
+
+/**
+ *  One outstanding operation.  The caller owns the memory, and MUST
+ *  keep it (and any buffers it references) valid until the callback
+ *  has been run with "more" set to false.
+ */
+struct fr_uring_op_t {
+	fr_uring_callback_t	callback;	//!< run when the operation completes
+	void			*uctx;		//!< caller context
+	fr_uring_bufs_t		*bufs;		//!< provided buffers, set by fr_uring_recvmsg_multishot()
+};
+
+fr_uring_t	*fr_uring_create(TALLOC_CTX *ctx, unsigned int entries);
+
+int		fr_uring_fd(fr_uring_t *ur) CC_HINT(nonnull);
+
+int		fr_uring_recvmsg(fr_uring_t *ur, int sockfd, struct msghdr *msg, fr_uring_op_t *op) CC_HINT(nonnull);
+int		fr_uring_sendmsg(fr_uring_t *ur, int sockfd, struct msghdr const *msg, fr_uring_op_t *op) CC_HINT(nonnull);
+
+fr_uring_bufs_t	*fr_uring_bufs_create(fr_uring_t *ur, unsigned int num, size_t size) CC_HINT(nonnull);
+void		fr_uring_bufs_return(fr_uring_bufs_t *bufs, uint8_t *buffer) CC_HINT(nonnull);
+
+size_t		fr_uring_recvmsg_overhead(struct msghdr const *msg) CC_HINT(nonnull);
+int		fr_uring_recvmsg_multishot(fr_uring_t *ur, int sockfd, struct msghdr *msg,
+					   fr_uring_bufs_t *bufs, fr_uring_op_t *op) CC_HINT(nonnull);
+ssize_t		fr_uring_recvmsg_parse(struct msghdr const *msg, uint8_t *buffer, int res,
+				       struct sockaddr_storage **src, socklen_t *salen,
+				       uint8_t **payload) CC_HINT(nonnull);
+
+int		fr_uring_submit(fr_uring_t *ur) CC_HINT(nonnull);
+int		fr_uring_service(fr_uring_t *ur) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_URING_H */
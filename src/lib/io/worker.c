@@ -57,6 +57,14 @@
  *  yeilded, it is placed onto the yielded list in the worker
  *  "tracking" data structure.
  *
+ *  Workers which are created by the same scheduler may steal work
+ *  from each other.  When stealing is enabled, a worker only reads a
+ *  few messages at a time from its channels, and leaves the rest in
+ *  the channels message queues.  An idle worker which sees that a peer
+ *  has been running one request for "too long" takes messages
+ *  directly from that peers channels.  It decodes and runs them, and
+ *  sends the reply on its own channel to the same network thread.
+ *
  * @copyright 2016 Alan DeKok <aland@freeradius.org>
  */
 RCSID("$Id$")
@@ -65,6 +73,36 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/message.h>
 
+#include <sched.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	Work stealing.  A worker stops reading from its channels once
+ *	it has WORKER_STEAL_BACKLOG messages to decode.  An idle worker
+ *	steals up to WORKER_STEAL_BATCH messages at a time, from a
+ *	worker which has been running one request for more than
+ *	WORKER_STEAL_DELAY.
+ */
+#define WORKER_STEAL_BACKLOG	(8)
+#define WORKER_STEAL_BATCH	(8)
+#define WORKER_STEAL_DELAY	(NANOSEC / 1000)
+
+/*
+ *	Adaptive spinning.  Before it goes to sleep, an idle worker
+ *	polls its channels for a while.  When requests arrive while it
+ *	spins, it spins for longer next time, up to WORKER_SPIN_MAX.
+ *	When they don't, it spins for less.  A worker which doesn't
+ *	sleep doesn't need to be woken up, which lets the network
+ *	thread skip the signal.
+ */
+#define WORKER_SPIN_MIN		(NANOSEC / 1000000)
+#define WORKER_SPIN_MAX		(NANOSEC / 20000)
+
 /**
  *  Track things by priority and time.
  */
@@ -102,6 +140,8 @@ struct fr_worker_t {
 
 	fr_time_t		checked_timeout; //!< when we last checked the tails of the queues
 
+	fr_time_t		spin;		//!< how long we poll our channels before sleeping
+
 	fr_worker_heap_t	to_decode;	//!< messages from the master, to be decoded or localized
 	fr_worker_heap_t       	localized;	//!< localized messages to be decoded
 
@@ -121,6 +161,27 @@ struct fr_worker_t {
 	fr_transport_t		**transports;	//!< array of active transports.
 
 	fr_channel_t		**channel;	//!< list of channels
+
+	fr_worker_peers_t	*peers;		//!< workers which we steal from, and which steal from us
+	int			peer_id;	//!< our index in the peers array
+	int			steal_start;	//!< where we start looking for a busy peer
+	fr_event_timer_t	*ev_steal;	//!< wake up to look for a busy peer
+
+	_Atomic(fr_channel_t *)	*stealable;	//!< copy of "channel", for other workers to read
+
+	_Atomic(fr_time_t)	busy_since;	//!< when we started running the current request, or 0
+	_Atomic(uint64_t)	num_stolen;	//!< number of messages we stole from other workers
+	_Atomic(uint64_t)	num_robbed;	//!< number of messages other workers stole from us
+};
+
+/**
+ *  Workers which can steal work from each other.
+ */
+struct fr_worker_peers_t {
+	int			max_workers;	//!< size of the worker array
+	atomic_bool		enabled;	//!< whether stealing is enabled
+	_Atomic(fr_worker_t *)	*worker;	//!< array of workers, indexed by peer id
+	atomic_uint		*holds;		//!< number of threads looking at each worker
 };
 
 /*
@@ -172,11 +233,42 @@ static void fr_worker_drain_input(fr_worker_t *worker, fr_channel_t *ch, fr_chan
 		worker->num_requests++;
 		fr_log(worker->log, L_DBG, "\t%sreceived request %d", worker->name, worker->num_requests);
 		cd->channel.ch = ch;
+		cd->channel.stolen_from = NULL;
 		WORKER_HEAP_INSERT(to_decode, cd, request.list);
+
+		/*
+		 *	We have enough to do.  Leave the rest in the
+		 *	channel, where idle workers can take it.
+		 */
+		if (worker->peers &&
+		    (fr_heap_num_elements(worker->to_decode.heap) >= WORKER_STEAL_BACKLOG) &&
+		    atomic_load_explicit(&worker->peers->enabled, memory_order_relaxed)) break;
+
 	} while ((cd = fr_channel_recv_request(ch)) != NULL);
 }
 
 
+/** Read more messages from all of our channels
+ *
+ *  If work stealing is enabled, we may have left messages in the
+ *  channels.
+ *
+ * @param[in] worker the worker
+ */
+static void fr_worker_drain_channels(fr_worker_t *worker)
+{
+	int i;
+	fr_channel_data_t *cd;
+
+	for (i = 0; i < worker->max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		cd = fr_channel_recv_request(worker->channel[i]);
+		if (cd) fr_worker_drain_input(worker, worker->channel[i], cd);
+	}
+}
+
+
 /** Handle a worker control message for a channel
  *
  * @param[in] ctx the worker
@@ -230,6 +322,13 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			if (worker->channel[i] != NULL) continue;
 
 			worker->channel[i] = ch;
+
+			/*
+			 *	Our peers may read from the channel
+			 *	once it's in the "stealable" array.
+			 */
+			if (worker->peers) fr_channel_stealable(ch);
+			atomic_store_explicit(&worker->stealable[i], ch, memory_order_release);
 			fr_log(worker->log, L_DBG, "\t%sreceived channel %p into array entry %d", worker->name, ch, i);
 
 			ms = fr_message_set_create(worker, worker->message_set_size,
@@ -273,6 +372,7 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			talloc_free(ms);
 
 			worker->channel[i] = NULL;
+			atomic_store_explicit(&worker->stealable[i], NULL, memory_order_release);
 			rad_assert(worker->num_channels > 0);
 			worker->num_channels--;
 			ok = true;
@@ -325,7 +425,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 {
 	size_t size;
 	fr_channel_data_t *reply;
-	fr_channel_t *ch;
+	fr_channel_t *ch, *victim;
 	fr_message_set_t *ms;
 
 	worker->num_timeouts++;
@@ -334,6 +434,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	 *	Cache the outbound channel.  We'll need it later.
 	 */
 	ch = cd->channel.ch;
+	victim = cd->channel.stolen_from;
 
 	ms = fr_channel_worker_ctx_get(ch);
 	rad_assert(ms != NULL);
@@ -361,6 +462,8 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 
 	reply->packet_ctx = cd->packet_ctx;
 	reply->io_ctx = cd->io_ctx;
+	reply->src_ipaddr = cd->src_ipaddr;
+	reply->src_port = cd->src_port;
 	reply->priority = cd->priority;
 	reply->transport = cd->transport;
 
@@ -372,7 +475,13 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	/*
 	 *	Send the reply, which also polls the request queue.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+	if (victim) {
+		if (fr_channel_send_stolen_reply(ch, reply, victim, &cd) < 0) {
+			fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
+			cd = NULL;
+		}
+
+	} else if (fr_channel_send_reply(ch, reply, &cd) < 0) {
 		fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
 		cd = NULL;
 	}
@@ -445,6 +554,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 
 	reply->packet_ctx = request->packet_ctx;
 	reply->io_ctx = request->io_ctx;
+	reply->src_ipaddr = request->src_ipaddr;
+	reply->src_port = request->src_port;
 	reply->priority = request->priority;
 	reply->transport = request->transport->id;
 
@@ -453,7 +564,13 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	/*
 	 *	Send the reply, which also polls the request queue.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+	if (request->stolen_from) {
+		if (fr_channel_send_stolen_reply(ch, reply, request->stolen_from, &cd) < 0) {
+			fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
+			cd = NULL;
+		}
+
+	} else if (fr_channel_send_reply(ch, reply, &cd) < 0) {
 		fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
 		cd = NULL;
 	}
@@ -605,6 +722,170 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 }
 
 
+/** Find our channel to the same master as another workers channel
+ *
+ * @param[in] worker the worker
+ * @param[in] other a channel owned by another worker
+ * @return
+ *	- NULL if we have no channel to that master
+ *	- our channel on success
+ */
+static fr_channel_t *fr_worker_channel_find(fr_worker_t *worker, fr_channel_t *other)
+{
+	int i;
+
+	for (i = 0; i < worker->max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		if (fr_channel_same_master(worker->channel[i], other)) return worker->channel[i];
+	}
+
+	return NULL;
+}
+
+
+/** Take a message from another worker
+ *
+ * @param[in] worker the worker
+ * @param[in] ch our channel, which we reply on
+ * @param[in] victim the channel the message was sent on
+ * @param[in] cd the message
+ */
+static void fr_worker_take(fr_worker_t *worker, fr_channel_t *ch, fr_channel_t *victim, fr_channel_data_t *cd)
+{
+	worker->num_requests++;
+	fr_log(worker->log, L_DBG, "\t%sstole request %d", worker->name, worker->num_requests);
+
+	cd->channel.ch = ch;
+	cd->channel.stolen_from = victim;
+	WORKER_HEAP_INSERT(to_decode, cd, request.list);
+}
+
+
+/** Get a peer, and stop it from being freed
+ *
+ *  The peer MUST be released with fr_worker_peer_release() as soon as
+ *  we're done looking at it, as fr_worker_peers_remove() waits for
+ *  that.
+ *
+ * @param[in] peers the group of workers
+ * @param[in] id of the peer
+ * @return
+ *	- NULL if there's no worker with that id.
+ *	- the worker.
+ */
+static fr_worker_t *fr_worker_peer_hold(fr_worker_peers_t *peers, int id)
+{
+	fr_worker_t *peer;
+
+	/*
+	 *	Sequentially consistent, so that either we see the
+	 *	worker being removed, or fr_worker_peers_remove()
+	 *	sees our hold.
+	 */
+	atomic_fetch_add(&peers->holds[id], 1);
+
+	peer = atomic_load(&peers->worker[id]);
+	if (!peer) atomic_fetch_sub_explicit(&peers->holds[id], 1, memory_order_release);
+
+	return peer;
+}
+
+
+/** Release a peer obtained with fr_worker_peer_hold()
+ *
+ * @param[in] peers the group of workers
+ * @param[in] id of the peer
+ */
+static inline void fr_worker_peer_release(fr_worker_peers_t *peers, int id)
+{
+	atomic_fetch_sub_explicit(&peers->holds[id], 1, memory_order_release);
+}
+
+
+/** Steal messages from a busy worker
+ *
+ *  We only steal from workers which have been running one request
+ *  for a while.  Workers which are processing requests quickly will
+ *  get to their backlog soon enough.
+ *
+ * @param[in] worker the worker
+ * @param[in] now the current time
+ * @return the number of messages we stole.
+ */
+static int fr_worker_steal(fr_worker_t *worker, fr_time_t now)
+{
+	int i, j, stolen;
+	fr_worker_peers_t *peers = worker->peers;
+
+	if (!peers || !atomic_load_explicit(&peers->enabled, memory_order_relaxed)) return 0;
+
+	for (i = 0; i < peers->max_workers; i++) {
+		int id;
+		fr_time_t busy;
+		fr_worker_t *victim;
+		fr_channel_t *ch;
+		fr_channel_data_t *cd;
+
+		id = (worker->steal_start + i) % peers->max_workers;
+		if (id == worker->peer_id) continue;
+
+		victim = fr_worker_peer_hold(peers, id);
+		if (!victim) continue;
+
+		busy = atomic_load_explicit(&victim->busy_since, memory_order_relaxed);
+		if (!busy || (busy >= now) || ((now - busy) < WORKER_STEAL_DELAY)) {
+			fr_worker_peer_release(peers, id);
+			continue;
+		}
+
+		stolen = 0;
+
+		/*
+		 *	Take the messages it hasn't read from its
+		 *	channels yet.
+		 */
+		for (j = 0; (j < victim->max_channels) && (stolen < WORKER_STEAL_BATCH); j++) {
+			fr_channel_t *victim_ch;
+
+			victim_ch = atomic_load_explicit(&victim->stealable[j], memory_order_acquire);
+			if (!victim_ch) continue;
+
+			ch = fr_worker_channel_find(worker, victim_ch);
+			if (!ch) continue;
+
+			while ((stolen < WORKER_STEAL_BATCH) && ((cd = fr_channel_steal_request(victim_ch)) != NULL)) {
+				fr_worker_take(worker, ch, victim_ch, cd);
+				stolen++;
+			}
+		}
+
+		if (stolen) atomic_fetch_add_explicit(&victim->num_robbed, stolen, memory_order_relaxed);
+
+		/*
+		 *	We're done with the victim, and it may now
+		 *	be freed.
+		 */
+		fr_worker_peer_release(peers, id);
+
+		if (!stolen) continue;
+
+		fr_log(worker->log, L_DBG, "\t%sstole %d requests from worker %d", worker->name, stolen, id);
+
+		atomic_fetch_add_explicit(&worker->num_stolen, stolen, memory_order_relaxed);
+
+		/*
+		 *	Start with the next worker next time, so that
+		 *	we spread the load.
+		 */
+		worker->steal_start = (id + 1) % peers->max_workers;
+		return stolen;
+	}
+
+	return 0;
+}
+
+
 /** Get a runnable request
  *
  * @param[in] worker the worker
@@ -641,6 +922,20 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		if (!cd) {
 			WORKER_HEAP_POP(to_decode, cd, request.list);
 		}
+
+		/*
+		 *	We may have left messages in our channels, or
+		 *	the master may have sent more without
+		 *	signaling us, because we're awake.
+		 */
+		if (!cd) {
+			fr_worker_drain_channels(worker);
+			WORKER_HEAP_POP(to_decode, cd, request.list);
+		}
+
+		if (!cd && fr_worker_steal(worker, now)) {
+			WORKER_HEAP_POP(to_decode, cd, request.list);
+		}
 		if (!cd) return NULL;
 
 		worker->num_decoded++;
@@ -689,6 +984,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	 */
 	memset(request, 0, sizeof(*request));
 	request->channel = cd->channel.ch;
+	request->stolen_from = cd->channel.stolen_from;
 	request->transport = worker->transports[cd->transport];
 	request->original_recv_time = cd->request.start_time;
 	request->recv_time = cd->m.when;
@@ -697,6 +993,8 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	request->el = worker->el;
 	request->packet_ctx = cd->packet_ctx;
 	request->io_ctx = cd->io_ctx;
+	request->src_ipaddr = cd->src_ipaddr;
+	request->src_port = cd->src_port;
 	request->number = 0;	/* @todo - assigned by someone intelligent... */
 
 	/*
@@ -841,6 +1139,80 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 	fr_worker_send_reply(worker, request, size);
 }
 
+/** Wake up, so that we can look for work to steal
+ *
+ *  This function does nothing.  The main loop takes care of stealing.
+ */
+static void fr_worker_steal_timer(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, UNUSED void *ctx)
+{
+}
+
+
+/** Check if any of our peers are running a request
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- true if another worker is running a request.
+ *	- false otherwise.
+ */
+static bool fr_worker_peers_busy(fr_worker_t *worker)
+{
+	int i;
+	fr_worker_t *peer;
+	fr_worker_peers_t *peers = worker->peers;
+
+	if (!peers || !atomic_load_explicit(&peers->enabled, memory_order_relaxed)) return false;
+
+	for (i = 0; i < peers->max_workers; i++) {
+		bool busy;
+
+		if (i == worker->peer_id) continue;
+
+		peer = fr_worker_peer_hold(peers, i);
+		if (!peer) continue;
+
+		busy = (atomic_load_explicit(&peer->busy_since, memory_order_relaxed) != 0);
+		fr_worker_peer_release(peers, i);
+
+		if (busy) return true;
+	}
+
+	return false;
+}
+
+
+/** Poll our channels for a while before sleeping
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- true if a channel has requests waiting
+ *	- false if we should sleep
+ */
+static bool fr_worker_spin(fr_worker_t *worker)
+{
+	int i;
+	fr_time_t start;
+
+	start = fr_time();
+
+	do {
+		for (i = 0; i < worker->max_channels; i++) {
+			if (!worker->channel[i]) continue;
+
+			if (!fr_channel_recv_ready(worker->channel[i])) continue;
+
+			worker->spin *= 2;
+			if (worker->spin > WORKER_SPIN_MAX) worker->spin = WORKER_SPIN_MAX;
+			return true;
+		}
+	} while ((fr_time() - start) < worker->spin);
+
+	worker->spin /= 2;
+	if (worker->spin < WORKER_SPIN_MIN) worker->spin = WORKER_SPIN_MIN;
+
+	return false;
+}
+
 /** Run the event loop 'idle' callback
  *
  *  This function MUST DO NO WORK.  All it does is check if there's
@@ -853,7 +1225,7 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 static int fr_worker_idle(void *ctx, struct timeval *wake)
 {
 	bool sleeping;
-	int i;
+	int i, pending;
 	fr_worker_t *worker = talloc_get_type_abort(ctx, fr_worker_t);
 
 	rad_assert(worker->runnable != NULL);
@@ -882,6 +1254,33 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	 */
 	if (!sleeping) return 1;
 
+	/*
+	 *	Other workers are busy.  Wake up in a little while
+	 *	to see if they need help.  The event loop has already
+	 *	calculated when it will wake up, so we ask it to
+	 *	re-calculate that.
+	 */
+	if (!worker->ev_steal && fr_worker_peers_busy(worker)) {
+		struct timeval when;
+
+		gettimeofday(&when, NULL);
+		when.tv_usec += WORKER_STEAL_DELAY / 1000;
+		if (when.tv_usec >= USEC) {
+			when.tv_sec++;
+			when.tv_usec -= USEC;
+		}
+
+		if (fr_event_timer_insert(worker->el, fr_worker_steal_timer, worker, &when, &worker->ev_steal) == 0) {
+			return 1;
+		}
+	}
+
+	/*
+	 *	Requests are arriving quickly.  We'd rather wait a
+	 *	little for the next one than be woken up for it.
+	 */
+	if (fr_worker_spin(worker)) return 1;
+
 	fr_log(worker->log, L_DBG, "\t%ssleeping running %zd, localized %zd, to_decode %zd",
 	       worker->name,
 	       fr_heap_num_elements(worker->runnable),
@@ -896,12 +1295,19 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	 *	sleeping.  The fr_channel_worker_sleeping() function
 	 *	will take care of skipping the signal if there are no
 	 *	outstanding requests for it.
+	 *
+	 *	If a request arrived while we were getting ready to
+	 *	sleep, the master may not signal us.  So we have to
+	 *	go read it now.
 	 */
-	for (i = 0; i < worker->num_channels; i++) {
-		(void) fr_channel_worker_sleeping(worker->channel[i]);
+	pending = 0;
+	for (i = 0; i < worker->max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		if (fr_channel_worker_sleeping(worker->channel[i]) > 0) pending++;
 	}
 
-	return 0;
+	return (pending > 0);
 }
 
 /**
@@ -1015,6 +1421,12 @@ nomem:
 		goto nomem;
 	}
 
+	worker->stealable = talloc_zero_array(worker, _Atomic(fr_channel_t *), max_channels);
+	if (!worker->stealable) {
+		talloc_free(worker);
+		goto nomem;
+	}
+
 	worker->log = logger;
 
 	/*
@@ -1024,6 +1436,7 @@ nomem:
 	worker->talloc_pool_size = 4096; /* at least enough for a REQUEST */
 	worker->message_set_size = 1024;
 	worker->ring_buffer_size = (1 << 16);
+	worker->spin = WORKER_SPIN_MIN;
 
 	worker->el = fr_event_list_alloc(worker, fr_worker_idle, worker);
 	if (!worker->el) {
@@ -1032,6 +1445,15 @@ nomem:
 		return NULL;
 	}
 
+	/*
+	 *	Workers have cleanup timers for every request.
+	 */
+	if (fr_event_list_timer_wheel(worker->el) < 0) {
+		fr_strerror_printf("Failed creating timer wheel: %s", fr_strerror());
+		talloc_free(worker);
+		return NULL;
+	}
+
 	if (fr_event_user_insert(worker->el, fr_worker_evfilt_user, worker) < 0) {
 		fr_strerror_printf("Failed updating event list: %s", fr_strerror());
 		talloc_free(worker);
@@ -1172,7 +1594,9 @@ void fr_worker(fr_worker_t *worker)
 		 *	yielded, or send a reply.
 		 */
 		fr_log(worker->log, L_DBG, "\t%srunning request (%zd)", worker->name, request->number);
+		atomic_store_explicit(&worker->busy_since, now, memory_order_relaxed);
 		fr_worker_run_request(worker, request);
+		atomic_store_explicit(&worker->busy_since, 0, memory_order_relaxed);
 	}
 }
 
@@ -1206,6 +1630,9 @@ void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 	fprintf(fp, "\tkq = %d\n", worker->kq);
 	fprintf(fp, "\tnum_channels = %d\n", worker->num_channels);
 	fprintf(fp, "\tnum_requests = %d\n", worker->num_requests);
+	fprintf(fp, "\tnum_stolen = %" PRIu64 "\n", atomic_load(&worker->num_stolen));
+	fprintf(fp, "\tnum_robbed = %" PRIu64 "\n", atomic_load(&worker->num_robbed));
+	fprintf(fp, "\tspin = %" PRIu64 "ns\n", (uint64_t) worker->spin);
 
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %zd\n", worker->tracking.predicted * worker->num_requests);
 	fprintf(fp, "\tcalculated (counted) per request time = %zd\n", worker->tracking.running / worker->num_requests);
@@ -1261,3 +1688,142 @@ void fr_worker_name(fr_worker_t *worker, char const *name)
 
 	worker->name = talloc_strdup(worker, name);
 }
+
+
+/** Create a group of workers which can steal work from each other
+ *
+ *  Stealing is disabled by default.
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] max_workers the maximum number of workers in the group
+ * @return
+ *	- NULL on error
+ *	- fr_worker_peers_t on success
+ */
+fr_worker_peers_t *fr_worker_peers_create(TALLOC_CTX *ctx, int max_workers)
+{
+	fr_worker_peers_t *peers;
+
+	if (max_workers <= 0) {
+		fr_strerror_printf("Invalid number of workers");
+		return NULL;
+	}
+
+	peers = talloc_zero(ctx, fr_worker_peers_t);
+	if (!peers) {
+	nomem:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	peers->worker = talloc_zero_array(peers, _Atomic(fr_worker_t *), max_workers);
+	peers->holds = talloc_zero_array(peers, atomic_uint, max_workers);
+	if (!peers->worker || !peers->holds) {
+		talloc_free(peers);
+		goto nomem;
+	}
+
+	peers->max_workers = max_workers;
+	atomic_init(&peers->enabled, false);
+
+	return peers;
+}
+
+
+/** Add a worker to a group of peers
+ *
+ *  MUST be called from the worker thread, before fr_worker() is
+ *  called.
+ *
+ * @param[in] peers the group of workers
+ * @param[in] id the workers index in the group
+ * @param[in] worker the worker to add
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_peers_add(fr_worker_peers_t *peers, int id, fr_worker_t *worker)
+{
+	(void) talloc_get_type_abort(worker, fr_worker_t);
+
+	if ((id < 0) || (id >= peers->max_workers)) {
+		fr_strerror_printf("Invalid worker id %d", id);
+		return -1;
+	}
+
+	if (worker->peers) {
+		fr_strerror_printf("Worker is already in a group");
+		return -1;
+	}
+
+	worker->peers = peers;
+	worker->peer_id = id;
+	worker->steal_start = (id + 1) % peers->max_workers;
+
+	atomic_store_explicit(&peers->worker[id], worker, memory_order_release);
+
+	return 0;
+}
+
+
+/** Remove a worker from a group of peers
+ *
+ *  Waits until no other thread is looking at the worker.  Once this
+ *  function returns, the worker may be freed.
+ *
+ * @param[in] peers the group of workers
+ * @param[in] worker the worker to remove
+ */
+void fr_worker_peers_remove(fr_worker_peers_t *peers, fr_worker_t *worker)
+{
+	if (worker->peers != peers) return;
+
+	/*
+	 *	No one can get a new hold on the worker after
+	 *	this.  Existing holds only last as long as it
+	 *	takes to steal a batch of messages.
+	 */
+	atomic_store(&peers->worker[worker->peer_id], NULL);
+
+	while (atomic_load(&peers->holds[worker->peer_id]) != 0) sched_yield();
+
+	worker->peers = NULL;
+}
+
+
+/** Enable or disable work stealing
+ *
+ *  May be called from any thread.
+ *
+ * @param[in] peers the group of workers
+ * @param[in] enable whether to steal work
+ */
+void fr_worker_peers_steal(fr_worker_peers_t *peers, bool enable)
+{
+	atomic_store_explicit(&peers->enabled, enable, memory_order_relaxed);
+}
+
+
+/** Get the total number of messages stolen by workers in a group
+ *
+ *  May be called from any thread.
+ *
+ * @param[in] peers the group of workers
+ * @return the number of stolen messages
+ */
+uint64_t fr_worker_peers_num_stolen(fr_worker_peers_t *peers)
+{
+	int i;
+	uint64_t num_stolen = 0;
+	fr_worker_t *worker;
+
+	for (i = 0; i < peers->max_workers; i++) {
+		worker = fr_worker_peer_hold(peers, i);
+		if (!worker) continue;
+
+		num_stolen += atomic_load_explicit(&worker->num_stolen, memory_order_relaxed);
+		fr_worker_peer_release(peers, i);
+	}
+
+	return num_stolen;
+}
@@ -44,6 +44,11 @@ extern "C" {
  */
 typedef struct fr_worker_t fr_worker_t;
 
+/**
+ *  A group of workers which may steal requests from each other.
+ */
+typedef struct fr_worker_peers_t fr_worker_peers_t;
+
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, fr_log_t *logger, uint32_t num_transports, fr_transport_t **transports);
 void fr_worker_destroy(fr_worker_t *worker) CC_HINT(nonnull);
 int fr_worker_kq(fr_worker_t *worker) CC_HINT(nonnull);
@@ -53,6 +58,12 @@ void fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
 void fr_worker_name(fr_worker_t *worker, char const *name) CC_HINT(nonnull);
 fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
 
+fr_worker_peers_t *fr_worker_peers_create(TALLOC_CTX *ctx, int max_workers);
+int fr_worker_peers_add(fr_worker_peers_t *peers, int id, fr_worker_t *worker) CC_HINT(nonnull);
+void fr_worker_peers_remove(fr_worker_peers_t *peers, fr_worker_t *worker) CC_HINT(nonnull);
+void fr_worker_peers_steal(fr_worker_peers_t *peers, bool enable) CC_HINT(nonnull);
+uint64_t fr_worker_peers_num_stolen(fr_worker_peers_t *peers) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
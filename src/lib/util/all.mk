@@ -20,12 +20,14 @@ SOURCES		:= base64.c \
 		   hmacsha1.c \
 		   inet.c \
 		   isaac.c \
+		   lpm.c \
 		   log.c \
 		   mem.c \
 		   misc.c \
 		   missing.c \
 		   md4.c \
 		   md5.c \
+		   md5_mb.c \
 		   net.c \
 		   pair.c \
 		   pair_cursor.c \
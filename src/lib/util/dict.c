@@ -36,6 +36,13 @@ RCSID("$Id$")
 
 #define MAX_ARGV (16)
 
+/*
+ *	Children with numbers below this are also kept in a directly
+ *	indexed array.  Larger numbers (usually vendors under
+ *	Vendor-Specific) are only found via the bins.
+ */
+#define CHILD_INDEX_MAX (1024)
+
 /** Magic internal dictionary
  *
  * Internal dictionary is checked in addition to the protocol dictionary
@@ -588,6 +595,65 @@ int fr_dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num)
 	return 0;
 }
 
+/** Find the first child in a bin with a given number
+ *
+ * Where vendors overload the RFC space, there may be more than one,
+ * and the bins are sorted so that the preferred one comes first.
+ */
+static inline fr_dict_attr_t const *fr_dict_attr_child_bin_find(fr_dict_attr_t const *parent, unsigned int attr)
+{
+	fr_dict_attr_t const *bin;
+
+	for (bin = parent->children[attr & 0xff]; bin; bin = bin->next) {
+		if (bin->attr == attr) return bin;
+	}
+
+	return NULL;
+}
+
+/** Update the direct index of a parent after adding a child
+ *
+ * The index is grown (in powers of 2) to cover the number of the child,
+ * and any new entries are filled in from the bins.  The entry for the
+ * child is then set to whatever the bins would return, so that both
+ * lookups always agree.
+ *
+ * @param parent we've added a child to.
+ * @param child we've added.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (memory allocation error).
+ */
+static int fr_dict_attr_child_index_add(fr_dict_attr_t *parent, fr_dict_attr_t const *child)
+{
+	unsigned int		i, len;
+	fr_dict_attr_t const	**index;
+
+	if (child->attr >= CHILD_INDEX_MAX) return 0;
+
+	if (child->attr >= parent->child_index_len) {
+		for (len = 16; len <= child->attr; len <<= 1) {
+			/* nothing */
+		}
+
+		index = talloc_realloc(parent, parent->child_index, fr_dict_attr_t const *, len);
+		if (!index) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+
+		for (i = parent->child_index_len; i < len; i++) index[i] = fr_dict_attr_child_bin_find(parent, i);
+
+		parent->child_index = index;
+		parent->child_index_len = len;
+		return 0;
+	}
+
+	parent->child_index[child->attr] = fr_dict_attr_child_bin_find(parent, child->attr);
+
+	return 0;
+}
+
 /** Add a child to a parent.
  *
  * @param parent we're adding a child to.
@@ -669,7 +735,7 @@ static inline int fr_dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t
 	child->next = *this;
 	*this = child;
 
-	return 0;
+	return fr_dict_attr_child_index_add(parent, child);
 }
 
 /** Build the tlv_stack for the specified DA and encode the path in OID form
@@ -4110,6 +4176,8 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_da(fr_dict_attr_t const *pare
 {
 	fr_dict_attr_t const *bin;
 
+	if ((child->attr < parent->child_index_len) && (parent->child_index[child->attr] == child)) return child;
+
 	if (!parent->children) return NULL;
 
 	/*
@@ -4151,6 +4219,12 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_num(fr_dict_attr_t const *par
 {
 	fr_dict_attr_t const *bin;
 
+	/*
+	 *	Most children are found here.  The index only exists
+	 *	for parents which can have children.
+	 */
+	if (attr < parent->child_index_len) return parent->child_index[attr];
+
 	if (!parent->children) return NULL;
 
 	/*
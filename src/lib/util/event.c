@@ -21,6 +21,13 @@
  * @note By non-thread-safe we mean multiple threads can't insert/delete events concurrently
  *	without synchronization.
  *
+ * @note When built with WITH_EVENT_EPOLL, epoll is used natively instead of going through
+ *	libkqueue.  EVFILT_USER is emulated with a single eventfd per event list.
+ *
+ * @note Timers are kept in a heap by default.  #fr_event_list_timer_wheel switches an event
+ *	list to a hierarchical timing wheel, which has O(1) insert and delete, and which
+ *	keys timers on the monotonic clock.
+ *
  * @copyright 2007-2016 The FreeRADIUS server project
  * @copyright 2016 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
  * @copyright 2007 Alan DeKok <aland@ox.org>
@@ -30,12 +37,33 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
+#include <freeradius-devel/io/time.h>
+
+#ifdef WITH_EVENT_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #define FR_EV_BATCH_FDS (256)
 
 #undef USEC
 #define USEC (1000000)
 
+/*
+ *	The timing wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots.
+ *	A level 0 slot covers one tick of 2^WHEEL_TICK_SHIFT ns (~1ms),
+ *	and each slot on level N covers all of level N-1.  So level 0
+ *	spans ~268ms, level 1 ~68s, level 2 ~4.9h and level 3 ~52 days.
+ *	Timers further out than that go into the last slot of level 3,
+ *	and are re-filed when it's cascaded.
+ */
+#define WHEEL_TICK_SHIFT	(20)
+#define WHEEL_BITS		(8)
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		(4)
+#define WHEEL_EXPIRED		(-1)
+
 /** A timer event
  *
  */
@@ -46,8 +74,28 @@ struct fr_event_timer_t {
 
 	fr_event_timer_t	**parent;		//!< Previous timer.
 	int			heap;			//!< Where to store opaque heap data.
+
+	fr_time_t		deadline;		//!< "when" on the monotonic clock, for the timing wheel.
+	fr_dlist_t		entry;			//!< Entry in a wheel slot, or in the expired list.
+	int			level;			//!< Wheel level we're in, or WHEEL_EXPIRED.
+	int			slot;			//!< Slot within that level.
 };
 
+/** A hierarchical timing wheel
+ *
+ */
+typedef struct fr_event_wheel_t {
+	uint64_t		tick;			//!< Current tick.  All earlier slots are empty.
+	int64_t			offset;			//!< Wall clock minus monotonic clock, in ns.
+	int			num_timers;		//!< Number of timers in the wheel, including expired ones.
+
+	int			count[WHEEL_LEVELS];	//!< Number of timers on each level.
+	uint64_t		used[WHEEL_LEVELS][WHEEL_SIZE / 64];	//!< Bitmap of non-empty slots.
+	fr_dlist_t		slots[WHEEL_LEVELS][WHEEL_SIZE];	//!< Timers, by level and slot.
+
+	fr_dlist_t		expired;		//!< Timers which are due, but haven't been run yet.
+} fr_event_wheel_t;
+
 /** A file descriptor event
  *
  */
@@ -75,6 +123,7 @@ typedef struct fr_event_fd_t {
  */
 struct fr_event_list_t {
 	fr_heap_t		*times;			//!< of timer events to be executed.
+	fr_event_wheel_t	*wheel;			//!< Timing wheel, used instead of "times" if set.
 	rbtree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			exit;
@@ -90,11 +139,18 @@ struct fr_event_list_t {
 	int			num_fd_events;		//!< Number of events in this event list.
 
 	int			kq;			//!< instance associated with this event list.
+#ifdef WITH_EVENT_EPOLL
+	int			user_fd;		//!< eventfd used to emulate EVFILT_USER.
+#endif
 
 	fr_event_user_handler_t user;			//!< callback for EVFILT_USER events
 	void			*user_ctx;		//!< Context pointer to pass to the user callback.
 
+#ifdef WITH_EVENT_EPOLL
+	struct epoll_event	events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#else
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#endif
 };
 
 /** Compare two timer events to see which one should occur first
@@ -158,10 +214,15 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return -1;
 
+	if (el->wheel) return el->wheel->num_timers;
+
 	return fr_heap_num_elements(el->times);
 }
 
 /** Return the kq associated with an event list.
+ *
+ * This is the descriptor other threads should pass to #fr_event_user_trigger.
+ * With the epoll backend, it's the eventfd used to emulate EVFILT_USER.
  *
  * @param[in] el to return timer events for.
  * @return kq
@@ -170,7 +231,11 @@ int fr_event_list_kq(fr_event_list_t *el)
 {
 	if (!el) return -1;
 
+#ifdef WITH_EVENT_EPOLL
+	return el->user_fd;
+#else
 	return el->kq;
+#endif
 }
 
 /** Get the current time according to the event list
@@ -248,11 +313,22 @@ int fr_event_fd_delete(fr_event_list_t *el, int fd)
  */
 static int _fr_event_fd_free(fr_event_fd_t *ef)
 {
+	fr_event_list_t	*el = talloc_parent(ef);
+
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	Closing an FD removes it from the epoll set, so
+	 *	the caller may have beaten us to it.
+	 */
+	if (ef->is_registered && (epoll_ctl(el->kq, EPOLL_CTL_DEL, ef->fd, NULL) < 0) &&
+	    (errno != EBADF) && (errno != ENOENT)) {
+		fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
+		return -1;
+	}
+#else
 	int		filter = 0;
 	struct kevent	evset;
 
-	fr_event_list_t	*el = talloc_parent(ef);
-
 	if (ef->read) filter |= EVFILT_READ;
 	if (ef->write) filter |= EVFILT_WRITE;
 
@@ -263,6 +339,7 @@ static int _fr_event_fd_free(fr_event_fd_t *ef)
 			return -1;
 		}
 	}
+#endif
 	rbtree_deletebydata(el->fds, ef);
 	ef->is_registered = false;
 
@@ -289,8 +366,12 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 		       fr_event_fd_handler_t error,
 		       void *ctx)
 {
+#ifdef WITH_EVENT_EPOLL
+	struct epoll_event evset;
+#else
 	int	      	filter = 0;
 	struct kevent	evset;
+#endif
 	fr_event_fd_t	*ef, find;
 	bool		pre_existing;
 
@@ -346,6 +427,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 	} else {
 		pre_existing = true;
 
+#ifndef WITH_EVENT_EPOLL
 		if (ef->read && !read_fn) filter |= EVFILT_READ;
 		if (ef->write && !write_fn) filter |= EVFILT_WRITE;
 
@@ -364,6 +446,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 			}
 			filter = 0;
 		}
+#endif
 
 		/*
 		 *	I/O handler may delete an event, then
@@ -375,6 +458,26 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 
 	ef->ctx = ctx;
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	epoll has one registration per FD, so modifying it
+	 *	replaces any existing read/write interest.
+	 */
+	memset(&evset, 0, sizeof(evset));
+	ef->read = read_fn;
+	if (read_fn) evset.events |= EPOLLIN;
+
+	ef->write = write_fn;
+	if (write_fn) evset.events |= EPOLLOUT;
+	ef->error = error;
+
+	evset.data.ptr = ef;
+	if (epoll_ctl(el->kq, ef->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &evset) < 0) {
+		fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
+		if (!pre_existing) talloc_free(ef);
+		return -1;
+	}
+#else
 	if (read_fn) {
 		ef->read = read_fn;
 		filter |= EVFILT_READ;
@@ -392,12 +495,413 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 		if (!pre_existing) talloc_free(ef);
 		return -1;
 	}
+#endif
 	ef->is_registered = true;
 
 	return 0;
 }
 
 
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+/** Read the monotonic clock
+ *
+ * @return the time in ns.
+ */
+static fr_time_t fr_event_wheel_clock(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((fr_time_t) ts.tv_sec * NANOSEC) + ts.tv_nsec;
+}
+
+/** Update el->now, and the offset between the wall clock and the monotonic clock
+ *
+ * Callers give us wall clock times, so we need the offset to put new
+ * timers into the wheel.  Timers which are already in the wheel keep
+ * their monotonic deadlines, so stepping the wall clock doesn't make
+ * them fire early or late.
+ *
+ * @param[in] el	to update.
+ * @return the current monotonic time.
+ */
+static fr_time_t fr_event_wheel_sync(fr_event_list_t *el)
+{
+	fr_time_t now;
+
+	now = fr_event_wheel_clock();
+	gettimeofday(&el->now, NULL);
+
+	el->wheel->offset = ((int64_t) el->now.tv_sec * NANOSEC) + ((int64_t) el->now.tv_usec * 1000) - (int64_t) now;
+
+	return now;
+}
+
+/** Convert a wall clock time to a monotonic one
+ *
+ */
+static fr_time_t fr_event_wheel_time(fr_event_wheel_t const *wheel, struct timeval const *when)
+{
+	int64_t mono;
+
+	mono = ((int64_t) when->tv_sec * NANOSEC) + ((int64_t) when->tv_usec * 1000) - wheel->offset;
+	if (mono < 0) return 0;
+
+	return mono;
+}
+
+/** Convert a monotonic time to a wall clock one, rounding up to the next usec
+ *
+ */
+static void fr_event_wheel_timeval(fr_event_wheel_t const *wheel, struct timeval *when, fr_time_t mono)
+{
+	int64_t wall;
+
+	wall = (int64_t) mono + wheel->offset + 999;
+
+	when->tv_sec = wall / NANOSEC;
+	when->tv_usec = (wall % NANOSEC) / 1000;
+}
+
+/** Put a timer into the wheel slot for its deadline
+ *
+ */
+static void fr_event_wheel_file(fr_event_wheel_t *wheel, fr_event_timer_t *ev)
+{
+	uint64_t tick, delta;
+	int level;
+
+	/*
+	 *	Timers which are already due go into the current slot.
+	 */
+	tick = ev->deadline >> WHEEL_TICK_SHIFT;
+	if (tick < wheel->tick) tick = wheel->tick;
+	delta = tick - wheel->tick;
+
+	for (level = 0; level < (WHEEL_LEVELS - 1); level++) {
+		if (delta < ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))) break;
+	}
+
+	/*
+	 *	Too far in the future.  Put it into the last slot, and
+	 *	it will be re-filed when that slot is cascaded.
+	 */
+	if (delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+		tick = wheel->tick + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+
+	ev->level = level;
+	ev->slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	fr_dlist_insert_tail(&wheel->slots[level][ev->slot], &ev->entry);
+	wheel->used[level][ev->slot / 64] |= ((uint64_t) 1) << (ev->slot % 64);
+	wheel->count[level]++;
+}
+
+/** Remove a timer from its wheel slot, or from the expired list
+ *
+ */
+static void fr_event_wheel_unfile(fr_event_wheel_t *wheel, fr_event_timer_t *ev)
+{
+	fr_dlist_t *head;
+
+	fr_dlist_remove(&ev->entry);
+
+	if (ev->level == WHEEL_EXPIRED) return;
+
+	wheel->count[ev->level]--;
+
+	head = &wheel->slots[ev->level][ev->slot];
+	if (head->next == head) wheel->used[ev->level][ev->slot / 64] &= ~(((uint64_t) 1) << (ev->slot % 64));
+}
+
+/** Move a timer from its wheel slot to the expired list
+ *
+ */
+static void fr_event_wheel_expire(fr_event_wheel_t *wheel, fr_event_timer_t *ev)
+{
+	fr_event_wheel_unfile(wheel, ev);
+
+	ev->level = WHEEL_EXPIRED;
+	fr_dlist_insert_tail(&wheel->expired, &ev->entry);
+}
+
+/** Re-file timers from the higher levels, when the lower levels wrap around
+ *
+ */
+static void fr_event_wheel_cascade(fr_event_wheel_t *wheel)
+{
+	int level;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		fr_dlist_t *head;
+
+		if ((wheel->tick & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0) break;
+
+		head = &wheel->slots[level][(wheel->tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+		while (head->next != head) {
+			fr_event_timer_t *ev = fr_ptr_to_type(fr_event_timer_t, entry, head->next);
+
+			fr_event_wheel_unfile(wheel, ev);
+			fr_event_wheel_file(wheel, ev);
+		}
+	}
+}
+
+/** Advance the wheel to "now", moving all timers which are due to the expired list
+ *
+ * @param[in] wheel	to advance.
+ * @param[in] now	the current monotonic time.
+ */
+static void fr_event_wheel_advance(fr_event_wheel_t *wheel, fr_time_t now)
+{
+	uint64_t	target = now >> WHEEL_TICK_SHIFT;
+	fr_dlist_t	*head, *entry, *next;
+
+	while (wheel->tick < target) {
+		int empty;
+
+		/*
+		 *	Everything in a slot before "now" is due.
+		 */
+		head = &wheel->slots[0][wheel->tick & WHEEL_MASK];
+		while (head->next != head) {
+			fr_event_wheel_expire(wheel, fr_ptr_to_type(fr_event_timer_t, entry, head->next));
+		}
+
+		/*
+		 *	Skip runs of empty slots.  If the lower levels
+		 *	are empty, nothing can happen until the next
+		 *	boundary of the first non-empty level, which is
+		 *	where it gets cascaded.
+		 */
+		for (empty = 0; empty < WHEEL_LEVELS; empty++) {
+			if (wheel->count[empty] > 0) break;
+		}
+
+		if (empty == 0) {
+			wheel->tick++;
+
+		} else if (empty == WHEEL_LEVELS) {
+			wheel->tick = target;
+
+		} else {
+			wheel->tick = ((wheel->tick >> (WHEEL_BITS * empty)) + 1) << (WHEEL_BITS * empty);
+			if (wheel->tick > target) wheel->tick = target;
+		}
+
+		fr_event_wheel_cascade(wheel);
+	}
+
+	/*
+	 *	The current slot can have timers which are due
+	 *	later in this tick.
+	 */
+	head = &wheel->slots[0][wheel->tick & WHEEL_MASK];
+	for (entry = head->next; entry != head; entry = next) {
+		fr_event_timer_t *ev = fr_ptr_to_type(fr_event_timer_t, entry, entry);
+
+		next = entry->next;
+		if (ev->deadline <= now) fr_event_wheel_expire(wheel, ev);
+	}
+}
+
+/** Find the distance to the next non-empty slot on a level
+ *
+ * @param[in] used	bitmap of non-empty slots.
+ * @param[in] start	slot to start searching after.
+ * @return
+ *	- 0 if all slots are empty.
+ *	- the number of slots after "start", wrapping around to "start" itself.
+ */
+static int fr_event_wheel_find(uint64_t const *used, int start)
+{
+	int distance = 1;
+
+	while (distance <= WHEEL_SIZE) {
+		int		slot = (start + distance) & WHEEL_MASK;
+		uint64_t	word = used[slot / 64] >> (slot % 64);
+
+		if (!word) {
+			distance += 64 - (slot % 64);
+			continue;
+		}
+
+		while (!(word & 1)) {
+			word >>= 1;
+			distance++;
+		}
+
+		return (distance <= WHEEL_SIZE) ? distance : 0;
+	}
+
+	return 0;
+}
+
+/** Find when the wheel next needs servicing
+ *
+ * For the current slot, that's the earliest deadline in it.  For any
+ * other slot, it's the start of the slot, when the timers in it are
+ * either due, or get cascaded to a lower level.  So we may wake up a
+ * little early, but never late.
+ *
+ * @param[in] wheel	to check.
+ * @param[out] next	monotonic time the wheel needs servicing.
+ * @return
+ *	- false if there are no timers.
+ *	- true if "next" was set.
+ */
+static bool fr_event_wheel_next(fr_event_wheel_t *wheel, fr_time_t *next)
+{
+	int		level;
+	bool		found = false;
+	fr_dlist_t	*head, *entry;
+
+	if (!wheel->num_timers) return false;
+
+	if (wheel->expired.next != &wheel->expired) {
+		*next = 0;
+		return true;
+	}
+
+	head = &wheel->slots[0][wheel->tick & WHEEL_MASK];
+	for (entry = head->next; entry != head; entry = entry->next) {
+		fr_event_timer_t *ev = fr_ptr_to_type(fr_event_timer_t, entry, entry);
+
+		if (!found || (ev->deadline < *next)) *next = ev->deadline;
+		found = true;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		int		distance;
+		uint64_t	tick;
+
+		if (!wheel->count[level]) continue;
+
+		distance = fr_event_wheel_find(wheel->used[level], (wheel->tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+		if (!distance) continue;
+
+		/*
+		 *	The current slot on level 0 was handled above.
+		 */
+		if ((level == 0) && (distance == WHEEL_SIZE)) continue;
+
+		tick = ((wheel->tick >> (WHEEL_BITS * level)) + distance) << (WHEEL_BITS * level);
+		if (!found || ((tick << WHEEL_TICK_SHIFT) < *next)) *next = tick << WHEEL_TICK_SHIFT;
+		found = true;
+	}
+
+	return found;
+}
+
+/** Run a single timer from the wheel
+ *
+ * @param[in] el	containing the timer events.
+ * @param[in] when	Process events scheduled to run before or at this time.
+ * @return
+ *	- 0 no timer events fired.
+ *	- 1 a timer event fired.
+ */
+static int fr_event_wheel_run(fr_event_list_t *el, struct timeval *when)
+{
+	fr_event_wheel_t	*wheel = el->wheel;
+	fr_event_timer_t	*ev;
+	fr_event_callback_t	callback;
+	void			*ctx;
+
+	if (wheel->expired.next == &wheel->expired) {
+		fr_time_t now, next;
+
+		now = fr_event_wheel_time(wheel, when);
+		fr_event_wheel_advance(wheel, now);
+
+		if (wheel->expired.next == &wheel->expired) {
+			if (!fr_event_wheel_next(wheel, &next)) {
+				when->tv_sec = 0;
+				when->tv_usec = 0;
+				return 0;
+			}
+
+			fr_event_wheel_timeval(wheel, when, next);
+			return 0;
+		}
+	}
+
+	ev = fr_ptr_to_type(fr_event_timer_t, entry, wheel->expired.next);
+
+	callback = ev->callback;
+	memcpy(&ctx, &ev->ctx, sizeof(ctx));
+
+	/*
+	 *	Delete the event before calling it.
+	 */
+	fr_event_timer_delete(el, ev->parent);
+
+	callback(el, when, ctx);
+
+	return 1;
+}
+
+/** Free all of the timers in a wheel list
+ *
+ */
+static void fr_event_wheel_free_list(fr_event_list_t *el, fr_dlist_t *head)
+{
+	while (head->next != head) {
+		fr_event_timer_t *ev = fr_ptr_to_type(fr_event_timer_t, entry, head->next);
+
+		fr_event_timer_delete(el, &ev);
+	}
+}
+
+/** Use a hierarchical timing wheel for timers, instead of a heap
+ *
+ * Inserting and deleting timers is O(1), which matters when there are
+ * hundreds of thousands of them.  Timers are kept on the monotonic
+ * clock.  Timers which are due in the same ~1ms tick may be run in
+ * any order.
+ *
+ * @param[in] el	to switch over.  It must not have any timers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_timer_wheel(fr_event_list_t *el)
+{
+	fr_event_wheel_t	*wheel;
+	int			i, j;
+
+	if (!el) {
+		fr_strerror_printf("Invalid argument: NULL event list");
+		return -1;
+	}
+
+	if (el->wheel) return 0;
+
+	if (fr_heap_num_elements(el->times) > 0) {
+		fr_strerror_printf("Cannot switch to a timer wheel with timers outstanding");
+		return -1;
+	}
+
+	wheel = talloc_zero(el, fr_event_wheel_t);
+	if (!wheel) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		for (j = 0; j < WHEEL_SIZE; j++) FR_DLIST_INIT(wheel->slots[i][j]);
+	}
+	FR_DLIST_INIT(wheel->expired);
+
+	el->wheel = wheel;
+	wheel->tick = fr_event_wheel_sync(el) >> WHEEL_TICK_SHIFT;
+
+	return 0;
+}
+
 /** Delete a timer event from the event list
  *
  * @param[in] el	to delete event from.
@@ -434,6 +938,13 @@ int fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t **parent)
 	}
 	*parent = NULL;
 
+	if (el->wheel) {
+		fr_event_wheel_unfile(el->wheel, ev);
+		el->wheel->num_timers--;
+		talloc_free(ev);
+		return 1;
+	}
+
 	ret = fr_heap_extract(el->times, ev);
 
 	/*
@@ -500,8 +1011,13 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 
 		ev = talloc_get_type_abort(*parent, fr_event_timer_t);
 
-		ret = fr_heap_extract(el->times, ev);
-		if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap */
+		if (el->wheel) {
+			fr_event_wheel_unfile(el->wheel, ev);
+			el->wheel->num_timers--;
+		} else {
+			ret = fr_heap_extract(el->times, ev);
+			if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap */
+		}
 
 		memset(ev, 0, sizeof(*ev));
 	} else {
@@ -514,7 +1030,12 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 	ev->when = *when;
 	ev->parent = parent;
 
-	if (!fr_heap_insert(el->times, ev)) {
+	if (el->wheel) {
+		ev->deadline = fr_event_wheel_time(el->wheel, when);
+		fr_event_wheel_file(el->wheel, ev);
+		el->wheel->num_timers++;
+
+	} else if (!fr_heap_insert(el->times, ev)) {
 		fr_strerror_printf("Failed inserting event into heap");
 		talloc_free(ev);
 		return -1;
@@ -563,6 +1084,92 @@ int fr_event_user_delete(fr_event_list_t *el, fr_event_user_handler_t user, void
 	return 0;
 }
 
+#ifdef WITH_EVENT_EPOLL
+/** Register interest in a user event
+ *
+ * All user events share the eventfd of the event list, so there's nothing to do.
+ *
+ * @param[in] kq	as returned by #fr_event_list_kq.
+ * @param[in] ident	of the user event.
+ * @return 0
+ */
+int fr_event_user_listen(UNUSED int kq, UNUSED uintptr_t ident)
+{
+	return 0;
+}
+
+/** Trigger a user event
+ *
+ * May be called from any thread.  Triggers are coalesced until the
+ * owner of the event list services the eventfd.
+ *
+ * @param[in] kq	as returned by #fr_event_list_kq.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- < 0 on error
+ *	- 0 on success
+ */
+int fr_event_user_trigger(int kq, UNUSED uintptr_t ident)
+{
+	uint64_t one = 1;
+
+	/*
+	 *	EAGAIN means the counter is saturated, so the
+	 *	reader is guaranteed to wake up anyway.
+	 */
+	if ((write(kq, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+		fr_strerror_printf("Failed triggering user event: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+/** Register interest in a user event
+ *
+ * @param[in] kq	as returned by #fr_event_list_kq.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- < 0 on error
+ *	- 0 on success
+ */
+int fr_event_user_listen(int kq, uintptr_t ident)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding user event: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Trigger a user event
+ *
+ * May be called from any thread.
+ *
+ * @param[in] kq	as returned by #fr_event_list_kq.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- < 0 on error
+ *	- 0 on success
+ */
+int fr_event_user_trigger(int kq, uintptr_t ident)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed triggering user event: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 
 /** Run a single scheduled timer event
  *
@@ -580,6 +1187,8 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
+	if (el->wheel) return fr_event_wheel_run(el, when);
+
 	if (fr_heap_num_elements(el->times) == 0) {
 		when->tv_sec = 0;
 		when->tv_usec = 0;
@@ -616,6 +1225,32 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 	return 1;
 }
 
+/** Run all timer events which are due
+ *
+ * @param[in] el	containing the timer events.
+ * @param[in,out] when	Process events scheduled to run before or at this time.
+ *			On return, it's set to when the next event should be run,
+ *			or zero if there are no more events.
+ * @return the number of timer events which fired.
+ */
+int fr_event_timer_run_all(fr_event_list_t *el, struct timeval *when)
+{
+	int		fired = 0;
+	struct timeval	now = *when;
+
+	/*
+	 *	Callbacks get a copy of "when", as they're allowed to
+	 *	change it.
+	 */
+	while (fr_event_timer_run(el, &now) == 1) {
+		fired++;
+		now = *when;
+	}
+	*when = now;
+
+	return fired;
+}
+
 /** Gather outstanding timer and file descriptor events
  *
  * @param[in] el	to process events for.
@@ -627,7 +1262,11 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 int fr_event_corral(fr_event_list_t *el, bool wait)
 {
 	struct timeval when, *wake;
+#ifdef WITH_EVENT_EPOLL
+	int timeout;
+#else
 	struct timespec ts_when, *ts_wake;
+#endif
 
 	if (el->exit) {
 		fr_strerror_printf("Event loop exiting");
@@ -643,7 +1282,25 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	wake = &when;
 
 	if (wait) {
-		if (fr_heap_num_elements(el->times) > 0) {
+		if (el->wheel) {
+			fr_time_t now, next;
+
+			now = fr_event_wheel_sync(el);
+
+			if (!fr_event_wheel_next(el->wheel, &next)) {
+				wake = NULL;
+
+			} else if (next > now) {
+				next -= now;
+				when.tv_sec = next / NANOSEC;
+				when.tv_usec = ((next % NANOSEC) + 999) / 1000;
+				if (when.tv_usec >= USEC) {
+					when.tv_sec++;
+					when.tv_usec -= USEC;
+				}
+			}
+
+		} else if (fr_heap_num_elements(el->times) > 0) {
 			fr_event_timer_t *ev;
 
 			ev = fr_heap_peek(el->times);
@@ -674,6 +1331,28 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 		}
 	}
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	epoll_wait() only has millisecond resolution.  Round
+	 *	up, so that we don't spin waiting for the next timer.
+	 */
+	if (wake) {
+		if (when.tv_sec > ((INT_MAX / 1000) - 1)) {
+			timeout = INT_MAX;
+		} else {
+			timeout = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+		}
+	} else {
+		timeout = -1;
+	}
+
+	/*
+	 *	Populate el->events with the list of I/O events
+	 *	that occurred since this function was last called
+	 *	or wait for the next timer event.
+	 */
+	el->num_fd_events = epoll_wait(el->kq, el->events, FR_EV_BATCH_FDS, timeout);
+#else
 	if (wake) {
 		ts_wake = &ts_when;
 		ts_when.tv_sec = when.tv_sec;
@@ -688,6 +1367,7 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	 *	or wait for the next timer event.
 	 */
 	el->num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
+#endif
 
 	/*
 	 *	Interrupt is different from timeout / FD events.
@@ -713,6 +1393,48 @@ void fr_event_service(fr_event_list_t *el)
 	for (i = 0; i < el->num_fd_events; i++) {
 		fr_event_fd_t *ev;
 
+#ifdef WITH_EVENT_EPOLL
+		uint32_t events = el->events[i].events;
+
+		/*
+		 *	The eventfd carries all of the user events.
+		 *	Drain it, and tell the user callback to check
+		 *	all of its sources.
+		 */
+		if (!el->events[i].data.ptr) {
+			uint64_t	count;
+			struct kevent	kev;
+
+			if (read(el->user_fd, &count, sizeof(count)) < 0) continue;
+			if (!el->user) continue;
+
+			memset(&kev, 0, sizeof(kev));
+			kev.ident = FR_EVENT_USER_ANY;
+			kev.filter = EVFILT_USER;
+			kev.data = count;
+
+			el->user(el->user_fd, &kev, el->user_ctx);
+			continue;
+		}
+
+		ev = talloc_get_type_abort(el->events[i].data.ptr, fr_event_fd_t);
+
+		if (!fr_cond_assert(ev->is_registered)) continue;
+
+		if (events & (EPOLLERR | EPOLLHUP)) {
+			/*
+			 *	Call the error handler which should
+			 *	tear down the connection.
+			 */
+			if (ev->error) ev->error(el, ev->fd, ev->ctx);
+			continue;
+		}
+
+		ev->in_handler = true;
+		if (ev->read && (events & EPOLLIN)) ev->read(el, ev->fd, ev->ctx);
+		if (ev->write && (events & EPOLLOUT) && !ev->do_delete) ev->write(el, ev->fd, ev->ctx);
+		ev->in_handler = false;
+#else
 		/*
 		 *	Process any user events
 		 */
@@ -749,6 +1471,7 @@ void fr_event_service(fr_event_list_t *el)
 		if (ev->read && (el->events[i].filter == EVFILT_READ)) ev->read(el, ev->fd, ev->ctx);
 		if (ev->write && (el->events[i].filter == EVFILT_WRITE) && !ev->do_delete) ev->write(el, ev->fd, ev->ctx);
 		ev->in_handler = false;
+#endif
 
 		/*
 		 *	Process any deferred deletes performed
@@ -757,13 +1480,17 @@ void fr_event_service(fr_event_list_t *el)
 		if (ev->do_delete) fr_event_fd_delete(el, ev->fd);
 	}
 
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (fr_event_list_num_elements(el) > 0) {
 		struct timeval when;
 
-		do {
+		if (el->wheel) {
+			(void) fr_event_wheel_sync(el);
+		} else {
 			gettimeofday(&el->now, NULL);
-			when = el->now;
-		} while (fr_event_timer_run(el, &when) == 1);
+		}
+
+		when = el->now;
+		(void) fr_event_timer_run_all(el, &when);
 	}
 }
 
@@ -776,8 +1503,6 @@ void fr_event_service(fr_event_list_t *el)
  */
 void fr_event_loop_exit(fr_event_list_t *el, int code)
 {
-	struct kevent kev;
-
 	if (!el) return;
 
 	el->exit = code;
@@ -785,8 +1510,7 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 	/*
 	 *	Signal the control plane to exit.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	(void) kevent(el->kq, &kev, 1, NULL, 0, NULL);
+	(void) fr_event_user_trigger(fr_event_list_kq(el), 0);
 }
 
 /** Check to see whether the event loop is in the process of exiting
@@ -829,6 +1553,16 @@ static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t *ev;
 
+	if (el->wheel) {
+		int i, j;
+
+		fr_event_wheel_free_list(el, &el->wheel->expired);
+
+		for (i = 0; i < WHEEL_LEVELS; i++) {
+			for (j = 0; j < WHEEL_SIZE; j++) fr_event_wheel_free_list(el, &el->wheel->slots[i][j]);
+		}
+	}
+
 	while ((ev = fr_heap_peek(el->times)) != NULL) {
 		fr_event_timer_delete(el, &ev);
 	}
@@ -836,6 +1570,9 @@ static int _event_list_free(fr_event_list_t *el)
 	fr_heap_delete(el->times);
 
 	close(el->kq);
+#ifdef WITH_EVENT_EPOLL
+	if (el->user_fd >= 0) close(el->user_fd);
+#endif
 
 	return 0;
 }
@@ -852,7 +1589,9 @@ static int _event_list_free(fr_event_list_t *el)
 fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status, void *status_ctx)
 {
 	fr_event_list_t *el;
-	struct kevent kev;
+#ifdef WITH_EVENT_EPOLL
+	struct epoll_event evset;
+#endif
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
@@ -867,7 +1606,13 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status,
 	}
 	el->fds = rbtree_create(el, fr_event_fd_cmp, NULL, 0);
 
+#ifdef WITH_EVENT_EPOLL
+	el->user_fd = -1;
+
+	el->kq = epoll_create1(EPOLL_CLOEXEC);
+#else
 	el->kq = kqueue();
+#endif
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
@@ -876,14 +1621,34 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status,
 	el->status = status;
 	el->status_ctx = status_ctx;
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	All user events, including our "exit" callback,
+	 *	go through the eventfd.  It's the only entry in
+	 *	the epoll set without an fr_event_fd_t.
+	 */
+	el->user_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (el->user_fd < 0) {
+		talloc_free(el);
+		return NULL;
+	}
+
+	memset(&evset, 0, sizeof(evset));
+	evset.events = EPOLLIN;
+	evset.data.ptr = NULL;
+	if (epoll_ctl(el->kq, EPOLL_CTL_ADD, el->user_fd, &evset) < 0) {
+		talloc_free(el);
+		return NULL;
+	}
+#else
 	/*
 	 *	Set our "exit" callback as ident 0.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(el->kq, &kev, 1, NULL, 0, NULL) < 0) {
+	if (fr_event_user_listen(el->kq, 0) < 0) {
 		talloc_free(el);
 		return NULL;
 	}
+#endif
 
 	return el;
 }
@@ -232,7 +232,12 @@ void *fr_heap_pop(fr_heap_t *hp)
 
 	data = hp->p[0];
 
-	(void) fr_heap_extract(hp, data);
+	/*
+	 *	Extract the root directly.  Extracting by pointer
+	 *	doesn't work for heaps which don't track the
+	 *	element positions (i.e. offset is zero).
+	 */
+	(void) fr_heap_extract(hp, NULL);
 
 	return data;
 }
@@ -105,6 +105,79 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 	fr_md5_final(digest, &context);	  /* finish up 2nd pass */
 }
 
+/** Precompute the MD5 states for a key
+ *
+ *  The key is not copied.  It must not change, or be freed, while the
+ *  states are in use.
+ *
+ * @param[out] mk where the states are written.
+ * @param[in] key Pointer to authentication key.
+ * @param[in] key_len Length of authentication key.
+ */
+void fr_md5_key_init(fr_md5_key_t *mk, uint8_t const *key, size_t key_len)
+{
+	uint8_t	k_ipad[64];
+	uint8_t	k_opad[64];
+	uint8_t	tk[16];
+	int	i;
+
+	mk->key = key;
+	mk->key_len = key_len;
+
+	fr_md5_init(&mk->prefix);
+	fr_md5_update(&mk->prefix, key, key_len);
+
+	/* if key is longer than 64 bytes reset it to key=MD5(key) */
+	if (key_len > 64) {
+		FR_MD5_CTX tctx;
+
+		fr_md5_copy(&tctx, &mk->prefix);
+		fr_md5_final(tk, &tctx);
+
+		key = tk;
+		key_len = 16;
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, k_ipad, sizeof(k_opad));
+
+	for (i = 0; i < 64; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	fr_md5_init(&mk->inner);
+	fr_md5_update(&mk->inner, k_ipad, 64);
+
+	fr_md5_init(&mk->outer);
+	fr_md5_update(&mk->outer, k_opad, 64);
+}
+
+/** Calculate HMAC using MD5, and a precomputed key
+ *
+ *  The result is the same as calling fr_hmac_md5() with the key
+ *  passed to fr_md5_key_init(), but the pads aren't hashed again.
+ *
+ * @param digest Caller digest to be filled in.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ * @param mk the precomputed key.
+ */
+void fr_hmac_md5_key(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+		     fr_md5_key_t const *mk)
+{
+	FR_MD5_CTX context;
+
+	fr_md5_copy(&context, &mk->inner);
+	fr_md5_update(&context, text, text_len);
+	fr_md5_final(digest, &context);
+
+	fr_md5_copy(&context, &mk->outer);
+	fr_md5_update(&context, digest, 16);
+	fr_md5_final(digest, &context);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -0,0 +1,523 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/util/lpm.c
+ * @brief Longest prefix match tables for IP addresses.
+ *
+ *  Each address family has a path-compressed binary trie.  A node
+ *  only exists where there is a prefix, or where two subtrees split,
+ *  so the depth of the trie depends on the number of prefixes, and
+ *  not on the length of the address.  Every node holds its (masked)
+ *  key, so a lookup can check each node as it goes, and remember the
+ *  last one which had data.
+ *
+ *  Once there are enough IPv4 prefixes, we also keep a table indexed
+ *  by the first 16 bits of the address, DIR-16 style.  Each entry
+ *  holds the longest match shorter than /16, and the first node of
+ *  /16 or longer under that /16.  A lookup then starts at that node,
+ *  and usually needs only one or two more.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/lpm.h>
+
+/*
+ *	Below this, the IPv4 trie is shallow enough that the table
+ *	isn't worth the memory.
+ */
+#define LPM_TABLE_MIN	(64)
+#define LPM_TABLE_BITS	(16)
+#define LPM_TABLE_SIZE	(1 << LPM_TABLE_BITS)
+
+/*
+ *	Bit "n" of a key, counting from the most significant bit.
+ */
+#define LPM_BIT(_key, _n) (((_key)[(_n) >> 6] >> (63 - ((_n) & 63))) & 0x01)
+
+typedef struct lpm_node_t lpm_node_t;
+
+struct lpm_node_t {
+	uint64_t	key[2];			//!< address, masked to "bits".
+	lpm_node_t	*child[2];		//!< subtrees where the next bit is 0, or 1.
+	void		*data;			//!< NULL for nodes which only join two subtrees.
+	uint8_t		bits;			//!< prefix length.
+};
+
+typedef struct lpm_slot_t {
+	lpm_node_t	*node;			//!< first node of /16 or longer under this /16.
+	lpm_node_t	*best;			//!< longest match shorter than /16.
+} lpm_slot_t;
+
+struct fr_lpm_t {
+	lpm_node_t	*root[2];		//!< IPv4 and IPv6 tries.
+	lpm_slot_t	*table;			//!< IPv4 table, or NULL.
+	uint32_t	num_v4;			//!< number of IPv4 prefixes.
+	uint32_t	num_entries;		//!< number of prefixes.
+};
+
+/** Convert an IP address to a key, and check the prefix length
+ *
+ * @return
+ *	- <0 on error.
+ *	- the address family index on success.
+ */
+static int lpm_key(uint64_t key[2], fr_ipaddr_t const *ipaddr)
+{
+	int		i;
+	uint8_t const	*p;
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		if (ipaddr->prefix > 32) goto bad_prefix;
+
+		key[0] = ((uint64_t) ntohl(ipaddr->addr.v4.s_addr)) << 32;
+		key[1] = 0;
+		return 0;
+
+	case AF_INET6:
+		if (ipaddr->prefix > 128) goto bad_prefix;
+
+		p = ipaddr->addr.v6.s6_addr;
+		key[0] = key[1] = 0;
+		for (i = 0; i < 8; i++) {
+			key[0] = (key[0] << 8) | p[i];
+			key[1] = (key[1] << 8) | p[i + 8];
+		}
+		return 1;
+
+	default:
+		fr_strerror_printf("Unsupported address family %i", ipaddr->af);
+		return -1;
+	}
+
+bad_prefix:
+	fr_strerror_printf("Invalid prefix length %u", ipaddr->prefix);
+	return -1;
+}
+
+/** Zero the bits of a key after the prefix
+ *
+ */
+static inline void lpm_mask(uint64_t out[2], uint64_t const in[2], int bits)
+{
+	out[0] = (bits == 0) ? 0 : (bits >= 64) ? in[0] : (in[0] & (~((uint64_t) 0) << (64 - bits)));
+	out[1] = (bits <= 64) ? 0 : (bits >= 128) ? in[1] : (in[1] & (~((uint64_t) 0) << (128 - bits)));
+}
+
+/** Check if the first "bits" of two keys are the same
+ *
+ */
+static inline bool lpm_match(uint64_t const a[2], uint64_t const b[2], int bits)
+{
+	if (bits <= 64) {
+		if (bits == 0) return true;
+
+		return ((a[0] ^ b[0]) >> (64 - bits)) == 0;
+	}
+
+	if (a[0] != b[0]) return false;
+
+	return ((a[1] ^ b[1]) >> (128 - bits)) == 0;
+}
+
+/** Count the leading bits which two keys have in common, up to "max"
+ *
+ */
+static inline int lpm_common(uint64_t const a[2], uint64_t const b[2], int max)
+{
+	uint64_t	x;
+	int		bits;
+
+	x = a[0] ^ b[0];
+	if (x) {
+		bits = __builtin_clzll(x);
+	} else {
+		x = a[1] ^ b[1];
+		bits = x ? 64 + __builtin_clzll(x) : 128;
+	}
+
+	return (bits < max) ? bits : max;
+}
+
+/** Walk down a trie, and return the last node which matched, and had data
+ *
+ */
+static inline lpm_node_t *lpm_walk(lpm_node_t *node, lpm_node_t *best, uint64_t const key[2], int bits)
+{
+	while (node && (node->bits <= bits)) {
+		if (!lpm_match(node->key, key, node->bits)) break;
+
+		if (node->data) best = node;
+
+		if (node->bits == bits) break;
+
+		node = node->child[LPM_BIT(key, node->bits)];
+	}
+
+	return best;
+}
+
+/** Update one entry of the IPv4 table
+ *
+ */
+static void lpm_slot_update(fr_lpm_t *lpm, uint32_t slot)
+{
+	uint64_t	key[2];
+	lpm_node_t	*node, *best = NULL;
+
+	key[0] = ((uint64_t) slot) << (64 - LPM_TABLE_BITS);
+	key[1] = 0;
+
+	node = lpm->root[0];
+	while (node && (node->bits < LPM_TABLE_BITS)) {
+		if (!lpm_match(node->key, key, node->bits)) {
+			node = NULL;
+			break;
+		}
+
+		if (node->data) best = node;
+
+		node = node->child[LPM_BIT(key, node->bits)];
+	}
+
+	if (node && !lpm_match(node->key, key, LPM_TABLE_BITS)) node = NULL;
+
+	lpm->table[slot].node = node;
+	lpm->table[slot].best = best;
+}
+
+/** Update the IPv4 table entries covered by a prefix which was added or removed
+ *
+ *  A prefix shorter than /16 changes the best match of every entry it
+ *  covers.  A longer one (and any node joining it to the trie) can
+ *  only change the entry for its own /16.
+ */
+static void lpm_table_update(fr_lpm_t *lpm, uint64_t const key[2], int bits)
+{
+	uint32_t slot, last;
+
+	if (!lpm->table) return;
+
+	slot = key[0] >> (64 - LPM_TABLE_BITS);
+	if (bits >= LPM_TABLE_BITS) {
+		lpm_slot_update(lpm, slot);
+		return;
+	}
+
+	last = slot + (1 << (LPM_TABLE_BITS - bits));
+	while (slot < last) lpm_slot_update(lpm, slot++);
+}
+
+/** Build the IPv4 table
+ *
+ *  If we're out of memory, we just do without it.
+ */
+static void lpm_table_build(fr_lpm_t *lpm)
+{
+	uint32_t slot;
+
+	lpm->table = talloc_array(lpm, lpm_slot_t, LPM_TABLE_SIZE);
+	if (!lpm->table) return;
+
+	for (slot = 0; slot < LPM_TABLE_SIZE; slot++) lpm_slot_update(lpm, slot);
+}
+
+static lpm_node_t *lpm_node_alloc(fr_lpm_t *lpm, uint64_t const key[2], int bits, void *data)
+{
+	lpm_node_t *node;
+
+	node = talloc_zero(lpm, lpm_node_t);
+	if (!node) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	lpm_mask(node->key, key, bits);
+	node->bits = bits;
+	node->data = data;
+
+	return node;
+}
+
+/** Create an empty longest prefix match table
+ *
+ * @param[in] ctx the talloc ctx
+ * @return
+ *	- NULL on error.
+ *	- fr_lpm_t *, a pointer to the new table.
+ */
+fr_lpm_t *fr_lpm_create(TALLOC_CTX *ctx)
+{
+	fr_lpm_t *lpm;
+
+	lpm = talloc_zero(ctx, fr_lpm_t);
+	if (!lpm) return NULL;
+
+	return lpm;
+}
+
+/** Add a prefix
+ *
+ * @param[in] lpm the table
+ * @param[in] ipaddr the prefix.  The address bits after ipaddr->prefix are ignored.
+ * @param[in] data to return for addresses within the prefix.  Must not be NULL.
+ * @return
+ *	- <0 on error, including if the prefix already exists.
+ *	- 0 on success.
+ */
+int fr_lpm_insert(fr_lpm_t *lpm, fr_ipaddr_t const *ipaddr, void *data)
+{
+	int		af, bits, common;
+	uint64_t	key[2];
+	lpm_node_t	**pp, *node, *new, *glue;
+
+	if (!data) {
+		fr_strerror_printf("Can't insert NULL data");
+		return -1;
+	}
+
+	af = lpm_key(key, ipaddr);
+	if (af < 0) return -1;
+
+	bits = ipaddr->prefix;
+	lpm_mask(key, key, bits);
+
+	pp = &lpm->root[af];
+	for (;;) {
+		node = *pp;
+		if (!node) {
+			node = lpm_node_alloc(lpm, key, bits, data);
+			if (!node) return -1;
+
+			*pp = node;
+			break;
+		}
+
+		common = lpm_common(node->key, key, (node->bits < bits) ? node->bits : bits);
+
+		/*
+		 *	The node is a prefix of the new one.  Either
+		 *	it's the same, or we keep going.
+		 */
+		if (common == node->bits) {
+			if (node->bits == bits) {
+				if (node->data) {
+					fr_strerror_printf("Prefix already exists");
+					return -1;
+				}
+
+				node->data = data;
+				break;
+			}
+
+			pp = &node->child[LPM_BIT(key, node->bits)];
+			continue;
+		}
+
+		new = lpm_node_alloc(lpm, key, bits, data);
+		if (!new) return -1;
+
+		/*
+		 *	The new prefix is a prefix of the node, so it
+		 *	goes above it.
+		 */
+		if (common == bits) {
+			new->child[LPM_BIT(node->key, bits)] = node;
+			*pp = new;
+			break;
+		}
+
+		/*
+		 *	They differ before the end of either prefix.
+		 *	Join them with a node which has no data.
+		 */
+		glue = lpm_node_alloc(lpm, key, common, NULL);
+		if (!glue) {
+			talloc_free(new);
+			return -1;
+		}
+
+		glue->child[LPM_BIT(key, common)] = new;
+		glue->child[LPM_BIT(node->key, common)] = node;
+		*pp = glue;
+		break;
+	}
+
+	lpm->num_entries++;
+
+	if (af == 0) {
+		lpm->num_v4++;
+
+		if (!lpm->table && (lpm->num_v4 >= LPM_TABLE_MIN)) {
+			lpm_table_build(lpm);
+		} else {
+			lpm_table_update(lpm, key, bits);
+		}
+	}
+
+	return 0;
+}
+
+/** Remove a prefix
+ *
+ * @param[in] lpm the table
+ * @param[in] ipaddr the prefix.  The address bits after ipaddr->prefix are ignored.
+ * @return
+ *	- NULL if the prefix wasn't found.
+ *	- the data which was inserted with the prefix.
+ */
+void *fr_lpm_remove(fr_lpm_t *lpm, fr_ipaddr_t const *ipaddr)
+{
+	int		af, bits;
+	uint64_t	key[2];
+	void		*data;
+	lpm_node_t	**pp, **parent_pp = NULL, *node, *parent;
+
+	af = lpm_key(key, ipaddr);
+	if (af < 0) return NULL;
+
+	bits = ipaddr->prefix;
+	lpm_mask(key, key, bits);
+
+	pp = &lpm->root[af];
+	while ((node = *pp) != NULL) {
+		if (node->bits > bits) return NULL;
+
+		if (!lpm_match(node->key, key, node->bits)) return NULL;
+
+		if (node->bits == bits) break;
+
+		parent_pp = pp;
+		pp = &node->child[LPM_BIT(key, node->bits)];
+	}
+
+	if (!node || !node->data) return NULL;
+
+	data = node->data;
+	node->data = NULL;
+
+	/*
+	 *	With two children, the node still has to join them.
+	 *	Otherwise the child (if any) takes its place.
+	 */
+	if (!node->child[0] || !node->child[1]) {
+		*pp = node->child[0] ? node->child[0] : node->child[1];
+		talloc_free(node);
+
+		/*
+		 *	If that left the parent joining only one
+		 *	subtree, it goes too.
+		 */
+		if (!*pp && parent_pp) {
+			parent = *parent_pp;
+
+			if (!parent->data) {
+				*parent_pp = parent->child[0] ? parent->child[0] : parent->child[1];
+				talloc_free(parent);
+			}
+		}
+	}
+
+	lpm->num_entries--;
+
+	if (af == 0) {
+		lpm->num_v4--;
+		lpm_table_update(lpm, key, bits);
+	}
+
+	return data;
+}
+
+/** Find the longest prefix which contains an address
+ *
+ *  Only prefixes which are no longer than ipaddr->prefix are
+ *  matched.  So a lookup for a host uses /32 (or /128), and a lookup
+ *  with a shorter prefix finds the next enclosing network.
+ *
+ * @param[in] lpm the table
+ * @param[in] ipaddr the address to look up.
+ * @return
+ *	- NULL if no prefix contains the address.
+ *	- the data which was inserted with the longest prefix.
+ */
+void *fr_lpm_find(fr_lpm_t const *lpm, fr_ipaddr_t const *ipaddr)
+{
+	int		af, bits;
+	uint64_t	key[2];
+	lpm_node_t	*best;
+
+	af = lpm_key(key, ipaddr);
+	if (af < 0) return NULL;
+
+	bits = ipaddr->prefix;
+
+	if ((af == 0) && lpm->table && (bits >= LPM_TABLE_BITS)) {
+		lpm_slot_t const *slot = &lpm->table[key[0] >> (64 - LPM_TABLE_BITS)];
+
+		best = lpm_walk(slot->node, slot->best, key, bits);
+	} else {
+		best = lpm_walk(lpm->root[af], NULL, key, bits);
+	}
+
+	return best ? best->data : NULL;
+}
+
+/** Find a prefix
+ *
+ * @param[in] lpm the table
+ * @param[in] ipaddr the prefix.  The address bits after ipaddr->prefix are ignored.
+ * @return
+ *	- NULL if the prefix wasn't found.
+ *	- the data which was inserted with the prefix.
+ */
+void *fr_lpm_find_exact(fr_lpm_t const *lpm, fr_ipaddr_t const *ipaddr)
+{
+	int		af, bits;
+	uint64_t	key[2];
+	lpm_node_t	*node;
+
+	af = lpm_key(key, ipaddr);
+	if (af < 0) return NULL;
+
+	bits = ipaddr->prefix;
+
+	node = lpm->root[af];
+	while (node && (node->bits < bits)) {
+		if (!lpm_match(node->key, key, node->bits)) return NULL;
+
+		node = node->child[LPM_BIT(key, node->bits)];
+	}
+
+	if (!node || (node->bits != bits) || !lpm_match(node->key, key, bits)) return NULL;
+
+	return node->data;
+}
+
+/** Return the number of prefixes in the table
+ *
+ * @param[in] lpm the table
+ * @return the number of prefixes.
+ */
+uint32_t fr_lpm_num_entries(fr_lpm_t const *lpm)
+{
+	return lpm->num_entries;
+}
@@ -0,0 +1,594 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file md5_mb.c
+ * @brief Multi-buffer MD5 and HMAC-MD5.
+ *
+ *  MD5 can't be made faster for one message, as each step depends on
+ *  the previous one.  But RADIUS servers hash many small, unrelated
+ *  messages.  So we hash several messages at once, one per 32-bit
+ *  lane of a SIMD register.  Each lane runs the normal MD5 steps on
+ *  its own message.
+ *
+ *  The lanes are fed one 64 byte block at a time.  When a message is
+ *  done, its lane picks up the next message, so that messages of
+ *  different lengths don't leave lanes idle.
+ *
+ *  The engine is picked at run time.  AVX2 gives 8 lanes, and the
+ *  compilers generic vectors (SSE2, NEON, etc.) give 4.  Otherwise,
+ *  we hash one message at a time.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+
+/*
+ *	GCC and clang vector extensions.
+ */
+#if defined(__GNUC__) && ((__GNUC__ >= 5) || defined(__clang__))
+#  define MD5_MB_VECTOR
+#  if defined(__x86_64__) || defined(__i386__)
+#    define MD5_MB_AVX2
+#  endif
+#endif
+
+#define MD5_MB_MAX_LANES	(8)
+
+/*
+ *	How many messages we hash in one go, for HMAC.  This bounds
+ *	the amount of stack we use.
+ */
+#define HMAC_MD5_MB_CHUNK	(64)
+
+#define GET_32BIT_LE(cp) ((uint32_t)(cp)[0] | ((uint32_t)(cp)[1] << 8) | \
+			  ((uint32_t)(cp)[2] << 16) | ((uint32_t)(cp)[3] << 24))
+
+#define PUT_32BIT_LE(cp, value) do {\
+	(cp)[3] = (value) >> 24;\
+	(cp)[2] = (value) >> 16;\
+	(cp)[1] = (value) >> 8;\
+	(cp)[0] = (value);\
+} while (0)
+
+/*
+ *	The state of every lane, and the current block for every
+ *	lane.  Both are transposed, so that the values for one word
+ *	across all lanes are next to each other.
+ */
+typedef uint32_t md5_mb_state_t[4][MD5_MB_MAX_LANES];
+typedef uint32_t md5_mb_block_t[16][MD5_MB_MAX_LANES];
+
+typedef void (*md5_mb_transform_t)(md5_mb_state_t state, md5_mb_block_t block);
+
+typedef struct md5_mb_engine_t {
+	char const		*name;
+	int			lanes;
+	md5_mb_transform_t	transform;
+} md5_mb_engine_t;
+
+/*
+ *	Where we are in one message.
+ */
+typedef struct md5_mb_lane_t {
+	fr_md5_mb_job_t		*job;		//!< message being hashed, or NULL for "idle"
+	uint64_t		bits;		//!< total length of the message, in bits
+	int			in;		//!< current fragment
+	size_t			offset;		//!< offset into the current fragment
+	bool			padded;		//!< the 0x80 byte has been written
+	bool			last;		//!< the final block has been written
+} md5_mb_lane_t;
+
+/* The four core functions - F1 is optimized somewhat */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/*
+ *	This is the central step in the MD5 algorithm.  It works on
+ *	both scalars and vectors.
+ */
+#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = (w << s) | (w >> (32 - s)), w += x)
+
+/*
+ *	All of the MD5 steps, for variables a, b, c, d and in[16].
+ */
+#define MD5_ROUNDS \
+do { \
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 2] + 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[ 7] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 5] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[ 3] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 1] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[ 8] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[ 6] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[ 4] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[ 2] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 9] + 0xeb86d391, 21); \
+} while (0)
+
+/*
+ *	Load / store a vector from one row of the transposed arrays.
+ *	memcpy() is used so that we don't care about alignment.
+ */
+#define MD5_MB_TRANSFORM_VECTOR(_type) \
+do { \
+	int i; \
+	_type a, b, c, d, sa, sb, sc, sd, in[16]; \
+\
+	for (i = 0; i < 16; i++) memcpy(&in[i], block[i], sizeof(in[i])); \
+\
+	memcpy(&a, state[0], sizeof(a)); \
+	memcpy(&b, state[1], sizeof(b)); \
+	memcpy(&c, state[2], sizeof(c)); \
+	memcpy(&d, state[3], sizeof(d)); \
+	sa = a; sb = b; sc = c; sd = d; \
+\
+	MD5_ROUNDS; \
+\
+	a += sa; b += sb; c += sc; d += sd; \
+	memcpy(state[0], &a, sizeof(a)); \
+	memcpy(state[1], &b, sizeof(b)); \
+	memcpy(state[2], &c, sizeof(c)); \
+	memcpy(state[3], &d, sizeof(d)); \
+} while (0)
+
+static void md5_mb_transform_scalar(md5_mb_state_t state, md5_mb_block_t block)
+{
+	int i;
+	uint32_t a, b, c, d, in[16];
+
+	for (i = 0; i < 16; i++) in[i] = block[i][0];
+
+	a = state[0][0];
+	b = state[1][0];
+	c = state[2][0];
+	d = state[3][0];
+
+	MD5_ROUNDS;
+
+	state[0][0] += a;
+	state[1][0] += b;
+	state[2][0] += c;
+	state[3][0] += d;
+}
+
+static md5_mb_engine_t const md5_mb_scalar = {
+	.name = "scalar",
+	.lanes = 1,
+	.transform = md5_mb_transform_scalar
+};
+
+#ifdef MD5_MB_VECTOR
+typedef uint32_t md5_v4_t __attribute__((vector_size(16)));
+
+static void md5_mb_transform_vector(md5_mb_state_t state, md5_mb_block_t block)
+{
+	MD5_MB_TRANSFORM_VECTOR(md5_v4_t);
+}
+
+static md5_mb_engine_t const md5_mb_vector = {
+	.name = "vector",
+	.lanes = 4,
+	.transform = md5_mb_transform_vector
+};
+#endif
+
+#ifdef MD5_MB_AVX2
+typedef uint32_t md5_v8_t __attribute__((vector_size(32)));
+
+static __attribute__((target("avx2"))) void md5_mb_transform_avx2(md5_mb_state_t state, md5_mb_block_t block)
+{
+	MD5_MB_TRANSFORM_VECTOR(md5_v8_t);
+}
+
+static md5_mb_engine_t const md5_mb_avx2 = {
+	.name = "avx2",
+	.lanes = 8,
+	.transform = md5_mb_transform_avx2
+};
+#endif
+
+static md5_mb_engine_t const *md5_mb_engines[] = {
+#ifdef MD5_MB_AVX2
+	&md5_mb_avx2,
+#endif
+#ifdef MD5_MB_VECTOR
+	&md5_mb_vector,
+#endif
+	&md5_mb_scalar,
+	NULL
+};
+
+static md5_mb_engine_t const *md5_mb_engine;
+
+/** Check if the CPU can run an engine
+ *
+ */
+static bool md5_mb_engine_ok(md5_mb_engine_t const *engine)
+{
+#ifdef MD5_MB_AVX2
+	if (engine == &md5_mb_avx2) {
+		__builtin_cpu_init();
+		return (__builtin_cpu_supports("avx2") != 0);
+	}
+#endif
+
+	return (engine != NULL);
+}
+
+/** Pick the engine with the most lanes that this CPU supports
+ *
+ *  Two threads may race to do this.  They both pick the same
+ *  engine, so it doesn't matter.
+ */
+static md5_mb_engine_t const *md5_mb_engine_get(void)
+{
+	int i;
+
+	if (md5_mb_engine) return md5_mb_engine;
+
+	for (i = 0; md5_mb_engines[i] != NULL; i++) {
+		if (md5_mb_engine_ok(md5_mb_engines[i])) break;
+	}
+
+	md5_mb_engine = md5_mb_engines[i] ? md5_mb_engines[i] : &md5_mb_scalar;
+	return md5_mb_engine;
+}
+
+/** Return the name of the multi-buffer MD5 engine in use
+ *
+ * @return "avx2", "vector", or "scalar".
+ */
+char const *fr_md5_mb_engine(void)
+{
+	return md5_mb_engine_get()->name;
+}
+
+/** Force the multi-buffer MD5 engine
+ *
+ *  This is mainly for tests and benchmarks, which need to compare the
+ *  engines.  It is not thread-safe.
+ *
+ * @param[in] name of the engine, as returned by fr_md5_mb_engine().
+ * @return
+ *	- 0 on success.
+ *	- -1 if the engine doesn't exist, or the CPU doesn't support it.
+ */
+int fr_md5_mb_engine_set(char const *name)
+{
+	int i;
+
+	for (i = 0; md5_mb_engines[i] != NULL; i++) {
+		if (strcmp(md5_mb_engines[i]->name, name) != 0) continue;
+
+		if (!md5_mb_engine_ok(md5_mb_engines[i])) break;
+
+		md5_mb_engine = md5_mb_engines[i];
+		return 0;
+	}
+
+	fr_strerror_printf("MD5 engine '%s' is not available", name);
+	return -1;
+}
+
+/** Start hashing a new message in a lane
+ *
+ */
+static void md5_mb_lane_init(md5_mb_lane_t *lane, md5_mb_state_t state, int l, fr_md5_mb_job_t *job)
+{
+	int i;
+	uint64_t len;
+
+	lane->job = job;
+	if (!job) return;
+
+	if (job->iv) {
+		for (i = 0; i < 4; i++) state[i][l] = job->iv[i];
+		len = job->ivlen;
+	} else {
+		state[0][l] = 0x67452301;
+		state[1][l] = 0xefcdab89;
+		state[2][l] = 0x98badcfe;
+		state[3][l] = 0x10325476;
+		len = 0;
+	}
+
+	for (i = 0; i < job->num_in; i++) len += job->inlen[i];
+
+	lane->bits = len << 3;
+	lane->in = 0;
+	lane->offset = 0;
+	lane->padded = false;
+	lane->last = false;
+}
+
+/** Get the next 64 byte block of a message, including padding
+ *
+ */
+static void md5_mb_lane_block(md5_mb_lane_t *lane, md5_mb_block_t block, int l)
+{
+	int i;
+	size_t p = 0, len;
+	uint8_t buffer[MD5_BLOCK_LENGTH];
+	fr_md5_mb_job_t *job = lane->job;
+
+	/*
+	 *	Copy as much of the message as will fit.
+	 */
+	while ((p < sizeof(buffer)) && (lane->in < job->num_in)) {
+		len = job->inlen[lane->in] - lane->offset;
+		if (len > (sizeof(buffer) - p)) len = sizeof(buffer) - p;
+
+		memcpy(buffer + p, job->in[lane->in] + lane->offset, len);
+		p += len;
+		lane->offset += len;
+
+		if (lane->offset == job->inlen[lane->in]) {
+			lane->in++;
+			lane->offset = 0;
+		}
+	}
+
+	/*
+	 *	The message is done, pad it out.  If there's no room
+	 *	for the length, it goes in the next block.
+	 */
+	if (lane->in == job->num_in) {
+		if (!lane->padded && (p < sizeof(buffer))) {
+			buffer[p++] = 0x80;
+			lane->padded = true;
+		}
+
+		if (lane->padded && (p <= (sizeof(buffer) - 8))) {
+			memset(buffer + p, 0, sizeof(buffer) - 8 - p);
+			for (i = 0; i < 8; i++) buffer[56 + i] = lane->bits >> (i * 8);
+			lane->last = true;
+
+		} else if (p < sizeof(buffer)) {
+			memset(buffer + p, 0, sizeof(buffer) - p);
+		}
+	}
+
+	for (i = 0; i < 16; i++) block[i][l] = GET_32BIT_LE(buffer + (i * 4));
+}
+
+/** Calculate the MD5 digests of many messages at once
+ *
+ *  Each job is a message made up of one or more fragments.  The
+ *  output may overlap the input.  It is written only once the whole
+ *  message has been read.
+ *
+ * @param[in] jobs to hash.
+ * @param[in] num number of jobs.
+ */
+void fr_md5_mb(fr_md5_mb_job_t *jobs, int num)
+{
+	int			l, i, lanes, next = 0, active = 0;
+	md5_mb_engine_t const	*engine;
+	md5_mb_lane_t		lane[MD5_MB_MAX_LANES];
+	md5_mb_state_t		state;
+	md5_mb_block_t		block;
+
+	if (num <= 0) return;
+
+	engine = md5_mb_engine_get();
+	if (num == 1) engine = &md5_mb_scalar;
+	lanes = engine->lanes;
+
+	memset(block, 0, sizeof(block));
+
+	for (l = 0; l < lanes; l++) {
+		md5_mb_lane_init(&lane[l], state, l, (next < num) ? &jobs[next++] : NULL);
+		if (lane[l].job) active++;
+	}
+
+	while (active > 0) {
+		for (l = 0; l < lanes; l++) {
+			if (lane[l].job) md5_mb_lane_block(&lane[l], block, l);
+		}
+
+		engine->transform(state, block);
+
+		/*
+		 *	Write out finished messages, and refill the
+		 *	lanes.  Idle lanes hash garbage, which we ignore.
+		 */
+		for (l = 0; l < lanes; l++) {
+			if (!lane[l].job || !lane[l].last) continue;
+
+			for (i = 0; i < 4; i++) PUT_32BIT_LE(lane[l].job->out + (i * 4), state[i][l]);
+
+			md5_mb_lane_init(&lane[l], state, l, (next < num) ? &jobs[next++] : NULL);
+			if (!lane[l].job) active--;
+		}
+	}
+}
+
+/** Calculate the MD5 state after hashing one 64 byte block
+ *
+ */
+static void md5_mb_block_state(uint32_t out[4], uint8_t const in[MD5_BLOCK_LENGTH])
+{
+	int		i;
+	md5_mb_state_t	state;
+	md5_mb_block_t	block;
+
+	state[0][0] = 0x67452301;
+	state[1][0] = 0xefcdab89;
+	state[2][0] = 0x98badcfe;
+	state[3][0] = 0x10325476;
+
+	for (i = 0; i < 16; i++) block[i][0] = GET_32BIT_LE(in + (i * 4));
+
+	md5_mb_transform_scalar(state, block);
+
+	for (i = 0; i < 4; i++) out[i] = state[i][0];
+}
+
+/** Calculate the HMAC states for the inner and outer pads of a key
+ *
+ */
+static void hmac_md5_mb_key(uint32_t istate[4], uint32_t ostate[4], uint8_t const *key, size_t key_len)
+{
+	int	i;
+	uint8_t	tk[MD5_DIGEST_LENGTH];
+	uint8_t	k_ipad[MD5_BLOCK_LENGTH];
+	uint8_t	k_opad[MD5_BLOCK_LENGTH];
+
+	/* if key is longer than 64 bytes reset it to key=MD5(key) */
+	if (key_len > MD5_BLOCK_LENGTH) {
+		fr_md5_calc(tk, key, key_len);
+		key = tk;
+		key_len = sizeof(tk);
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, k_ipad, sizeof(k_opad));
+
+	for (i = 0; i < MD5_BLOCK_LENGTH; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	md5_mb_block_state(istate, k_ipad);
+	md5_mb_block_state(ostate, k_opad);
+}
+
+/** Calculate HMAC-MD5 for many messages at once
+ *
+ *  The result is the same as calling fr_hmac_md5() for each message.
+ *  The digest may overlap the text.
+ *
+ *  The key pads are hashed once, and then re-used for the following
+ *  messages which have the same key.
+ *
+ * @param[out] digest array of where to write each digest.
+ * @param[in] text array of messages.
+ * @param[in] text_len array of message lengths.
+ * @param[in] key array of keys.
+ * @param[in] key_len array of key lengths.
+ * @param[in] num number of messages.
+ */
+void fr_hmac_md5_mb(uint8_t *digest[], uint8_t const *text[], size_t const text_len[],
+		    uint8_t const *key[], size_t const key_len[], int num)
+{
+	int		i, j, chunk;
+	uint32_t	istate[HMAC_MD5_MB_CHUNK][4];
+	uint32_t	ostate[HMAC_MD5_MB_CHUNK][4];
+	uint8_t		inner[HMAC_MD5_MB_CHUNK][MD5_DIGEST_LENGTH];
+	fr_md5_mb_job_t	jobs[HMAC_MD5_MB_CHUNK];
+
+	for (i = 0; i < num; i += chunk) {
+		chunk = num - i;
+		if (chunk > HMAC_MD5_MB_CHUNK) chunk = HMAC_MD5_MB_CHUNK;
+
+		/*
+		 *	MD5(K XOR ipad, text)
+		 */
+		for (j = 0; j < chunk; j++) {
+			if ((j > 0) && (key[i + j] == key[i + j - 1]) && (key_len[i + j] == key_len[i + j - 1])) {
+				memcpy(istate[j], istate[j - 1], sizeof(istate[j]));
+				memcpy(ostate[j], ostate[j - 1], sizeof(ostate[j]));
+			} else {
+				hmac_md5_mb_key(istate[j], ostate[j], key[i + j], key_len[i + j]);
+			}
+
+			jobs[j].in[0] = text[i + j];
+			jobs[j].inlen[0] = text_len[i + j];
+			jobs[j].num_in = 1;
+			jobs[j].iv = istate[j];
+			jobs[j].ivlen = MD5_BLOCK_LENGTH;
+			jobs[j].out = inner[j];
+		}
+		fr_md5_mb(jobs, chunk);
+
+		/*
+		 *	MD5(K XOR opad, MD5(K XOR ipad, text))
+		 */
+		for (j = 0; j < chunk; j++) {
+			jobs[j].in[0] = inner[j];
+			jobs[j].inlen[0] = MD5_DIGEST_LENGTH;
+			jobs[j].iv = ostate[j];
+			jobs[j].out = digest[i + j];
+		}
+		fr_md5_mb(jobs, chunk);
+	}
+}
@@ -549,6 +549,7 @@ void fr_pair_list_free(VALUE_PAIR **vps)
 	}
 
 	*vps = NULL;
+	fr_pair_list_index_invalidate();
 }
 
 /** Mark malformed or unrecognised attributed as unknown
@@ -612,17 +613,339 @@ int fr_pair_mark_xlat(VALUE_PAIR *vp, char const *value)
 	return 0;
 }
 
+/*
+ *	An index entry points to the first pair in the list with a
+ *	given da.  Later pairs with the same da are found by walking
+ *	the list from there.
+ */
+typedef struct fr_pair_list_index_entry_t {
+	fr_dict_attr_t const	*da;
+	VALUE_PAIR		*vp;
+} fr_pair_list_index_entry_t;
+
+struct fr_pair_list_index {
+	VALUE_PAIR		**head;		//!< of the list we're indexing.
+	VALUE_PAIR		*first;		//!< the head of the list when we last indexed it.
+	VALUE_PAIR		*tail;		//!< the last pair we've indexed.
+	uint64_t		generation;	//!< of the pair lists when we last indexed.
+
+	uint32_t		num_entries;	//!< number of different das in the index.
+	uint32_t		mask;		//!< number of slots - 1.
+	fr_pair_list_index_entry_t *slots;	//!< open addressing, linear probing.
+
+	fr_pair_list_index_t	*next;		//!< next index in this thread.
+};
+
+#define PAIR_INDEX_MIN_SLOTS	(32)
+
+/*
+ *	Bumped whenever pairs are removed from, replaced in, or
+ *	re-ordered in any list.  Indexes built before that are rebuilt
+ *	on their next lookup, before they follow any pointer into the
+ *	list.
+ */
+static _Thread_local uint64_t pair_list_generation;
+
+/*
+ *	Indexes which this thread has allocated, so that
+ *	fr_pair_find_by_da() can find one for the list it's searching.
+ */
+static _Thread_local fr_pair_list_index_t *pair_index_list;
+
+/** Find a pair by walking the list
+ *
+ */
+static VALUE_PAIR *pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
+{
+	VALUE_PAIR *vp;
+
+	for (vp = head; vp; vp = vp->next) {
+		VERIFY_VP(vp);
+		if ((vp->da == da) && (!da->flags.has_tag || TAG_EQ(tag, vp->tag))) return vp;
+	}
+
+	return NULL;
+}
+
+static inline uint32_t pair_index_hash(fr_dict_attr_t const *da)
+{
+	uint64_t h = (uintptr_t) da;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return (uint32_t) h;
+}
+
+static fr_pair_list_index_entry_t *pair_index_slot(fr_pair_list_index_t const *index, fr_dict_attr_t const *da)
+{
+	uint32_t i;
+
+	for (i = pair_index_hash(da) & index->mask; index->slots[i].da != NULL; i = (i + 1) & index->mask) {
+		if (index->slots[i].da == da) break;
+	}
+
+	return &index->slots[i];
+}
+
+static int pair_index_grow(fr_pair_list_index_t *index)
+{
+	uint32_t			i, old_mask = index->mask;
+	fr_pair_list_index_entry_t	*old = index->slots, *slots;
+
+	slots = talloc_zero_array(index, fr_pair_list_index_entry_t,
+				  old ? ((old_mask + 1) * 2) : PAIR_INDEX_MIN_SLOTS);
+	if (!slots) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	index->slots = slots;
+	index->mask = talloc_array_length(slots) - 1;
+
+	if (!old) return 0;
+
+	for (i = 0; i <= old_mask; i++) {
+		if (old[i].da) *pair_index_slot(index, old[i].da) = old[i];
+	}
+	talloc_free(old);
+
+	return 0;
+}
+
+/** Throw away everything in an index
+ *
+ */
+static void pair_index_reset(fr_pair_list_index_t *index)
+{
+	if (index->slots) memset(index->slots, 0, sizeof(index->slots[0]) * (index->mask + 1));
+	index->num_entries = 0;
+	index->first = *index->head;
+	index->tail = NULL;
+	index->generation = pair_list_generation;
+}
+
+/** Index any pairs which have been added to the list since the last lookup
+ *
+ */
+static int pair_index_update(fr_pair_list_index_t *index)
+{
+	VALUE_PAIR *vp;
+
+	/*
+	 *	Pairs have been removed from a list, or something
+	 *	replaced the head of this one, so we can't trust
+	 *	anything we've indexed.  Start again.  This MUST be
+	 *	checked before we look at the tail.
+	 */
+	if ((index->generation != pair_list_generation) || (*index->head != index->first)) {
+		pair_index_reset(index);
+	}
+
+#ifdef WITH_VERIFY_PTR
+	/*
+	 *	Catch pairs which were removed from the list without
+	 *	going through the pair API.  The tail must still be
+	 *	in the list before we follow it.
+	 */
+	if (index->tail) {
+		for (vp = *index->head; vp && (vp != index->tail); vp = vp->next) {
+			/* nothing */
+		}
+		if (!fr_cond_assert(vp)) pair_index_reset(index);
+	}
+#endif
+
+	for (vp = index->tail ? index->tail->next : *index->head; vp; vp = vp->next) {
+		fr_pair_list_index_entry_t *entry;
+
+		if (!index->slots || ((index->num_entries * 2) >= (index->mask + 1))) {
+			if (pair_index_grow(index) < 0) return -1;
+		}
+
+		/*
+		 *	Only the first pair with a given da goes into
+		 *	the index, which preserves the ordering of the
+		 *	list for lookups.
+		 */
+		entry = pair_index_slot(index, vp->da);
+		if (!entry->da) {
+			entry->da = vp->da;
+			entry->vp = vp;
+			index->num_entries++;
+		}
+
+		index->tail = vp;
+	}
+
+	return 0;
+}
+
+/** Update any indexes of a list, after pairs have been appended to it
+ *
+ */
+static void pair_index_add(VALUE_PAIR **head)
+{
+	fr_pair_list_index_t *index;
+
+	for (index = pair_index_list; index; index = index->next) {
+		if (index->head == head) (void) pair_index_update(index);
+	}
+}
+
+/** Find the index (if any) for a list
+ *
+ */
+static inline fr_pair_list_index_t *pair_index_by_head(VALUE_PAIR const *head)
+{
+	fr_pair_list_index_t *index;
+
+	if (!head) return NULL;
+
+	for (index = pair_index_list; index; index = index->next) {
+		if (*index->head == head) return index;
+	}
+
+	return NULL;
+}
+
+static int _pair_index_free(fr_pair_list_index_t *index)
+{
+	fr_pair_list_index_t **last;
+
+	for (last = &pair_index_list; *last; last = &(*last)->next) {
+		if (*last != index) continue;
+
+		*last = index->next;
+		break;
+	}
+
+	return 0;
+}
+
+/** Allocate an index for repeated lookups in a pair list
+ *
+ * The index is built lazily, on the first lookup.  While it exists,
+ * fr_pair_find_by_da() (and so tmpl_find_vp(), and the cursor
+ * functions when they search from the start of the list) use it for
+ * lookups in the list.
+ *
+ * Pairs added with fr_pair_add() are indexed immediately.  Pairs
+ * appended in any other way are indexed by the next lookup.  Removing,
+ * replacing, or re-ordering pairs with the pair API (fr_pair_replace(),
+ * fr_pair_delete_by_num(), fr_pair_cursor_remove(), etc.) invalidates
+ * the index, which is then rebuilt by the next lookup.  Code which
+ * removes pairs by editing the list directly MUST call
+ * fr_pair_list_index_invalidate().
+ *
+ * @note The index is only visible to the thread which allocated it,
+ *	and MUST be freed before the list it refers to.
+ *
+ * @param[in] ctx	to allocate the index in.
+ * @param[in] head	of the list to index.
+ * @return
+ *	- The new index.
+ *	- NULL on error.
+ */
+fr_pair_list_index_t *fr_pair_list_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **head)
+{
+	fr_pair_list_index_t *index;
+
+	index = talloc_zero(ctx, fr_pair_list_index_t);
+	if (!index) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	index->head = head;
+	index->first = *head;
+	index->generation = pair_list_generation;
+
+	index->next = pair_index_list;
+	pair_index_list = index;
+	talloc_set_destructor(index, _pair_index_free);
+
+	return index;
+}
+
+/** Tell all indexes that pairs have been removed from, or replaced in, a list
+ *
+ * The pair API calls this itself.  It only needs to be called by code
+ * which edits lists directly.
+ */
+void fr_pair_list_index_invalidate(void)
+{
+	pair_list_generation++;
+}
+
+/** Return the head of the list an index refers to
+ *
+ */
+VALUE_PAIR *fr_pair_list_index_head(fr_pair_list_index_t const *index)
+{
+	return *index->head;
+}
+
+/** Find the first pair with the matching da, using an index
+ *
+ * Returns the same pair as fr_pair_find_by_da() would.
+ *
+ * @param[in] index	of the list to search.
+ * @param[in] da	to match.
+ * @param[in] tag	to match. TAG_ANY matches any tag, TAG_NONE matches tagless VPs.
+ * @return
+ *	- The matching pair.
+ *	- NULL if there is no matching pair.
+ */
+VALUE_PAIR *fr_pair_list_index_find(fr_pair_list_index_t *index, fr_dict_attr_t const *da, int8_t tag)
+{
+	VALUE_PAIR *vp;
+
+	if (!fr_cond_assert(da)) return NULL;
+
+	/*
+	 *	If we can't update the index, fall back to searching
+	 *	the list.
+	 */
+	if (pair_index_update(index) < 0) return pair_find_by_da(*index->head, da, tag);
+
+	if (!index->slots) return NULL;
+
+	vp = pair_index_slot(index, da)->vp;
+
+#ifdef WITH_VERIFY_PTR
+	/*
+	 *	Compare the pointers before using the indexed pair,
+	 *	as it may have been freed.
+	 */
+	{
+		VALUE_PAIR *found = pair_find_by_da(*index->head, da, TAG_ANY);
+
+		if (!fr_cond_assert(vp == found)) vp = found;
+	}
+#endif
+
+	if (!vp || !da->flags.has_tag) return vp;
+
+	return pair_find_by_da(vp, da, tag);
+}
+
 /** Find the pair with the matching DAs
  *
+ * If the list has an index (see fr_pair_list_index_alloc()), it's
+ * used instead of walking the list.
  */
 VALUE_PAIR *fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
 {
-	vp_cursor_t 	cursor;
+	fr_pair_list_index_t *index;
 
 	if(!fr_cond_assert(da)) return NULL;
 
-	(void) fr_pair_cursor_init(&cursor, &head);
-	return fr_pair_cursor_next_by_da(&cursor, da, tag);
+	index = pair_index_by_head(head);
+	if (index) return fr_pair_list_index_find(index, da, tag);
+
+	return pair_find_by_da(head, da, tag);
 }
 
 
@@ -659,7 +982,6 @@ VALUE_PAIR *fr_pair_find_by_child_num(VALUE_PAIR *head, fr_dict_attr_t const *pa
 	return fr_pair_cursor_next_by_child_num(&cursor, parent, attr, tag);
 }
 
-
 /** Add a VP to the end of the list.
  *
  * Locates the end of 'head', and links an additional VP 'add' at the end.
@@ -677,7 +999,7 @@ void fr_pair_add(VALUE_PAIR **head, VALUE_PAIR *add)
 
 	if (*head == NULL) {
 		*head = add;
-		return;
+		goto done;
 	}
 
 	for (i = *head; i->next; i = i->next) {
@@ -692,6 +1014,12 @@ void fr_pair_add(VALUE_PAIR **head, VALUE_PAIR *add)
 	}
 
 	i->next = add;
+
+done:
+	/*
+	 *	Index the new pairs, if the list has an index.
+	 */
+	if (pair_index_list) pair_index_add(head);
 }
 
 /** Replace all matching VPs
@@ -737,6 +1065,7 @@ void fr_pair_replace(VALUE_PAIR **head, VALUE_PAIR *replace)
 			 */
 			replace->next = next;
 			talloc_free(i);
+			fr_pair_list_index_invalidate();
 			return;
 		}
 
@@ -818,6 +1147,7 @@ void fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int
 			    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
 				*last = next;
 				talloc_free(i);
+				fr_pair_list_index_invalidate();
 			} else {
 				last = &i->next;
 			}
@@ -831,6 +1161,7 @@ void fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int
 			    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
 				*last = next;
 				talloc_free(i);
+				fr_pair_list_index_invalidate();
 			} else {
 				last = &i->next;
 			}
@@ -1165,6 +1496,7 @@ void fr_pair_list_sort(VALUE_PAIR **vps, fr_cmp_t cmp)
 	 *	merge the two sorted lists together
 	 */
 	*vps = _pair_list_sort_merge(a, b, cmp);
+	fr_pair_list_index_invalidate();
 }
 
 /** Write an error to the library errorbuff detailing the mismatch
@@ -1608,6 +1940,45 @@ VALUE_PAIR *fr_pair_list_copy_by_num(TALLOC_CTX *ctx, VALUE_PAIR *from,
 
 
 
+/** Move one VP into a new context, as part of moving it to another list
+ *
+ * VALUE_PAIRs decoded from a RADIUS packet are carved from a talloc pool
+ * owned by the packet.  Stealing one of them into another context would
+ * keep the whole pool allocated for as long as that VALUE_PAIR lives, so
+ * those are copied into the new context instead, and the original is freed.
+ *
+ * @param[in] ctx to move VALUE_PAIR into.
+ * @param[in] vp VALUE_PAIR to move.  It may be freed.
+ * @return the VALUE_PAIR in the new context, with the same "next" pointer.
+ */
+static VALUE_PAIR *pair_move(TALLOC_CTX *ctx, VALUE_PAIR *vp)
+{
+	TALLOC_CTX	*parent;
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*copy;
+
+	parent = talloc_parent(vp);
+	if (!parent || (parent == ctx)) goto steal;
+
+	packet = talloc_get_type(parent, RADIUS_PACKET);
+	if (!packet || !packet->decode_pool) goto steal;
+
+	if (((uint8_t *) vp < (uint8_t *) packet->decode_pool) ||
+	    ((uint8_t *) vp >= ((uint8_t *) packet->decode_pool + packet->decode_pool_size))) goto steal;
+
+	copy = fr_pair_copy(ctx, vp);
+	if (!copy) goto steal;
+
+	copy->next = vp->next;
+	talloc_free(vp);
+
+	return copy;
+
+steal:
+	fr_pair_steal(ctx, vp);
+	return vp;
+}
+
 /** Move pairs from source list to destination list respecting operator
  *
  * @note This function does some additional magic that's probably not needed
@@ -1747,13 +2118,19 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 	do_add:
 			*tail_from = i->next;
 			i->next = NULL;
+			i = pair_move(ctx, i);
 			*tail_new = i;
-			fr_pair_steal(ctx, i);
 			tail_new = &(i->next);
 			continue;
 		}
 	} /* loop over the "from" list. */
 
+	/*
+	 *	Pairs have been removed from the "from" list, and
+	 *	maybe from the "to" list.
+	 */
+	fr_pair_list_index_invalidate();
+
 	/*
 	 *	Take the "new" list, and append it to the "to" list.
 	 */
@@ -1804,17 +2181,19 @@ static void fr_pair_list_move_by_num_internal(TALLOC_CTX *ctx, VALUE_PAIR **to,
 	 *	It's better than "fr_pair_add(foo,bar);bar=NULL"
 	 */
 	if ((vendor == 0) && (attr == 0)) {
-		if (*to) {
-			to_tail->next = *from;
-		} else {
-			*to = *from;
-		}
+		VALUE_PAIR **last;
+
+		last = *to ? &to_tail->next : to;
+
+		for (i = *from; i; i = next) {
+			next = i->next;
 
-		for (i = *from; i; i = i->next) {
-			fr_pair_steal(ctx, i);
+			*last = pair_move(ctx, i);
+			last = &(*last)->next;
 		}
 
 		*from = NULL;
+		fr_pair_list_index_invalidate();
 		return;
 	}
 
@@ -1876,7 +2255,7 @@ static void fr_pair_list_move_by_num_internal(TALLOC_CTX *ctx, VALUE_PAIR **to,
 			*from = next;
 
 		if (move) {
-			this = i;
+			this = pair_move(ctx, i);
 		} else {
 			this = fr_pair_copy(ctx, i);
 		}
@@ -1891,12 +2270,10 @@ static void fr_pair_list_move_by_num_internal(TALLOC_CTX *ctx, VALUE_PAIR **to,
 		to_tail = this;
 		this->next = NULL;
 
-		if (move) {
-			fr_pair_steal(ctx, i);
-		} else {
-			talloc_free(i);
-		}
+		if (!move) talloc_free(i);
 	}
+
+	fr_pair_list_index_invalidate();
 }
 
 
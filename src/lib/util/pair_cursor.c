@@ -299,6 +299,14 @@ VALUE_PAIR *fr_pair_cursor_next_by_da(vp_cursor_t *cursor, fr_dict_attr_t const
 
 	if (!cursor->first) return NULL;
 
+	/*
+	 *	Searching from the start of the list, which may
+	 *	have an index.
+	 */
+	if (!cursor->found && *cursor->first && (cursor->current == *cursor->first)) {
+		return fr_pair_cursor_update(cursor, fr_pair_find_by_da(*cursor->first, da, tag));
+	}
+
 	for (i = cursor->found ? cursor->found->next : cursor->current;
 	     i != NULL;
 	     i = i->next) {
@@ -629,6 +637,8 @@ fixup:
 	 *	Fixup cursor->last if we removed the VP it was referring to
 	 */
 	if (vp == cursor->last) cursor->last = cursor->current;
+
+	fr_pair_list_index_invalidate();
 	return vp;
 }
 
@@ -667,6 +677,8 @@ VALUE_PAIR *fr_pair_cursor_replace(vp_cursor_t *cursor, VALUE_PAIR *new)
 	new->next = vp->next;
 	vp->next = NULL;
 
+	fr_pair_list_index_invalidate();
+
 	VERIFY_LIST(*(cursor->first));
 
 	return vp;
@@ -28,6 +28,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/lpm.h>
 
 #include <sys/stat.h>
 
@@ -47,6 +48,7 @@ struct radclient_list {
 	char const	*name;			//!< Name of the client list.
 	rbtree_t	*trees[129];		//!< For 0..128, inclusive.
 	uint32_t       	min_prefix;
+	fr_lpm_t	*lpm;			//!< One client for each network, for client_find().
 };
 
 #ifdef WITH_STATS
@@ -163,6 +165,12 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
 	clients->min_prefix = 128;
 
+	clients->lpm = fr_lpm_create(clients);
+	if (!clients->lpm) {
+		talloc_free(clients);
+		return NULL;
+	}
+
 	return clients;
 }
 
@@ -205,6 +213,17 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
 	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
 
+	/*
+	 *	Hash the secret once, instead of once per packet.
+	 *	Clients aren't changed after they've been added, so a
+	 *	reloaded dynamic client is a new client, with new
+	 *	states.
+	 */
+	if (client->secret) {
+		fr_md5_key_init(&client->secret_key, (uint8_t const *) client->secret,
+				talloc_array_length(client->secret) - 1);
+	}
+
 	/*
 	 *	If the client also defines a server, do that now.
 	 */
@@ -317,6 +336,18 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		return false;
 	}
 
+	/*
+	 *	The LPM table only needs one client for each network.
+	 *	Clients which differ only by protocol (or IPv6 scope)
+	 *	are found via the tree for that prefix.
+	 */
+	if (!fr_lpm_find_exact(clients->lpm, &client->ipaddr) &&
+	    (fr_lpm_insert(clients->lpm, &client->ipaddr, client) < 0)) {
+		rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+		ERROR("Failed to add client %s: %s", client->shortname, fr_strerror());
+		return false;
+	}
+
 #ifdef WITH_STATS
 	if (!tree_num) {
 		tree_num = rbtree_create(clients, client_num_cmp, NULL, 0);
@@ -360,8 +391,28 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 
 #ifdef WITH_DYNAMIC_CLIENTS
+/** Find another client for the same network as a deleted one
+ *
+ */
+static int client_same_network(void *ctx, void *data)
+{
+	RADCLIENT	**found = ctx;
+	RADCLIENT	*client = data;
+	fr_ipaddr_t	ipaddr;
+
+	ipaddr = client->ipaddr;
+	ipaddr.scope_id = (*found)->ipaddr.scope_id;
+
+	if (fr_ipaddr_cmp(&ipaddr, &(*found)->ipaddr) != 0) return 0;
+
+	*found = client;
+	return 1;
+}
+
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	RADCLIENT	myclient, *other;
+
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
@@ -376,6 +427,26 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	rbtree_deletebydata(tree_num, client);
 #endif
 	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+
+	if (fr_lpm_find_exact(clients->lpm, &client->ipaddr) != client) return;
+
+	fr_lpm_remove(clients->lpm, &client->ipaddr);
+
+	/*
+	 *	If there's another client for the same network, it
+	 *	takes the place of the deleted one.
+	 */
+	myclient.ipaddr = client->ipaddr;
+	myclient.proto = IPPROTO_IP;
+
+	other = rbtree_finddata(clients->trees[client->ipaddr.prefix], &myclient);
+	if (!other && (client->ipaddr.af == AF_INET6)) {
+		other = client;
+		if (rbtree_walk(clients->trees[client->ipaddr.prefix], RBTREE_IN_ORDER,
+				client_same_network, &other) == 0) other = NULL;
+	}
+
+	if (other) fr_lpm_insert(clients->lpm, &other->ipaddr, other);
 }
 #endif
 
@@ -412,11 +483,17 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 
 /*
  *	Find a client in the RADCLIENTS list.
+ *
+ *	The LPM table gives us the longest network which contains the
+ *	address.  If the client it returns is for a different protocol
+ *	(or IPv6 scope), then we look for one which matches in the
+ *	tree for that prefix, and then try the next shorter network.
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
+	int32_t max_prefix;
+	fr_ipaddr_t addr;
+	RADCLIENT myclient, *client;
 
 	if (!clients) clients = root_clients;
 
@@ -435,17 +512,31 @@ RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 		return NULL;
 	}
 
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
+	addr = *ipaddr;
+	addr.prefix = max_prefix;
 
-		if (!clients->trees[i]) continue;
+	while ((client = fr_lpm_find(clients->lpm, &addr)) != NULL) {
+		uint8_t prefix = client->ipaddr.prefix;
+
+		if ((ipaddr->af == AF_INET) || (client->ipaddr.scope_id == ipaddr->scope_id)) {
+#ifdef WITH_TCP
+			if ((proto == IPPROTO_IP) || (client->proto == IPPROTO_IP) ||
+			    (client->proto == proto)) return client;
+#else
+			return client;
+#endif
+		}
 
 		myclient.ipaddr = *ipaddr;
 		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+		fr_ipaddr_mask(&myclient.ipaddr, prefix);
+
+		client = rbtree_finddata(clients->trees[prefix], &myclient);
+		if (client) return client;
+
+		if (prefix == 0) break;
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
+		addr.prefix = prefix - 1;
 	}
 
 	return NULL;
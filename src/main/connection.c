@@ -34,6 +34,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 typedef struct fr_connection fr_connection_t;
+typedef struct fr_connection_thread fr_connection_thread_t;
 
 static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request);
 
@@ -70,6 +71,37 @@ struct fr_connection {
 #endif
 };
 
+/** A worker thread's private cache of connections
+ *
+ * Connections released by a thread are stashed here, and handed back to the
+ * same thread on its next reservation without touching the pool mutex.
+ *
+ * From the pool's point of view, a stashed connection is still in use.  It
+ * stays out of the heap, is counted in fr_connection_pool_state_t.active, and
+ * is never closed by fr_connection_manage.
+ *
+ * The mutex is only contended when the pool is being maintained, or when another
+ * thread is stealing idle connections because the pool is at max.
+ *
+ * @see fr_connection_pool_t
+ */
+struct fr_connection_thread {
+	fr_connection_thread_t	*next;		//!< Next thread cache in the pool's list.
+	fr_connection_pool_t	*pool;		//!< Pool the cached connections belong to.
+
+	pthread_mutex_t		mutex;		//!< Protects the arrays below.
+
+	fr_connection_t		**idle;		//!< Connections released by this thread, most recent last.
+	uint32_t		num_idle;	//!< Number of entries in idle.
+
+	fr_connection_t		**reserved;	//!< Connections this thread currently holds.
+	uint32_t		num_reserved;	//!< Number of entries in reserved.
+	uint32_t		alloc_reserved;	//!< Number of slots allocated in reserved.
+
+	uint64_t		hits;		//!< Reservations satisfied from the cache.
+	uint64_t		misses;		//!< Reservations that fell back to the pool.
+};
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -106,6 +138,13 @@ struct fr_connection_pool_t {
 	bool		spread;			//!< If true we spread requests over the connections,
 						//!< using the connection released longest ago, first.
 
+	uint32_t	thread_cache;		//!< Maximum number of idle connections each thread may
+						//!< keep for itself.  0 disables per-thread caching.
+	bool		thread_key_init;	//!< Whether thread_key has been created.
+	pthread_key_t	thread_key;		//!< Key for the calling thread's fr_connection_thread_t.
+	pthread_mutex_t	thread_mutex;		//!< Protects the threads list.
+	fr_connection_thread_t *threads;	//!< All thread caches belonging to this pool.
+
 	fr_heap_t	*heap;			//!< For the next connection heap
 
 	fr_connection_t	*head;			//!< Start of the connection list.
@@ -157,6 +196,7 @@ static const CONF_PARSER connection_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", FR_TYPE_TIMEVAL, fr_connection_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", FR_TYPE_UINT32, fr_connection_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", FR_TYPE_BOOL, fr_connection_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("thread_cache", FR_TYPE_UINT32, fr_connection_pool_t, thread_cache), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -634,6 +674,420 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 }
 
 
+/** Check whether a connection held in a thread cache can be handed out again
+ *
+ * Applies the same limits as fr_connection_manage, which skips connections
+ * in thread caches as they're marked as in use.
+ *
+ * @note Must be called with the thread cache's mutex held.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] this	Connection to check.
+ * @param[in] now	Current time.
+ * @return
+ *	- true if the connection may be reused.
+ *	- false if it should be closed.
+ */
+static bool fr_connection_thread_usable(fr_connection_pool_t *pool, fr_connection_t *this, time_t now)
+{
+	if (this->needs_reconnecting) return false;
+
+	if ((pool->max_uses > 0) && (this->num_uses >= pool->max_uses)) return false;
+
+	if ((pool->lifetime > 0) && ((this->created + pool->lifetime) < now)) return false;
+
+	if ((pool->idle_timeout > 0) && ((this->last_released.tv_sec + pool->idle_timeout) < now)) return false;
+
+	return true;
+}
+
+/** Close a connection which was idle in a thread cache
+ *
+ * @note Must be called with the pool mutex held.
+ *
+ * @param[in] pool	to modify.
+ * @param[in] request	The current request.
+ * @param[in] this	Connection to close.
+ */
+static void fr_connection_thread_close(fr_connection_pool_t *pool, REQUEST *request, fr_connection_t *this)
+{
+	ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Idle in thread cache", this->number);
+
+	/*
+	 *	May have been cached by a different thread.
+	 */
+#ifdef PTHREAD_DEBUG
+	this->pthread_id = pthread_self();
+#endif
+	fr_connection_close_internal(pool, request, this);
+}
+
+/** Return the calling thread's cache, optionally creating it
+ *
+ * @note Must be called with the pool mutex free.
+ *
+ * @param[in] pool	to retrieve the thread cache for.
+ * @param[in] create	whether to allocate a new cache if the thread has none.
+ * @return
+ *	- The calling thread's cache.
+ *	- NULL if it has none, or on error.
+ */
+static fr_connection_thread_t *fr_connection_thread(fr_connection_pool_t *pool, bool create)
+{
+	fr_connection_thread_t *thread;
+
+	thread = pthread_getspecific(pool->thread_key);
+	if (thread || !create) return thread;
+
+	/*
+	 *	Allocated in the NULL ctx, as the pool may be
+	 *	under a module instance that's read only.
+	 */
+	thread = talloc_zero(NULL, fr_connection_thread_t);
+	if (!thread) return NULL;
+
+	thread->pool = pool;
+	thread->idle = talloc_array(thread, fr_connection_t *, pool->thread_cache);
+	thread->reserved = talloc_array(thread, fr_connection_t *, pool->thread_cache);
+	if (!thread->idle || !thread->reserved) {
+		talloc_free(thread);
+		return NULL;
+	}
+	thread->alloc_reserved = pool->thread_cache;
+	pthread_mutex_init(&thread->mutex, NULL);
+
+	pthread_mutex_lock(&pool->thread_mutex);
+	thread->next = pool->threads;
+	pool->threads = thread;
+	pthread_mutex_unlock(&pool->thread_mutex);
+
+	pthread_setspecific(pool->thread_key, thread);
+
+	return thread;
+}
+
+/** Add a connection to a thread's reserved list
+ *
+ * @note Must be called with the thread cache's mutex held.
+ *
+ * @param[in] thread	to modify.
+ * @param[in] this	Connection that's been reserved.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the reserved list couldn't be grown.
+ */
+static int fr_connection_thread_reserve(fr_connection_thread_t *thread, fr_connection_t *this)
+{
+	if (thread->num_reserved == thread->alloc_reserved) {
+		fr_connection_t **reserved;
+
+		reserved = talloc_realloc(thread, thread->reserved, fr_connection_t *, thread->alloc_reserved * 2);
+		if (!reserved) return -1;
+
+		thread->reserved = reserved;
+		thread->alloc_reserved *= 2;
+	}
+	thread->reserved[thread->num_reserved++] = this;
+
+	return 0;
+}
+
+/** Record that the calling thread holds a connection
+ *
+ * Only connections recorded here can be stashed in the thread cache when
+ * they're released.  If recording fails the connection will simply be
+ * released back to the pool.
+ *
+ * @note Must be called with the pool mutex free.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] this	Connection that's been reserved.
+ */
+static void fr_connection_thread_track(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	fr_connection_thread_t *thread;
+
+	thread = fr_connection_thread(pool, true);
+	if (!thread) return;
+
+	pthread_mutex_lock(&thread->mutex);
+	(void) fr_connection_thread_reserve(thread, this);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+/** Remove a connection handle from the calling thread's reserved list
+ *
+ * @note Must be called with the thread cache's mutex held.
+ *
+ * @param[in] thread	to search.
+ * @param[in] conn	handle to search for.
+ * @return
+ *	- The connection that was removed.
+ *	- NULL if this thread wasn't tracking the connection.
+ */
+static fr_connection_t *fr_connection_thread_untrack(fr_connection_thread_t *thread, void *conn)
+{
+	uint32_t	i;
+	fr_connection_t	*this;
+
+	for (i = 0; i < thread->num_reserved; i++) {
+		if (thread->reserved[i]->connection != conn) continue;
+
+		this = thread->reserved[i];
+		thread->reserved[i] = thread->reserved[--thread->num_reserved];
+
+		return this;
+	}
+
+	return NULL;
+}
+
+/** Stop tracking a connection that's about to be closed or reconnected
+ *
+ * @note Must be called with the pool mutex free.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] conn	handle to forget.
+ */
+static void fr_connection_thread_forget(fr_connection_pool_t *pool, void *conn)
+{
+	fr_connection_thread_t *thread;
+
+	thread = fr_connection_thread(pool, false);
+	if (!thread) return;
+
+	pthread_mutex_lock(&thread->mutex);
+	(void) fr_connection_thread_untrack(thread, conn);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+/** Reserve a connection from the calling thread's cache
+ *
+ * Connections which have exceeded their limits are closed, which requires
+ * the pool mutex.  That's the only time it's taken.
+ *
+ * @note Must be called with the pool mutex free.
+ *
+ * @param[in] pool	to reserve the connection from.
+ * @param[in] request	The current request.
+ * @return
+ *	- A connection, marked as reserved by this thread.
+ *	- NULL if the thread has no usable cached connections.
+ */
+static fr_connection_t *fr_connection_thread_get(fr_connection_pool_t *pool, REQUEST *request)
+{
+	fr_connection_thread_t	*thread;
+	fr_connection_t		*this;
+	time_t			now;
+
+	thread = fr_connection_thread(pool, false);
+	if (!thread) return NULL;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&thread->mutex);
+	while (thread->num_idle > 0) {
+		this = thread->idle[--thread->num_idle];
+
+		if (fr_connection_thread_usable(pool, this, now)) {
+			/*
+			 *	If we can't track it, it'll be
+			 *	released back to the pool instead.
+			 */
+			(void) fr_connection_thread_reserve(thread, this);
+			thread->hits++;
+
+			this->num_uses++;
+			gettimeofday(&this->last_reserved, NULL);
+			pthread_mutex_unlock(&thread->mutex);
+
+			return this;
+		}
+
+		/*
+		 *	Lock ordering is pool, then thread, so
+		 *	we have to drop ours before closing.
+		 */
+		pthread_mutex_unlock(&thread->mutex);
+
+		pthread_mutex_lock(&pool->mutex);
+		fr_connection_thread_close(pool, request, this);
+		pthread_mutex_unlock(&pool->mutex);
+
+		pthread_mutex_lock(&thread->mutex);
+	}
+	thread->misses++;
+	pthread_mutex_unlock(&thread->mutex);
+
+	return NULL;
+}
+
+/** Stash a connection in the calling thread's cache
+ *
+ * @note Must be called with the pool mutex free.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] request	The current request.
+ * @param[in] conn	handle being released.
+ * @return
+ *	- true if the connection was stashed.
+ *	- false if it must be released back to the pool.
+ */
+static bool fr_connection_thread_release(fr_connection_pool_t *pool, REQUEST *request, void *conn)
+{
+	fr_connection_thread_t	*thread;
+	fr_connection_t		*this;
+
+	thread = fr_connection_thread(pool, false);
+	if (!thread) return false;
+
+	pthread_mutex_lock(&thread->mutex);
+	this = fr_connection_thread_untrack(thread, conn);
+	if (!this || this->needs_reconnecting || (thread->num_idle >= pool->thread_cache)) {
+		pthread_mutex_unlock(&thread->mutex);
+		return false;
+	}
+
+	gettimeofday(&this->last_released, NULL);
+	thread->idle[thread->num_idle++] = this;
+	pthread_mutex_unlock(&thread->mutex);
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Released connection (%" PRIu64 ") to thread cache", this->number);
+
+	return true;
+}
+
+/** Take an idle connection from another thread's cache
+ *
+ * Used when the pool is at max, and all remaining connections are sitting
+ * idle in thread caches.  Expired connections found along the way are closed.
+ *
+ * @note Must be called with the pool mutex held.
+ *
+ * @param[in] pool	to search.
+ * @param[in] request	The current request.
+ * @param[in] now	Current time.
+ * @return
+ *	- A connection, still marked as in use.
+ *	- NULL if no thread had a usable connection.
+ */
+static fr_connection_t *fr_connection_thread_steal(fr_connection_pool_t *pool, REQUEST *request, time_t now)
+{
+	fr_connection_thread_t	*thread;
+	fr_connection_t		*this = NULL;
+
+	pthread_mutex_lock(&pool->thread_mutex);
+	for (thread = pool->threads; thread && !this; thread = thread->next) {
+		pthread_mutex_lock(&thread->mutex);
+		while (thread->num_idle > 0) {
+			this = thread->idle[--thread->num_idle];
+			if (fr_connection_thread_usable(pool, this, now)) break;
+
+			fr_connection_thread_close(pool, request, this);
+			this = NULL;
+		}
+		pthread_mutex_unlock(&thread->mutex);
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+
+	if (this) ROPTIONAL(RDEBUG2, DEBUG2, "Took connection (%" PRIu64 ") from another thread's cache", this->number);
+
+	return this;
+}
+
+/** Count the idle connections held in thread caches
+ *
+ * @note Must be called with the pool mutex held.
+ *
+ * @param[in] pool	to count connections for.
+ * @return the number of connections idle in thread caches.
+ */
+static uint32_t fr_connection_thread_num_idle(fr_connection_pool_t *pool)
+{
+	fr_connection_thread_t	*thread;
+	uint32_t		num = 0;
+
+	pthread_mutex_lock(&pool->thread_mutex);
+	for (thread = pool->threads; thread; thread = thread->next) {
+		pthread_mutex_lock(&thread->mutex);
+		num += thread->num_idle;
+		pthread_mutex_unlock(&thread->mutex);
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+
+	return num;
+}
+
+/** Close expired connections held in thread caches
+ *
+ * @note Must be called with the pool mutex held.
+ *
+ * @param[in] pool	to manage.
+ * @param[in] request	The current request.
+ * @param[in] now	Current time.
+ * @param[in] all	Close every cached connection, not just expired ones.
+ */
+static void fr_connection_thread_sweep(fr_connection_pool_t *pool, REQUEST *request, time_t now, bool all)
+{
+	fr_connection_thread_t	*thread;
+	uint32_t		i, keep;
+
+	pthread_mutex_lock(&pool->thread_mutex);
+	for (thread = pool->threads; thread; thread = thread->next) {
+		pthread_mutex_lock(&thread->mutex);
+		for (i = 0, keep = 0; i < thread->num_idle; i++) {
+			fr_connection_t *this = thread->idle[i];
+
+			if (!all && fr_connection_thread_usable(pool, this, now)) {
+				thread->idle[keep++] = this;
+				continue;
+			}
+
+			fr_connection_thread_close(pool, request, this);
+		}
+		thread->num_idle = keep;
+		pthread_mutex_unlock(&thread->mutex);
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+}
+
+/** Return a thread's cached connections to the pool when the thread exits
+ *
+ * @param[in] arg	fr_connection_thread_t to free.
+ */
+static void _fr_connection_thread_free(void *arg)
+{
+	fr_connection_thread_t	*thread = talloc_get_type_abort(arg, fr_connection_thread_t);
+	fr_connection_thread_t	**last;
+	fr_connection_pool_t	*pool = thread->pool;
+	uint32_t		i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_mutex_lock(&pool->thread_mutex);
+	for (last = &pool->threads; *last; last = &(*last)->next) {
+		if (*last != thread) continue;
+
+		*last = thread->next;
+		break;
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+
+	for (i = 0; i < thread->num_idle; i++) {
+		fr_connection_t *this = thread->idle[i];
+
+		this->in_use = false;
+		fr_heap_insert(pool->heap, this);
+
+		rad_assert(pool->state.active != 0);
+		pool->state.active--;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_mutex_destroy(&thread->mutex);
+	talloc_free(thread);
+}
+
+
 /** Check whether any connections need to be removed from the pool
  *
  * Maintains the number of connections in the pool as per the configuration
@@ -663,8 +1117,12 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 	 *	Some idle connections are OK, if they're within the
 	 *	configured "spare" range.  Any extra connections
 	 *	outside of that range can be closed.
+	 *
+	 *	Connections in thread caches are counted as active,
+	 *	but they're just as idle as the ones in the heap.
 	 */
 	idle = pool->state.num - pool->state.active;
+	if (pool->thread_cache) idle += fr_connection_thread_num_idle(pool);
 	if (idle <= pool->spare) {
 		extra = 0;
 	} else {
@@ -770,7 +1228,27 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 			}
 		}
 
-		if (!rad_cond_assert(found)) goto done;
+		/*
+		 *	All the spare connections may be in
+		 *	thread caches.  The one we take is still
+		 *	marked as in use, and is released as it's
+		 *	closed.
+		 */
+		if (!found && pool->thread_cache) {
+			found = fr_connection_thread_steal(pool, request, now);
+#ifdef PTHREAD_DEBUG
+			if (found) found->pthread_id = pthread_self();
+#endif
+		}
+
+		/*
+		 *	Cached connections may have expired, and been
+		 *	closed as we looked for one.
+		 */
+		if (!found) {
+			if (!pool->thread_cache) (void) rad_cond_assert(found);
+			goto done;
+		}
 
 		ROPTIONAL(RDEBUG, DEBUG, "Closing connection (%" PRIu64 "), from %d unused connections",
 			  found->number, extra);
@@ -793,6 +1271,12 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 		fr_connection_manage(pool, request, this, now);
 	}
 
+	/*
+	 *	Connections in thread caches are marked as in use,
+	 *	so they need to be checked separately.
+	 */
+	if (pool->thread_cache) fr_connection_thread_sweep(pool, request, now, false);
+
 	pool->state.last_checked = now;
 done:
 	pthread_mutex_unlock(&pool->mutex);
@@ -818,6 +1302,18 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 
 	if (!pool) return NULL;
 
+	/*
+	 *	Try the calling thread's cache first, this
+	 *	avoids contending on the pool mutex.
+	 */
+	if (pool->thread_cache) {
+		this = fr_connection_thread_get(pool, request);
+		if (this) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ") from thread cache", this->number);
+			return this->connection;
+		}
+	}
+
 	pthread_mutex_lock(&pool->mutex);
 
 	now = time(NULL);
@@ -841,6 +1337,16 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 		goto do_return;
 	}
 
+	/*
+	 *	Other threads may have idle connections in their
+	 *	caches.  Take one of those before opening a new
+	 *	connection.
+	 */
+	if (pool->thread_cache) {
+		this = fr_connection_thread_steal(pool, request, now);
+		if (this) goto do_reuse;
+	}
+
 	if (pool->state.num == pool->max) {
 		bool complain = false;
 
@@ -865,13 +1371,21 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 		return NULL;
 	}
 
+	/*
+	 *	Nothing is idle, either in the heap or in thread
+	 *	caches, so every connection really is in use.
+	 *	Only suggest more spares if there's room for them,
+	 *	and we're not just making up the numbers to "min".
+	 */
+	if (spawn && (pool->state.num >= pool->min) && (pool->spare < (pool->max - pool->min))) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "%i of %u connections in use.  You may need to increase \"spare\"",
+			  pool->state.active, pool->state.num);
+	}
+
 	pthread_mutex_unlock(&pool->mutex);
 
 	if (!spawn) return NULL;
 
-	ROPTIONAL(RDEBUG2, DEBUG2, "%i of %u connections in use.  You  may need to increase \"spare\"",
-	       pool->state.active, pool->state.num);
-
 	/*
 	 *	Returns unlocked on failure, or locked on success
 	 */
@@ -880,6 +1394,8 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 
 do_return:
 	pool->state.active++;
+
+do_reuse:
 	this->num_uses++;
 	gettimeofday(&this->last_reserved, NULL);
 	this->in_use = true;
@@ -889,6 +1405,8 @@ do_return:
 #endif
 	pthread_mutex_unlock(&pool->mutex);
 
+	if (pool->thread_cache) fr_connection_thread_track(pool, this);
+
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
 
 	return this->connection;
@@ -1038,6 +1556,7 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	pthread_mutex_init(&pool->mutex, NULL);
 	pthread_cond_init(&pool->done_spawn, NULL);
 	pthread_cond_init(&pool->done_reconnecting, NULL);
+	pthread_mutex_init(&pool->thread_mutex, NULL);
 
 	DEBUG2("Initialising connection pool");
 
@@ -1086,6 +1605,25 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	 */
 	FR_TIMEVAL_BOUND_CHECK("connect_timeout", &pool->connect_timeout, >=, 0, 100000);
 
+	FR_INTEGER_BOUND_CHECK("thread_cache", pool->thread_cache, <=, pool->max);
+
+	/*
+	 *	Thread caches always reuse the connection the thread
+	 *	released last, which defeats the point of spreading.
+	 */
+	if (pool->spread && pool->thread_cache) {
+		WARN("Ignoring \"thread_cache = %u\", it cannot be used with \"spread = yes\"", pool->thread_cache);
+		pool->thread_cache = 0;
+	}
+
+	if (pool->thread_cache) {
+		if (pthread_key_create(&pool->thread_key, _fr_connection_thread_free) != 0) {
+			ERROR("%s: Failed creating thread cache key", __FUNCTION__);
+			goto error;
+		}
+		pool->thread_key_init = true;
+	}
+
 	/*
 	 *	Don't open any connections.  Instead, force the limits
 	 *	to only 1 connection.
@@ -1143,6 +1681,30 @@ fr_connection_pool_t *fr_connection_pool_copy(TALLOC_CTX *ctx, fr_connection_poo
  */
 fr_connection_pool_state_t const *fr_connection_pool_state(fr_connection_pool_t *pool)
 {
+	fr_connection_thread_t *thread;
+
+	if (!pool->thread_cache) return &pool->state;
+
+	/*
+	 *	Counters are kept per-thread so the fast path
+	 *	doesn't need the pool mutex.  Total them here.
+	 */
+	pthread_mutex_lock(&pool->thread_mutex);
+	pool->state.thread_caches = 0;
+	pool->state.thread_cached = 0;
+	pool->state.thread_hits = 0;
+	pool->state.thread_misses = 0;
+
+	for (thread = pool->threads; thread; thread = thread->next) {
+		pthread_mutex_lock(&thread->mutex);
+		pool->state.thread_caches++;
+		pool->state.thread_cached += thread->num_idle;
+		pool->state.thread_hits += thread->hits;
+		pool->state.thread_misses += thread->misses;
+		pthread_mutex_unlock(&thread->mutex);
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+
 	return &pool->state;
 }
 
@@ -1204,9 +1766,10 @@ void fr_connection_pool_reconnect_func(fr_connection_pool_t *pool, fr_connection
  */
 int fr_connection_pool_reconnect(fr_connection_pool_t *pool, REQUEST *request)
 {
-	uint32_t	i;
-	fr_connection_t	*this;
-	time_t		now;
+	uint32_t		i;
+	fr_connection_t		*this;
+	fr_connection_thread_t	*thread;
+	time_t			now;
 
 	pthread_mutex_lock(&pool->mutex);
 
@@ -1237,12 +1800,30 @@ int fr_connection_pool_reconnect(fr_connection_pool_t *pool, REQUEST *request)
 		fr_connection_close_internal(pool, request, this);
 	}
 
+	/*
+	 *	Connections idle in thread caches can be closed
+	 *	immediately.  Hold every thread cache while marking,
+	 *	as their owners check needs_reconnecting without
+	 *	the pool mutex.
+	 */
+	if (pool->thread_cache) {
+		fr_connection_thread_sweep(pool, request, 0, true);
+
+		pthread_mutex_lock(&pool->thread_mutex);
+		for (thread = pool->threads; thread; thread = thread->next) pthread_mutex_lock(&thread->mutex);
+	}
+
 	/*
 	 *	Mark all remaining connections in the pool as
 	 *	requiring reconnection.
 	 */
 	for (this = pool->head; this; this = this->next) this->needs_reconnecting = true;
 
+	if (pool->thread_cache) {
+		for (thread = pool->threads; thread; thread = thread->next) pthread_mutex_unlock(&thread->mutex);
+		pthread_mutex_unlock(&pool->thread_mutex);
+	}
+
 	/*
 	 *	Call the reconnect callback (if one's set)
 	 *	This may modify the opaque data associated
@@ -1289,7 +1870,8 @@ int fr_connection_pool_reconnect(fr_connection_pool_t *pool, REQUEST *request)
  */
 void fr_connection_pool_free(fr_connection_pool_t *pool)
 {
-	fr_connection_t *this;
+	fr_connection_t		*this;
+	fr_connection_thread_t	*thread;
 
 	if (!pool) return;
 
@@ -1306,6 +1888,28 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 
 	pthread_mutex_lock(&pool->mutex);
 
+	/*
+	 *	Stop thread exit handlers touching the pool, then
+	 *	discard the thread caches.  Connections reserved by
+	 *	threads are still in the connection list, and are
+	 *	closed below.
+	 */
+	if (pool->thread_key_init) {
+		pthread_key_delete(pool->thread_key);
+		pool->thread_key_init = false;
+	}
+
+	pthread_mutex_lock(&pool->thread_mutex);
+	while ((thread = pool->threads) != NULL) {
+		pool->threads = thread->next;
+
+		while (thread->num_idle > 0) fr_connection_thread_close(pool, NULL, thread->idle[--thread->num_idle]);
+
+		pthread_mutex_destroy(&thread->mutex);
+		talloc_free(thread);
+	}
+	pthread_mutex_unlock(&pool->thread_mutex);
+
 	/*
 	 *	Don't loop over the list.  Just keep removing the head
 	 *	until they're all gone.
@@ -1327,6 +1931,7 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 	pthread_mutex_destroy(&pool->mutex);
 	pthread_cond_destroy(&pool->done_spawn);
 	pthread_cond_destroy(&pool->done_reconnecting);
+	pthread_mutex_destroy(&pool->thread_mutex);
 
 	talloc_free(pool);
 }
@@ -1372,6 +1977,12 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
 	struct timeval	held;
 	bool trigger_min = false, trigger_max = false;
 
+	/*
+	 *	Keep the connection for this thread's next
+	 *	reservation if there's room.
+	 */
+	if (pool && pool->thread_cache && fr_connection_thread_release(pool, request, conn)) return;
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return;
 
@@ -1465,6 +2076,8 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void
 
 	if (!pool || !conn) return NULL;
 
+	if (pool->thread_cache) fr_connection_thread_forget(pool, conn);
+
 	/*
 	 *	If fr_connection_find is successful the pool is now locked
 	 */
@@ -1500,6 +2113,8 @@ int fr_connection_close(fr_connection_pool_t *pool, REQUEST *request, void *conn
 {
 	fr_connection_t *this;
 
+	if (pool && pool->thread_cache) fr_connection_thread_forget(pool, conn);
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return 0;
 
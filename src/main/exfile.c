@@ -30,21 +30,49 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-typedef struct exfile_entry_t {
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+typedef struct exfile_entry_t exfile_entry_t;
+
+struct exfile_entry_t {
 	int			fd;			//!< File descriptor associated with an entry.
-	int			dup;
 	uint32_t		hash;			//!< Hash for cheap comparison.
 	time_t			last_used;		//!< Last time the entry was used.
 	char			*filename;		//!< Filename.
-} exfile_entry_t;
 
+	exfile_entry_t		*prev;			//!< Previous entry in the LRU list.
+	exfile_entry_t		*next;			//!< Next entry in the LRU list, or the free list.
+};
+
+/** A subset of the file descriptors, with its own lock
+ *
+ * Files are assigned to a shard by the hash of their name.  The shard
+ * mutex is held from exfile_open() until exfile_close() or exfile_unlock(),
+ * so writers to files in different shards don't contend.
+ */
+typedef struct exfile_shard_t {
+	pthread_mutex_t		mutex;			//!< Held while a caller is writing to a file in the shard.
+	atomic_int		dup;			//!< Descriptor given to the current holder, or -1.
+	exfile_entry_t		*reserved;		//!< Entry the current holder is writing to.
+
+	fr_hash_table_t		*index;			//!< Open entries, indexed by filename.
+	exfile_entry_t		*head;			//!< Least recently used entry.
+	exfile_entry_t		*tail;			//!< Most recently used entry.
+	exfile_entry_t		*free;			//!< Unused entries.
+
+	exfile_entry_t		*entries;		//!< All entries for this shard.
+	_Atomic(time_t)		last_cleaned;		//!< Last time we closed idle entries.
+} exfile_shard_t;
 
 struct exfile_t {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
 	uint32_t		max_idle;		//!< Maximum idle time for a descriptor.
-	time_t			last_cleaned;
-	pthread_mutex_t		mutex;
-	exfile_entry_t		*entries;
+	uint32_t		num_shards;		//!< How many shards the entries are spread over.
+	exfile_shard_t		*shards;
 	bool			locking;
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
@@ -54,6 +82,8 @@ struct exfile_t {
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
 					//!< before giving up.
 
+#define MAX_SHARDS 16			//!< Upper bound on the number of shards.
+
 /** Send an exfile trigger.
  *
  * @param[in] ef to send trigger for.
@@ -94,37 +124,181 @@ static inline void exfile_trigger_exec(exfile_t *ef, REQUEST *request, exfile_en
 }
 
 
-static void exfile_cleanup_entry(exfile_t *ef, REQUEST *request, exfile_entry_t *entry)
+static uint32_t exfile_entry_hash(void const *data)
 {
-	TALLOC_FREE(entry->filename);
+	exfile_entry_t const *entry = data;
 
-	close(entry->fd);
+	return entry->hash;
+}
 
-	entry->hash = 0;
+static int exfile_entry_cmp(void const *one, void const *two)
+{
+	exfile_entry_t const *a = one;
+	exfile_entry_t const *b = two;
+
+	if (a->hash < b->hash) return -1;
+	if (a->hash > b->hash) return +1;
+
+	/*
+	 *	Hash comparisons are fast.  String comparisons are slow.
+	 *
+	 *	But we still need to do string comparisons if
+	 *	the hash matches, because 1/2^16 filenames
+	 *	will result in a hash collision.  And that's
+	 *	enough filenames in a long-running server to
+	 *	ensure that it happens.
+	 */
+	return strcmp(a->filename, b->filename);
+}
+
+/** Pick the shard for a filename hash
+ *
+ * Uses the high bits of the hash, as the hash table in the shard
+ * uses the low bits.
+ */
+static inline exfile_shard_t *exfile_shard(exfile_t *ef, uint32_t hash)
+{
+	return &ef->shards[((uint64_t) hash * ef->num_shards) >> 32];
+}
+
+/** Remove an entry from the LRU list
+ *
+ */
+static void exfile_entry_unlink(exfile_shard_t *shard, exfile_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		rad_assert(shard->head == entry);
+		shard->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		rad_assert(shard->tail == entry);
+		shard->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+/** Add an entry to the most recently used end of the LRU list
+ *
+ */
+static void exfile_entry_link(exfile_shard_t *shard, exfile_entry_t *entry)
+{
+	entry->next = NULL;
+	entry->prev = shard->tail;
+
+	if (shard->tail) {
+		shard->tail->next = entry;
+	} else {
+		shard->head = entry;
+	}
+	shard->tail = entry;
+}
+
+/** Close the file for an entry, and return the entry to the free list
+ *
+ * @note Called with the shard mutex held.
+ */
+static void exfile_cleanup_entry(exfile_t *ef, exfile_shard_t *shard, REQUEST *request, exfile_entry_t *entry)
+{
+	if (entry->filename) fr_hash_table_delete(shard->index, entry);
+	exfile_entry_unlink(shard, entry);
+
+	if (entry->fd >= 0) close(entry->fd);
 	entry->fd = -1;
-	entry->dup = -1;
 
 	/*
 	 *	Issue close trigger *after* we've closed the fd
 	 */
 	exfile_trigger_exec(ef, request, entry, "close");
+
+	TALLOC_FREE(entry->filename);
+	entry->hash = 0;
+
+	entry->next = shard->free;
+	shard->free = entry;
 }
 
+/** Close entries which haven't been used in max_idle seconds
+ *
+ * The LRU list is ordered by last use, so we only look at entries
+ * which have expired.
+ *
+ * @note Called with the shard mutex held.
+ */
+static void exfile_cleanup_idle(exfile_t *ef, exfile_shard_t *shard, REQUEST *request, time_t now)
+{
+	while (shard->head && ((shard->head->last_used + ef->max_idle) < now)) {
+		exfile_cleanup_entry(ef, shard, request, shard->head);
+	}
+
+	atomic_store_explicit(&shard->last_cleaned, now, memory_order_relaxed);
+}
+
+/** Release the shard held by the caller
+ *
+ * Idle entries are cleaned up here rather than in exfile_open(), so that
+ * it doesn't add to the time writers hold the mutex.  If another thread
+ * already has the mutex, we leave the cleanup to a later call.
+ */
+static void exfile_release(exfile_t *ef, exfile_shard_t *shard, REQUEST *request)
+{
+	time_t now;
+
+	exfile_trigger_exec(ef, request, shard->reserved, "release");
+
+	shard->reserved = NULL;
+	atomic_store(&shard->dup, -1);
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	now = time(NULL);
+	if (now <= (atomic_load_explicit(&shard->last_cleaned, memory_order_relaxed) + 1)) return;
+
+	if (pthread_mutex_trylock(&shard->mutex) != 0) return;
+	exfile_cleanup_idle(ef, shard, request, now);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Find the shard a descriptor returned by exfile_open() belongs to
+ *
+ * Each shard has at most one holder, and the holder's descriptor is
+ * unique while it's open, so there's at most one match.
+ */
+static exfile_shard_t *exfile_shard_by_fd(exfile_t *ef, int fd)
+{
+	uint32_t i;
+
+	if (fd < 0) return NULL;
+
+	for (i = 0; i < ef->num_shards; i++) {
+		if (atomic_load(&ef->shards[i].dup) == fd) return &ef->shards[i];
+	}
+
+	return NULL;
+}
 
 static int _exfile_free(exfile_t *ef)
 {
 	uint32_t i;
 
-	pthread_mutex_lock(&ef->mutex);
+	for (i = 0; i < ef->num_shards; i++) {
+		exfile_shard_t *shard = &ef->shards[i];
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+		if (!shard->index) break;
 
-		exfile_cleanup_entry(ef, NULL, &ef->entries[i]);
-	}
+		pthread_mutex_lock(&shard->mutex);
 
-	pthread_mutex_unlock(&ef->mutex);
-	pthread_mutex_destroy(&ef->mutex);
+		while (shard->head) exfile_cleanup_entry(ef, shard, NULL, shard->head);
+		fr_hash_table_free(shard->index);
+
+		pthread_mutex_unlock(&shard->mutex);
+		pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
@@ -142,29 +316,71 @@ static int _exfile_free(exfile_t *ef)
 exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle, bool locking)
 {
 	exfile_t *ef;
+	uint32_t i, j, per_shard;
+
+	if (!max_entries) return NULL;
 
 	ef = talloc_zero(NULL, exfile_t);
 	if (!ef) return NULL;
 
 	fr_talloc_link_ctx(ctx, ef);
 
-	ef->entries = talloc_zero_array(ef, exfile_entry_t, max_entries);
-	if (!ef->entries) {
-		talloc_free(ef);
-		return NULL;
-	}
+	ef->max_entries = max_entries;
+	ef->max_idle = max_idle;
+	ef->locking = locking;
+
+	/*
+	 *	Keep at least a few descriptors per shard, so that
+	 *	a hot shard doesn't thrash.
+	 */
+	ef->num_shards = max_entries / 8;
+	if (ef->num_shards < 1) ef->num_shards = 1;
+	if (ef->num_shards > MAX_SHARDS) ef->num_shards = MAX_SHARDS;
+	per_shard = (max_entries + ef->num_shards - 1) / ef->num_shards;
 
-	if (pthread_mutex_init(&ef->mutex, NULL) != 0) {
+	ef->shards = talloc_zero_array(ef, exfile_shard_t, ef->num_shards);
+	if (!ef->shards) {
 		talloc_free(ef);
 		return NULL;
 	}
 
-	ef->max_entries = max_entries;
-	ef->max_idle = max_idle;
-	ef->locking = locking;
-
 	talloc_set_destructor(ef, _exfile_free);
 
+	for (i = 0; i < ef->num_shards; i++) {
+		exfile_shard_t *shard = &ef->shards[i];
+
+		shard->entries = talloc_zero_array(ef->shards, exfile_entry_t, per_shard);
+		if (!shard->entries) {
+			talloc_free(ef);
+			return NULL;
+		}
+
+		for (j = 0; j < per_shard; j++) {
+			shard->entries[j].fd = -1;
+			shard->entries[j].next = shard->free;
+			shard->free = &shard->entries[j];
+		}
+
+		atomic_init(&shard->dup, -1);
+		atomic_init(&shard->last_cleaned, 0);
+
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+			talloc_free(ef);
+			return NULL;
+		}
+
+		/*
+		 *	Entries are allocated up front, so the
+		 *	index doesn't free them.
+		 */
+		shard->index = fr_hash_table_create(NULL, exfile_entry_hash, exfile_entry_cmp, NULL);
+		if (!shard->index) {
+			pthread_mutex_destroy(&shard->mutex);
+			talloc_free(ef);
+			return NULL;
+		}
+	}
+
 	return ef;
 }
 
@@ -210,99 +426,57 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
  */
 int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t permissions, bool append)
 {
-	int i, tries, unused = -1, found = -1, oldest = -1;
-	bool do_cleanup = false;
-	uint32_t hash;
-	time_t now = time(NULL);
-	struct stat st;
+	int		tries, fd;
+	uint32_t	hash;
+	time_t		now = time(NULL);
+	struct stat	st;
+	exfile_shard_t	*shard;
+	exfile_entry_t	*entry, my_entry;
 
 	if (!ef || !filename) return -1;
 
 	hash = fr_hash_string(filename);
-	unused = -1;
+	shard = exfile_shard(ef, hash);
 
-	pthread_mutex_lock(&ef->mutex);
+	my_entry.hash = hash;
+	memcpy(&my_entry.filename, &filename, sizeof(my_entry.filename));
 
-	if (now > (ef->last_cleaned + 1)) do_cleanup = true;
-
-	/*
-	 *	Find the matching entry, or an unused one.
-	 *
-	 *	Also track which entry is the oldest, in case there
-	 *	are no unused entries.
-	 */
-	for (i = 0; i < (int) ef->max_entries; i++) {
-		if (!ef->entries[i].filename) {
-			if (unused < 0) unused = i;
-			continue;
-		}
-
-		if ((oldest < 0) ||
-		    (ef->entries[i].last_used < ef->entries[oldest].last_used)) {
-			oldest = i;
-		}
-
-		/*
-		 *	Hash comparisons are fast.  String comparisons are slow.
-		 *
-		 *	But we still need to do string comparisons if
-		 *	the hash matches, because 1/2^16 filenames
-		 *	will result in a hash collision.  And that's
-		 *	enough filenames in a long-running server to
-		 *	ensure that it happens.
-		 */
-		if ((found < 0) &&
-		    (ef->entries[i].hash == hash) &&
-		    (strcmp(ef->entries[i].filename, filename) == 0)) {
-			found = i;
-
-			/*
-			 *	If we're not cleanin up, stop now.
-			 */
-			if (!do_cleanup) break;
-
-			/*
-			 *	If we are cleaning up, and only
-			 *	entries OTHER than the one we found,
-			 *	do so now.
-			 */
-		} else if (do_cleanup) {
-			if ((ef->entries[i].last_used + ef->max_idle) >= now) continue;
-
-			exfile_cleanup_entry(ef, request, &ef->entries[i]);
-		}
-	}
-
-	if (do_cleanup) ef->last_cleaned = now;
+	pthread_mutex_lock(&shard->mutex);
 
 	/*
 	 *	We found an existing entry, return that
 	 */
-	if (found >= 0) {
-		i = found;
+	entry = fr_hash_table_finddata(shard->index, &my_entry);
+	if (entry) {
+		exfile_entry_unlink(shard, entry);
+		exfile_entry_link(shard, entry);
 		goto do_return;
 	}
 
 	/*
 	 *	There are no unused entries, free the oldest one.
 	 */
-	if (unused < 0) {
-		exfile_cleanup_entry(ef, request, &ef->entries[oldest]);
-		unused = oldest;
-	}
+	if (!shard->free) exfile_cleanup_entry(ef, shard, request, shard->head);
 
 	/*
 	 *	Create a new entry.
 	 */
-	i = unused;
+	entry = shard->free;
+	shard->free = entry->next;
 
-	ef->entries[i].hash = hash;
-	ef->entries[i].filename = talloc_strdup(ef->entries, filename);
-	ef->entries[i].fd = -1;
-	ef->entries[i].dup = -1;
+	entry->hash = hash;
+	entry->filename = talloc_strdup(shard->entries, filename);
+	entry->fd = -1;
+	entry->last_used = now;
 
-	ef->entries[i].fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
-	if (ef->entries[i].fd < 0) {
+	exfile_entry_link(shard, entry);
+	if (!entry->filename || !fr_hash_table_insert(shard->index, entry)) {
+		fr_strerror_printf("Failed tracking file %s", filename);
+		goto error;
+	}
+
+	entry->fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
+	if (entry->fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
 
@@ -310,11 +484,12 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 		 *	Maybe the directory doesn't exist.  Try to
 		 *	create it.
 		 */
-		dir = talloc_strdup(ef, filename);
+		dir = talloc_strdup(NULL, filename);
 		if (!dir) goto error;
 		p = strrchr(dir, FR_DIR_SEP);
 		if (!p) {
 			fr_strerror_printf("No '/' in '%s'", filename);
+			talloc_free(dir);
 			goto error;
 		}
 		*p = '\0';
@@ -336,29 +511,29 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 		}
 		talloc_free(dir);
 
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
 		} /* else fall through to creating the rest of the entry */
 
-		exfile_trigger_exec(ef, request, &ef->entries[i], "create");
+		exfile_trigger_exec(ef, request, entry, "create");
 	} /* else the file was already opened */
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "open");
+	exfile_trigger_exec(ef, request, entry, "open");
 
 do_return:
 	/*
 	 *	Lock from the start of the file.
 	 */
-	if (lseek(ef->entries[i].fd, 0, SEEK_SET) < 0) {
+	if (lseek(entry->fd, 0, SEEK_SET) < 0) {
 		fr_strerror_printf("Failed to seek in file %s: %s", filename, strerror(errno));
 
 	error:
-		exfile_cleanup_entry(ef, request, &ef->entries[i]);
+		exfile_cleanup_entry(ef, shard, request, entry);
 
-		pthread_mutex_unlock(&(ef->mutex));
+		pthread_mutex_unlock(&shard->mutex);
 		return -1;
 	}
 
@@ -370,16 +545,16 @@ do_return:
 	 */
 	if (ef->locking) {
 		for (tries = 0; tries < MAX_TRY_LOCK; tries++) {
-			if (rad_lockfd_nonblock(ef->entries[i].fd, 0) >= 0) break;
+			if (rad_lockfd_nonblock(entry->fd, 0) >= 0) break;
 
 			if (errno != EAGAIN) {
 				fr_strerror_printf("Failed to lock file %s: %s", filename, strerror(errno));
 				goto error;
 			}
 
-			close(ef->entries[i].fd);
-			ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-			if (ef->entries[i].fd < 0) {
+			close(entry->fd);
+			entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+			if (entry->fd < 0) {
 				fr_strerror_printf("Failed to open file %s: %s",
 						   filename, strerror(errno));
 				goto error;
@@ -396,15 +571,15 @@ do_return:
 	 *	Maybe someone deleted the file while we were waiting
 	 *	for the lock.  If so, re-open it.
 	 */
-	if (fstat(ef->entries[i].fd, &st) < 0) {
+	if (fstat(entry->fd, &st) < 0) {
 		fr_strerror_printf("Failed to stat file %s: %s", filename, strerror(errno));
 		goto error;
 	}
 
 	if (st.st_nlink == 0) {
-		close(ef->entries[i].fd);
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		close(entry->fd);
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
@@ -415,21 +590,23 @@ do_return:
 	 *	Seek to the end of the file before returning the FD to
 	 *	the caller.
 	 */
-	if (append) lseek(ef->entries[i].fd, 0, SEEK_END);
+	if (append) lseek(entry->fd, 0, SEEK_END);
 
 	/*
-	 *	Return holding the mutex for the entry.
+	 *	Return holding the mutex for the shard.
 	 */
-	ef->entries[i].last_used = now;
-	ef->entries[i].dup = dup(ef->entries[i].fd);
-	if (ef->entries[i].dup < 0) {
+	entry->last_used = now;
+	fd = dup(entry->fd);
+	if (fd < 0) {
 		fr_strerror_printf("Failed calling dup(): %s", strerror(errno));
 		goto error;
 	}
+	shard->reserved = entry;
+	atomic_store(&shard->dup, fd);
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "reserve");
+	exfile_trigger_exec(ef, request, entry, "reserve");
 
-	return ef->entries[i].dup;
+	return fd;
 }
 
 /** Close the log file.  Really just return it to the pool.
@@ -447,31 +624,30 @@ do_return:
  */
 int exfile_close(exfile_t *ef, REQUEST *request, int fd)
 {
-	uint32_t i;
-
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
-
-		/*
-		 *	Unlock the bytes that we had previously locked.
-		 */
-		if (ef->entries[i].dup == fd) {
-			if (ef->locking) (void) rad_unlockfd(ef->entries[i].dup, 0);
-			close(ef->entries[i].dup); /* releases the fcntl lock */
-			ef->entries[i].dup = -1;
+	exfile_shard_t *shard;
 
-			pthread_mutex_unlock(&(ef->mutex));
+	shard = exfile_shard_by_fd(ef, fd);
+	if (!shard) {
+		fr_strerror_printf("Attempt to unlock file which is not tracked");
+		return -1;
+	}
 
-			exfile_trigger_exec(ef, request, &ef->entries[i], "release");
+	/*
+	 *	Forget the descriptor before closing it.  Once it's
+	 *	closed, the same number may be handed out to a
+	 *	holder of another shard.
+	 */
+	atomic_store(&shard->dup, -1);
 
-			return 0;
-		}
-	}
+	/*
+	 *	Unlock the bytes that we had previously locked.
+	 */
+	if (ef->locking) (void) rad_unlockfd(fd, 0);
+	close(fd); /* releases the fcntl lock */
 
-	pthread_mutex_unlock(&(ef->mutex));
+	exfile_release(ef, shard, request);
 
-	fr_strerror_printf("Attempt to unlock file which is not tracked");
-	return -1;
+	return 0;
 }
 
 /** Unlock the file, but leave the dup'd file descriptor open
@@ -479,24 +655,15 @@ int exfile_close(exfile_t *ef, REQUEST *request, int fd)
  */
 int exfile_unlock(exfile_t *ef, REQUEST *request, int fd)
 {
-	uint32_t i;
-
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
-
-		if (ef->entries[i].dup == fd) {
-			ef->entries[i].dup = -1;
-
-			pthread_mutex_unlock(&(ef->mutex));
+	exfile_shard_t *shard;
 
-			exfile_trigger_exec(ef, request, &ef->entries[i], "release");
-
-			return 0;
-		}
+	shard = exfile_shard_by_fd(ef, fd);
+	if (!shard) {
+		fr_strerror_printf("Attempt to unlock file which does not exist");
+		return -1;
 	}
 
-	pthread_mutex_unlock(&(ef->mutex));
+	exfile_release(ef, shard, request);
 
-	fr_strerror_printf("Attempt to unlock file which does not exist");
-	return -1;
+	return 0;
 }
@@ -1657,8 +1657,8 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #endif
 
-	if (fr_radius_packet_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (fr_radius_packet_send_key(request->reply, request->packet,
+			   &request->client->secret_key) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1697,8 +1697,8 @@ static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #  endif
 
-	if (fr_radius_packet_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (fr_radius_packet_send_key(request->reply, request->packet,
+			   &request->client->secret_key) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1719,8 +1719,8 @@ static int proxy_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *requ
 	rad_assert(request->proxy->listener == listener);
 	rad_assert(listener->send == proxy_socket_send);
 
-	if (fr_radius_packet_send(request->proxy->packet, NULL,
-			   request->proxy->home_server->secret) < 0) {
+	if (fr_radius_packet_send_key(request->proxy->packet, NULL,
+			   &request->proxy->home_server->secret_key) < 0) {
 		RERROR("Failed sending proxied request: %s",
 			       fr_strerror());
 		return -1;
@@ -2429,7 +2429,7 @@ static int client_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
 	if (!request->reply->code) return 0;
 
-	if (fr_radius_packet_encode(request->reply, request->packet, request->client->secret) < 0) {
+	if (fr_radius_packet_encode_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 		RPERROR("Failed encoding packet");
 
 		return -1;
@@ -2440,7 +2440,7 @@ static int client_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 			request->reply->data_len, MAX_PACKET_LEN);
 	}
 
-	if (fr_radius_packet_sign(request->reply, request->packet, request->client->secret) < 0) {
+	if (fr_radius_packet_sign_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 		RPERROR("Failed signing packet");
 
 		return -1;
@@ -2456,8 +2456,8 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	listen_socket_t *sock;
 #endif
 
-	if (fr_radius_packet_verify(request->packet, NULL,
-			     request->client->secret) < 0) {
+	if (fr_radius_packet_verify_key(request->packet, NULL,
+			     &request->client->secret_key) < 0) {
 		if (request->reply) request->reply->id = -1;
 		return -1;
 	}
@@ -2482,14 +2482,14 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	}
 #endif
 
-	return fr_radius_packet_decode(request->packet, NULL,
-				request->client->secret);
+	return fr_radius_packet_decode_key(request->packet, NULL,
+				&request->client->secret_key);
 }
 
 #ifdef WITH_PROXY
 static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
-	if (fr_radius_packet_encode(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
+	if (fr_radius_packet_encode_key(request->proxy->packet, NULL, &request->proxy->home_server->secret_key) < 0) {
 		RPERROR("Failed encoding proxied packet");
 
 		return -1;
@@ -2500,7 +2500,7 @@ static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 			request->proxy->packet->data_len, MAX_PACKET_LEN);
 	}
 
-	if (fr_radius_packet_sign(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
+	if (fr_radius_packet_sign_key(request->proxy->packet, NULL, &request->proxy->home_server->secret_key) < 0) {
 		RPERROR("Failed signing proxied packet");
 
 		return -1;
@@ -2516,8 +2516,8 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	 *	fr_radius_packet_verify is run in event.c, received_proxy_response()
 	 */
 
-	return fr_radius_packet_decode(request->proxy->reply, request->proxy->packet,
-				request->proxy->home_server->secret);
+	return fr_radius_packet_decode_key(request->proxy->reply, request->proxy->packet,
+				&request->proxy->home_server->secret_key);
 }
 #endif
 
@@ -465,20 +465,8 @@ void paircompare_unregister_instance(void *instance)
 	}
 }
 
-/** Compare two pair lists except for the password information.
- *
- * For every element in "check" at least one matching copy must be present
- * in "reply".
- *
- * @param[in] request Current request.
- * @param[in] req_list request valuepairs.
- * @param[in] check Check/control valuepairs.
- * @param[in,out] rep_list Reply value pairs.
- *
- * @return 0 on match.
- */
-int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
-		VALUE_PAIR **rep_list)
+static int paircompare_list(REQUEST *request, VALUE_PAIR *req_list, fr_pair_list_index_t *index,
+			    VALUE_PAIR *check, VALUE_PAIR **rep_list)
 {
 	vp_cursor_t cursor;
 	VALUE_PAIR *check_item;
@@ -542,6 +530,7 @@ int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
 		first_only = otherattr(check_item->da, &from);
 
 		auth_item = req_list;
+		if (index && from && !first_only) auth_item = fr_pair_list_index_find(index, from, TAG_ANY);
 	try_again:
 		if (!first_only) {
 			while (auth_item != NULL) {
@@ -642,6 +631,43 @@ int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
 	return result;
 }
 
+/** Compare two pair lists except for the password information.
+ *
+ * For every element in "check" at least one matching copy must be present
+ * in "reply".
+ *
+ * @param[in] request Current request.
+ * @param[in] req_list request valuepairs.
+ * @param[in] check Check/control valuepairs.
+ * @param[in,out] rep_list Reply value pairs.
+ *
+ * @return 0 on match.
+ */
+int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
+		VALUE_PAIR **rep_list)
+{
+	return paircompare_list(request, req_list, NULL, check, rep_list);
+}
+
+/** Compare two pair lists except for the password information, using an index
+ *
+ * As paircompare(), but the request attributes are found using an
+ * index, rather than by walking the list.  This is for callers which
+ * compare many check lists against the same request list.
+ *
+ * @param[in] request Current request.
+ * @param[in] index of the request valuepairs.
+ * @param[in] check Check/control valuepairs.
+ * @param[in,out] rep_list Reply value pairs.
+ *
+ * @return 0 on match.
+ */
+int paircompare_index(REQUEST *request, fr_pair_list_index_t *index, VALUE_PAIR *check,
+		      VALUE_PAIR **rep_list)
+{
+	return paircompare_list(request, fr_pair_list_index_head(index), index, check, rep_list);
+}
+
 /** Expands an attribute marked with fr_pair_mark_xlat
  *
  * Writes the new value to the vp.
@@ -2374,7 +2374,7 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 	 *	ignore it.  This does the MD5 calculations in the
 	 *	server core, but I guess we can fix that later.
 	 */
-	if (!proxy->reply && (fr_radius_packet_verify(reply, proxy->packet, proxy->home_server->secret) != 0)) {
+	if (!proxy->reply && (fr_radius_packet_verify_key(reply, proxy->packet, &proxy->home_server->secret_key) != 0)) {
 		RWDEBUG("Discarding invalid reply from host %s port %d - ID: %d: %s",
 			inet_ntop(reply->src_ipaddr.af, &reply->src_ipaddr.addr, buffer, sizeof(buffer)),
 			reply->src_port, reply->id, fr_strerror());
@@ -5193,6 +5193,15 @@ int radius_event_init(TALLOC_CTX *ctx)
 	el = fr_event_list_alloc(ctx, event_status, NULL);
 	if (!el) return 0;
 
+	/*
+	 *	Every request has cleanup, proxy and max_request_time
+	 *	timers, so there are a lot of them.
+	 */
+	if (fr_event_list_timer_wheel(el) < 0) {
+		ERROR("Failed creating timer wheel: %s", fr_strerror());
+		return 0;
+	}
+
 #ifdef HAVE_SYSTEMD_WATCHDOG
 	if (sd_watchdog_interval.tv_sec || sd_watchdog_interval.tv_usec) {
 		struct timeval now;
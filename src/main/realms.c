@@ -474,6 +474,14 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
 	if (parent && strcmp(cf_section_name1(parent), "server") == 0) {
 		home->parent_server = cf_section_name2(parent);
 	}
+
+	/*
+	 *	Hash the secret once, instead of once per packet.
+	 */
+	if (home->secret) {
+		fr_md5_key_init(&home->secret_key, (uint8_t const *) home->secret,
+				talloc_array_length(home->secret) - 1);
+	}
 }
 
 /** Insert a new home server into the various internal lookup trees
@@ -663,7 +671,7 @@ home_server_t *home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SE
 			goto error;
 		}
 
-		home->secret = "";
+		home->secret = talloc_typed_strdup(home, "");
 		home->log_name = talloc_typed_strdup(home, home->server);
 	/*
 	 *	Otherwise it's an invalid config section and we
@@ -814,7 +822,7 @@ home_server_t *home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SE
 	if (!home->secret) {
 #ifdef WITH_TLS
 		if (tls && (home->proto == IPPROTO_TCP)) {
-			home->secret = "radsec";
+			home->secret = talloc_typed_strdup(home, "radsec");
 		} else
 #endif
 		{
@@ -1482,6 +1490,11 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 		home->cs = cs;
 		home->proto = IPPROTO_UDP;
 
+		if (secret) {
+			fr_md5_key_init(&home->secret_key, (uint8_t const *) secret,
+					talloc_array_length(secret) - 1);
+		}
+
 		p = strchr(name, ':');
 		if (!p) {
 			if (type == HOME_TYPE_AUTH) {
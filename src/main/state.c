@@ -50,6 +50,12 @@ RCSID("$Id$")
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -106,16 +112,33 @@ typedef struct state_entry {
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
 } fr_state_entry_t;
 
-struct fr_state_tree_t {
-	uint64_t		id;				//!< Next ID to assign.
+/** Number of shards in a state tree
+ *
+ * Must be a power of 2.
+ */
+#define STATE_TREE_SHARDS	(32)
+
+/** A slice of the state tree, with its own lock, index and expiry list
+ *
+ */
+typedef struct state_shard {
+	uint64_t		id;				//!< Number of entries created in this shard.
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_hash_table_t		*hash;				//!< Hash table used to lookup state value.
 
 	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
-	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} fr_state_shard_t;
+
+struct fr_state_tree_t {
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
+
+	atomic_uint_fast32_t	num_entries;			//!< Number of entries in all the shards.
+
+	fr_state_shard_t	shard[STATE_TREE_SHARDS];	//!< Entries are spread over the shards by the
+								//!< random component of their state value.
 };
 
 fr_state_tree_t *global_state = NULL;
@@ -123,7 +146,17 @@ fr_state_tree_t *global_state = NULL;
 #define PTHREAD_MUTEX_LOCK if (main_config.spawn_workers) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (main_config.spawn_workers) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
+
+/** Hash a fr_state_entry_t based on its state value
+ *
+ */
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
+
+	return fr_hash(entry->state, sizeof(entry->state));
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -136,34 +169,57 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard an entry belongs in
+ *
+ * r_5 is random, isn't touched by the server hash, and is carried over
+ * from one round to the next, so all entries for an authentication
+ * session normally land in the same shard.
+ *
+ * We don't use bits from the hash, as then all entries in a shard
+ * would share the same hash buckets.
+ */
+static inline fr_state_shard_t *state_entry_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	return &state->shard[entry->state_comp.r_5 & (STATE_TREE_SHARDS - 1)];
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
 	fr_state_entry_t *this;
-
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
+	fr_state_shard_t *shard;
+	int i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		shard = &state->shard[i];
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+		/*
+		 *	Partially initialised tree.
+		 */
+		if (!shard->hash) break;
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+		if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(state, shard, this);
+			talloc_free(this);
+		}
+
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+
+		/*
+		 *	Free the hash table
+		 */
+		fr_hash_table_free(shard->hash);
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -180,6 +236,7 @@ static int _state_tree_free(fr_state_tree_t *state)
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
 	fr_state_tree_t *state;
+	int i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -196,31 +253,59 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 */
 	fr_talloc_link_ctx(ctx, state);
 
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	talloc_set_destructor(state, _state_tree_free);
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+	atomic_init(&state->num_entries, 0);
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
+
+		if (main_config.spawn_workers && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash table, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->hash = fr_hash_table_create(NULL, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->hash) {
+			if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
 }
 
-/** Unlink an entry and remove if from the tree
+/** Reserve room for another entry
+ *
+ * max_sessions applies to the tree as a whole, not to each shard, so a busy
+ * shard can use capacity the others aren't using.  The count is only touched
+ * when entries are created and freed, so the shards don't contend on it the
+ * way they would on a lock.
+ *
+ * @return
+ *	- true if there's room.
+ *	- false if we're tracking max_sessions already.
+ */
+static bool state_entry_reserve(fr_state_tree_t *state)
+{
+	if (atomic_fetch_add_explicit(&state->num_entries, 1, memory_order_relaxed) < state->max_sessions) return true;
+
+	atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
+
+	return false;
+}
+
+/** Unlink an entry and remove if from the shard
  *
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -228,28 +313,28 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	fr_hash_table_delete(shard->hash, entry);
+	atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
-
 /** Frees any data associated with a state
  *
  */
@@ -288,85 +373,32 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Create a new state entry, and transfer the request's state to it
  *
- * @note Called with the mutex held.
+ * @note Called with the mutex free.
+ *
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		the state and persistable data belong to.
+ * @param[in] packet		to add the State attribute to.
+ * @param[in] data		persistable request data to store.
+ * @param[in] old_state		value of the previous State, or NULL if this is the
+ *				first round.
+ * @param[in] old_tries		number of rounds in the previous state entry.
+ * @return
+ *	- The new entry.
+ *	- NULL if we're tracking too many sessions, or on error.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet,
+					    request_data_t *data, uint8_t const *old_state, int old_tries)
 {
 	size_t			i;
 	uint32_t		x;
 	time_t			now = time(NULL);
 	VALUE_PAIR		*vp;
+	fr_state_shard_t	*shard;
 	fr_state_entry_t	*entry, *next;
 	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
 
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
-
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = state->head; entry != NULL; entry = next) {
-		next = entry->next;
-
-		if (entry == old) continue;
-
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			*free_next = entry;
-			free_next = &(entry->next);
-			state->timed_out++;
-			continue;
-		}
-
-		break;
-	}
-
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (!old->data) {
-			state_entry_unlink(state, old);
-			*free_next = old;
-		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	for (next = free_head; next;) {
-		entry = next;
-		next = entry->next;
-		talloc_free(entry);
-	}
-
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
@@ -375,12 +407,8 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	we can't do it now due to thread safety issues with talloc.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -408,7 +436,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (!old) {
+		if (!old_state) {
 			for (i = 0; i < sizeof(entry->state) / sizeof(x); i++) {
 				x = fr_rand();
 				memcpy(entry->state + (i * 4), &x, sizeof(x));
@@ -443,21 +471,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		fr_pair_add(&packet->vps, vp);
 	}
 
-	if (DEBUG_ENABLED4) {
-		char hex[(sizeof(entry->state) * 2) + 1];
-
-		fr_bin2hex(hex, entry->state, sizeof(entry->state));
-
-		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
-		       entry->id, hex, (uint64_t)entry->cleanup - now);
-	}
-
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t)state->max_sessions) {
-		talloc_free(entry);
-		return NULL;
-	}
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -466,52 +479,146 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(request->server);
 
-	if (!rbtree_insert(state->tree, entry)) {
-		talloc_free(entry);
-		return NULL;
+	shard = state_entry_shard(state, entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	for (next = shard->head; next != NULL;) {
+		fr_state_entry_t *this = next;
+
+		next = this->next;
+
+		/*
+		 *	The list is ordered by cleanup time, so
+		 *	we can stop at the first live entry.
+		 */
+		if (this->cleanup >= now) break;
+
+		state_entry_unlink(state, shard, this);
+		*free_next = this;
+		free_next = &(this->next);
+		shard->timed_out++;
+	}
+
+	if (!state_entry_reserve(state)) {
+	full:
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		*free_next = entry;
+		entry = NULL;
+		goto done;
+	}
+
+	if (!fr_hash_table_insert(shard->hash, entry)) {
+		atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
+		goto full;
 	}
 
+	/*
+	 *	IDs are unique across shards.
+	 */
+	entry->id = (shard->id++ * STATE_TREE_SHARDS) + (shard - state->shard);
+
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	if (!state->head) {
+	if (!shard->head) {
 		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
+		shard->head = shard->tail = entry;
 	} else {
-		rad_assert(state->tail != NULL);
+		rad_assert(shard->tail != NULL);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
 
 		entry->next = NULL;
-		state->tail = entry;
+		shard->tail = entry;
+	}
+
+	rad_assert(request->state_ctx);
+
+	entry->seq_start = request->seq_start;
+	entry->ctx = request->state_ctx;
+	entry->vps = request->state;
+	entry->data = data;
+
+	request->state_ctx = NULL;
+	request->state = NULL;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (DEBUG_ENABLED4) {
+		char hex[(sizeof(entry->state) * 2) + 1];
+
+		fr_bin2hex(hex, entry->state, sizeof(entry->state));
+
+		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
+		       entry->id, hex, (uint64_t)entry->cleanup - now);
+	}
+
+done:
+	/*
+	 *	Now free the unlinked entries.
+	 *
+	 *	We do it here as freeing may involve significantly more
+	 *	work than just freeing the data.
+	 *
+	 *	If there's request data that was persisted it will now
+	 *	be freed also, and it may have complex destructors associated
+	 *	with it.
+	 */
+	for (next = free_head; next;) {
+		fr_state_entry_t *this = next;
+
+		next = this->next;
+		talloc_free(this);
 	}
 
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Build the lookup key for the State attribute in a packet
  *
+ * @param[out] key	to populate.
+ * @param[in] state	tree the entry would be in.
+ * @param[in] request	the packet belongs to.
+ * @param[in] packet	containing the State attribute.
+ * @return
+ *	- The shard to search, which must be locked before calling #state_entry_find.
+ *	- NULL if the packet has no valid State attribute.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
+static fr_state_shard_t *state_entry_key(fr_state_entry_t *key, fr_state_tree_t *state,
+					 REQUEST *request, RADIUS_PACKET *packet)
 {
 	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
 	if (!vp) return NULL;
 
-	if (vp->vp_length != sizeof(my_entry.state)) return NULL;
+	if (vp->vp_length != sizeof(key->state)) return NULL;
 
-	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
+	memcpy(key->state, vp->vp_octets, sizeof(key->state));
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(request->server);
+	key->state_comp.server_hash ^= fr_hash_string(request->server);
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	return state_entry_shard(state, key);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
+
+	entry = fr_hash_table_finddata(shard->hash, key);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -523,16 +630,20 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
-	fr_state_entry_t *entry;
+	fr_state_entry_t *entry, my_entry;
+	fr_state_shard_t *shard;
+
+	shard = state_entry_key(&my_entry, state, request, original);
+	if (!shard) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, original);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -559,7 +670,8 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry;
+	fr_state_entry_t *entry, my_entry;
+	fr_state_shard_t *shard;
 	TALLOC_CTX *old_ctx = NULL;
 
 	rad_assert(request->state == NULL);
@@ -573,23 +685,26 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	shard = state_entry_key(&my_entry, state, request, packet);
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
 
-	entry = state_entry_find(state, request, packet);
-	if (entry) {
-		if (request->state_ctx) old_ctx = request->state_ctx;
+		entry = state_entry_find(shard, &my_entry);
+		if (entry) {
+			if (request->state_ctx) old_ctx = request->state_ctx;
 
-		request->seq_start = entry->seq_start;
-		request->state_ctx = entry->ctx;
-		request->state = entry->vps;
-		request_data_restore(request, entry->data);
+			request->seq_start = entry->seq_start;
+			request->state_ctx = entry->ctx;
+			request->state = entry->vps;
+			request_data_restore(request, entry->data);
 
-		entry->ctx = NULL;
-		entry->vps = NULL;
-		entry->data = NULL;
-	}
+			entry->ctx = NULL;
+			entry->vps = NULL;
+			entry->data = NULL;
+		}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -617,9 +732,14 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
+	fr_state_entry_t *old = NULL, old_key;
+	fr_state_shard_t *shard = NULL;
 	request_data_t *data;
 
+	uint8_t old_state[sizeof(old_key.state)];
+	int old_tries = 0;
+	bool have_old = false;
+
 	request_data_by_persistance(&data, request, true);
 
 	if (!request->state && !data) return true;
@@ -629,29 +749,44 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	if (original) shard = state_entry_key(&old_key, state, request, original);
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+		old = state_entry_find(shard, &old_key);
+		if (old) {
+			have_old = true;
+
+			/*
+			 *	Record the information from the old state, we may
+			 *	base the new state off the old one.
+			 *
+			 *	Once we release the mutex, the state of old becomes
+			 *	indeterminate so we have to grab the values now.
+			 */
+			old_tries = old->tries;
+			memcpy(old_state, old->state, sizeof(old_state));
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (!old->data) {
+				state_entry_unlink(state, shard, old);
+			} else {
+				old = NULL;
+			}
+		}
 
-	old = original ? state_entry_find(state, request, original) :
-			 NULL;
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	entry = state_entry_create(state, request, packet, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return false;
+		/*
+		 *	Free it outside of the mutex, as there may
+		 *	be significant work in the destructors.
+		 */
+		if (old) talloc_free(old);
 	}
 
-	rad_assert(entry->ctx == NULL);
-	rad_assert(request->state_ctx);
-
-	entry->seq_start = request->seq_start;
-	entry->ctx = request->state_ctx;
-	entry->vps = request->state;
-	entry->data = data;
-
-	request->state_ctx = NULL;
-	request->state = NULL;
-
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (!state_entry_create(state, request, packet, data, have_old ? old_state : NULL, old_tries)) return false;
 
 	rad_assert(request->state == NULL);
 	VERIFY_REQUEST(request);
@@ -663,7 +798,16 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	uint64_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&state->shard[i].mutex);
+		total += state->shard[i].id;
+		PTHREAD_MUTEX_UNLOCK(&state->shard[i].mutex);
+	}
+
+	return total;
 }
 
 /** Return number of entries that timed out
@@ -671,7 +815,16 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&state->shard[i].mutex);
+		total += state->shard[i].timed_out;
+		PTHREAD_MUTEX_UNLOCK(&state->shard[i].mutex);
+	}
+
+	return total;
 }
 
 /** Return number of entries we're currently tracking
@@ -679,5 +832,14 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	uint32_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&state->shard[i].mutex);
+		total += (uint32_t) fr_hash_table_num_elements(state->shard[i].hash);
+		PTHREAD_MUTEX_UNLOCK(&state->shard[i].mutex);
+	}
+
+	return total;
 }
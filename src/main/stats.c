@@ -518,6 +518,25 @@ void request_stats_reply(REQUEST *request)
 		vp = radius_pair_create(request->reply, &request->reply->vps,
 				       PW_FREERADIUS_STATS_HUP_TIME, VENDORPEC_FREERADIUS);
 		if (vp) vp->vp_date = hup_time.tv_sec;
+
+		{
+			uint32_t queue_len, queue_max, pps_in, pps_out;
+
+			thread_pool_queue_stats(&queue_len, &queue_max, &pps_in, &pps_out);
+
+			vp = radius_pair_create(request->reply, &request->reply->vps,
+					       PW_FREERADIUS_QUEUE_LEN_INTERNAL, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_uint32 = queue_len;
+			vp = radius_pair_create(request->reply, &request->reply->vps,
+					       PW_FREERADIUS_QUEUE_PPS_IN, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_uint32 = pps_in;
+			vp = radius_pair_create(request->reply, &request->reply->vps,
+					       PW_FREERADIUS_QUEUE_PPS_OUT, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_uint32 = pps_out;
+			vp = radius_pair_create(request->reply, &request->reply->vps,
+					       PW_FREERADIUS_QUEUE_USE_PERCENTAGE, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_uint32 = queue_max ? ((uint64_t) queue_len * 100) / queue_max : 0;
+		}
 	}
 
 	/*
@@ -29,6 +29,13 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/io/atomic_queue.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
 #ifdef HAVE_SYS_WAIT_H
 #  include <sys/wait.h>
@@ -77,6 +84,9 @@ typedef struct THREAD_HANDLE {
 
 	pthread_mutex_t		backlog_mutex;
 	fr_heap_t		*backlog;
+
+	atomic_bool		sleeping;	//!< waiting for a request, and needs to be woken up.
+	atomic_bool		in_idle;	//!< in the pools "idle" queue.
 } THREAD_HANDLE;
 
 #endif	/* WITH_GCD */
@@ -132,6 +142,21 @@ typedef struct THREAD_POOL {
 #endif
 
 	char const	*queue_priority;
+	char const	*dispatch;
+
+	/*
+	 *	For dispatch = atomic.  Sleeping threads put themselves
+	 *	into the idle queue.  The main thread takes a thread
+	 *	from there, or picks the next busy thread in turn, and
+	 *	only signals a thread if it's asleep.
+	 */
+	bool		atomic_dispatch;
+	fr_atomic_queue_t *idle;
+	THREAD_HANDLE	*next_thread;
+
+	atomic_uint_fast32_t	num_enqueued;	//!< requests given to worker threads
+	atomic_uint_fast32_t	num_processed;	//!< requests run by worker threads
+	atomic_uint_fast32_t	num_wakeups;	//!< signals sent to worker threads
 
 	/*
 	 *	To ensure only one thread at a time touches the scheduler.
@@ -179,6 +204,7 @@ static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_POINTER("cleanup_delay", FR_TYPE_UINT32, &thread_pool.cleanup_delay), .dflt = "5" },
 	{ FR_CONF_POINTER("max_queue_size", FR_TYPE_UINT32, &thread_pool.max_queue_size), .dflt = "65536" },
 	{ FR_CONF_POINTER("queue_priority", FR_TYPE_STRING, &thread_pool.queue_priority), .dflt = NULL },
+	{ FR_CONF_POINTER("dispatch", FR_TYPE_STRING, &thread_pool.dispatch), .dflt = NULL },
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
 	{ FR_CONF_POINTER("auto_limit_acct", FR_TYPE_BOOL, &thread_pool.auto_limit_acct) },
@@ -255,6 +281,73 @@ static void link_list_tail(THREAD_HANDLE **head_p, THREAD_HANDLE **tail_p, THREA
 	}
 }
 
+/*
+ *	Find a thread for a request, in constant time.
+ *
+ *	Prefer a thread which is asleep.  The idle queue may contain
+ *	threads which have since woken up on their own, so we skip
+ *	those.  If all threads are busy, take the less loaded of the
+ *	next two threads in turn.
+ */
+static THREAD_HANDLE *thread_select(void)
+{
+	THREAD_HANDLE *thread, *next;
+	void *data;
+
+	while (fr_atomic_queue_pop(thread_pool.idle, &data)) {
+		thread = data;
+
+		atomic_store(&thread->in_idle, false);
+		if (atomic_load(&thread->sleeping)) return thread;
+	}
+
+	thread = thread_pool.next_thread;
+	if (!thread) thread = thread_pool.thread_head;
+
+	next = thread->next;
+	if (!next) next = thread_pool.thread_head;
+
+	thread_pool.next_thread = next->next;
+
+	if (fr_heap_num_elements(next->backlog) < fr_heap_num_elements(thread->backlog)) return next;
+
+	return thread;
+}
+
+/*
+ *	Tell the main thread that we're about to sleep.
+ *
+ *	Returns false if the main thread has queued a request for us
+ *	in the mean time, in which case we shouldn't sleep.
+ */
+static bool thread_sleep(THREAD_HANDLE *thread)
+{
+	bool in_idle = false;
+	uint32_t num_elements;
+
+	atomic_store(&thread->sleeping, true);
+
+	if (atomic_compare_exchange_strong(&thread->in_idle, &in_idle, true) &&
+	    !fr_atomic_queue_push(thread_pool.idle, thread)) {
+		atomic_store(&thread->in_idle, false);
+	}
+
+	/*
+	 *	The main thread adds requests to the backlog before
+	 *	checking if we're asleep.  We check the backlog after
+	 *	saying that we're asleep.  So one of us will always
+	 *	see the other.
+	 */
+	pthread_mutex_lock(&thread->backlog_mutex);
+	num_elements = fr_heap_num_elements(thread->backlog);
+	pthread_mutex_unlock(&thread->backlog_mutex);
+
+	if (num_elements == 0) return true;
+
+	atomic_store(&thread->sleeping, false);
+	return false;
+}
+
 /*
  *	Add a request to the list of waiting requests.
  *	This function gets called ONLY from the main handler thread...
@@ -292,6 +385,30 @@ void request_enqueue(REQUEST *request)
 	request->child_state = REQUEST_QUEUED;
 	request->module = "<queue>";
 
+	atomic_fetch_add_explicit(&thread_pool.num_enqueued, 1, memory_order_relaxed);
+
+	if (thread_pool.atomic_dispatch) {
+		thread = thread_select();
+		DEBUG3("Thread %d being assigned a request", thread->thread_num);
+
+		pthread_mutex_lock(&thread->backlog_mutex);
+		fr_heap_insert(thread->backlog, request);
+		request->backlog = thread->backlog;
+		request->thread_ctx = thread;
+		pthread_mutex_unlock(&thread->backlog_mutex);
+
+		/*
+		 *	Only signal the thread if it's asleep.  If
+		 *	it's awake, it will drain the backlog the next
+		 *	time around it's loop.
+		 */
+		if (atomic_exchange(&thread->sleeping, false)) {
+			atomic_fetch_add_explicit(&thread_pool.num_wakeups, 1, memory_order_relaxed);
+			(void) write(thread->pipe_fd[1], &data, 1);
+		}
+		return;
+	}
+
 	found = thread_pool.thread_head;
 
 	for (thread = thread_pool.thread_head;
@@ -317,6 +434,7 @@ void request_enqueue(REQUEST *request)
 	 *	Tell the thread that there's a request available for
 	 *	it, once we're done all of the above work.
 	 */
+	atomic_fetch_add_explicit(&thread_pool.num_wakeups, 1, memory_order_relaxed);
 	(void) write(thread->pipe_fd[1], &data, 1);
 }
 
@@ -410,6 +528,7 @@ static void max_request_time_hook(UNUSED fr_event_list_t *el, UNUSED struct time
 static void thread_process_request(THREAD_HANDLE *thread, REQUEST *request)
 {
 	thread->request_count++;
+	atomic_fetch_add_explicit(&thread_pool.num_processed, 1, memory_order_relaxed);
 
 	RDEBUG2("Thread %d handling request %" PRIu64 ", (%d handled so far)",
 		thread->thread_num, request->number,
@@ -542,9 +661,9 @@ static void *thread_handler(void *arg)
 		 *	signalled.
 		 */
 		if (fr_heap_num_elements(local_backlog) == 0) {
-			wait_for_event = true;
+			wait_for_event = !thread_pool.atomic_dispatch || thread_sleep(thread);
 
-			DEBUG2("Thread %d waiting to be assigned a request", thread->thread_num);
+			if (wait_for_event) DEBUG2("Thread %d waiting to be assigned a request", thread->thread_num);
 		} else {
 			/*
 			 *	Otherwise service the timer and FD
@@ -560,6 +679,7 @@ static void *thread_handler(void *arg)
 		 *	serviced here.
 		 */
 		rcode = fr_event_corral(el, wait_for_event);
+		if (wait_for_event) atomic_store(&thread->sleeping, false);
 		if (rcode < 0) {
 			ERROR("Thread %d failed waiting for request: %s: Exiting",
 			      thread->thread_num, fr_syserror(errno));
@@ -655,21 +775,6 @@ static THREAD_HANDLE *thread_spawn(time_t now, int do_trigger)
 	fr_nonblock(thread->pipe_fd[1]);
 #endif
 
-	/*
-	 *	Create the thread joinable, so that it can be cleaned up
-	 *	using pthread_join().
-	 *
-	 *	Note that the function returns non-zero on error, NOT
-	 *	-1.  The return code is the error, and errno isn't set.
-	 */
-	rcode = pthread_create(&thread->pthread_id, 0, thread_handler, thread);
-	if (rcode != 0) {
-		talloc_free(thread);
-		ERROR("Thread create failed: %s",
-		       fr_syserror(rcode));
-		return NULL;
-	}
-
 	if ((pthread_mutex_init(&thread->backlog_mutex,NULL) != 0)) {
 		talloc_free(thread);
 		ERROR("FATAL: Failed to initialize thread backlog mutex: %s",
@@ -684,6 +789,25 @@ static THREAD_HANDLE *thread_spawn(time_t now, int do_trigger)
 		return NULL;
 	}
 
+	atomic_init(&thread->sleeping, false);
+	atomic_init(&thread->in_idle, false);
+
+	/*
+	 *	Create the thread joinable, so that it can be cleaned up
+	 *	using pthread_join().  The backlog MUST be initialized
+	 *	first, as the thread uses it immediately.
+	 *
+	 *	Note that the function returns non-zero on error, NOT
+	 *	-1.  The return code is the error, and errno isn't set.
+	 */
+	rcode = pthread_create(&thread->pthread_id, 0, thread_handler, thread);
+	if (rcode != 0) {
+		talloc_free(thread);
+		ERROR("Thread create failed: %s",
+		       fr_syserror(rcode));
+		return NULL;
+	}
+
 	DEBUG2("Thread spawned new child %d. Total threads in pool: %d",
 	       thread->thread_num, thread_pool.total_threads + 1);
 	if (do_trigger) trigger_exec(NULL, NULL, "server.thread.start", true, NULL);
@@ -787,6 +911,18 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 
 	if (cf_section_parse(NULL, NULL, pool_cf, thread_config) < 0) return -1;
 
+	if (!thread_pool.dispatch ||
+	    (strcmp(thread_pool.dispatch, "default") == 0)) {
+		thread_pool.atomic_dispatch = false;
+
+	} else if (strcmp(thread_pool.dispatch, "atomic") == 0) {
+		thread_pool.atomic_dispatch = true;
+
+	} else {
+		ERROR("FATAL: Invalid dispatch '%s'", thread_pool.dispatch);
+		return -1;
+	}
+
 	/*
 	 *	Catch corner cases.
 	 */
@@ -895,6 +1031,17 @@ int thread_pool_init(void)
 		return -1;
 	}
 
+	/*
+	 *	Each thread is in the idle queue at most once.
+	 */
+	if (thread_pool.atomic_dispatch) {
+		thread_pool.idle = fr_atomic_queue_create(NULL, thread_pool.start_threads);
+		if (!thread_pool.idle) {
+			ERROR("FATAL: Failed creating idle thread queue");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Create a number of waiting threads.  Note we don't
 	 *	need to lock the mutex, as nothing is sending
@@ -958,12 +1105,80 @@ void thread_pool_stop(void)
 		talloc_free(thread);
 	}
 
+	DEBUG2("Thread pool enqueued %u requests, with %u wakeups",
+	       (unsigned int) atomic_load(&thread_pool.num_enqueued),
+	       (unsigned int) atomic_load(&thread_pool.num_wakeups));
+
+	TALLOC_FREE(thread_pool.idle);
+
 #  ifdef WNOHANG
 	fr_hash_table_free(thread_pool.waiters);
 #  endif
 #endif
 }
 
+#ifdef WITH_STATS
+#ifndef WITH_GCD
+/*
+ *	Turn a running total into a per-second rate.  The rate is
+ *	only updated once a second has passed.
+ */
+static uint32_t thread_pool_pps(fr_pps_t *pps, uint32_t total, time_t now)
+{
+	pps->pps_now = total;
+
+	if (!pps->time_old) {
+		pps->time_old = now;
+		pps->pps_old = total;
+		return 0;
+	}
+
+	if (now > pps->time_old) {
+		pps->pps = (pps->pps_now - pps->pps_old) / (now - pps->time_old);
+		pps->pps_old = pps->pps_now;
+		pps->time_old = now;
+	}
+
+	return pps->pps;
+}
+#endif
+
+/** Return statistics about the thread pool backlog
+ *
+ * @param[out] queue_len	Number of requests waiting in the thread backlogs.
+ * @param[out] queue_max	Maximum number of requests which can be queued.
+ * @param[out] pps_in		Requests per second given to worker threads.
+ * @param[out] pps_out		Requests per second run by worker threads.
+ */
+void thread_pool_queue_stats(uint32_t *queue_len, uint32_t *queue_max, uint32_t *pps_in, uint32_t *pps_out)
+{
+#ifndef WITH_GCD
+	THREAD_HANDLE *thread;
+	time_t now;
+#endif
+
+	*queue_len = *queue_max = *pps_in = *pps_out = 0;
+
+#ifndef WITH_GCD
+	if (!pool_initialized) return;
+
+	for (thread = thread_pool.thread_head; thread; thread = thread->next) {
+		pthread_mutex_lock(&thread->backlog_mutex);
+		*queue_len += fr_heap_num_elements(thread->backlog);
+		pthread_mutex_unlock(&thread->backlog_mutex);
+	}
+	*queue_max = thread_pool.max_queue_size;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&thread_pool.thread_mutex);
+	*pps_in = thread_pool_pps(&thread_pool.pps_in, atomic_load(&thread_pool.num_enqueued), now);
+	*pps_out = thread_pool_pps(&thread_pool.pps_out, atomic_load(&thread_pool.num_processed), now);
+	pthread_mutex_unlock(&thread_pool.thread_mutex);
+#endif
+}
+#endif
+
 
 #ifdef WITH_GCD
 void request_enqueue(REQUEST *request)
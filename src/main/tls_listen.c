@@ -394,8 +394,8 @@ int dual_tls_send(rad_listen_t *listener, REQUEST *request)
 	/*
 	 *	Pack the VPs
 	 */
-	if (fr_radius_packet_encode(request->reply, request->packet,
-			     request->client->secret) < 0) {
+	if (fr_radius_packet_encode_key(request->reply, request->packet,
+			     &request->client->secret_key) < 0) {
 		RPERROR("Failed encoding packet");
 		return 0;
 	}
@@ -408,8 +408,8 @@ int dual_tls_send(rad_listen_t *listener, REQUEST *request)
 	/*
 	 *	Sign the packet.
 	 */
-	if (fr_radius_packet_sign(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (fr_radius_packet_sign_key(request->reply, request->packet,
+			   &request->client->secret_key) < 0) {
 		RPERROR("Failed signing packet");
 		return 0;
 	}
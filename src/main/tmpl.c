@@ -2109,6 +2109,10 @@ VALUE_PAIR *tmpl_cursor_init(int *err, vp_cursor_t *cursor, REQUEST *request, vp
 	 */
 	case TMPL_TYPE_ATTR:
 		switch (vpt->tmpl_num) {
+		/*
+		 *	The cursor is at the start of the list, so
+		 *	this uses the list's index, if it has one.
+		 */
 		case NUM_ANY:
 			vp = fr_pair_cursor_next_by_da(cursor, vpt->tmpl_da, vpt->tmpl_tag);
 			if (!vp) {
@@ -399,6 +399,20 @@ static REQUEST *request_from_file(FILE *fp, RADCLIENT *client)
 	return request;
 }
 
+/*
+ *	Order requests in the backlog.  They're resumed as soon as
+ *	they're added, so any stable order will do.
+ */
+static int request_cmp(void const *one, void const *two)
+{
+	REQUEST const *a = one;
+	REQUEST const *b = two;
+
+	if (a->number < b->number) return -1;
+	if (a->number > b->number) return +1;
+
+	return 0;
+}
 
 static void print_packet(FILE *fp, RADIUS_PACKET *packet)
 {
@@ -548,6 +562,119 @@ static ssize_t xlat_poke(TALLOC_CTX *ctx, char **out, size_t outlen,
 	return len;
 }
 
+/*
+ *	%{concurrent:<Autz-Type>}
+ *
+ *	Runs "Autz-Type <name>" from the authorize section in several
+ *	requests at once, one for each control:User-Name.  Each request
+ *	is a copy of this one, with that User-Name.  All of them are
+ *	started before any is resumed, so a module which yields has the
+ *	work for all of them outstanding at the same time.
+ *
+ *	Expands to the number of requests which returned ok or updated.
+ */
+static ssize_t xlat_concurrent(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+			       UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			       REQUEST *request, char const *fmt)
+{
+	CONF_SECTION	*cs;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	REQUEST		**children;
+	REQUEST		*child;
+	rlm_rcode_t	rcode;
+	int		i, num = 0, pending = 0, passed = 0;
+
+	if (!request->el || !request->backlog) {
+		REDEBUG("Request has no event list to run the requests with");
+		return -1;
+	}
+
+	cs = cf_subsection_find(request->server_cs, "authorize");
+	if (cs) cs = cf_subsection_find_name2(cs, "Autz-Type", fmt);
+	if (!cs) {
+		REDEBUG("No \"Autz-Type %s\" section in authorize", fmt);
+		return -1;
+	}
+
+	fr_pair_cursor_init(&cursor, &request->control);
+	while (fr_pair_cursor_next_by_num(&cursor, 0, PW_USER_NAME, TAG_ANY)) num++;
+
+	if (num == 0) {
+		REDEBUG("No control:User-Name to run requests for");
+		return -1;
+	}
+
+	MEM(children = talloc_zero_array(request, REQUEST *, num));
+
+	fr_pair_cursor_init(&cursor, &request->control);
+	for (i = 0; i < num; i++) {
+		vp = fr_pair_cursor_next_by_num(&cursor, 0, PW_USER_NAME, TAG_ANY);
+
+		/*
+		 *	They're independent requests, which just
+		 *	happen to be run from this one.
+		 */
+		MEM(child = children[i] = request_alloc_fake(request));
+		talloc_steal(children, child);
+		child->parent = NULL;
+		child->number = request->number + i + 1;
+		child->server_cs = request->server_cs;
+		child->component = "authorize";
+		child->el = request->el;
+		child->backlog = request->backlog;
+
+		child->packet->vps = fr_pair_list_copy(child->packet, request->packet->vps);
+		fr_pair_delete_by_num(&child->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+		fr_pair_add(&child->packet->vps, fr_pair_copy(child->packet, vp));
+		child->username = fr_pair_find_by_num(child->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+
+		RDEBUG2("Starting request %" PRIu64 " for User-Name \"%s\"", child->number, vp->vp_strvalue);
+
+		rcode = unlang_interpret(child, cs, RLM_MODULE_NOOP);
+		if (rcode == RLM_MODULE_YIELD) {
+			pending++;
+			continue;
+		}
+
+		RDEBUG2("Request %" PRIu64 " returned %s", child->number,
+			fr_int2str(mod_rcode_table, rcode, "<invalid>"));
+
+		if ((rcode == RLM_MODULE_OK) || (rcode == RLM_MODULE_UPDATED)) passed++;
+	}
+
+	RDEBUG2("%i request(s) yielded", pending);
+
+	while (pending > 0) {
+		if (fr_event_corral(request->el, true) < 0) {
+			RPERROR("Failed retrieving events");
+
+			for (i = 0; i < num; i++) (void) fr_heap_extract(request->backlog, children[i]);
+			talloc_free(children);
+			return -1;
+		}
+
+		fr_event_service(request->el);
+
+		while ((child = fr_heap_peek(request->backlog))) {
+			(void) fr_heap_extract(request->backlog, child);
+
+			rcode = unlang_interpret_continue(child);
+			if (rcode == RLM_MODULE_YIELD) continue;
+
+			RDEBUG2("Request %" PRIu64 " returned %s", child->number,
+				fr_int2str(mod_rcode_table, rcode, "<invalid>"));
+
+			pending--;
+			if ((rcode == RLM_MODULE_OK) || (rcode == RLM_MODULE_UPDATED)) passed++;
+		}
+	}
+
+	talloc_free(children);
+
+	return snprintf(*out, outlen, "%i", passed);
+}
+
 
 /*
  *	Read a file compose of xlat's and expected results
@@ -689,6 +816,7 @@ int main(int argc, char *argv[])
 	bool			xlat_only = false;
 	fr_state_tree_t		*state = NULL;
 	fr_event_list_t		*el = NULL;
+	fr_heap_t		*backlog = NULL;
 	RADCLIENT		*client = NULL;
 
 	fr_talloc_fault_setup();
@@ -813,6 +941,11 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (xlat_register(NULL, "concurrent", xlat_concurrent, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) < 0) {
+		rcode = EXIT_FAILURE;
+		goto finish;
+	}
+
 	if (map_proc_register(NULL, "test-fail", mod_map_proc, map_proc_verify, 0) < 0) {
 		rcode = EXIT_FAILURE;
 		goto finish;
@@ -935,6 +1068,18 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Modules which yield register their events with the
+	 *	thread's event list, which is serviced until the
+	 *	request is done.  They add the request to the backlog
+	 *	when it can be resumed.
+	 */
+	backlog = fr_heap_create(request_cmp, offsetof(REQUEST, heap_id));
+	rad_assert(backlog != NULL);
+
+	request->el = el;
+	request->backlog = backlog;
+
 	/*
 	 *	No filter file, OR there's no more input, OR we're
 	 *	reading from a file, and it's different from the
@@ -1017,8 +1162,10 @@ int main(int argc, char *argv[])
 finish:
 	talloc_free(request);
 	talloc_free(state);
+	fr_heap_delete(backlog);
 
 	xlat_unregister(NULL, "poke", xlat_poke);
+	xlat_unregister(NULL, "concurrent", xlat_concurrent);
 
 	/*
 	 *	Free the event list.
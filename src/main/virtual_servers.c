@@ -123,6 +123,35 @@ static rlm_rcode_t module_method_call(rlm_components_t comp, int idx, REQUEST *r
 
 	rcode = unlang_interpret(request, cs, default_component_results[comp]);
 
+	/*
+	 *	Nothing else will resume the request on this path, so
+	 *	service its event list until it's done.  That's only
+	 *	safe if we're not nested inside another request which
+	 *	is being serviced by the same event list.
+	 *
+	 *	Modules mark the request as resumable by adding it to
+	 *	its backlog.  Until then, there's nothing to continue.
+	 */
+	while (rcode == RLM_MODULE_YIELD) {
+		if (!request->el || !request->backlog || request->parent) {
+			REDEBUG("Module yielded, but nothing can resume the request");
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		if (fr_event_corral(request->el, true) < 0) {
+			RPERROR("Failed retrieving events");
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		fr_event_service(request->el);
+
+		if (!fr_heap_extract(request->backlog, request)) continue;
+
+		rcode = unlang_interpret_continue(request);
+	}
+
 	request->component = component;
 	request->module = module;
 	request->server_cs = server_cs;
@@ -53,7 +53,7 @@ static void acct_running(REQUEST *request, fr_state_action_t action)
 	switch (request->request_state) {
 	case REQUEST_INIT:
 		if (request->packet->data_len != 0) {
-			if (fr_radius_packet_decode(request->packet, NULL, request->client->secret) < 0) {
+			if (fr_radius_packet_decode_key(request->packet, NULL, &request->client->secret_key) < 0) {
 				RDEBUG("Failed decoding RADIUS packet: %s", fr_strerror());
 				goto done;
 			}
@@ -209,17 +209,17 @@ static void acct_running(REQUEST *request, fr_state_action_t action)
 
 		if (RDEBUG_ENABLED) common_packet_debug(request, request->reply, false);
 
-		if (fr_radius_packet_encode(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_encode_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed encoding RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
 
-		if (fr_radius_packet_sign(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_sign_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed signing RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
 
-		if (fr_radius_packet_send(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_send_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed sending RADIUS reply: %s", fr_strerror());
 		}
 		/* FALL-THROUGH */
@@ -169,7 +169,7 @@ static void auth_cleanup_delay(REQUEST *request, fr_state_action_t action)
 		if (request->reply->code != 0) {
 			gettimeofday(&request->reply->timestamp, NULL);
 
-			if (fr_radius_packet_send(request->reply, request->packet, request->client->secret) < 0) {
+			if (fr_radius_packet_send_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 				RDEBUG("Failed sending RADIUS reply: %s", fr_strerror());
 				goto done;
 			}
@@ -243,7 +243,7 @@ static void auth_reject_delay(REQUEST *request, fr_state_action_t action)
 		if (RDEBUG_ENABLED) common_packet_debug(request, request->reply, false);
 
 		gettimeofday(&request->reply->timestamp, NULL);
-		if (fr_radius_packet_send(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_send_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed sending RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
@@ -324,7 +324,7 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 	switch (request->request_state) {
 	case REQUEST_INIT:
 		if (request->packet->data_len != 0) {
-			if (fr_radius_packet_decode(request->packet, NULL, request->client->secret) < 0) {
+			if (fr_radius_packet_decode_key(request->packet, NULL, &request->client->secret_key) < 0) {
 				RDEBUG("Failed decoding RADIUS packet: %s", fr_strerror());
 				goto done; /* don't reject it, Message-Authenticator might be wrong */
 			}
@@ -766,12 +766,12 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 		}
 #endif
 
-		if (fr_radius_packet_encode(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_encode_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed encoding RADIUS reply: %s", fr_strerror());
 			goto stop_processing;
 		}
 
-		if (fr_radius_packet_sign(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_sign_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed signing RADIUS reply: %s", fr_strerror());
 
 			/*
@@ -844,7 +844,7 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 			/* else fall through to sending the response immediately. */
 		}
 
-		if (fr_radius_packet_send(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_packet_send_key(request->reply, request->packet, &request->client->secret_key) < 0) {
 			RDEBUG("Failed sending RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
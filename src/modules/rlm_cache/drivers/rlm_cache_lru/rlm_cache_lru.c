@@ -0,0 +1,606 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_lru.c
+ * @brief Sharded in memory cache with LRU eviction.
+ *
+ * Entries are distributed over a power of two number of shards by the hash
+ * of their key.  Each shard has its own hash table, LRU list and mutex, so
+ * requests operating on keys in different shards don't contend.
+ *
+ * The mutex for a shard is acquired by the first find/insert/expire call
+ * made with a handle, and held until the handle is released, as rlm_cache
+ * continues to use the entries we return until then.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+#define LOG_PREFIX "rlm_cache_lru - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include "../../rlm_cache.h"
+
+typedef struct rlm_cache_lru_entry rlm_cache_lru_entry_t;
+
+struct rlm_cache_lru_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	uint32_t		hash;		//!< Hash of the entry's key.
+	size_t			size;		//!< Memory used by the entry, as recorded on insert.
+
+	rlm_cache_lru_entry_t	*prev;		//!< More recently used entry.
+	rlm_cache_lru_entry_t	*next;		//!< Less recently used entry.
+};
+
+typedef struct rlm_cache_lru_shard {
+	pthread_mutex_t		mutex;		//!< Protect the shard from multiple readers/writers.
+
+	fr_hash_table_t		*cache;		//!< Hash table for looking up cache keys.
+
+	rlm_cache_lru_entry_t	*head;		//!< Most recently used entry.
+	rlm_cache_lru_entry_t	*tail;		//!< Least recently used entry, evicted first.
+
+	uint32_t		num_entries;	//!< Number of entries in the shard.
+	size_t			size;		//!< Memory used by entries in the shard.
+
+	uint32_t		max_entries;	//!< Maximum number of entries in this shard (0 for no limit).
+	size_t			max_size;	//!< Maximum memory used by this shard (0 for no limit).
+
+	uint64_t		hits;		//!< Lookups which found a live entry.
+	uint64_t		misses;		//!< Lookups which didn't.
+	uint64_t		evictions;	//!< Live entries removed to stay within limits.
+	uint64_t		expired;	//!< Expired entries removed.
+} rlm_cache_lru_shard_t;
+
+typedef struct rlm_cache_lru {
+	uint32_t		num_shards;	//!< Number of shards.  Rounded up to a power of two.
+	size_t			max_size;	//!< Maximum memory used by entries across all shards.
+
+	uint32_t		mask;		//!< For mapping key hashes to shards.
+	rlm_cache_lru_shard_t	*shards;	//!< Array of shards.
+} rlm_cache_lru_t;
+
+/** Per-request handle, recording which shard we hold the mutex for
+ *
+ */
+typedef struct rlm_cache_lru_handle {
+	rlm_cache_lru_shard_t	*shard;		//!< Shard currently locked, or NULL.
+} rlm_cache_lru_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_lru_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_lru_t, max_size), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Hash an entry using the hash we calculated from its key
+ *
+ */
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_lru_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_lru_entry_t const *a = one;
+	rlm_cache_lru_entry_t const *b = two;
+
+	if (a->fields.key_len < b->fields.key_len) return -1;
+	if (a->fields.key_len > b->fields.key_len) return +1;
+
+	return memcmp(a->fields.key, b->fields.key, a->fields.key_len);
+}
+
+/** Remove an entry from a shard's LRU list
+ *
+ */
+static inline void lru_unlink(rlm_cache_lru_shard_t *shard, rlm_cache_lru_entry_t *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		shard->head = c->next;
+	}
+
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		shard->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+/** Add an entry to the head of a shard's LRU list
+ *
+ */
+static inline void lru_push(rlm_cache_lru_shard_t *shard, rlm_cache_lru_entry_t *c)
+{
+	c->prev = NULL;
+	c->next = shard->head;
+
+	if (shard->head) {
+		shard->head->prev = c;
+	} else {
+		shard->tail = c;
+	}
+	shard->head = c;
+}
+
+/** Remove an entry from a shard and free it
+ *
+ */
+static void shard_entry_free(rlm_cache_lru_shard_t *shard, rlm_cache_lru_entry_t *c)
+{
+	fr_hash_table_yank(shard->cache, c);
+	lru_unlink(shard, c);
+
+	shard->num_entries--;
+	shard->size -= c->size;
+
+	talloc_free(c);
+}
+
+/** Lock the shard responsible for a key
+ *
+ * rlm_cache only operates on a single key between acquire and release, so we
+ * should only ever need one shard per handle.
+ */
+static rlm_cache_lru_shard_t *shard_lock(rlm_cache_lru_t *driver, REQUEST *request,
+					 rlm_cache_lru_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_lru_shard_t *shard = &driver->shards[hash & driver->mask];
+
+	if (handle->shard == shard) return shard;
+
+	if (handle->shard) {
+		rad_assert(0);
+		pthread_mutex_unlock(&handle->shard->mutex);
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	RDEBUG3("Mutex for shard %u acquired", hash & driver->mask);
+
+	return shard;
+}
+
+/** Add up the counters for all the shards
+ *
+ * Each shard is locked in turn, so the totals may be slightly out of date,
+ * but we never stop requests using the whole cache.
+ */
+static void shard_stats(rlm_cache_lru_t *driver, rlm_cache_lru_shard_t *out)
+{
+	uint32_t i;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i <= driver->mask; i++) {
+		rlm_cache_lru_shard_t *shard = &driver->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		out->num_entries += shard->num_entries;
+		out->size += shard->size;
+		out->hits += shard->hits;
+		out->misses += shard->misses;
+		out->evictions += shard->evictions;
+		out->expired += shard->expired;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/** Return one of the cache's counters
+ *
+ * Example:
+@verbatim
+"%{cache_stats:hits}" == "42"
+@endverbatim
+ *
+ * Counters are "hits", "misses", "evictions", "expired", "entries" and
+ * "size" (in bytes).
+ */
+static ssize_t cache_stats_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_lru_t		*driver;
+	rlm_cache_lru_shard_t	stats;
+	uint64_t		value;
+
+	memcpy(&driver, &mod_inst, sizeof(driver));
+
+	shard_stats(driver, &stats);
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (strcmp(fmt, "hits") == 0) {
+		value = stats.hits;
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = stats.misses;
+	} else if (strcmp(fmt, "evictions") == 0) {
+		value = stats.evictions;
+	} else if (strcmp(fmt, "expired") == 0) {
+		value = stats.expired;
+	} else if (strcmp(fmt, "entries") == 0) {
+		value = stats.num_entries;
+	} else if (strcmp(fmt, "size") == 0) {
+		value = stats.size;
+	} else {
+		REDEBUG("Unknown counter \"%s\"", fmt);
+		return -1;
+	}
+
+	return snprintf(*out, outlen, "%" PRIu64, value);
+}
+
+/** Cleanup a cache_lru instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	stats;
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	xlat_unregister_module(driver);
+
+	shard_stats(driver, &stats);
+	DEBUG("hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64 ", expired %" PRIu64,
+	      stats.hits, stats.misses, stats.evictions, stats.expired);
+
+	for (i = 0; i <= driver->mask; i++) {
+		rlm_cache_lru_shard_t	*shard = &driver->shards[i];
+		rlm_cache_lru_entry_t	*c, *next;
+
+		for (c = shard->head; c; c = next) {
+			next = c->next;
+			talloc_free(c);
+		}
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	talloc_free(driver->shards);
+
+	return 0;
+}
+
+/** Create a new cache_lru instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_cache_lru_t	*driver = instance;
+	uint32_t	num_shards = 1;
+	uint32_t	i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	while (num_shards < driver->num_shards) num_shards <<= 1;
+	if (num_shards != driver->num_shards) {
+		WARN("Ignoring \"shards = %u\", forcing to \"shards = %u\" (must be a power of two)",
+		     driver->num_shards, num_shards);
+		driver->num_shards = num_shards;
+	}
+	driver->mask = num_shards - 1;
+
+	/*
+	 *	Not parented by the instance, as its memory is
+	 *	limited after instantiation, and the hash tables
+	 *	need to grow.
+	 */
+	driver->shards = talloc_zero_array(NULL, rlm_cache_lru_shard_t, num_shards);
+	if (!driver->shards) {
+		ERROR("Failed to allocate shards");
+		return -1;
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		rlm_cache_lru_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_hash_table_create(driver->shards, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			goto error;
+		}
+
+		/*
+		 *	Divide the limits between the shards, rounding up
+		 *	so small limits still allow an entry per shard.
+		 */
+		shard->max_entries = (config->max_entries + (num_shards - 1)) / num_shards;
+		shard->max_size = (driver->max_size + (num_shards - 1)) / num_shards;
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			goto error;
+		}
+	}
+
+	/*
+	 *	Allow the counters to be read with %{<name>_stats:<counter>}
+	 */
+	{
+		char *name;
+
+		name = talloc_asprintf(NULL, "%s_stats", config->name);
+		xlat_register(driver, name, cache_stats_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+		talloc_free(name);
+	}
+
+	return 0;
+
+error:
+	while (i-- > 0) pthread_mutex_destroy(&driver->shards[i].mutex);
+	TALLOC_FREE(driver->shards);
+
+	return -1;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_lru_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_lru_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Expired entries are removed and reported as misses.  Entries we find
+ * are moved to the head of their shard's LRU list.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*c, my_c;
+
+	rad_assert(handle);
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = shard_lock(driver, request, handle, my_c.hash);
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (c && (c->fields.expires < request->packet->timestamp.tv_sec)) {
+		shard_entry_free(shard, c);
+		shard->expired++;
+		c = NULL;
+	}
+
+	if (!c) {
+		shard->misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	shard->hits++;
+
+	if (shard->head != c) {
+		lru_unlink(shard, c);
+		lru_push(shard, c);
+	}
+
+	*out = (rlm_cache_entry_t *)c;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*c, my_c;
+
+	if (!request) return CACHE_ERROR;
+
+	rad_assert(handle);
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = shard_lock(driver, request, handle, my_c.hash);
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	shard_entry_free(shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Evicts the least recently used entries from the shard until it's back
+ * within its entry and memory limits.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*my_c, *old;
+
+	if (!request) return CACHE_ERROR;
+
+	rad_assert(handle);
+
+	memcpy(&my_c, &c, sizeof(my_c));
+
+	my_c->hash = fr_hash(c->key, c->key_len);
+	my_c->size = talloc_total_size(my_c);
+
+	shard = shard_lock(driver, request, handle, my_c->hash);
+
+	if (shard->max_size && (my_c->size > shard->max_size)) {
+		RWDEBUG("Entry size %zu exceeds the maximum size of a shard (%zu bytes)",
+			my_c->size, shard->max_size);
+		return CACHE_ERROR;
+	}
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_finddata(shard->cache, my_c);
+	if (old) shard_entry_free(shard, old);
+
+	if (!fr_hash_table_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+	lru_push(shard, my_c);
+
+	shard->num_entries++;
+	shard->size += my_c->size;
+
+	while (((shard->max_entries && (shard->num_entries > shard->max_entries)) ||
+	        (shard->max_size && (shard->size > shard->max_size))) && (shard->tail != my_c)) {
+		old = shard->tail;
+
+		if (old->fields.expires < request->packet->timestamp.tv_sec) {
+			shard->expired++;
+		} else {
+			shard->evictions++;
+		}
+		shard_entry_free(shard, old);
+	}
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry is checked on lookup, so there's nothing to reindex.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  REQUEST *request, void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	rlm_cache_lru_handle_t *my_handle = handle;
+
+	if (!request) return CACHE_ERROR;
+
+	/*
+	 *	The entry must have come from a find, so
+	 *	its shard should still be locked.
+	 */
+	rad_assert(my_handle && my_handle->shard);
+
+	return CACHE_OK;
+}
+
+/** Allocate a handle to record which shard we lock
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_lru_handle_t *my_handle;
+
+	my_handle = talloc_zero(request, rlm_cache_lru_handle_t);
+	if (!my_handle) {
+		RERROR("Failed allocating handle");
+		return -1;
+	}
+	*handle = my_handle;
+
+	return 0;
+}
+
+/** Release a handle unlocking the shard it locked (if any)
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_lru_handle_t *my_handle = handle;
+
+	if (!my_handle) return;
+
+	if (my_handle->shard) {
+		pthread_mutex_unlock(&my_handle->shard->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(my_handle);
+}
+
+extern cache_driver_t rlm_cache_lru;
+cache_driver_t rlm_cache_lru = {
+	.name		= "rlm_cache_lru",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_lru_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
@@ -39,11 +39,14 @@ typedef struct rlm_cache_memcached_handle {
 
 typedef struct rlm_cache_memcached {
 	char const 		*options;	//!< Connection options
+	char const		*serialize_name;	//!< Format to store entries in.
+	cache_serialize_t	serialize;	//!< Format to store entries in.
 	fr_connection_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("serialize", FR_TYPE_STRING, rlm_cache_memcached_t, serialize_name), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -110,6 +113,13 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
 
+	driver->serialize = fr_str2int(cache_serialize_table, driver->serialize_name, -1);
+	if ((int)driver->serialize < 0) {
+		cf_log_err_cs(conf, "Invalid 'serialize' value \"%s\", expected 'text' or 'binary'",
+			      driver->serialize_name);
+		return -1;
+	}
+
 	ret = libmemcached_check_configuration(driver->options, talloc_array_length(driver->options) -1,
 					       buffer, sizeof(buffer));
 	if (ret != MEMCACHED_SUCCESS) {
@@ -174,7 +184,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	if (from_store[0] == '&') RDEBUG2("%s", from_store);	/* Binary entries aren't printable */
 
 	c = talloc_zero(NULL,  rlm_cache_entry_t);
 	ret = cache_deserialize(c, from_store, len);
@@ -185,6 +195,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
 	*out = c;
 
 	return CACHE_OK;
@@ -194,28 +205,40 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
 					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
+	rlm_cache_memcached_t *driver = instance;
 	rlm_cache_memcached_handle_t *mandle = handle;
 
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
-	char *to_store;
+	char *to_store = NULL;
+	size_t len = 0;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
-
-		return CACHE_ERROR;
+	switch (driver->serialize) {
+	case CACHE_SERIALIZE_BINARY:
+		if (cache_serialize_binary(pool, (uint8_t **)&to_store, &len, c) < 0) {
+		error:
+			RPERROR("Failed serializing entry");
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		break;
+
+	case CACHE_SERIALIZE_TEXT:
+		if (cache_serialize(pool, &to_store, c) < 0) goto error;
+		if (to_store) len = talloc_array_length(to_store) - 1;
+		break;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            to_store ? to_store : "", len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
@@ -27,24 +27,31 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
-static CONF_PARSER driver_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
-
 typedef struct rlm_cache_redis {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
+	char const		*serialize_name;	//!< How to store entries.
+	cache_serialize_t	serialize;	//!< How to store entries.  Text entries are
+						//!< stored as a list of attribute, operator,
+						//!< value triplets, binary entries as a string.
+
 	vp_tmpl_t		*created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
 } rlm_cache_redis_t;
 
+static CONF_PARSER driver_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("serialize", FR_TYPE_STRING, rlm_cache_redis_t, serialize_name), .dflt = "text" },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Create a new rlm_cache_redis instance
  *
  * @copydetails cache_instantiate_t
@@ -58,6 +65,13 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 
 	if (cf_section_parse(driver, driver, conf, driver_config) < 0) return -1;
 
+	driver->serialize = fr_str2int(cache_serialize_table, driver->serialize_name, -1);
+	if ((int)driver->serialize < 0) {
+		cf_log_err_cs(conf, "Invalid 'serialize' value \"%s\", expected 'text' or 'binary'",
+			      driver->serialize_name);
+		return -1;
+	}
+
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
 
 	driver->cluster = fr_redis_cluster_alloc(driver, conf, &driver->conf, true,
@@ -96,13 +110,82 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
+/** Locate a binary serialized cache entry in redis
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find_binary(rlm_cache_entry_t **out,
+					      UNUSED rlm_cache_config_t const *config, void *instance,
+					      REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_t		*driver = instance;
+
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+
+	rlm_cache_entry_t		*c;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "GET %b", key, key_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		char *p;
+
+		p = fr_asprint(NULL, (char const *)key, key_len, '"');
+		RERROR("Failed retrieving entry for key \"%s\"", p);
+		talloc_free(p);
+
+	error:
+		fr_redis_reply_free(reply);
+		return CACHE_ERROR;
+	}
+
+	if (!rad_cond_assert(reply)) goto error;
+
+	switch (reply->type) {
+	case REDIS_REPLY_NIL:
+		fr_redis_reply_free(reply);
+		return CACHE_MISS;
+
+	case REDIS_REPLY_STRING:
+		break;
+
+	default:
+		REDEBUG("Bad result type, expected string, got %s",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto error;
+	}
+
+	RDEBUG3("Entry is %zu bytes", (size_t)reply->len);
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	if (cache_deserialize_binary(c, (uint8_t const *)reply->str, reply->len) < 0) {
+		RPERROR("Failed deserializing entry");
+		talloc_free(c);
+		goto error;
+	}
+	fr_redis_reply_free(reply);
+
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+	*out = c;
+
+	return CACHE_OK;
+}
+
 /** Locate a cache entry in redis
  *
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
-				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+				       rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
 {
 	rlm_cache_redis_t		*driver = instance;
 	size_t				i;
@@ -119,6 +202,10 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 #endif
 	rlm_cache_entry_t		*c;
 
+	if (driver->serialize == CACHE_SERIALIZE_BINARY) {
+		return cache_entry_find_binary(out, config, instance, request, handle, key, key_len);
+	}
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
@@ -238,12 +325,95 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 }
 
 
+/** Insert a new binary serialized entry into the data store
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert_binary(UNUSED rlm_cache_config_t const *config, void *instance,
+						REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+{
+	rlm_cache_redis_t	*driver = instance;
+
+	fr_redis_conn_t		*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t	status;
+	redisReply		*reply = NULL;
+	int			s_ret;
+
+	unsigned int		pipelined = 0;	/* How many commands pending in the pipeline */
+	redisReply		*replies[4];	/* Should have the same number of elements as pipelined commands */
+	size_t			reply_num = 0, i;
+
+	uint8_t			*to_store;
+	size_t			len;
+
+	if (cache_serialize_binary(request, &to_store, &len, c) < 0) {
+		RPERROR("Failed serializing entry");
+		return CACHE_ERROR;
+	}
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, c->key, c->key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		/*
+		 *	SET replaces the existing value, so unlike the
+		 *	list format, there's no need to DEL first.
+		 */
+		if (c->expires > 0) {
+			RDEBUG3("MULTI");
+			if (redisAppendCommand(conn->handle, "MULTI") != REDIS_OK) {
+			append_error:
+				RERROR("Failed appending Redis command to output buffer: %s", conn->handle->errstr);
+				talloc_free(to_store);
+				return CACHE_ERROR;
+			}
+			pipelined++;
+		}
+
+		RDEBUG3("SET <key> <%zu bytes>", len);
+		if (redisAppendCommand(conn->handle, "SET %b %b", c->key, c->key_len,
+				       to_store, len) != REDIS_OK) goto append_error;
+		pipelined++;
+
+		if (c->expires > 0) {
+			RDEBUG3("EXPIREAT <key> %li", (long)c->expires);
+			if (redisAppendCommand(conn->handle, "EXPIREAT %b %i", c->key,
+					       c->key_len, c->expires) != REDIS_OK) goto append_error;
+			pipelined++;
+			RDEBUG3("EXEC");
+			if (redisAppendCommand(conn->handle, "EXEC") != REDIS_OK) goto append_error;
+			pipelined++;
+		}
+
+		reply_num = fr_redis_pipeline_result(&pipelined, &status,
+						     replies, sizeof(replies) / sizeof(*replies),
+						     conn);
+		reply = replies[0];
+	}
+	talloc_free(to_store);
+
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RPERROR("Failed inserting entry");
+		return CACHE_ERROR;
+	}
+
+	RDEBUG3("Command results");
+	RINDENT();
+	for (i = 0; i < reply_num; i++) {
+		fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+		fr_redis_reply_free(replies[i]);
+	}
+	REXDENT();
+
+	return CACHE_OK;
+}
+
 /** Insert a new entry into the data store
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_redis_t	*driver = instance;
 	TALLOC_CTX		*pool;
@@ -284,6 +454,10 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 					.next	= &expires
 				};
 
+	if (driver->serialize == CACHE_SERIALIZE_BINARY) {
+		return cache_entry_insert_binary(config, instance, request, handle, c);
+	}
+
 	/*
 	 *	Encode the entry created date
 	 */
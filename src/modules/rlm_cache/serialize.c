@@ -25,9 +25,326 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/rad_assert.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
+/*
+ *	Binary format
+ *
+ *	All integers are in network byte order.
+ *
+ *	Header:
+ *	    magic[3] ("FRC"), version[1], created[8], expires[8]
+ *
+ *	Followed by zero or more maps:
+ *	    op[1], flags[1]
+ *	    If flags & CACHE_BINARY_FLAG_ATTR_NAME
+ *		name_len[2], name[name_len]	Attribute reference as printed by tmpl_snprint
+ *	    else
+ *		request[1], list[1], tag[1], num[4], vendor[4], attr[4]
+ *	    type[1], value_len[4], value[value_len]
+ *
+ *	Values of fixed width types are stored in network byte order, strings and
+ *	octets as is.  Anything else (or values with flags & CACHE_BINARY_FLAG_VALUE_STR)
+ *	is stored in its presentation format.
+ */
+#define CACHE_BINARY_VERSION		1
+#define CACHE_BINARY_HDR_LEN		(3 + 1 + 8 + 8)
+#define CACHE_BINARY_ATTR_LEN		(1 + 1 + 1 + 4 + 4 + 4)
+
+#define CACHE_BINARY_FLAG_ATTR_NAME	0x01	//!< LHS is stored as a string.
+#define CACHE_BINARY_FLAG_VALUE_STR	0x02	//!< RHS is stored in its presentation format.
+
+static uint8_t const cache_binary_magic[3] = { 'F', 'R', 'C' };
+
+const FR_NAME_NUMBER cache_serialize_table[] = {
+	{ "text",	CACHE_SERIALIZE_TEXT },
+	{ "binary",	CACHE_SERIALIZE_BINARY },
+	{ NULL, -1 }
+};
+
+/** Buffer we serialize binary entries into
+ *
+ */
+typedef struct cache_binary_buff {
+	uint8_t		*start;		//!< talloced buffer.
+	size_t		used;		//!< How much of the buffer has been written.
+} cache_binary_buff_t;
+
+/** Reserve len bytes at the end of the buffer, growing it if needed
+ *
+ * @return a pointer to the reserved bytes or NULL on failure.
+ */
+static uint8_t *binary_reserve(cache_binary_buff_t *buff, size_t len)
+{
+	size_t	size = talloc_array_length(buff->start);
+	uint8_t	*p;
+
+	if ((buff->used + len) > size) {
+		while ((buff->used + len) > size) size *= 2;
+
+		p = talloc_realloc(NULL, buff->start, uint8_t, size);
+		if (!p) {
+			fr_strerror_printf("Out of memory");
+			return NULL;
+		}
+		buff->start = p;
+	}
+
+	p = buff->start + buff->used;
+	buff->used += len;
+
+	return p;
+}
+
+static inline void binary_put_uint16(uint8_t *p, uint16_t num)
+{
+	num = htons(num);
+	memcpy(p, &num, sizeof(num));
+}
+
+static inline void binary_put_uint32(uint8_t *p, uint32_t num)
+{
+	num = htonl(num);
+	memcpy(p, &num, sizeof(num));
+}
+
+static inline void binary_put_uint64(uint8_t *p, uint64_t num)
+{
+	num = htonll(num);
+	memcpy(p, &num, sizeof(num));
+}
+
+static inline uint16_t binary_get_uint16(uint8_t const *p)
+{
+	uint16_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohs(num);
+}
+
+static inline uint32_t binary_get_uint32(uint8_t const *p)
+{
+	uint32_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohl(num);
+}
+
+static inline uint64_t binary_get_uint64(uint8_t const *p)
+{
+	uint64_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohll(num);
+}
+
+/** How many bytes a fixed width value occupies in the binary format
+ *
+ * @return the width, 0 for variable length types, or -1 if the type
+ *	must be stored in its presentation format.
+ */
+static ssize_t binary_value_width(fr_type_t type)
+{
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		return 0;
+
+	case FR_TYPE_BOOL:
+	case FR_TYPE_UINT8:
+		return 1;
+
+	case FR_TYPE_UINT16:
+		return 2;
+
+	case FR_TYPE_UINT32:
+	case FR_TYPE_INT32:
+	case FR_TYPE_DATE:
+		return 4;
+
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+		return 1 + 4;
+
+	case FR_TYPE_ETHERNET:
+		return 6;
+
+	case FR_TYPE_UINT64:
+	case FR_TYPE_SIZE:
+	case FR_TYPE_FLOAT64:
+	case FR_TYPE_IFID:
+		return 8;
+
+	case FR_TYPE_TIMEVAL:
+		return 8 + 4;
+
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV6_PREFIX:
+		return 1 + 16 + 4;
+
+	default:
+		return -1;
+	}
+}
+
+/** Write a fixed width value
+ *
+ * @param[out] p where to write the value.  Must be binary_value_width() bytes.
+ * @param[in] value to write.
+ */
+static void binary_put_value(uint8_t *p, fr_value_box_t const *value)
+{
+	uint64_t num;
+
+	switch (value->type) {
+	case FR_TYPE_BOOL:
+		*p = value->datum.boolean;
+		break;
+
+	case FR_TYPE_UINT8:
+		*p = value->datum.uint8;
+		break;
+
+	case FR_TYPE_UINT16:
+		binary_put_uint16(p, value->datum.uint16);
+		break;
+
+	case FR_TYPE_UINT32:
+	case FR_TYPE_INT32:
+		binary_put_uint32(p, value->datum.uint32);
+		break;
+
+	case FR_TYPE_DATE:
+		binary_put_uint32(p, value->datum.date);
+		break;
+
+	case FR_TYPE_UINT64:
+		binary_put_uint64(p, value->datum.uint64);
+		break;
+
+	case FR_TYPE_SIZE:
+		binary_put_uint64(p, value->datum.size);
+		break;
+
+	case FR_TYPE_FLOAT64:
+		memcpy(&num, &value->datum.float64, sizeof(num));
+		binary_put_uint64(p, num);
+		break;
+
+	case FR_TYPE_TIMEVAL:
+		binary_put_uint64(p, value->datum.timeval.tv_sec);
+		binary_put_uint32(p + 8, value->datum.timeval.tv_usec);
+		break;
+
+	case FR_TYPE_IFID:
+		memcpy(p, value->datum.ifid, sizeof(value->datum.ifid));
+		break;
+
+	case FR_TYPE_ETHERNET:
+		memcpy(p, value->datum.ether, sizeof(value->datum.ether));
+		break;
+
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+		*p++ = value->datum.ip.prefix;
+		memcpy(p, &value->datum.ip.addr.v4.s_addr, 4);
+		break;
+
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV6_PREFIX:
+		*p++ = value->datum.ip.prefix;
+		memcpy(p, value->datum.ip.addr.v6.s6_addr, 16);
+		binary_put_uint32(p + 16, value->datum.ip.scope_id);
+		break;
+
+	default:
+		rad_assert(0);
+		break;
+	}
+}
+
+/** Read a fixed width value
+ *
+ * @param[out] value to populate.  value->type must already be set.
+ * @param[in] p where to read the value from.  Must be binary_value_width() bytes.
+ */
+static void binary_get_value(fr_value_box_t *value, uint8_t const *p)
+{
+	uint64_t num;
+
+	switch (value->type) {
+	case FR_TYPE_BOOL:
+		value->datum.boolean = (*p != 0);
+		break;
+
+	case FR_TYPE_UINT8:
+		value->datum.uint8 = *p;
+		break;
+
+	case FR_TYPE_UINT16:
+		value->datum.uint16 = binary_get_uint16(p);
+		break;
+
+	case FR_TYPE_UINT32:
+	case FR_TYPE_INT32:
+		value->datum.uint32 = binary_get_uint32(p);
+		break;
+
+	case FR_TYPE_DATE:
+		value->datum.date = binary_get_uint32(p);
+		break;
+
+	case FR_TYPE_UINT64:
+		value->datum.uint64 = binary_get_uint64(p);
+		break;
+
+	case FR_TYPE_SIZE:
+		value->datum.size = binary_get_uint64(p);
+		break;
+
+	case FR_TYPE_FLOAT64:
+		num = binary_get_uint64(p);
+		memcpy(&value->datum.float64, &num, sizeof(num));
+		break;
+
+	case FR_TYPE_TIMEVAL:
+		value->datum.timeval.tv_sec = binary_get_uint64(p);
+		value->datum.timeval.tv_usec = binary_get_uint32(p + 8);
+		break;
+
+	case FR_TYPE_IFID:
+		memcpy(value->datum.ifid, p, sizeof(value->datum.ifid));
+		break;
+
+	case FR_TYPE_ETHERNET:
+		memcpy(value->datum.ether, p, sizeof(value->datum.ether));
+		break;
+
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+		value->datum.ip.af = AF_INET;
+		value->datum.ip.prefix = *p++;
+		value->datum.ip.scope_id = 0;
+		memcpy(&value->datum.ip.addr.v4.s_addr, p, 4);
+		break;
+
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV6_PREFIX:
+		value->datum.ip.af = AF_INET6;
+		value->datum.ip.prefix = *p++;
+		memcpy(value->datum.ip.addr.v6.s6_addr, p, 16);
+		value->datum.ip.scope_id = binary_get_uint32(p + 16);
+		break;
+
+	default:
+		rad_assert(0);
+		break;
+	}
+}
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -90,6 +407,10 @@ finish:
 }
 
 /** Converts a serialized cache entry back into a structure
+ *
+ * Entries serialized with #cache_serialize_binary are detected, and passed
+ * to #cache_deserialize_binary, so drivers can switch formats without
+ * invalidating existing entries.
  *
  * @param c Cache entry to populate (should already be allocated)
  * @param in String representation of cache entry.
@@ -104,6 +425,10 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 	vp_map_t	**last = &c->maps;
 	char		*p, *q;
 
+	if ((inlen >= CACHE_BINARY_HDR_LEN) && (memcmp(in, cache_binary_magic, sizeof(cache_binary_magic)) == 0)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, inlen);
+	}
+
 	if (inlen < 0) inlen = strlen(in);
 
 	p = in;
@@ -172,3 +497,299 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	return 0;
 }
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param outlen Where to write the length of the serialized cache entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	cache_binary_buff_t	buff;
+	vp_map_t		*map;
+	uint8_t			*p;
+
+	buff.start = talloc_array(ctx, uint8_t, 256);
+	if (!buff.start) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	buff.used = 0;
+
+	p = binary_reserve(&buff, CACHE_BINARY_HDR_LEN);
+	if (!p) goto error;
+
+	memcpy(p, cache_binary_magic, sizeof(cache_binary_magic));
+	p[3] = CACHE_BINARY_VERSION;
+	binary_put_uint64(p + 4, (uint64_t)c->created);
+	binary_put_uint64(p + 12, (uint64_t)c->expires);
+
+	for (map = c->maps; map; map = map->next) {
+		vp_tmpl_t const		*lhs = map->lhs;
+		fr_dict_attr_t const	*da = lhs->tmpl_da;
+		fr_value_box_t const	*value = &map->rhs->tmpl_value_box;
+		uint8_t			flags = 0;
+		ssize_t			width;
+		char			*str = NULL;
+		size_t			len;
+
+		rad_assert(lhs->type == TMPL_TYPE_ATTR);
+		rad_assert(map->rhs->type == TMPL_TYPE_DATA);
+
+		/*
+		 *	Attributes we wouldn't get back by looking
+		 *	them up by number are stored by name.
+		 */
+		if (da->flags.is_unknown || (fr_dict_attr_by_num(NULL, da->vendor, da->attr) != da)) {
+			flags |= CACHE_BINARY_FLAG_ATTR_NAME;
+		}
+
+		width = binary_value_width(value->type);
+		if (width < 0) flags |= CACHE_BINARY_FLAG_VALUE_STR;
+
+		p = binary_reserve(&buff, 2);
+		if (!p) goto error;
+		p[0] = map->op;
+		p[1] = flags;
+
+		if (flags & CACHE_BINARY_FLAG_ATTR_NAME) {
+			char attr[256];
+
+			len = tmpl_snprint(attr, sizeof(attr), lhs);
+			if (is_truncated(len, sizeof(attr))) {
+				fr_strerror_printf("Serialized attribute too long.  Must be < " STRINGIFY(sizeof(attr)) " "
+						   "bytes, got %zu bytes", len);
+				goto error;
+			}
+
+			p = binary_reserve(&buff, 2 + len);
+			if (!p) goto error;
+			binary_put_uint16(p, len);
+			memcpy(p + 2, attr, len);
+		} else {
+			p = binary_reserve(&buff, CACHE_BINARY_ATTR_LEN);
+			if (!p) goto error;
+			p[0] = lhs->tmpl_request;
+			p[1] = lhs->tmpl_list;
+			p[2] = (uint8_t)lhs->tmpl_tag;
+			binary_put_uint32(p + 3, (uint32_t)lhs->tmpl_num);
+			binary_put_uint32(p + 7, da->vendor);
+			binary_put_uint32(p + 11, da->attr);
+		}
+
+		if (flags & CACHE_BINARY_FLAG_VALUE_STR) {
+			str = fr_value_box_asprint(NULL, value, '\0');
+			if (!str) goto error;
+			len = talloc_array_length(str) - 1;
+		} else if (width == 0) {
+			len = value->datum.length;
+		} else {
+			len = width;
+		}
+
+		p = binary_reserve(&buff, 1 + 4 + len);
+		if (!p) {
+			talloc_free(str);
+			goto error;
+		}
+		p[0] = value->type;
+		binary_put_uint32(p + 1, len);
+
+		if (str) {
+			memcpy(p + 5, str, len);
+			talloc_free(str);
+		} else if (width == 0) {
+			if (len > 0) memcpy(p + 5, value->datum.ptr, len);
+		} else {
+			binary_put_value(p + 5, value);
+		}
+	}
+
+	*out = buff.start;
+	*outlen = buff.used;
+
+	return 0;
+
+error:
+	talloc_free(buff.start);
+	return -1;
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ * Attributes are looked up by number, and fixed width values are copied
+ * directly into their value boxes.  Only attributes and values which
+ * couldn't be stored that way are parsed.
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of binary data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p, *end = in + inlen;
+
+	if ((inlen < CACHE_BINARY_HDR_LEN) || (memcmp(in, cache_binary_magic, sizeof(cache_binary_magic)) != 0)) {
+		fr_strerror_printf("Data is not a binary serialized cache entry");
+		return -1;
+	}
+
+	if (in[3] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported serialized cache entry version %u, expected %u",
+				   in[3], CACHE_BINARY_VERSION);
+		return -1;
+	}
+
+	c->created = binary_get_uint64(in + 4);
+	c->expires = binary_get_uint64(in + 12);
+
+	p = in + CACHE_BINARY_HDR_LEN;
+	while (p < end) {
+		vp_map_t		*map = NULL;
+		fr_dict_attr_t const	*da;
+		fr_value_box_t		*value;
+		fr_type_t		type;
+		uint8_t			flags;
+		ssize_t			width;
+		size_t			len;
+
+		if ((end - p) < 2) goto too_short;
+
+		map = talloc_zero(c, vp_map_t);
+		if (!map) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		map->op = p[0];
+		flags = p[1];
+		p += 2;
+
+		if (flags & CACHE_BINARY_FLAG_ATTR_NAME) {
+			char attr[256];
+
+			if ((end - p) < 2) goto too_short;
+			len = binary_get_uint16(p);
+			p += 2;
+
+			if (len >= sizeof(attr)) {
+				fr_strerror_printf("Serialized attribute too long");
+				goto error;
+			}
+			if ((size_t)(end - p) < len) goto too_short;
+
+			memcpy(attr, p, len);
+			attr[len] = '\0';
+			p += len;
+
+			if (tmpl_afrom_attr_str(map, &map->lhs, attr,
+						REQUEST_CURRENT, PAIR_LIST_REQUEST, true, false) <= 0) {
+				fr_strerror_printf("Failed parsing attribute \"%s\": %s", attr, fr_strerror());
+				goto error;
+			}
+
+			if (map->lhs->type != TMPL_TYPE_ATTR) {
+				fr_strerror_printf("Attribute \"%s\" parsed as %s, needed attribute.  "
+						   "Check local dictionaries", attr,
+						   fr_int2str(tmpl_names, map->lhs->type, "<INVALID>"));
+				goto error;
+			}
+			da = map->lhs->tmpl_da;
+		} else {
+			if ((size_t)(end - p) < CACHE_BINARY_ATTR_LEN) goto too_short;
+
+			da = fr_dict_attr_by_num(NULL, binary_get_uint32(p + 7), binary_get_uint32(p + 11));
+			if (!da) {
+				fr_strerror_printf("Unknown attribute %u (vendor %u).  Check local dictionaries",
+						   binary_get_uint32(p + 11), binary_get_uint32(p + 7));
+				goto error;
+			}
+
+			/*
+			 *	The name is only used for debug output, so use
+			 *	the attribute name instead of printing the full
+			 *	reference.
+			 */
+			map->lhs = talloc(map, vp_tmpl_t);
+			if (!map->lhs) goto oom;
+			tmpl_init(map->lhs, TMPL_TYPE_ATTR, da->name, -1, T_BARE_WORD);
+			map->lhs->tmpl_request = p[0];
+			map->lhs->tmpl_list = p[1];
+			map->lhs->tmpl_tag = (int8_t)p[2];
+			map->lhs->tmpl_num = (int32_t)binary_get_uint32(p + 3);
+			map->lhs->tmpl_da = da;
+			p += CACHE_BINARY_ATTR_LEN;
+		}
+
+		if ((end - p) < 5) goto too_short;
+		type = p[0];
+		len = binary_get_uint32(p + 1);
+		p += 5;
+		if ((size_t)(end - p) < len) goto too_short;
+
+		if (type != da->type) {
+			fr_strerror_printf("Serialized value of %s is %s, expected %s.  Check local dictionaries",
+					   da->name, fr_int2str(dict_attr_types, type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"));
+			goto error;
+		}
+
+		map->rhs = talloc(map, vp_tmpl_t);
+		if (!map->rhs) goto oom;
+		tmpl_init(map->rhs, TMPL_TYPE_DATA, "", 0, T_BARE_WORD);
+		value = &map->rhs->tmpl_value_box;
+
+		if (flags & CACHE_BINARY_FLAG_VALUE_STR) {
+			if (fr_value_box_from_str(map->rhs, value, &type, da, (char const *)p, len, '\0') < 0) goto error;
+		} else {
+			width = binary_value_width(type);
+			if ((width < 0) || ((width > 0) && (len != (size_t)width))) {
+				fr_strerror_printf("Serialized value of %s has invalid length %zu", da->name, len);
+				goto error;
+			}
+
+			value->type = type;
+			switch (type) {
+			case FR_TYPE_STRING:
+				value->datum.strvalue = talloc_bstrndup(map->rhs, (char const *)p, len);
+				if (!value->datum.strvalue) goto oom;
+				value->datum.length = len;
+				break;
+
+			case FR_TYPE_OCTETS:
+				if (fr_value_box_memdup(map->rhs, value, p, len, false) < 0) goto error;
+				break;
+
+			default:
+				binary_get_value(value, p);
+				if (fr_dict_enum_types[type]) value->datum.enumv = da;
+				break;
+			}
+		}
+		p += len;
+
+		*last = map;
+		last = &(*last)->next;
+		continue;
+
+	oom:
+		fr_strerror_printf("Out of memory");
+		goto error;
+
+	too_short:
+		fr_strerror_printf("Serialized cache entry truncated");
+	error:
+		talloc_free(map);
+		return -1;
+	}
+
+	return 0;
+}
@@ -25,5 +25,15 @@
  */
 RCSIDH(serialize_h, "$Id$")
 
+typedef enum {
+	CACHE_SERIALIZE_TEXT = 0,			//!< Humanly readable, one map per line.
+	CACHE_SERIALIZE_BINARY				//!< Compact binary encoding.
+} cache_serialize_t;
+
+extern const FR_NAME_NUMBER cache_serialize_table[];
+
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen);
+
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
@@ -30,38 +30,72 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** Index of DEFAULT entries
+ *
+ * DEFAULT entries which have a "==" check are put into a bucket for
+ * the attribute and value.  Everything else is residual, and has to
+ * be checked for every request.
+ */
+typedef struct rlm_files_index_t {
+	fr_dict_attr_t const	**keys;			//!< Attributes the buckets are for.
+
+	PAIR_LIST const		**defaults;		//!< All DEFAULT entries, in order.
+
+	fr_hash_table_t		*buckets;		//!< of rlm_files_bucket_t.
+	uint32_t		*residual;		//!< Positions of entries with no key, in order.
+} rlm_files_index_t;
+
+/*
+ *	Entries are referred to by their position in the list of
+ *	DEFAULT entries, not by line number, as entries from $INCLUDEd
+ *	files have their own line numbers.
+ */
+typedef struct rlm_files_bucket_t {
+	VALUE_PAIR const	*vp;			//!< Key attribute and value.
+	uint32_t		count;			//!< Of entries which could go in this bucket.
+	uint32_t		*positions;		//!< Of matching entries, in order.
+} rlm_files_bucket_t;
+
+/** A parsed users file
+ *
+ */
+typedef struct rlm_files_data_t {
+	rbtree_t		*tree;			//!< Entries by name, each a list in line order.
+	rlm_files_index_t	*index;			//!< Of the DEFAULT entries.  May be NULL.
+} rlm_files_data_t;
+
 typedef struct rlm_files_t {
 	char const *key;
 
 	char const *filename;
-	rbtree_t *common;
+	rlm_files_data_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	rlm_files_data_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	rlm_files_data_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	rlm_files_data_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	rlm_files_data_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	rlm_files_data_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	rlm_files_data_t *postauth_users;
 } rlm_files_t;
 
 
@@ -97,16 +131,412 @@ static int pairlist_cmp(void const *a, void const *b)
 		      ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
+/*
+ *	Whether a check item can be used to index an entry.  It must
+ *	be a plain equality check, and the value must be known when
+ *	the file is read.  Registered comparison functions are checked
+ *	for when the index is used, as modules may register them after
+ *	we've read the file.
+ */
+static bool index_item_ok(VALUE_PAIR const *vp)
+{
+	if (vp->op != T_OP_CMP_EQ) return false;
+	if (vp->type == VT_XLAT) return false;
+	if (vp->da->flags.has_tag) return false;
+
+	/*
+	 *	paircompare() treats these "server" check items as
+	 *	always matching, so they're never in the request.  It
+	 *	also skips User-Password checks when there's no
+	 *	User-Password in the request.
+	 */
+	if (!vp->da->vendor) switch (vp->da->attr) {
+	case PW_CRYPT_PASSWORD:
+	case PW_AUTH_TYPE:
+	case PW_AUTZ_TYPE:
+	case PW_ACCT_TYPE:
+	case PW_SESSION_TYPE:
+	case PW_STRIP_USER_NAME:
+	case PW_USER_PASSWORD:
+		return false;
+
+	default:
+		break;
+	}
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_IPV4_ADDR:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ *	Find the first check item in an entry we can index by "da".
+ */
+static VALUE_PAIR const *index_item(PAIR_LIST const *entry, fr_dict_attr_t const *da)
+{
+	VALUE_PAIR const *vp;
+
+	for (vp = entry->check; vp; vp = vp->next) {
+		if ((vp->da == da) && index_item_ok(vp)) return vp;
+	}
+
+	return NULL;
+}
+
+/*
+ *	These have to agree with radius_compare_vps() as to which
+ *	values are equal.
+ */
+static uint32_t bucket_hash(void const *data)
+{
+	VALUE_PAIR const	*vp = ((rlm_files_bucket_t const *) data)->vp;
+	uint32_t		hash;
+
+	hash = fr_hash(&vp->da, sizeof(vp->da));
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		return fr_hash_update(vp->vp_strvalue, strlen(vp->vp_strvalue), hash);
+
+	case FR_TYPE_OCTETS:
+		return fr_hash_update(vp->vp_octets, vp->vp_length, hash);
+
+	case FR_TYPE_UINT8:
+		return fr_hash_update(&vp->vp_uint8, sizeof(vp->vp_uint8), hash);
+
+	case FR_TYPE_UINT16:
+		return fr_hash_update(&vp->vp_short, sizeof(vp->vp_short), hash);
+
+	case FR_TYPE_UINT32:
+		return fr_hash_update(&vp->vp_uint32, sizeof(vp->vp_uint32), hash);
+
+	case FR_TYPE_IPV4_ADDR:
+		return fr_hash_update(&vp->vp_ipv4addr, sizeof(vp->vp_ipv4addr), hash);
+
+	default:
+		return hash;
+	}
+}
+
+static int bucket_cmp(void const *one, void const *two)
+{
+	VALUE_PAIR const *a = ((rlm_files_bucket_t const *) one)->vp;
+	VALUE_PAIR const *b = ((rlm_files_bucket_t const *) two)->vp;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	switch (a->vp_type) {
+	case FR_TYPE_STRING:
+		return strcmp(a->vp_strvalue, b->vp_strvalue);
+
+	case FR_TYPE_OCTETS:
+		if (a->vp_length != b->vp_length) return (a->vp_length < b->vp_length) ? -1 : +1;
+		return memcmp(a->vp_octets, b->vp_octets, a->vp_length);
+
+	case FR_TYPE_UINT8:
+		return a->vp_uint8 - b->vp_uint8;
+
+	case FR_TYPE_UINT16:
+		return a->vp_short - b->vp_short;
+
+	case FR_TYPE_UINT32:
+		if (a->vp_uint32 == b->vp_uint32) return 0;
+		return (a->vp_uint32 < b->vp_uint32) ? -1 : +1;
+
+	case FR_TYPE_IPV4_ADDR:
+		if (a->vp_ipv4addr == b->vp_ipv4addr) return 0;
+		return (ntohl(a->vp_ipv4addr) < ntohl(b->vp_ipv4addr)) ? -1 : +1;
+
+	default:
+		return 0;
+	}
+}
+
+static int position_cmp(void const *one, void const *two)
+{
+	uint32_t a = *(uint32_t const *) one;
+	uint32_t b = *(uint32_t const *) two;
+
+	if (a < b) return -1;
+	if (a > b) return +1;
+	return 0;
+}
+
+/*
+ *	Add a position to the end of a talloc'd array of positions.
+ */
+static int position_append(TALLOC_CTX *ctx, uint32_t **positions, uint32_t position)
+{
+	size_t		num = talloc_array_length(*positions);
+	uint32_t	*array;
+
+	array = talloc_realloc(ctx, *positions, uint32_t, num + 1);
+	if (!array) return -1;
+
+	array[num] = position;
+	*positions = array;
+
+	return 0;
+}
+
+/*
+ *	Find the first check item in an entry we can index by, for
+ *	each attribute, starting after "prev".
+ */
+static VALUE_PAIR const *index_item_next(PAIR_LIST const *entry, VALUE_PAIR const *prev)
+{
+	VALUE_PAIR const *vp;
+
+	for (vp = prev ? prev->next : entry->check; vp; vp = vp->next) {
+		if (!index_item_ok(vp)) continue;
+
+		if (index_item(entry, vp->da) == vp) return vp;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Index the DEFAULT entries.
+ *
+ *	An entry may have "==" checks for more than one attribute, but
+ *	it only goes into one bucket.  We pick the one with the fewest
+ *	other entries, so that requests have as few candidates as
+ *	possible.
+ */
+static int index_build(TALLOC_CTX *ctx, rlm_files_index_t **out, char const *filename, PAIR_LIST const *defaults)
+{
+	size_t			i, num_keys;
+	uint32_t		position;
+	PAIR_LIST const		*entry;
+	VALUE_PAIR const	*vp;
+	rlm_files_index_t	*index;
+	rlm_files_bucket_t	my_bucket, *bucket, *best;
+
+	*out = NULL;
+
+	index = talloc_zero(ctx, rlm_files_index_t);
+	if (!index) return -1;
+
+	index->buckets = fr_hash_table_create(index, bucket_hash, bucket_cmp, NULL);
+	if (!index->buckets) goto error;
+
+	/*
+	 *	Count how many entries could go into each bucket.
+	 */
+	for (entry = defaults; entry; entry = entry->next) {
+		for (vp = index_item_next(entry, NULL); vp; vp = index_item_next(entry, vp)) {
+			my_bucket.vp = vp;
+			bucket = fr_hash_table_finddata(index->buckets, &my_bucket);
+			if (!bucket) {
+				bucket = talloc_zero(index, rlm_files_bucket_t);
+				if (!bucket) goto error;
+
+				bucket->vp = vp;
+				if (!fr_hash_table_insert(index->buckets, bucket)) goto error;
+			}
+			bucket->count++;
+		}
+	}
+
+	/*
+	 *	Nothing we can index.
+	 */
+	if (!fr_hash_table_num_elements(index->buckets)) {
+		talloc_free(index);
+		return 0;
+	}
+
+	/*
+	 *	Put each entry into its smallest bucket.  Entries are
+	 *	added in order, so each bucket is in order, too.
+	 */
+	for (entry = defaults, position = 0; entry; entry = entry->next, position++) {
+		PAIR_LIST const		**array;
+
+		array = talloc_realloc(index, index->defaults, PAIR_LIST const *, position + 1);
+		if (!array) goto error;
+
+		array[position] = entry;
+		index->defaults = array;
+
+		best = NULL;
+		for (vp = index_item_next(entry, NULL); vp; vp = index_item_next(entry, vp)) {
+			my_bucket.vp = vp;
+			bucket = fr_hash_table_finddata(index->buckets, &my_bucket);
+			if (!best || (bucket->count < best->count)) best = bucket;
+		}
+
+		if (!best) {
+			if (position_append(index, &index->residual, position) < 0) goto error;
+			continue;
+		}
+
+		if (position_append(best, &best->positions, position) < 0) goto error;
+
+		/*
+		 *	Requests are only checked against buckets for
+		 *	the key attributes.
+		 */
+		num_keys = talloc_array_length(index->keys);
+		for (i = 0; i < num_keys; i++) if (index->keys[i] == best->vp->da) break;
+
+		if (i == num_keys) {
+			fr_dict_attr_t const **keys;
+
+			keys = talloc_realloc(index, index->keys, fr_dict_attr_t const *, num_keys + 1);
+			if (!keys) goto error;
+
+			keys[num_keys] = best->vp->da;
+			index->keys = keys;
+
+			DEBUG("[%s] Indexing DEFAULT entries by %s", filename, best->vp->da->name);
+		}
+	}
+
+	DEBUG("[%s] %zu of %u DEFAULT entries are not indexed", filename,
+	      talloc_array_length(index->residual), position);
+
+	*out = index;
+
+	return 0;
+
+error:
+	talloc_free(index);
+	return -1;
+}
+
+/*
+ *	We can't use the index if any key attribute has a comparison
+ *	function, as the check items aren't then simple comparisons.
+ */
+static bool index_usable(rlm_files_index_t const *index)
+{
+	size_t i, num_keys = talloc_array_length(index->keys);
+
+	for (i = 0; i < num_keys; i++) {
+		if (radius_find_compare(index->keys[i])) return false;
+	}
+
+	return true;
+}
+
+/*
+ *	Get the positions of the DEFAULT entries which might match the
+ *	request, in order.  That is the residual entries, and the
+ *	entries in the buckets for the request's key attributes.  The
+ *	DEFAULT entries we skip can't match, as the request doesn't
+ *	have the value they check for.
+ */
+static uint32_t *index_candidates(TALLOC_CTX *ctx, size_t *num, rlm_files_index_t const *index,
+				  fr_pair_list_index_t *list)
+{
+	size_t			i, j, used, count = talloc_array_length(index->residual);
+	size_t			num_keys = talloc_array_length(index->keys);
+	uint32_t		*out;
+	VALUE_PAIR		*vp;
+	rlm_files_bucket_t	my_bucket, *bucket;
+
+	out = talloc_array(ctx, uint32_t, count);
+	if (!out) return NULL;
+
+	if (count) memcpy(out, index->residual, sizeof(out[0]) * count);
+
+	for (i = 0; i < num_keys; i++) {
+		for (vp = fr_pair_list_index_find(list, index->keys[i], TAG_ANY); vp; vp = vp->next) {
+			size_t		num_positions;
+			uint32_t	*array;
+
+			if (vp->da != index->keys[i]) continue;
+
+			my_bucket.vp = vp;
+			bucket = fr_hash_table_finddata(index->buckets, &my_bucket);
+			if (!bucket) continue;
+
+			num_positions = talloc_array_length(bucket->positions);
+
+			array = talloc_realloc(ctx, out, uint32_t, count + num_positions);
+			if (!array) {
+				talloc_free(out);
+				return NULL;
+			}
+			out = array;
+
+			memcpy(out + count, bucket->positions, sizeof(out[0]) * num_positions);
+			count += num_positions;
+		}
+	}
+
+	qsort(out, count, sizeof(out[0]), position_cmp);
+
+	/*
+	 *	The same value may be in the request more than once,
+	 *	so remove any duplicates.
+	 */
+	for (j = 0, used = 0; j < count; j++) {
+		if (used && (out[used - 1] == out[j])) continue;
+		out[used++] = out[j];
+	}
+
+	*num = used;
+
+	return out;
+}
+
+/*
+ *	Get the candidate DEFAULT entries, skipping the ones before
+ *	"start", which we've already checked.
+ */
+static int index_defaults(TALLOC_CTX *ctx, rlm_files_index_t const *index, fr_pair_list_index_t *list,
+			  uint32_t start, uint32_t **defaults, size_t *num_defaults, size_t *i)
+{
+	talloc_free(*defaults);
+
+	*defaults = index_candidates(ctx, num_defaults, index, list);
+	if (!*defaults) return -1;
+
+	for (*i = 0; (*i < *num_defaults) && ((*defaults)[*i] < start); (*i)++);
+
+	return 0;
+}
+
+/*
+ *	Get the next DEFAULT entry, from the candidates if we're using
+ *	the index, otherwise from the list.  "start" is set to the
+ *	position after the entry we're moving past.
+ */
+static PAIR_LIST const *default_next(rlm_files_index_t const *index, PAIR_LIST const *pl,
+				     uint32_t const *defaults, size_t num_defaults, size_t *i, uint32_t *start)
+{
+	if (!index) return pl->next;
+
+	*start = defaults[(*i)++] + 1;
+	if (*i >= num_defaults) return NULL;
+
+	return index->defaults[defaults[*i]];
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_data_t **pdata)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
 	PAIR_LIST *user_list, *default_list, **default_tail;
 	rbtree_t *tree;
+	rlm_files_data_t *data;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pdata = NULL;
 		return 0;
 	}
 
@@ -186,9 +616,16 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
+	data = talloc_zero(ctx, rlm_files_data_t);
+	if (!data) {
+		pairlist_free(&users);
+		return -1;
+	}
+
+	tree = rbtree_create(data, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
 	if (!tree) {
 		pairlist_free(&users);
+		talloc_free(data);
 		return -1;
 	}
 
@@ -222,7 +659,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 				error:
 					pairlist_free(&entry);
 					pairlist_free(&next);
-					talloc_free(tree);
+					talloc_free(data);
 					return -1;
 				}
 
@@ -258,7 +695,17 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	*ptree = tree;
+	/*
+	 *	Matching a request against the DEFAULT entries means
+	 *	checking all of them, so index them, too.
+	 */
+	if (index_build(data, &data->index, filename, default_list) < 0) {
+		talloc_free(data);
+		return -1;
+	}
+
+	data->tree = tree;
+	*pdata = data;
 
 	return 0;
 }
@@ -293,7 +740,8 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename,
+			       rlm_files_data_t const *data,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name, *match;
@@ -303,6 +751,11 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	fr_pair_list_index_t *index;
+	rlm_files_index_t const *files_index = NULL;
+	uint32_t	*defaults = NULL, next_default = 0;
+	size_t		num_defaults = 0, i_default = 0;
+	VALUE_PAIR	*last = NULL;
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -320,12 +773,38 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!data) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = rbtree_finddata(data->tree, &my_pl);
 	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	default_pl = rbtree_finddata(data->tree, &my_pl);
+
+	/*
+	 *	Every entry is compared against the same request
+	 *	attributes, so index them instead of walking the list
+	 *	for every check item.  Matching entries only change
+	 *	the reply and control lists.
+	 */
+	index = fr_pair_list_index_alloc(request, &request_packet->vps);
+	if (!index) return RLM_MODULE_FAIL;
+
+	/*
+	 *	Only check the DEFAULT entries which might match.
+	 */
+	if (default_pl && data->index && index_usable(data->index)) {
+		files_index = data->index;
+
+		if (index_defaults(request, files_index, index, 0, &defaults, &num_defaults, &i_default) < 0) {
+		fail:
+			talloc_free(defaults);
+			talloc_free(index);
+			return RLM_MODULE_FAIL;
+		}
+		default_pl = (i_default < num_defaults) ? files_index->defaults[defaults[i_default]] : NULL;
+
+		for (last = request_packet->vps; last && last->next; last = last->next);
+	}
 
 	/*
 	 *	Find the entry for the user.
@@ -347,7 +826,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = default_next(files_index, default_pl, defaults, num_defaults,
+						  &i_default, &next_default);
 
 		} else if (user_pl->lineno < default_pl->lineno) {
 			pl = user_pl;
@@ -357,7 +837,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = default_next(files_index, default_pl, defaults, num_defaults,
+						  &i_default, &next_default);
 		}
 
 		check_tmp = fr_pair_list_copy(request, pl->check);
@@ -371,7 +852,7 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			}
 		}
 
-		if (paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps) == 0) {
+		if (paircompare_index(request, index, check_tmp, &reply_packet->vps) == 0) {
 			RDEBUG2("Found match \"%s\" one line %d of %s", match, pl->lineno, filename);
 			found = true;
 
@@ -386,8 +867,24 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			 */
 			if (!fall_through(pl->reply)) break;
 		}
+
+		/*
+		 *	A comparison function added attributes to the
+		 *	request (e.g. Stripped-User-Name), so DEFAULT
+		 *	entries we skipped may now match.  Look again.
+		 */
+		if (files_index && (last ? last->next : request_packet->vps)) {
+			if (index_defaults(request, files_index, index, next_default,
+					   &defaults, &num_defaults, &i_default) < 0) goto fail;
+			default_pl = (i_default < num_defaults) ? files_index->defaults[defaults[i_default]] : NULL;
+
+			for (last = request_packet->vps; last && last->next; last = last->next);
+		}
 	}
 
+	talloc_free(defaults);
+	talloc_free(index);
+
 	/*
 	 *	Remove server internal parameters.
 	 */
@@ -148,3 +148,449 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 
 	return conn;
 }
+
+/** An asynchronous search issued on behalf of a request
+ */
+struct rlm_ldap_query {
+	rlm_ldap_thread_t	*thread;		//!< Thread the search was issued by.
+	REQUEST			*request;		//!< Request the search was issued for.
+
+	int			msgid;			//!< Returned by ldap_search_ext.
+	char			*dn;			//!< Base DN of the search, for error messages.
+
+	rlm_ldap_search_cb_t	callback;		//!< Called with the result.
+	void			*uctx;			//!< Passed to callback.
+
+	fr_event_timer_t	*ev;			//!< Result timeout.
+
+	LDAPMessage		*result;		//!< Complete result, set during demux.
+	rlm_ldap_query_t	*next;			//!< Next query in a list of completed or failed queries.
+};
+
+static int _query_cmp(void const *one, void const *two)
+{
+	rlm_ldap_query_t const *a = one;
+	rlm_ldap_query_t const *b = two;
+
+	return a->msgid - b->msgid;
+}
+
+static int _query_list_add(void *ctx, void *data)
+{
+	rlm_ldap_query_t **head = ctx;
+	rlm_ldap_query_t *query = data;
+
+	query->next = *head;
+	*head = query;
+
+	return 0;
+}
+
+/** Remove a query from the set of outstanding queries, and stop its timer
+ *
+ */
+static void query_remove(rlm_ldap_query_t *query)
+{
+	rlm_ldap_thread_t *t = query->thread;
+
+	rbtree_deletebydata(t->queries, query);
+	if (query->ev) fr_event_timer_delete(t->el, &query->ev);
+}
+
+/** Close the thread's connection, failing any outstanding searches
+ *
+ * Searches issued by the result callbacks will open a new connection.
+ *
+ * @param[in] t		thread whose connection failed.
+ */
+static void mod_conn_async_close(rlm_ldap_thread_t *t)
+{
+	rlm_ldap_query_t	*head = NULL, *query, *next;
+	fr_ldap_conn_t		*conn = t->conn;
+
+	if (!conn) return;
+
+	(void) fr_event_fd_delete(t->el, t->fd);
+	t->conn = NULL;
+	t->fd = -1;
+
+	/*
+	 *	Callbacks may still be running for results
+	 *	received on this connection, so defer freeing
+	 *	it until demux has finished.
+	 */
+	if (t->demux && !t->closed) {
+		t->closed = conn;
+	} else {
+		talloc_free(conn);
+	}
+
+	rbtree_walk(t->queries, RBTREE_IN_ORDER, _query_list_add, &head);
+
+	for (query = head; query; query = next) {
+		next = query->next;
+
+		query_remove(query);
+		query->callback(query->request, NULL, LDAP_PROC_BAD_CONN, NULL, query->uctx);
+		talloc_free(query);
+	}
+}
+
+/** Check the result of a search for errors, as #fr_ldap_search does
+ *
+ */
+static fr_ldap_rcode_t query_result_status(rlm_ldap_query_t *query, fr_ldap_conn_t *conn)
+{
+	REQUEST		*request = query->request;
+	fr_ldap_rcode_t	status = LDAP_PROC_SUCCESS;
+	LDAPMessage	*msg;
+	int		count;
+
+	for (msg = ldap_first_message(conn->handle, query->result);
+	     msg;
+	     msg = ldap_next_message(conn->handle, msg)) {
+		status = fr_ldap_error_check(NULL, conn, msg, query->dn);
+		if (status != LDAP_PROC_SUCCESS) {
+			RPEDEBUG("Failed performing search");
+			goto error;
+		}
+	}
+
+	count = ldap_count_entries(conn->handle, query->result);
+	if (count < 0) {
+		REDEBUG("Error counting results: %s", fr_ldap_error_str(conn));
+		status = LDAP_PROC_ERROR;
+		goto error;
+	}
+
+	if (count == 0) {
+		RDEBUG("Search returned no results");
+		status = LDAP_PROC_NO_RESULT;
+		goto error;
+	}
+
+	return LDAP_PROC_SUCCESS;
+
+error:
+	ldap_msgfree(query->result);
+	query->result = NULL;
+
+	return status;
+}
+
+/** Process results received on the thread's connection
+ *
+ * Every complete result libldap has received is retrieved, and passed to the
+ * callback of the search it belongs to.  Results for searches which have timed
+ * out, or been cancelled, are discarded.
+ */
+static void _mod_conn_async_readable(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	static struct timeval		poll = { 0, 0 };
+	rlm_ldap_thread_t		*t = talloc_get_type_abort(ctx, rlm_ldap_thread_t);
+	fr_ldap_handle_config_t const	*handle_config = &t->inst->handle_config;
+	fr_ldap_conn_t			*conn = t->conn;
+	rlm_ldap_query_t		*head = NULL, **tail = &head, *query, *next;
+	rlm_ldap_query_t		find = { .msgid = -1 };
+	LDAPMessage			*result;
+	bool				error = false;
+
+	rad_assert(conn);
+
+	/*
+	 *	Drain the socket.  The fd is level triggered, so
+	 *	anything left unread would wake us again straight
+	 *	away.  Remove the completed queries as we go, so
+	 *	that they're not failed if a callback closes the
+	 *	connection.
+	 */
+	for (;;) {
+		int ret;
+
+		result = NULL;
+		ret = ldap_result(conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &poll, &result);
+		if (ret == 0) break;	/* Nothing more received */
+
+		/*
+		 *	Error, or the server closed the connection
+		 */
+		if (ret < 0) {
+			error = true;
+			break;
+		}
+
+		find.msgid = ldap_msgid(result);
+
+		/*
+		 *	Usually a notice of disconnection, the server
+		 *	will close the connection after sending it.
+		 */
+		if (find.msgid == 0) {
+			WARN("Received unsolicited message, closing connection");
+			ldap_msgfree(result);
+			error = true;
+			break;
+		}
+
+		query = rbtree_finddata(t->queries, &find);
+		if (!query) {
+			DEBUG3("Discarding result for msgid %i, doesn't match any outstanding searches",
+			       find.msgid);
+			ldap_msgfree(result);
+			continue;
+		}
+
+		query_remove(query);
+		query->result = result;
+		query->next = NULL;
+		*tail = query;
+		tail = &query->next;
+	}
+
+	t->demux = true;
+	for (query = head; query; query = next) {
+		fr_ldap_rcode_t status;
+
+		next = query->next;
+
+		status = query_result_status(query, conn);
+		query->callback(query->request, conn, status, query->result, query->uctx);
+		talloc_free(query);
+	}
+	t->demux = false;
+
+	if (error && (t->conn == conn)) {
+		(void) fr_ldap_error_check(NULL, conn, NULL, NULL);
+		PERROR("Connection failed");
+		mod_conn_async_close(t);
+	}
+
+	TALLOC_FREE(t->closed);
+}
+
+static void _mod_conn_async_error(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	rlm_ldap_thread_t		*t = talloc_get_type_abort(ctx, rlm_ldap_thread_t);
+	fr_ldap_handle_config_t const	*handle_config = &t->inst->handle_config;
+
+	ERROR("Connection failed");
+	mod_conn_async_close(t);
+}
+
+static void _mod_conn_query_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *ctx)
+{
+	rlm_ldap_query_t	*query = talloc_get_type_abort(ctx, rlm_ldap_query_t);
+	rlm_ldap_thread_t	*t = query->thread;
+	REQUEST			*request = query->request;
+
+	query->ev = NULL;	/* Timer has been removed from the event list */
+	query_remove(query);
+
+	REDEBUG("Timeout waiting for search result");
+
+	/*
+	 *	Tell the server to stop sending results
+	 */
+	if (t->conn) ldap_abandon_ext(t->conn->handle, query->msgid, NULL, NULL);
+
+	query->callback(request, t->conn, LDAP_PROC_TIMEOUT, NULL, query->uctx);
+	talloc_free(query);
+}
+
+/** Open the connection searches are multiplexed over, and register it with the event list
+ *
+ */
+static int mod_conn_async_open(rlm_ldap_thread_t *t)
+{
+	fr_ldap_handle_config_t const	*config = &t->inst->handle_config;
+	fr_ldap_handle_config_t		*handle_config;
+	fr_ldap_conn_t			*conn;
+	int				fd = -1;
+
+	memcpy(&handle_config, &config, sizeof(handle_config)); /* const */
+
+	/*
+	 *	This is the only part of the process that
+	 *	blocks, and only happens once per thread,
+	 *	or after the connection fails.
+	 */
+	conn = mod_conn_create(t, handle_config, &handle_config->net_timeout);
+	if (!conn) return -1;
+
+	/*
+	 *	libldap opens new connections to chase referrals,
+	 *	and we'd never see the events for those.  Referrals
+	 *	are returned to us instead, and ignored.
+	 */
+	if (ldap_set_option(conn->handle, LDAP_OPT_REFERRALS, LDAP_OPT_OFF) != LDAP_OPT_SUCCESS) {
+		ERROR("Failed disabling referral chasing");
+	error:
+		talloc_free(conn);
+		return -1;
+	}
+
+	if ((ldap_get_option(conn->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+		ERROR("Failed retrieving file descriptor from LDAP handle");
+		goto error;
+	}
+
+	if (fr_event_fd_insert(t->el, fd, _mod_conn_async_readable, NULL, _mod_conn_async_error, t) < 0) {
+		PERROR("Failed registering file descriptor %i", fd);
+		goto error;
+	}
+
+	t->conn = conn;
+	t->fd = fd;
+
+	return 0;
+}
+
+/** Initialise the thread specific state used for asynchronous searches
+ *
+ * The connection itself isn't opened until it's needed.
+ *
+ * @param[in] thread	to initialise.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] el	Event list serviced by this thread.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mod_conn_thread_init(rlm_ldap_thread_t *thread, rlm_ldap_t const *inst, fr_event_list_t *el)
+{
+	thread->inst = inst;
+	thread->el = el;
+	thread->fd = -1;
+
+	thread->queries = rbtree_create(thread, _query_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!thread->queries) return -1;
+
+	return 0;
+}
+
+/** Close the thread's connection, and free any outstanding searches
+ *
+ * No callbacks are called, as the requests that issued the searches are gone.
+ *
+ * @param[in] thread	to free.
+ */
+void mod_conn_thread_free(rlm_ldap_thread_t *thread)
+{
+	rlm_ldap_query_t *head = NULL, *query, *next;
+
+	if (thread->conn) {
+		(void) fr_event_fd_delete(thread->el, thread->fd);
+		TALLOC_FREE(thread->conn);
+	}
+
+	rbtree_walk(thread->queries, RBTREE_IN_ORDER, _query_list_add, &head);
+	for (query = head; query; query = next) {
+		next = query->next;
+
+		query_remove(query);
+		talloc_free(query);
+	}
+	TALLOC_FREE(thread->queries);
+}
+
+/** Start an asynchronous search on the thread's connection
+ *
+ * Many searches may be outstanding on the connection at once.  The result of the search
+ * is passed to callback, which is always called from the event loop, never from within
+ * this function.
+ *
+ * @param[in] thread		to issue the search from.
+ * @param[in] request		Current request.
+ * @param[in] dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.
+ * @param[in] attrs		to retrieve.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ * @param[in] callback		to call with the result.
+ * @param[in] uctx		to pass to callback.
+ * @return
+ *	- The outstanding query, which may be passed to #mod_conn_search_cancel.
+ *	- NULL if the search couldn't be started.
+ */
+rlm_ldap_query_t *mod_conn_search_async(rlm_ldap_thread_t *thread, REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls, rlm_ldap_search_cb_t callback, void *uctx)
+{
+	rlm_ldap_t const	*inst = thread->inst;
+	rlm_ldap_query_t	*query;
+	fr_ldap_rcode_t		status;
+	struct timeval		now, when;
+	int			tries = 0;
+
+	MEM(query = talloc_zero(thread, rlm_ldap_query_t));
+	query->thread = thread;
+	query->request = request;
+	query->callback = callback;
+	query->uctx = uctx;
+	query->dn = talloc_typed_strdup(query, dn);
+
+retry:
+	if (!thread->conn && (mod_conn_async_open(thread) < 0)) {
+		REDEBUG("No connection available");
+	error:
+		talloc_free(query);
+		return NULL;
+	}
+
+#ifdef LDAP_CONTROL_X_SESSION_TRACKING
+	/*
+	 *	Controls are sent with the search, so they can be
+	 *	cleared as soon as it's been issued.
+	 */
+	if (inst->session_tracking && (fr_ldap_control_add_session_tracking(thread->conn, request) < 0)) goto error;
+#endif
+
+	status = fr_ldap_search_async(&query->msgid, request, &thread->conn, dn, scope, filter, attrs,
+				      serverctrls, NULL);
+	fr_ldap_control_clear(thread->conn);
+	if (status != LDAP_PROC_SUCCESS) {
+		/*
+		 *	Retry once on a new connection if the server
+		 *	went away.
+		 */
+		if ((fr_ldap_error_check(NULL, thread->conn, NULL, dn) == LDAP_PROC_BAD_CONN) && (tries++ == 0)) {
+			mod_conn_async_close(thread);
+			goto retry;
+		}
+		goto error;
+	}
+
+	if (!rbtree_insert(thread->queries, query)) {
+		REDEBUG("Failed tracking search (msgid %i)", query->msgid);
+		ldap_abandon_ext(thread->conn->handle, query->msgid, NULL, NULL);
+		goto error;
+	}
+
+	fr_event_list_time(&now, thread->el);
+	fr_timeval_add(&when, &now, &inst->handle_config.res_timeout);
+	if (fr_event_timer_insert(thread->el, _mod_conn_query_timeout, query, &when, &query->ev) < 0) {
+		RPEDEBUG("Failed inserting result timeout");
+		ldap_abandon_ext(thread->conn->handle, query->msgid, NULL, NULL);
+		query_remove(query);
+		goto error;
+	}
+
+	RDEBUG3("Waiting for search result (msgid %i)", query->msgid);
+
+	return query;
+}
+
+/** Cancel an outstanding search
+ *
+ * The server is told to stop sending results, and the callback will not be called.
+ *
+ * @param[in] query	to cancel.  Must not be used after its callback has been called.
+ */
+void mod_conn_search_cancel(rlm_ldap_query_t *query)
+{
+	rlm_ldap_thread_t *t = query->thread;
+
+	if (t->conn) ldap_abandon_ext(t->conn->handle, query->msgid, NULL, NULL);
+	query_remove(query);
+	talloc_free(query);
+}
@@ -404,6 +404,43 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 	return rcode;
 }
 
+/** Expand the base DN and filter used to search for group objects the user is a member of
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[out] filter Buffer to write the expanded filter to.
+ * @param[in] filter_len Length of filter.
+ * @param[out] base_dn Where to write the expanded base DN.
+ * @param[in] base_dn_buff to expand the base DN into.
+ * @param[in] base_dn_len Length of base_dn_buff.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_groupobj_search_expand(rlm_ldap_t const *inst, REQUEST *request,
+					   char *filter, size_t filter_len,
+					   char const **base_dn, char *base_dn_buff, size_t base_dn_len)
+{
+	char const *filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
+
+	rad_assert(inst->groupobj_base_dn);
+
+	if (fr_ldap_xlat_filter(request,
+				 filters, sizeof(filters) / sizeof(*filters),
+				 filter, filter_len) < 0) {
+		return -1;
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, base_dn_len, request,
+			inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating base_dn");
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Convert group membership information into attributes
  *
  * @param[in] inst rlm_ldap configuration.
@@ -413,47 +450,105 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
  */
 rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
 	fr_ldap_rcode_t status;
-	int ldap_errno;
 
 	LDAPMessage *result = NULL;
-	LDAPMessage *entry;
 
 	char const *base_dn;
 	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
 
-	char const *filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
 	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
 
 	char const *attrs[] = { inst->groupobj_name_attr, NULL };
 
-	VALUE_PAIR *vp;
-	char *dn;
-
-	rad_assert(inst->groupobj_base_dn);
-
 	if (!inst->groupobj_membership_filter) {
 		RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
 
 		return RLM_MODULE_OK;
 	}
 
-	if (fr_ldap_xlat_filter(request,
-				 filters, sizeof(filters) / sizeof(*filters),
-				 filter, sizeof(filter)) < 0) {
+	if (rlm_ldap_groupobj_search_expand(inst, request, filter, sizeof(filter),
+					    &base_dn, base_dn_buff, sizeof(base_dn_buff)) < 0) {
 		return RLM_MODULE_INVALID;
 	}
 
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Failed creating base_dn");
+	status = fr_ldap_search(&result, request, pconn, base_dn,
+				inst->groupobj_scope, filter, attrs, NULL, NULL);
 
-		return RLM_MODULE_INVALID;
+	return rlm_ldap_cacheable_groupobj_process(inst, request, *pconn ? (*pconn)->handle : NULL, status, result);
+}
+
+/** Start an asynchronous search for group objects the user is a member of
+ *
+ * The result should be passed to #rlm_ldap_cacheable_groupobj_process.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] thread to issue the search from.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to callback.
+ * @param[out] rcode The status of the operation if no search was started.
+ * @return
+ *	- The outstanding query.
+ *	- NULL if no search was required (rcode will be #RLM_MODULE_OK), or on error.
+ */
+rlm_ldap_query_t *rlm_ldap_cacheable_groupobj_async(rlm_ldap_t const *inst, REQUEST *request,
+						    rlm_ldap_thread_t *thread,
+						    rlm_ldap_search_cb_t callback, void *uctx, rlm_rcode_t *rcode)
+{
+	rlm_ldap_query_t *query;
+
+	char const *base_dn;
+	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
+
+	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
+
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
+
+	*rcode = RLM_MODULE_OK;
+
+	if (!inst->groupobj_membership_filter) {
+		RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
+
+		return NULL;
 	}
 
-	status = fr_ldap_search(&result, request, pconn, base_dn,
-				inst->groupobj_scope, filter, attrs, NULL, NULL);
+	if (rlm_ldap_groupobj_search_expand(inst, request, filter, sizeof(filter),
+					    &base_dn, base_dn_buff, sizeof(base_dn_buff)) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
+
+	query = mod_conn_search_async(thread, request, base_dn, inst->groupobj_scope, filter, attrs,
+				      NULL, callback, uctx);
+	if (!query) {
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
+	}
+
+	return query;
+}
+
+/** Convert the group objects found by a search into attributes
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] handle the result was received on.
+ * @param[in] status of the search.
+ * @param[in] result of the search.  Will be freed.
+ * @return One of the RLM_MODULE_* values.
+ */
+rlm_rcode_t rlm_ldap_cacheable_groupobj_process(rlm_ldap_t const *inst, REQUEST *request, LDAP *handle,
+						fr_ldap_rcode_t status, LDAPMessage *result)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+	int ldap_errno;
+
+	LDAPMessage *entry;
+
+	VALUE_PAIR *vp;
+	char *dn;
+
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -467,9 +562,9 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		goto finish;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, result);
+	entry = ldap_first_entry(handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
 		goto finish;
@@ -478,9 +573,9 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 	RDEBUG("Adding cacheable group object memberships");
 	do {
 		if (inst->cacheable_group_dn) {
-			dn = ldap_get_dn((*pconn)->handle, entry);
+			dn = ldap_get_dn(handle, entry);
 			if (!dn) {
-				ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+				ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 				REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 				goto finish;
@@ -499,7 +594,7 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		if (inst->cacheable_group_name) {
 			struct berval **values;
 
-			values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
+			values = ldap_get_values_len(handle, entry, inst->groupobj_name_attr);
 			if (!values) continue;
 
 			MEM(vp = pair_make_config(inst->cache_da->name, NULL, T_OP_ADD));
@@ -512,7 +607,7 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 
 			ldap_value_free_len(values);
 		}
-	} while ((entry = ldap_next_entry((*pconn)->handle, entry)));
+	} while ((entry = ldap_next_entry(handle, entry)));
 
 finish:
 	if (result) ldap_msgfree(result);
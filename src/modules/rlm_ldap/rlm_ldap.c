@@ -788,43 +788,96 @@ finish:
 	return rcode;
 }
 
-/** Search for and apply an LDAP profile
+/** Expand the filter used to retrieve a profile object
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[out] filter Where to write the expanded filter.
+ * @param[in] filter_buff to expand the filter into.
+ * @param[in] filter_len Length of filter_buff.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_profile_filter_expand(rlm_ldap_t const *inst, REQUEST *request,
+					  char const **filter, char *filter_buff, size_t filter_len)
+{
+	rad_assert(inst->profile_filter); 	/* We always have a default filter set */
+
+	if (tmpl_expand(filter, filter_buff, filter_len, request,
+			inst->profile_filter, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating profile filter");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Start an asynchronous search for an LDAP profile
  *
  * LDAP profiles are mapped using the same attribute map as user objects, they're used to add common
  * sets of attributes to the request.
  *
+ * The result should be passed to #rlm_ldap_map_profile_process.
+ *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
- * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
- * @param[in] dn of profile object to apply.
+ * @param[in] thread to issue the search from.
+ * @param[in] dn of profile object to retrieve.
  * @param[in] expanded Structure containing a list of xlat expanded attribute names and mapping
-information.
- * @return One of the RLM_MODULE_* values.
+ *	information.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to callback.
+ * @param[out] rcode The status of the operation if the search couldn't be started.
+ * @return
+ *	- The outstanding query.
+ *	- NULL on error.
  */
-static rlm_rcode_t rlm_ldap_map_profile(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
-					char const *dn, fr_ldap_map_exp_t const *expanded)
+static rlm_ldap_query_t *rlm_ldap_map_profile_async(rlm_ldap_t const *inst, REQUEST *request,
+						    rlm_ldap_thread_t *thread, char const *dn,
+						    fr_ldap_map_exp_t const *expanded,
+						    rlm_ldap_search_cb_t callback, void *uctx, rlm_rcode_t *rcode)
 {
-	rlm_rcode_t	rcode = RLM_MODULE_OK;
-	fr_ldap_rcode_t	status;
-	LDAPMessage	*result = NULL, *entry = NULL;
-	int		ldap_errno;
-	LDAP		*handle = (*pconn)->handle;
-	char const	*filter;
-	char		filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	rlm_ldap_query_t	*query;
+	char const		*filter;
+	char			filter_buff[LDAP_MAX_FILTER_STR_LEN];
 
-	rad_assert(inst->profile_filter); 	/* We always have a default filter set */
+	if (rlm_ldap_profile_filter_expand(inst, request, &filter, filter_buff, sizeof(filter_buff)) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
 
-	if (!dn || !*dn) return RLM_MODULE_OK;
+	query = mod_conn_search_async(thread, request, dn, LDAP_SCOPE_BASE, filter, expanded->attrs,
+				      NULL, callback, uctx);
+	if (!query) {
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
+	}
 
-	if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request,
-			inst->profile_filter, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Failed creating profile filter");
+	return query;
+}
 
-		return RLM_MODULE_INVALID;
-	}
+/** Apply the attributes from a profile object
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the result was received on.
+ * @param[in] dn of the profile object.
+ * @param[in] status of the search.
+ * @param[in] result of the search.  Will be freed.
+ * @param[in] expanded Structure containing a list of xlat expanded attribute names and mapping
+ *	information.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_map_profile_process(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t *conn,
+						char const *dn, fr_ldap_rcode_t status, LDAPMessage *result,
+						fr_ldap_map_exp_t const *expanded)
+{
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	LDAPMessage	*entry = NULL;
+	int		ldap_errno;
 
-	status = fr_ldap_search(&result, request, pconn, dn,
-				LDAP_SCOPE_BASE, filter, expanded->attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -838,12 +891,12 @@ static rlm_rcode_t rlm_ldap_map_profile(rlm_ldap_t const *inst, REQUEST *request
 		return RLM_MODULE_FAIL;
 	}
 
-	rad_assert(*pconn);
+	rad_assert(conn);
 	rad_assert(result);
 
-	entry = ldap_first_entry(handle, result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
 		rcode = RLM_MODULE_NOTFOUND;
@@ -853,7 +906,7 @@ static rlm_rcode_t rlm_ldap_map_profile(rlm_ldap_t const *inst, REQUEST *request
 
 	RDEBUG("Processing profile attributes");
 	RINDENT();
-	if (fr_ldap_map_do(request, *pconn, inst->valuepair_attr, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+	if (fr_ldap_map_do(request, conn, inst->valuepair_attr, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 	REXDENT();
 
 free_result:
@@ -862,73 +915,361 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+#ifdef WITH_EDIR
+/** Retrieve the user's Universal Password from eDirectory
+ *
+ * The extended operation, and the optional bind as the user, are performed
+ * synchronously on a connection from the pool.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the user object.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_edir_autz(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	fr_ldap_rcode_t		status;
-	int			ldap_errno;
-	int			i;
-	rlm_ldap_t const	*inst = instance;
-	struct berval		**values;
-	VALUE_PAIR		*vp;
-	fr_ldap_conn_t		*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	fr_ldap_rcode_t	status;
+	fr_ldap_conn_t	*conn;
+	VALUE_PAIR	*vp;
+	int		res = 0;
+	char		password[256];
+	size_t		pass_size = sizeof(password);
 
 	/*
-	 *	Don't be tempted to add a check for request->username
-	 *	or request->password here. rlm_ldap.authorize can be used for
-	 *	many things besides searching for users.
+	 *	We already have a Cleartext-Password.  Skip edir.
 	 */
-
-	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
+	if (!inst->edir || fr_pair_find_by_num(request->control, 0, PW_CLEARTEXT_PASSWORD, TAG_ANY)) {
+		return RLM_MODULE_OK;
+	}
 
 	conn = mod_conn_get(inst, request);
 	if (!conn) return RLM_MODULE_FAIL;
 
 	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 *	Retrive universal password
 	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
+	res = fr_ldap_edir_get_password(conn->handle, dn, password, &pass_size);
+	if (res != 0) {
+		REDEBUG("Failed to retrieve eDirectory password: (%i) %s", res, fr_ldap_edir_errstr(res));
+		rcode = RLM_MODULE_FAIL;
+
+		goto finish;
 	}
 
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
+	/*
+	 *	Add Cleartext-Password attribute to the request
+	 */
+	vp = radius_pair_create(request, &request->control, PW_CLEARTEXT_PASSWORD, 0);
+	fr_pair_value_bstrncpy(vp, password, pass_size);
+
+	if (RDEBUG_ENABLED3) {
+		RDEBUG3("Added eDirectory password.  control:%s += '%s'", vp->da->name, vp->vp_strvalue);
+	} else {
+		RDEBUG2("Added eDirectory password");
 	}
 
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
+	if (inst->edir_autz) {
+		RDEBUG2("Binding as user for eDirectory authorization checks");
+		/*
+		 *	Bind as the user
+		 */
+		conn->rebound = true;
+		status = fr_ldap_bind(request, &conn, dn, vp->vp_strvalue, NULL, NULL, NULL, NULL);
+		switch (status) {
+		case LDAP_PROC_SUCCESS:
+			rcode = RLM_MODULE_OK;
+			RDEBUG("Bind as user '%s' was successful", dn);
+			break;
+
+		case LDAP_PROC_NOT_PERMITTED:
+			rcode = RLM_MODULE_USERLOCK;
+			break;
+
+		case LDAP_PROC_REJECT:
+			rcode = RLM_MODULE_REJECT;
+			break;
+
+		case LDAP_PROC_BAD_DN:
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		case LDAP_PROC_NO_RESULT:
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		};
 	}
 
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+finish:
+	mod_conn_release(inst, request, conn);
+
+	return rcode;
+}
+#endif
+
+/** What we're waiting for in an asynchronous authorization
+ *
+ */
+typedef enum {
+	LDAP_AUTZ_FIND_USER = 0,			//!< Searching for the user object.
+	LDAP_AUTZ_GROUPOBJ,				//!< Searching for group objects the user is a member of.
+	LDAP_AUTZ_DEFAULT_PROFILE,			//!< Retrieving the default profile.
+	LDAP_AUTZ_USER_PROFILE				//!< Retrieving profiles listed in the user object.
+} ldap_autz_status_t;
+
+/** State of an asynchronous authorization
+ *
+ * Each step is started from the result callback of the previous one, so a request
+ * only occupies its worker thread whilst results are being processed.
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap.
+	rlm_ldap_thread_t	*thread;		//!< Thread specific instance data.
+	fr_ldap_map_exp_t	expanded;		//!< Attributes to retrieve, and maps to apply.
+
+	ldap_autz_status_t	status;			//!< What we're currently doing.
+	rlm_ldap_query_t	*query;			//!< Outstanding search.  NULL if there is none.
+	fr_ldap_conn_t		*conn;			//!< Connection the last result was received on.
+
+	LDAPMessage		*result;		//!< Result of the user object search.
+	LDAPMessage		*entry;			//!< The user object.
+	char const		*dn;			//!< DN of the user object.
+
+	char			*profile_dn;		//!< DN of the profile being retrieved.
+	struct berval		**profiles;		//!< Values of the profile attribute in the user object.
+	int			profile;		//!< Index of the next profile to retrieve.
+
+	rlm_rcode_t		rcode;			//!< What we'll return when the request is resumed.
+} ldap_autz_ctx_t;
+
+static int _autz_ctx_free(ldap_autz_ctx_t *autz)
+{
+	if (autz->query) mod_conn_search_cancel(autz->query);
+	if (autz->profiles) ldap_value_free_len(autz->profiles);
+	if (autz->result) ldap_msgfree(autz->result);
+	talloc_free(autz->expanded.ctx);
+
+	return 0;
+}
+
+/** Finish authorization, and mark the request as resumable
+ *
+ */
+static void autz_done(REQUEST *request, ldap_autz_ctx_t *autz, rlm_rcode_t rcode)
+{
+	autz->rcode = rcode;
+	unlang_resumable(request);
+}
+
+/** Apply the user object's attributes, which is the last step of authorization
+ *
+ */
+static void autz_map(REQUEST *request, ldap_autz_ctx_t *autz)
+{
+	rlm_ldap_t const *inst = autz->inst;
+
+	if (inst->user_map || inst->valuepair_attr) {
+		RDEBUG("Processing user attributes");
+		RINDENT();
+		if (fr_ldap_map_do(request, autz->conn, inst->valuepair_attr,
+				   &autz->expanded, autz->entry) > 0) autz->rcode = RLM_MODULE_UPDATED;
+		REXDENT();
+		rlm_ldap_check_reply(inst, request, autz->conn);
 	}
 
-	expanded.attrs[expanded.count] = NULL;
+	autz_done(request, autz, autz->rcode);
+}
 
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
+static void _autz_profile_result(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				 LDAPMessage *result, void *uctx);
+
+/** Retrieve the next profile, or apply the user object's attributes if there are none left
+ *
+ * Applies ONE default profile, then a SET of profiles listed in the user object.
+ */
+static void autz_profile_next(REQUEST *request, ldap_autz_ctx_t *autz)
+{
+	rlm_ldap_t const	*inst = autz->inst;
+	rlm_rcode_t		rcode;
+
+	for (;;) {
+		switch (autz->status) {
+		case LDAP_AUTZ_FIND_USER:
+		case LDAP_AUTZ_GROUPOBJ:
+			autz->status = LDAP_AUTZ_DEFAULT_PROFILE;
+			if (!inst->default_profile) continue;
+		{
+			char const	*profile;
+			char		profile_buff[1024];
+
+			if (tmpl_expand(&profile, profile_buff, sizeof(profile_buff),
+					request, inst->default_profile, NULL, NULL) < 0) {
+				REDEBUG("Failed creating default profile string");
+
+				autz_done(request, autz, RLM_MODULE_INVALID);
+				return;
+			}
+			MEM(autz->profile_dn = talloc_typed_strdup(autz, profile));
+		}
+			break;
+
+		case LDAP_AUTZ_DEFAULT_PROFILE:
+			autz->status = LDAP_AUTZ_USER_PROFILE;
+			if (inst->profile_attr) {
+				autz->profiles = ldap_get_values_len(autz->conn->handle, autz->entry,
+								     inst->profile_attr);
+			}
+			continue;
+
+		case LDAP_AUTZ_USER_PROFILE:
+			if (!autz->profiles || !autz->profiles[autz->profile]) {
+				autz_map(request, autz);
+				return;
+			}
+			autz->profile_dn = fr_ldap_berval_to_string(autz, autz->profiles[autz->profile++]);
+			break;
+		}
+
+		if (!*autz->profile_dn) {
+			TALLOC_FREE(autz->profile_dn);
+			continue;
+		}
+
+		autz->query = rlm_ldap_map_profile_async(inst, request, autz->thread, autz->profile_dn,
+							 &autz->expanded, _autz_profile_result, autz, &rcode);
+		if (autz->query) return;
+
+		TALLOC_FREE(autz->profile_dn);
+
+		/*
+		 *	Failing to retrieve any profile in the user
+		 *	object is fatal, otherwise only invalid
+		 *	configuration, or failures, are.
+		 */
+		if ((rcode == RLM_MODULE_FAIL) ||
+		    ((autz->status == LDAP_AUTZ_DEFAULT_PROFILE) && (rcode == RLM_MODULE_INVALID))) {
+			autz_done(request, autz, rcode);
+			return;
+		}
 	}
+}
 
-	entry = ldap_first_entry(conn->handle, result);
-	if (!entry) {
+static void _autz_profile_result(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				 LDAPMessage *result, void *uctx)
+{
+	ldap_autz_ctx_t	*autz = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+	rlm_rcode_t	rcode;
+
+	autz->query = NULL;
+	autz->conn = conn;
+
+	rcode = rlm_ldap_map_profile_process(autz->inst, request, conn, autz->profile_dn,
+					     status, result, &autz->expanded);
+	TALLOC_FREE(autz->profile_dn);
+
+	switch (rcode) {
+	case RLM_MODULE_FAIL:
+		autz_done(request, autz, rcode);
+		return;
+
+	case RLM_MODULE_INVALID:
+		if (autz->status == LDAP_AUTZ_DEFAULT_PROFILE) {
+			autz_done(request, autz, rcode);
+			return;
+		}
+		break;
+
+	case RLM_MODULE_UPDATED:
+		if (autz->status == LDAP_AUTZ_DEFAULT_PROFILE) autz->rcode = RLM_MODULE_UPDATED;
+		break;
+
+	default:
+		break;
+	}
+
+	autz_profile_next(request, autz);
+}
+
+/** Perform the steps of authorization which follow group membership caching
+ *
+ */
+static void autz_profile_start(REQUEST *request, ldap_autz_ctx_t *autz)
+{
+#ifdef WITH_EDIR
+	rlm_rcode_t rcode;
+
+	/*
+	 *      Retrieve Universal Password if we use eDirectory
+	 */
+	rcode = rlm_ldap_edir_autz(autz->inst, request, autz->dn);
+	if (rcode != RLM_MODULE_OK) {
+		autz_done(request, autz, rcode);
+		return;
+	}
+#endif
+
+	autz_profile_next(request, autz);
+}
+
+static void _autz_groupobj_result(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				  LDAPMessage *result, void *uctx)
+{
+	ldap_autz_ctx_t	*autz = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+	rlm_rcode_t	rcode;
+
+	autz->query = NULL;
+	autz->conn = conn;
+
+	rcode = rlm_ldap_cacheable_groupobj_process(autz->inst, request, conn ? conn->handle : NULL,
+						    status, result);
+	if (rcode != RLM_MODULE_OK) {
+		autz_done(request, autz, rcode);
+		return;
+	}
+
+	autz_profile_start(request, autz);
+}
+
+static void _autz_user_result(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+			      LDAPMessage *result, void *uctx)
+{
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+	rlm_ldap_t const	*inst = autz->inst;
+	rlm_rcode_t		rcode;
+	int			ldap_errno;
+
+	autz->query = NULL;
+	autz->conn = conn;
+	autz->result = result;
+
+	autz->dn = rlm_ldap_find_user_process(inst, request, conn ? conn->handle : NULL,
+					      status, &autz->result, &rcode);
+	if (!autz->dn) {
+		autz_done(request, autz, rcode);
+		return;
+	}
+
+	autz->entry = ldap_first_entry(conn->handle, autz->result);
+	if (!autz->entry) {
 		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+		autz_done(request, autz, rcode);
+		return;
 	}
 
 	/*
 	 *	Check for access.
 	 */
 	if (inst->userobj_access_attr) {
-		rcode = rlm_ldap_check_access(inst, request, conn, entry);
+		rcode = rlm_ldap_check_access(inst, request, conn, autz->entry);
 		if (rcode != RLM_MODULE_OK) {
-			goto finish;
+			autz_done(request, autz, rcode);
+			return;
 		}
 	}
 
@@ -937,167 +1278,122 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
 		if (inst->userobj_membership_attr) {
-			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
+			fr_ldap_conn_t *pool_conn;
+
+			/*
+			 *	Resolving names to DNs, or DNs to names,
+			 *	may take a search per group, so it's done
+			 *	on a connection from the pool.
+			 */
+			pool_conn = mod_conn_get(inst, request);
+			if (!pool_conn) {
+				autz_done(request, autz, RLM_MODULE_FAIL);
+				return;
+			}
+
+			rcode = rlm_ldap_cacheable_userobj(inst, request, &pool_conn, autz->entry,
+							   inst->userobj_membership_attr);
+			mod_conn_release(inst, request, pool_conn);
 			if (rcode != RLM_MODULE_OK) {
-				goto finish;
+				autz_done(request, autz, rcode);
+				return;
 			}
 		}
 
-		rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
+		autz->status = LDAP_AUTZ_GROUPOBJ;
+		autz->query = rlm_ldap_cacheable_groupobj_async(inst, request, autz->thread,
+								_autz_groupobj_result, autz, &rcode);
+		if (autz->query) return;
+
 		if (rcode != RLM_MODULE_OK) {
-			goto finish;
+			autz_done(request, autz, rcode);
+			return;
 		}
 	}
 
-#ifdef WITH_EDIR
-	/*
-	 *	We already have a Cleartext-Password.  Skip edir.
-	 */
-	if (fr_pair_find_by_num(request->control, 0, PW_CLEARTEXT_PASSWORD, TAG_ANY)) {
-		goto skip_edir;
-	}
-
-	/*
-	 *      Retrieve Universal Password if we use eDirectory
-	 */
-	if (inst->edir) {
-		int res = 0;
-		char password[256];
-		size_t pass_size = sizeof(password);
-
-		/*
-		 *	Retrive universal password
-		 */
-		res = fr_ldap_edir_get_password(conn->handle, dn, password, &pass_size);
-		if (res != 0) {
-			REDEBUG("Failed to retrieve eDirectory password: (%i) %s", res, fr_ldap_edir_errstr(res));
-			rcode = RLM_MODULE_FAIL;
-
-			goto finish;
-		}
-
-		/*
-		 *	Add Cleartext-Password attribute to the request
-		 */
-		vp = radius_pair_create(request, &request->control, PW_CLEARTEXT_PASSWORD, 0);
-		fr_pair_value_bstrncpy(vp, password, pass_size);
+	autz_profile_start(request, autz);
+}
 
-		if (RDEBUG_ENABLED3) {
-			RDEBUG3("Added eDirectory password.  control:%s += '%s'", vp->da->name, vp->vp_strvalue);
-		} else {
-			RDEBUG2("Added eDirectory password");
-		}
+static rlm_rcode_t mod_authorize_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+					void *ctx)
+{
+	ldap_autz_ctx_t	*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+	rlm_rcode_t	rcode = autz->rcode;
 
-		if (inst->edir_autz) {
-			RDEBUG2("Binding as user for eDirectory authorization checks");
-			/*
-			 *	Bind as the user
-			 */
-			conn->rebound = true;
-			status = fr_ldap_bind(request, &conn, dn, vp->vp_strvalue, NULL, NULL, NULL, NULL);
-			switch (status) {
-			case LDAP_PROC_SUCCESS:
-				rcode = RLM_MODULE_OK;
-				RDEBUG("Bind as user '%s' was successful", dn);
-				break;
-
-			case LDAP_PROC_NOT_PERMITTED:
-				rcode = RLM_MODULE_USERLOCK;
-				goto finish;
+	talloc_free(autz);
 
-			case LDAP_PROC_REJECT:
-				rcode = RLM_MODULE_REJECT;
-				goto finish;
+	return rcode;
+}
 
-			case LDAP_PROC_BAD_DN:
-				rcode = RLM_MODULE_INVALID;
-				goto finish;
+static void mod_authorize_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				 void *ctx, fr_state_action_t action)
+{
+	ldap_autz_ctx_t	*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
 
-			case LDAP_PROC_NO_RESULT:
-				rcode = RLM_MODULE_NOTFOUND;
-				goto finish;
+	if (action != FR_ACTION_DONE) return;
 
-			default:
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			};
-		}
+	/*
+	 *	Results will be discarded if they arrive
+	 */
+	if (autz->query) {
+		mod_conn_search_cancel(autz->query);
+		autz->query = NULL;
 	}
+}
 
-skip_edir:
-#endif
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz;
+	fr_ldap_map_exp_t	expanded;
 
 	/*
-	 *	Apply ONE user profile, or a default user profile.
+	 *	Don't be tempted to add a check for request->username
+	 *	or request->password here. rlm_ldap.authorize can be used for
+	 *	many things besides searching for users.
 	 */
-	if (inst->default_profile) {
-		char const *profile;
-		char profile_buff[1024];
-
-		if (tmpl_expand(&profile, profile_buff, sizeof(profile_buff),
-				request, inst->default_profile, NULL, NULL) < 0) {
-			REDEBUG("Failed creating default profile string");
 
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
-		}
+	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
-		case RLM_MODULE_INVALID:
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
+	MEM(autz = talloc_zero(request, ldap_autz_ctx_t));
+	talloc_set_destructor(autz, _autz_ctx_free);
+	autz->inst = inst;
+	autz->thread = thread;
+	autz->expanded = expanded;
+	autz->status = LDAP_AUTZ_FIND_USER;
+	autz->rcode = RLM_MODULE_OK;
 
-		case RLM_MODULE_FAIL:
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+	/*
+	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 */
+	if (inst->userobj_access_attr) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->userobj_access_attr;
+	}
 
-		case RLM_MODULE_UPDATED:
-			rcode = RLM_MODULE_UPDATED;
-			/* FALL-THROUGH */
-		default:
-			break;
-		}
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->userobj_membership_attr;
 	}
 
-	/*
-	 *	Apply a SET of user profiles.
-	 */
 	if (inst->profile_attr) {
-		values = ldap_get_values_len(conn->handle, entry, inst->profile_attr);
-		if (values != NULL) {
-			for (i = 0; values[i] != NULL; i++) {
-				rlm_rcode_t ret;
-				char *value;
-
-				value = fr_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
-				talloc_free(value);
-				if (ret == RLM_MODULE_FAIL) {
-					ldap_value_free_len(values);
-					rcode = ret;
-					goto finish;
-				}
-
-			}
-			ldap_value_free_len(values);
-		}
+		autz->expanded.attrs[autz->expanded.count++] = inst->profile_attr;
 	}
 
-	if (inst->user_map || inst->valuepair_attr) {
-		RDEBUG("Processing user attributes");
-		RINDENT();
-		if (fr_ldap_map_do(request, conn, inst->valuepair_attr,
-				   &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
-		REXDENT();
-		rlm_ldap_check_reply(inst, request, conn);
+	if (inst->valuepair_attr) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->valuepair_attr;
 	}
 
-finish:
-	talloc_free(expanded.ctx);
-	if (result) ldap_msgfree(result);
-	mod_conn_release(inst, request, conn);
+	autz->expanded.attrs[autz->expanded.count] = NULL;
 
-	return rcode;
+	autz->query = rlm_ldap_find_user_async(inst, request, autz->thread, autz->expanded.attrs,
+					       _autz_user_result, autz, &rcode);
+	if (!autz->query) {
+		talloc_free(autz);
+		return rcode;
+	}
+
+	return unlang_yield(request, mod_authorize_resume, mod_authorize_signal, autz);
 }
 
 /** Modify user's object in LDAP
@@ -1370,6 +1666,34 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Initialise the thread specific state used for asynchronous searches
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_ldap_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	return mod_conn_thread_init(thread, instance, el);
+}
+
+/** Close the thread's connection
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	mod_conn_thread_free(thread);
+
+	return 0;
+}
+
 /** Parse an accounting sub section.
  *
  * Allocate a new ldap_acct_section_t and write the config data into it.
@@ -1981,12 +2305,15 @@ rad_module_t rlm_ldap = {
 	.name		= "ldap",
 	.type		= 0,
 	.inst_size	= sizeof(rlm_ldap_t),
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
 	.config		= module_config,
 	.load		= mod_load,
 	.unload		= mod_unload,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -20,6 +20,7 @@
 #include <freeradius-devel/ldap/libfreeradius-ldap.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct rlm_ldap_query rlm_ldap_query_t;
 
 typedef struct {
 	vp_tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -160,12 +161,51 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** Thread specific instance data
+ *
+ * Each thread holds a single connection, over which all of its asynchronous
+ * searches are multiplexed.
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap this thread belongs to.
+	fr_event_list_t		*el;			//!< Event list serviced by this thread.
+
+	fr_ldap_conn_t		*conn;			//!< Multiplexed connection.  NULL until the first search,
+							//!< or after the connection failed.
+	int			fd;			//!< Socket associated with conn.
+	rbtree_t		*queries;		//!< Outstanding searches, keyed by msgid.
+
+	bool			demux;			//!< True if we're processing results.
+	fr_ldap_conn_t		*closed;		//!< Connection which failed during demux.  Freed once
+							//!< all result callbacks have been called.
+} rlm_ldap_thread_t;
+
+/** Called when the result of an asynchronous search is available
+ *
+ * @param[in] request	the search was issued for.
+ * @param[in] conn	the result was received on.  NULL if the connection failed.
+ *			Valid for the duration of the callback only.
+ * @param[in] status	of the search, as returned by #fr_ldap_search.
+ * @param[in] result	of the search.  NULL unless status is #LDAP_PROC_SUCCESS.
+ *			Must be freed with ldap_msgfree.
+ * @param[in] uctx	passed to #mod_conn_search_async.
+ */
+typedef void (*rlm_ldap_search_cb_t)(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				     LDAPMessage *result, void *uctx);
+
 /*
  *	user.c - User lookup functions
  */
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+rlm_ldap_query_t *rlm_ldap_find_user_async(rlm_ldap_t const *inst, REQUEST *request, rlm_ldap_thread_t *thread,
+					   char const *attrs[], rlm_ldap_search_cb_t callback, void *uctx,
+					   rlm_rcode_t *rcode);
+
+char const *rlm_ldap_find_user_process(rlm_ldap_t const *inst, REQUEST *request, LDAP *handle,
+				       fr_ldap_rcode_t status, LDAPMessage **result, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 				  fr_ldap_conn_t const *conn, LDAPMessage *entry);
 
@@ -179,6 +219,13 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 
 rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn);
 
+rlm_ldap_query_t *rlm_ldap_cacheable_groupobj_async(rlm_ldap_t const *inst, REQUEST *request,
+						    rlm_ldap_thread_t *thread,
+						    rlm_ldap_search_cb_t callback, void *uctx, rlm_rcode_t *rcode);
+
+rlm_rcode_t rlm_ldap_cacheable_groupobj_process(rlm_ldap_t const *inst, REQUEST *request, LDAP *handle,
+						fr_ldap_rcode_t status, LDAPMessage *result);
+
 rlm_rcode_t rlm_ldap_check_groupobj_dynamic(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
 					    VALUE_PAIR *check);
 
@@ -196,6 +243,16 @@ void		mod_conn_release(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t
 
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 
+int		mod_conn_thread_init(rlm_ldap_thread_t *thread, rlm_ldap_t const *inst, fr_event_list_t *el);
+
+void		mod_conn_thread_free(rlm_ldap_thread_t *thread);
+
+rlm_ldap_query_t *mod_conn_search_async(rlm_ldap_thread_t *thread, REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls, rlm_ldap_search_cb_t callback, void *uctx);
+
+void		mod_conn_search_cancel(rlm_ldap_query_t *query);
+
 /*
  *	clients.c - Dynamic clients (bulk load).
  */
@@ -32,6 +32,43 @@
 
 #include "rlm_ldap.h"
 
+/** Expand the base DN and filter used to search for user objects
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[out] filter Where to write the expanded filter.  Will be NULL if no filter is configured.
+ * @param[in] filter_buff to expand the filter into.
+ * @param[in] filter_len Length of filter_buff.
+ * @param[out] base_dn Where to write the expanded base DN.
+ * @param[in] base_dn_buff to expand the base DN into.
+ * @param[in] base_dn_len Length of base_dn_buff.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_user_search_expand(rlm_ldap_t const *inst, REQUEST *request,
+				       char const **filter, char *filter_buff, size_t filter_len,
+				       char const **base_dn, char *base_dn_buff, size_t base_dn_len)
+{
+	*filter = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(filter, filter_buff, filter_len, request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			return -1;
+		}
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, base_dn_len, request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Retrieve the DN of a user object
  *
  * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
@@ -57,10 +94,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_ldap_rcode_t	status;
 	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -111,26 +146,95 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		(*pconn)->rebound = false;
 	}
 
-	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
-				fr_ldap_escape_func, NULL) < 0) {
-			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
+	if (rlm_ldap_user_search_expand(inst, request, &filter, filter_buff, sizeof(filter_buff),
+					&base_dn, base_dn_buff, sizeof(base_dn_buff)) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
 
-			return NULL;
-		}
+	status = fr_ldap_search(result, request, pconn, base_dn,
+				inst->userobj_scope, filter, attrs, serverctrls, NULL);
+
+	dn = rlm_ldap_find_user_process(inst, request, *pconn ? (*pconn)->handle : NULL, status, result, rcode);
+	if (freeit && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
 	}
 
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
+	return dn;
+}
+
+/** Start an asynchronous search for a user object
+ *
+ * The result should be passed to #rlm_ldap_find_user_process.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] thread to issue the search from.
+ * @param[in] attrs Additional attributes to retrieve, may be NULL.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to callback.
+ * @param[out] rcode The status of the operation if the search couldn't be started.
+ * @return
+ *	- The outstanding query.
+ *	- NULL on error.
+ */
+rlm_ldap_query_t *rlm_ldap_find_user_async(rlm_ldap_t const *inst, REQUEST *request, rlm_ldap_thread_t *thread,
+					   char const *attrs[], rlm_ldap_search_cb_t callback, void *uctx,
+					   rlm_rcode_t *rcode)
+{
+	static char const	*tmp_attrs[] = { NULL };
+
+	rlm_ldap_query_t	*query;
+	char const		*filter = NULL;
+	char	    		filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const		*base_dn;
+	char	    		base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl		*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	if (!attrs) {
+		memset(&attrs, 0, sizeof(tmp_attrs));
+	}
+
+	if (rlm_ldap_user_search_expand(inst, request, &filter, filter_buff, sizeof(filter_buff),
+					&base_dn, base_dn_buff, sizeof(base_dn_buff)) < 0) {
 		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
 
+	query = mod_conn_search_async(thread, request, base_dn, inst->userobj_scope, filter, attrs,
+				      serverctrls, callback, uctx);
+	if (!query) {
+		*rcode = RLM_MODULE_FAIL;
 		return NULL;
 	}
 
-	status = fr_ldap_search(result, request, pconn, base_dn,
-				inst->userobj_scope, filter, attrs, serverctrls, NULL);
+	return query;
+}
+
+/** Process the result of a search for a user object
+ *
+ * Adds the DN of the user to the control list as LDAP-UserDN.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] handle the result was received on.
+ * @param[in] status of the search.
+ * @param[in,out] result of the search.  Freed, and set to NULL if we fail.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_process(rlm_ldap_t const *inst, REQUEST *request, LDAP *handle,
+				       fr_ldap_rcode_t status, LDAPMessage **result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*entry = NULL;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn = NULL;
+
+	*rcode = RLM_MODULE_FAIL;
+
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -145,7 +249,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		return NULL;
 	}
 
-	rad_assert(*pconn);
+	rad_assert(handle);
 
 	/*
 	 *	Forbid the use of unsorted search results that
@@ -153,16 +257,16 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 	 *	security issue, and likely non deterministic.
 	 */
 	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
+		cnt = ldap_count_entries(handle, *result);
 		if (cnt > 1) {
 			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
 				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
 			REDEBUG("The following entries were returned:");
 			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
+			for (entry = ldap_first_entry(handle, *result);
 			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
+			     entry = ldap_next_entry(handle, entry)) {
+				dn = ldap_get_dn(handle, entry);
 				REDEBUG("%s", dn);
 				ldap_memfree(dn);
 			}
@@ -172,18 +276,18 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		}
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
+	entry = ldap_first_entry(handle, *result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s",
 			ldap_err2string(ldap_errno));
 
 		goto finish;
 	}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
+	dn = ldap_get_dn(handle, entry);
 	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 		goto finish;
@@ -207,7 +311,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 	ldap_memfree(dn);
 
 finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+	if ((*rcode != RLM_MODULE_OK) && *result) {
 		ldap_msgfree(*result);
 		*result = NULL;
 	}
@@ -0,0 +1,651 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file async.c
+ * @brief Asynchronous, pipelining Redis cluster client
+ *
+ * Each worker thread gets its own #fr_redis_async_t, which holds a small number of
+ * non-blocking hiredis connections to each cluster node, serviced by the thread's
+ * event list.
+ *
+ * Commands are never written to the socket immediately.  hiredis appends them to
+ * the connection's output buffer, and asks for the fd to be polled for writability.
+ * All commands issued by requests processed in the same event loop iteration are
+ * therefore flushed with a single write, and their replies are read back in
+ * bulk.  This gives us pipelining without callers needing to batch commands
+ * explicitly.
+ *
+ * The cluster is only used for its key slot map.  -MOVED and -ASK redirects
+ * are followed here, up to max_redirects.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/rbtree.h>
+#include <hiredis/async.h>
+
+#include "async.h"
+
+typedef struct fr_redis_async_node fr_redis_async_node_t;
+typedef struct fr_redis_async_conn fr_redis_async_conn_t;
+
+/** A thread's asynchronous client for a Redis cluster
+ */
+struct fr_redis_async {
+	fr_event_list_t		*el;		//!< Event list servicing this thread's connections.
+	fr_redis_cluster_t	*cluster;	//!< Used to resolve keys and redirects to nodes.
+	fr_redis_conf_t const	*conf;		//!< Password, database and limits.
+	char const		*log_prefix;	//!< What to prepend to log messages.
+
+	rbtree_t		*nodes;		//!< Nodes we've sent commands to, keyed by address.
+
+	bool			freeing;	//!< Client is being freed, discard all replies.
+};
+
+/** The connections a thread has to a single cluster node
+ */
+struct fr_redis_async_node {
+	fr_socket_addr_t	addr;		//!< Address of the node.
+	char			name[INET6_ADDRSTRLEN];	//!< Text version of addr.ipaddr, for hiredis and
+						//!< debug messages.
+	fr_redis_async_t	*async;		//!< Client this node belongs to.
+
+	fr_redis_async_conn_t	**conn;		//!< Array of conf->async_conns connections.  Slots are
+						//!< NULL until a connection is needed.
+};
+
+/** A single non-blocking connection to a cluster node
+ */
+struct fr_redis_async_conn {
+	fr_redis_async_node_t	*node;		//!< Node we're connected to.
+	unsigned int		slot;		//!< Index of this connection in node->conn.
+
+	redisAsyncContext	*ac;		//!< hiredis async context.
+	int			fd;		//!< Socket associated with ac.
+
+	bool			read;		//!< hiredis wants read events.
+	bool			write;		//!< hiredis wants write events.
+	bool			registered;	//!< fd is inserted into the event list.
+
+	uint32_t		in_flight;	//!< Commands awaiting replies.
+};
+
+/** A command issued on behalf of a request
+ */
+struct fr_redis_async_cmd {
+	fr_redis_async_t	*async;		//!< Client the command was issued with.
+	REQUEST			*request;	//!< Request that issued the command.  NULL if cancelled.
+
+	fr_redis_async_reply_t	callback;	//!< Called with the reply.
+	void			*uctx;		//!< Passed to callback.
+
+	int			argc;		//!< Number of arguments.
+	char const		**argv;		//!< Arguments, copied so the request may free its own.
+	size_t			*argv_len;	//!< Length of each argument.
+
+	uint32_t		redirects;	//!< How many redirects we've followed.
+};
+
+static int _async_node_cmp(void const *a, void const *b)
+{
+	int ret;
+
+	fr_redis_async_node_t const *my_a = a;
+	fr_redis_async_node_t const *my_b = b;
+
+	ret = fr_ipaddr_cmp(&my_a->addr.ipaddr, &my_b->addr.ipaddr);
+	if (ret != 0) return ret;
+
+	if (my_a->addr.port < my_b->addr.port) return -1;
+	if (my_a->addr.port > my_b->addr.port) return +1;
+
+	return 0;
+}
+
+/*
+ *	Forward declarations for the event handlers
+ */
+static void _async_conn_readable(fr_event_list_t *el, int fd, void *ctx);
+static void _async_conn_writable(fr_event_list_t *el, int fd, void *ctx);
+
+/** Update the events we're interested in, for a connection's fd
+ *
+ * @param[in] conn	to update.
+ */
+static void async_conn_events(fr_redis_async_conn_t *conn)
+{
+	fr_redis_async_t *async = conn->node->async;
+
+	if (!conn->read && !conn->write) {
+		if (conn->registered) {
+			(void) fr_event_fd_delete(async->el, conn->fd);
+			conn->registered = false;
+		}
+		return;
+	}
+
+	if (fr_event_fd_insert(async->el, conn->fd,
+			       conn->read ? _async_conn_readable : NULL,
+			       conn->write ? _async_conn_writable : NULL,
+			       _async_conn_readable, conn) < 0) {
+		PERROR("%s [%s:%i]: Failed registering fd %i", async->log_prefix,
+		       conn->node->name, conn->node->addr.port, conn->fd);
+		return;
+	}
+	conn->registered = true;
+}
+
+static void _async_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_redis_async_conn_t *conn = talloc_get_type_abort(ctx, fr_redis_async_conn_t);
+
+	/*
+	 *	conn may be freed by this call.
+	 */
+	redisAsyncHandleRead(conn->ac);
+}
+
+static void _async_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_redis_async_conn_t *conn = talloc_get_type_abort(ctx, fr_redis_async_conn_t);
+
+	/*
+	 *	conn may be freed by this call.
+	 */
+	redisAsyncHandleWrite(conn->ac);
+}
+
+/*
+ *	hiredis event library adapter
+ */
+static void _async_add_read(void *ctx)
+{
+	fr_redis_async_conn_t *conn = ctx;
+
+	conn->read = true;
+	async_conn_events(conn);
+}
+
+static void _async_del_read(void *ctx)
+{
+	fr_redis_async_conn_t *conn = ctx;
+
+	conn->read = false;
+	async_conn_events(conn);
+}
+
+static void _async_add_write(void *ctx)
+{
+	fr_redis_async_conn_t *conn = ctx;
+
+	conn->write = true;
+	async_conn_events(conn);
+}
+
+static void _async_del_write(void *ctx)
+{
+	fr_redis_async_conn_t *conn = ctx;
+
+	conn->write = false;
+	async_conn_events(conn);
+}
+
+/** Called by hiredis when the async context is being freed
+ *
+ * This is the only hook hiredis calls for every connection, whether the
+ * connection failed, was closed by the server, or was closed by us.  All
+ * pending commands have already been called back with a NULL reply.
+ */
+static void _async_cleanup(void *ctx)
+{
+	fr_redis_async_conn_t	*conn = ctx;
+	fr_redis_async_node_t	*node = conn->node;
+
+	conn->read = conn->write = false;
+	async_conn_events(conn);
+
+	DEBUG2("%s [%s:%i]: Connection %u closed", node->async->log_prefix, node->name, node->addr.port, conn->slot);
+
+	node->conn[conn->slot] = NULL;
+	conn->ac = NULL;
+	talloc_free(conn);
+}
+
+/** Close the hiredis context when the connection is freed explicitly
+ *
+ */
+static int _async_conn_free(fr_redis_async_conn_t *conn)
+{
+	redisAsyncContext *ac = conn->ac;
+
+	if (!ac) return 0;	/* Freed by hiredis */
+
+	/*
+	 *	Stop _async_cleanup from freeing us again
+	 */
+	ac->ev.cleanup = NULL;
+	conn->ac = NULL;
+	conn->node->conn[conn->slot] = NULL;
+
+	conn->read = conn->write = false;
+	async_conn_events(conn);
+
+	redisAsyncFree(ac);
+
+	return 0;
+}
+
+static void _async_connected(redisAsyncContext const *ac, int status)
+{
+	fr_redis_async_conn_t	*conn = ac->data;
+	fr_redis_async_node_t	*node = conn->node;
+
+	if (status != REDIS_OK) {
+		ERROR("%s [%s:%i]: Connection failed: %s", node->async->log_prefix,
+		      node->name, node->addr.port, ac->errstr);
+		return;
+	}
+
+	DEBUG2("%s [%s:%i]: Connection %u established", node->async->log_prefix,
+	       node->name, node->addr.port, conn->slot);
+}
+
+/** Check the replies to the AUTH and SELECT commands sent when the connection was opened
+ *
+ */
+static void _async_setup_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+	fr_redis_async_conn_t	*conn = privdata;
+	fr_redis_async_node_t	*node = conn->node;
+	redisReply		*reply = r;
+
+	conn->in_flight--;
+
+	if (!reply) return;	/* Connection failed, will be logged elsewhere */
+
+	if (reply->type != REDIS_REPLY_ERROR) return;
+
+	ERROR("%s [%s:%i]: Connection setup failed: %s", node->async->log_prefix,
+	      node->name, node->addr.port, reply->str);
+	redisAsyncDisconnect(ac);
+}
+
+/** Open a new connection to a node
+ *
+ * The connection completes asynchronously.  AUTH and SELECT are queued
+ * immediately, and will be written ahead of any other commands.
+ *
+ * @param[in] node	to connect to.
+ * @param[in] slot	to store the connection in.
+ * @return
+ *	- A new connection.
+ *	- NULL on error.
+ */
+static fr_redis_async_conn_t *async_conn_alloc(fr_redis_async_node_t *node, unsigned int slot)
+{
+	fr_redis_async_t	*async = node->async;
+	fr_redis_async_conn_t	*conn;
+	redisAsyncContext	*ac;
+
+	DEBUG2("%s [%s:%i]: Opening connection %u", async->log_prefix, node->name, node->addr.port, slot);
+
+	ac = redisAsyncConnect(node->name, node->addr.port);
+	if (!ac) {
+		ERROR("%s [%s:%i]: Connection failed", async->log_prefix, node->name, node->addr.port);
+		return NULL;
+	}
+	if (ac->err) {
+		ERROR("%s [%s:%i]: Connection failed: %s", async->log_prefix, node->name, node->addr.port, ac->errstr);
+		redisAsyncFree(ac);
+		return NULL;
+	}
+
+	/*
+	 *	Parented by the array so the destructor
+	 *	can still clear the slot during teardown.
+	 */
+	MEM(conn = talloc_zero(node->conn, fr_redis_async_conn_t));
+	conn->node = node;
+	conn->slot = slot;
+	conn->ac = ac;
+	conn->fd = ac->c.fd;
+	talloc_set_destructor(conn, _async_conn_free);
+
+	ac->data = conn;
+	ac->ev.data = conn;
+	ac->ev.addRead = _async_add_read;
+	ac->ev.delRead = _async_del_read;
+	ac->ev.addWrite = _async_add_write;
+	ac->ev.delWrite = _async_del_write;
+	ac->ev.cleanup = _async_cleanup;
+
+	redisAsyncSetConnectCallback(ac, _async_connected);
+
+	node->conn[slot] = conn;
+
+	if (async->conf->password) {
+		DEBUG3("%s [%s:%i]: Queuing: AUTH %s", async->log_prefix, node->name, node->addr.port,
+		       async->conf->password);
+		if (redisAsyncCommand(ac, _async_setup_reply, conn, "AUTH %s", async->conf->password) != REDIS_OK) {
+		error:
+			talloc_free(conn);
+			return NULL;
+		}
+		conn->in_flight++;
+	}
+
+	if (async->conf->database) {
+		DEBUG3("%s [%s:%i]: Queuing: SELECT %i", async->log_prefix, node->name, node->addr.port,
+		       async->conf->database);
+		if (redisAsyncCommand(ac, _async_setup_reply, conn, "SELECT %i", async->conf->database) != REDIS_OK) {
+			goto error;
+		}
+		conn->in_flight++;
+	}
+
+	return conn;
+}
+
+/** Find or create the connections for a node
+ *
+ * @param[in] async	client to search in.
+ * @param[in] addr	of the node.
+ * @return the node.
+ */
+static fr_redis_async_node_t *async_node_find(fr_redis_async_t *async, fr_socket_addr_t const *addr)
+{
+	fr_redis_async_node_t find, *node;
+
+	memset(&find, 0, sizeof(find));
+	find.addr = *addr;
+
+	node = rbtree_finddata(async->nodes, &find);
+	if (node) return node;
+
+	MEM(node = talloc_zero(async->nodes, fr_redis_async_node_t));
+	node->async = async;
+	node->addr = *addr;
+	MEM(node->conn = talloc_zero_array(node, fr_redis_async_conn_t *, async->conf->async_conns));
+
+	if (!inet_ntop(addr->ipaddr.af, &addr->ipaddr.addr, node->name, sizeof(node->name))) {
+		rad_assert(0);	/* addr.ipaddr is probably corrupt */
+	}
+
+	rbtree_insert(async->nodes, node);
+
+	return node;
+}
+
+/** Pick the connection to a node with the fewest commands in flight
+ *
+ * Empty slots are filled before existing connections are reused.
+ *
+ * @param[in] node	to pick connection for.
+ * @return
+ *	- A connection.
+ *	- NULL if no connection could be opened.
+ */
+static fr_redis_async_conn_t *async_conn_select(fr_redis_async_node_t *node)
+{
+	fr_redis_async_conn_t	*found = NULL;
+	unsigned int		i;
+
+	for (i = 0; i < talloc_array_length(node->conn); i++) {
+		fr_redis_async_conn_t *conn = node->conn[i];
+
+		if (!conn) return async_conn_alloc(node, i);
+
+		if (!found || (conn->in_flight < found->in_flight)) found = conn;
+	}
+
+	return found;
+}
+
+static void _async_cmd_reply(redisAsyncContext *ac, void *r, void *privdata);
+
+/** Queue a command on a connection to the specified node
+ *
+ * @param[in] cmd	to send.
+ * @param[in] addr	of the node to send it to.
+ * @param[in] asking	Prefix the command with ASKING, as we're following an -ASK redirect.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int async_cmd_send(fr_redis_async_cmd_t *cmd, fr_socket_addr_t const *addr, bool asking)
+{
+	fr_redis_async_t	*async = cmd->async;
+	fr_redis_async_node_t	*node;
+	fr_redis_async_conn_t	*conn;
+	REQUEST			*request = cmd->request;
+
+	node = async_node_find(async, addr);
+	conn = async_conn_select(node);
+	if (!conn) {
+		REDEBUG("[%s:%i]: No connections available", node->name, node->addr.port);
+		return -1;
+	}
+
+	if (asking && (redisAsyncCommand(conn->ac, NULL, NULL, "ASKING") != REDIS_OK)) {
+	error:
+		REDEBUG("[%s:%i]: Failed queuing command: %s", node->name, node->addr.port, conn->ac->errstr);
+		return -1;
+	}
+
+	if (redisAsyncCommandArgv(conn->ac, _async_cmd_reply, cmd, cmd->argc, cmd->argv, cmd->argv_len) != REDIS_OK) {
+		goto error;
+	}
+	conn->in_flight++;
+
+	RDEBUG2("[%s:%i]: >>> Queued command %s on connection %u (%u in flight)",
+		node->name, node->addr.port, cmd->argv[0], conn->slot, conn->in_flight);
+
+	return 0;
+}
+
+/** Process the reply to a command, following redirects
+ *
+ */
+static void _async_cmd_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+	fr_redis_async_conn_t	*conn = ac->data;
+	fr_redis_async_cmd_t	*cmd = talloc_get_type_abort(privdata, fr_redis_async_cmd_t);
+	fr_redis_async_t	*async = cmd->async;
+	redisReply		*reply = r;
+	REQUEST			*request = cmd->request;
+	fr_redis_rcode_t	status;
+	fr_socket_addr_t	addr;
+
+	conn->in_flight--;
+
+	/*
+	 *	Request went away whilst the command was
+	 *	in flight, or we're shutting down.
+	 */
+	if (!request || async->freeing) {
+		talloc_free(cmd);
+		return;
+	}
+
+	if (!reply) {
+		REDEBUG("[%s:%i]: Connection error: %s", conn->node->name, conn->node->addr.port, ac->errstr);
+		status = REDIS_RCODE_RECONNECT;
+	} else {
+		/*
+		 *	Only uses the connection if reply is NULL.
+		 */
+		status = fr_redis_command_status(NULL, reply);
+	}
+
+	RDEBUG2("[%s:%i]: <<< Received reply to %s, status %s", conn->node->name, conn->node->addr.port,
+		cmd->argv[0], fr_int2str(redis_rcodes, status, "<INVALID>"));
+
+	switch (status) {
+	case REDIS_RCODE_MOVE:
+	case REDIS_RCODE_ASK:
+		if (cmd->redirects >= async->conf->max_redirects) {
+			REDEBUG("Too many redirects (%u)", cmd->redirects);
+			break;
+		}
+		cmd->redirects++;
+
+		if (fr_redis_cluster_addr_by_redirect(&addr, async->cluster, reply) < 0) {
+			RPEDEBUG("Failed processing redirect");
+			break;
+		}
+
+		if (async_cmd_send(cmd, &addr, (status == REDIS_RCODE_ASK)) < 0) break;
+
+		return;
+
+	default:
+		break;
+	}
+
+	cmd->callback(request, status, reply, cmd->uctx);
+	talloc_free(cmd);
+}
+
+/** Close all connections before freeing the commands still in flight
+ *
+ */
+static int _async_free(fr_redis_async_t *async)
+{
+	async->freeing = true;
+	talloc_free(async->nodes);
+
+	return 0;
+}
+
+/** Allocate a new asynchronous client for a cluster
+ *
+ * Should be called from a module's thread_instantiate callback.  Connections
+ * are opened lazily, when the first command is issued to a node.
+ *
+ * @param[in] ctx		to allocate the client in.  Freeing it closes all connections.
+ * @param[in] el		Event list servicing the current thread.
+ * @param[in] cluster		Used to map keys to nodes.
+ * @param[in] conf		Common redis configuration.
+ * @param[in] log_prefix	to prepend to log messages.
+ * @return
+ *	- A new client.
+ *	- NULL on error.
+ */
+fr_redis_async_t *fr_redis_async_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				       fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf,
+				       char const *log_prefix)
+{
+	fr_redis_async_t *async;
+
+	async = talloc_zero(ctx, fr_redis_async_t);
+	if (!async) return NULL;
+
+	async->el = el;
+	async->cluster = cluster;
+	async->conf = conf;
+	async->log_prefix = talloc_typed_strdup(async, log_prefix);
+
+	async->nodes = rbtree_create(async, _async_node_cmp, NULL, 0);
+	if (!async->nodes) {
+		talloc_free(async);
+		return NULL;
+	}
+	talloc_set_destructor(async, _async_free);
+
+	return async;
+}
+
+/** Issue a command asynchronously
+ *
+ * The command is queued, and will be written to the node responsible for the key
+ * along with any other commands queued before the current event loop iteration
+ * completes.  The callback will be called when the reply arrives.
+ *
+ * Callers will usually call unlang_yield() after this function returns, and
+ * unlang_resumable() from the callback.
+ *
+ * @param[in] async	client to issue the command with.
+ * @param[in] request	The current request.
+ * @param[in] key	to resolve to a cluster node.  If NULL a random node will be used.
+ * @param[in] key_len	Length of the key.
+ * @param[in] read_only	If true, may be sent to a slave.
+ * @param[in] callback	to call with the reply.
+ * @param[in] uctx	to pass to the callback.
+ * @param[in] argc	Number of command arguments.
+ * @param[in] argv	Command arguments.  Will be copied.
+ * @return
+ *	- A handle which may be passed to #fr_redis_async_cancel.  It's freed
+ *	  after the callback returns.
+ *	- NULL on error.  The callback will not be called.
+ */
+fr_redis_async_cmd_t *fr_redis_async_command(fr_redis_async_t *async, REQUEST *request,
+					     uint8_t const *key, size_t key_len, bool read_only,
+					     fr_redis_async_reply_t callback, void *uctx,
+					     int argc, char const **argv)
+{
+	fr_redis_async_cmd_t	*cmd;
+	fr_socket_addr_t	addr;
+	int			i;
+
+	rad_assert(argc > 0);
+
+	if (fr_redis_cluster_addr_by_key(&addr, async->cluster, request, key, key_len, read_only) < 0) {
+		RPEDEBUG("Failed resolving key to cluster node");
+		return NULL;
+	}
+
+	/*
+	 *	The command may outlive the request if it's
+	 *	cancelled, so it's allocated in the client.
+	 */
+	MEM(cmd = talloc_zero(async, fr_redis_async_cmd_t));
+	cmd->async = async;
+	cmd->request = request;
+	cmd->callback = callback;
+	cmd->uctx = uctx;
+	cmd->argc = argc;
+	MEM(cmd->argv = talloc_array(cmd, char const *, argc));
+	MEM(cmd->argv_len = talloc_array(cmd, size_t, argc));
+	for (i = 0; i < argc; i++) {
+		MEM(cmd->argv[i] = talloc_typed_strdup(cmd->argv, argv[i]));
+		cmd->argv_len[i] = talloc_array_length(cmd->argv[i]) - 1;
+	}
+
+	if (async_cmd_send(cmd, &addr, false) < 0) {
+		talloc_free(cmd);
+		return NULL;
+	}
+
+	return cmd;
+}
+
+/** Cancel a command
+ *
+ * The command can't be removed from the connection's pipeline, so the reply
+ * is discarded when it arrives, and the callback is not called.
+ *
+ * @param[in] cmd	to cancel.
+ */
+void fr_redis_async_cancel(fr_redis_async_cmd_t *cmd)
+{
+	cmd->request = NULL;
+	cmd->callback = NULL;
+	cmd->uctx = NULL;
+}
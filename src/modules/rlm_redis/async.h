@@ -0,0 +1,64 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file async.h
+ * @brief Asynchronous, pipelining Redis cluster client
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+#ifndef LIBFREERADIUS_REDIS_ASYNC_H
+#define	LIBFREERADIUS_REDIS_ASYNC_H
+
+RCSIDH(async_h, "$Id$")
+
+#include <freeradius-devel/event.h>
+#include "redis.h"
+#include "cluster.h"
+
+typedef struct fr_redis_async fr_redis_async_t;
+typedef struct fr_redis_async_cmd fr_redis_async_cmd_t;
+
+/** Called when the reply to a command has been received
+ *
+ * Redirects are followed before this is called, so status will never be
+ * #REDIS_RCODE_MOVE or #REDIS_RCODE_ASK unless max_redirects was exceeded.
+ *
+ * @note The reply is freed when the callback returns.  Anything needed from it
+ *	must be copied.
+ * @note Further commands may be issued from within the callback.
+ *
+ * @param[in] request	the command was issued for.
+ * @param[in] status	of the command.
+ * @param[in] reply	from the server.  NULL if the connection failed.
+ * @param[in] uctx	passed to #fr_redis_async_command.
+ */
+typedef void (*fr_redis_async_reply_t)(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx);
+
+fr_redis_async_t	*fr_redis_async_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					      fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf,
+					      char const *log_prefix);
+
+fr_redis_async_cmd_t	*fr_redis_async_command(fr_redis_async_t *async, REQUEST *request,
+						uint8_t const *key, size_t key_len, bool read_only,
+						fr_redis_async_reply_t callback, void *uctx,
+						int argc, char const **argv);
+
+void			fr_redis_async_cancel(fr_redis_async_cmd_t *cmd);
+
+#endif /* LIBFREERADIUS_REDIS_ASYNC_H */
@@ -1942,6 +1942,86 @@ try_again:
 	return REDIS_RCODE_TRY_AGAIN;
 }
 
+/** Resolve a key to the address of the node that should service it
+ *
+ * Used by clients which maintain their own connections to cluster nodes, and
+ * only need the cluster for its key slot map (see async.c).
+ *
+ * If a previous redirect indicated the map is stale, a connection is borrowed
+ * from the key slot master's pool to remap the cluster before resolving the key.
+ *
+ * @param[out] out Where to write the address of the node.
+ * @param[in] cluster to resolve key in.
+ * @param[in] request The current request (may be NULL).
+ * @param[in] key to resolve.  If NULL or key_len is 0 a random slot will be chosen.
+ * @param[in] key_len Length of the key.
+ * @param[in] read_only If true, will pick a random slave for the key slot in preference to
+ *	the master.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are no nodes in the cluster.
+ */
+int fr_redis_cluster_addr_by_key(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, REQUEST *request,
+				 uint8_t const *key, size_t key_len, bool read_only)
+{
+	cluster_key_slot_t	*key_slot;
+	cluster_node_t		*node;
+
+	if (rbtree_num_elements(cluster->used_nodes) == 0) {
+		fr_strerror_printf("No nodes in cluster");
+		return -1;
+	}
+
+	key_slot = cluster_slot_by_key(cluster, request, key, key_len);
+
+	if (cluster->remap_needed) {
+		fr_redis_conn_t *conn;
+
+		node = &cluster->node[key_slot->master];
+		conn = fr_connection_get(node->pool, request);
+		if (conn) {
+			if (cluster_remap(request, cluster, conn) == CLUSTER_OP_SUCCESS) {
+				key_slot = cluster_slot_by_key(cluster, request, key, key_len);
+			}
+			fr_connection_release(node->pool, request, conn);
+		}
+	}
+
+	if (read_only && (key_slot->slave_num > 0)) {
+		node = &cluster->node[key_slot->slave[fr_rand() % key_slot->slave_num]];
+	} else {
+		node = &cluster->node[key_slot->master];
+	}
+
+	*out = node->addr;
+
+	return 0;
+}
+
+/** Resolve a -MOVED or -ASK redirect to the address of the node we were redirected to
+ *
+ * A -MOVED redirect indicates the key slot map is stale, so the cluster will be
+ * remapped on the next call to #fr_redis_cluster_addr_by_key or
+ * #fr_redis_cluster_state_init.
+ *
+ * @param[out] out Where to write the address of the node.
+ * @param[in] cluster the redirect was received from.
+ * @param[in] reply containing the redirect.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the redirect was invalid.
+ */
+int fr_redis_cluster_addr_by_redirect(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, redisReply *reply)
+{
+	if (cluster_node_conf_from_redirect(NULL, out, reply) < 0) return -1;
+
+	if (strncmp(REDIS_ERROR_MOVED_STR, reply->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) {
+		cluster->remap_needed = true;
+	}
+
+	return 0;
+}
+
 /** Get the pool associated with a node in the cluster
  *
  * @note This is used for testing only.  It's not ifdef'd out because
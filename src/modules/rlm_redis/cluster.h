@@ -75,6 +75,15 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 					     fr_redis_cluster_t *cluster, REQUEST *request,
 					     fr_redis_rcode_t status, redisReply **reply);
 
+/*
+ *	Resolve keys and redirects to node addresses, for clients
+ *	which manage their own connections.
+ */
+int fr_redis_cluster_addr_by_key(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, REQUEST *request,
+				 uint8_t const *key, size_t key_len, bool read_only);
+
+int fr_redis_cluster_addr_by_redirect(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, redisReply *reply);
+
 /*
  *	Useful for running commands over every node, such as PING
  *	or KEYS.
@@ -99,6 +99,8 @@ typedef struct redis_common_conf {
 	uint32_t		max_alt;	//!< Maximum alternative nodes to try.
 	struct timeval		retry_delay;	//!< How long to wait when we received a -TRYAGAIN
 						//!< message.
+	uint32_t		async_conns;	//!< Number of connections each thread's asynchronous
+						//!< client opens to each node.
 } fr_redis_conf_t;
 
 #define REDIS_COMMON_CONFIG \
@@ -108,7 +110,8 @@ typedef struct redis_common_conf {
 	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, fr_redis_conf_t, password) }, \
 	{ FR_CONF_OFFSET("max_nodes", FR_TYPE_UINT8, fr_redis_conf_t, max_nodes), .dflt = "20" }, \
 	{ FR_CONF_OFFSET("max_alt", FR_TYPE_UINT32, fr_redis_conf_t, max_alt), .dflt = "3" }, \
-	{ FR_CONF_OFFSET("max_redirects", FR_TYPE_UINT32, fr_redis_conf_t, max_redirects), .dflt = "2" }
+	{ FR_CONF_OFFSET("max_redirects", FR_TYPE_UINT32, fr_redis_conf_t, max_redirects), .dflt = "2" }, \
+	{ FR_CONF_OFFSET("async_connections", FR_TYPE_UINT32, fr_redis_conf_t, async_conns), .dflt = "1" }
 
 void		fr_redis_version_print(void);
 
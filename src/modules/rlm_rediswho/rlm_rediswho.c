@@ -35,9 +35,10 @@ RCSID("$Id$")
 
 #include "../rlm_redis/redis.h"
 #include "../rlm_redis/cluster.h"
+#include "../rlm_redis/async.h"
 
 typedef struct rlm_rediswho {
-	fr_redis_conf_t		*conf;		//!< Connection parameters for the Redis server.
+	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
 	char const		*name;		//!< Instance name.
@@ -53,6 +54,28 @@ typedef struct rlm_rediswho {
 	char const		*expire;	//!< Command for expiring entries.
 } rlm_rediswho_t;
 
+/** Thread specific data
+ *
+ */
+typedef struct rlm_rediswho_thread {
+	fr_redis_async_t	*async;		//!< Asynchronous client, shared by all requests
+						//!< processed by this thread.
+} rlm_rediswho_thread_t;
+
+/** State of an accounting request whilst its commands are in flight
+ *
+ */
+typedef struct rediswho_state {
+	rlm_rediswho_t const	*inst;		//!< Module instance.
+	rlm_rediswho_thread_t	*thread;	//!< Thread the request is being processed in.
+
+	char const		*trim;		//!< Command for trimming the session list.
+	char const		*expire;	//!< Command for expiring entries.
+
+	fr_redis_async_cmd_t	*cmd;		//!< Command currently in flight.
+	rlm_rcode_t		rcode;		//!< To return when the request is resumed.
+} rediswho_state_t;
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -77,19 +100,14 @@ static CONF_PARSER module_config[] = {
 };
 
 /*
- *	Query the database executing a command with no result rows
+ *	Expand a command and queue it, with no result rows
+ *
+ *	Returns 1 if there was no command to send, 0 if the command was
+ *	queued, and -1 on error.
  */
-static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char const *fmt)
+static int rediswho_command(rediswho_state_t *state, REQUEST *request, char const *fmt,
+			    fr_redis_async_reply_t callback)
 {
-	fr_redis_conn_t		*conn;
-
-	int 			ret = -1;
-
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
-	redisReply		*reply = NULL;
-	int			s_ret;
-
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
 
@@ -97,10 +115,10 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	char const		*argv[MAX_REDIS_ARGS];
 	char			argv_buf[MAX_REDIS_COMMAND_LEN];
 
-	if (!fmt || !*fmt) return 0;
+	if (!fmt || !*fmt) return 1;
 
 	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, argv, false, sizeof(argv_buf), argv_buf);
- 	if (argc < 0) return -1;
+ 	if (argc <= 0) return -1;
 
 	/*
 	 *	If we've got multiple arguments, the second one is usually the key.
@@ -114,19 +132,28 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	 	key_len = strlen((char const *)key);
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+	state->cmd = fr_redis_async_command(state->thread->async, request, key, key_len, false,
+					    callback, state, argc, argv);
+	if (!state->cmd) return -1;
+
+	return 0;
+}
+
+/*
+ *	Process the reply to a command
+ *
+ *	Returns the integer the server replied with (if positive), 0 for other
+ *	successful replies, and -1 on error.
+ */
+static int rediswho_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply)
+{
+	int ret = 0;
+
+	if (status != REDIS_RCODE_SUCCESS) {
 		RERROR("Failed inserting accounting data");
-	error:
-		fr_redis_reply_free(reply);
 		return -1;
 	}
-	if (!rad_cond_assert(reply)) goto error;
+	if (!rad_cond_assert(reply)) return -1;
 
 	switch (reply->type) {
 	case REDIS_REPLY_INTEGER:
@@ -141,38 +168,134 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	default:
 		break;
 	}
-	fr_redis_reply_free(reply);
 
 	return ret;
 }
 
-static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *request,
-				      char const *insert,
-				      char const *trim,
-				      char const *expire)
+/*
+ *	Finish processing, and mark the request as resumable
+ */
+static void rediswho_done(REQUEST *request, rediswho_state_t *state, rlm_rcode_t rcode)
+{
+	state->rcode = rcode;
+	unlang_resumable(request);
+}
+
+static void _rediswho_expire_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx);
+
+/*
+ *	Queue the expire command, or finish if there isn't one
+ */
+static void rediswho_expire(REQUEST *request, rediswho_state_t *state)
+{
+	switch (rediswho_command(state, request, state->expire, _rediswho_expire_reply)) {
+	case 0:
+		return;
+
+	case 1:
+		rediswho_done(request, state, RLM_MODULE_OK);
+		return;
+
+	default:
+		rediswho_done(request, state, RLM_MODULE_FAIL);
+		return;
+	}
+}
+
+static void _rediswho_expire_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
+{
+	rediswho_state_t	*state = talloc_get_type_abort(uctx, rediswho_state_t);
+
+	state->cmd = NULL;
+
+	if (rediswho_reply(request, status, reply) < 0) {
+		rediswho_done(request, state, RLM_MODULE_FAIL);
+		return;
+	}
+
+	rediswho_done(request, state, RLM_MODULE_OK);
+}
+
+static void _rediswho_trim_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
+{
+	rediswho_state_t	*state = talloc_get_type_abort(uctx, rediswho_state_t);
+
+	state->cmd = NULL;
+
+	if (rediswho_reply(request, status, reply) < 0) {
+		rediswho_done(request, state, RLM_MODULE_FAIL);
+		return;
+	}
+
+	rediswho_expire(request, state);
+}
+
+static void _rediswho_insert_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
 {
-	int ret;
+	rediswho_state_t	*state = talloc_get_type_abort(uctx, rediswho_state_t);
+	rlm_rediswho_t const	*inst = state->inst;
+	int			ret;
 
-	ret = rediswho_command(inst, request, insert);
-	if (ret < 0) return RLM_MODULE_FAIL;
+	state->cmd = NULL;
+
+	ret = rediswho_reply(request, status, reply);
+	if (ret < 0) {
+		rediswho_done(request, state, RLM_MODULE_FAIL);
+		return;
+	}
 
 	/* Only trim if necessary */
 	if ((inst->trim_count >= 0) && (ret > inst->trim_count)) {
-		if (rediswho_command(inst, request, trim) < 0) return RLM_MODULE_FAIL;
+		switch (rediswho_command(state, request, state->trim, _rediswho_trim_reply)) {
+		case 0:
+			return;
+
+		case 1:
+			break;
+
+		default:
+			rediswho_done(request, state, RLM_MODULE_FAIL);
+			return;
+		}
 	}
 
-	if (rediswho_command(inst, request, expire) < 0) return RLM_MODULE_FAIL;
-	return RLM_MODULE_OK;
+	rediswho_expire(request, state);
+}
+
+static rlm_rcode_t mod_accounting_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+					 void *ctx)
+{
+	rediswho_state_t	*state = talloc_get_type_abort(ctx, rediswho_state_t);
+	rlm_rcode_t		rcode = state->rcode;
+
+	talloc_free(state);
+
+	return rcode;
+}
+
+static void mod_accounting_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				  void *ctx, fr_state_action_t action)
+{
+	rediswho_state_t	*state = talloc_get_type_abort(ctx, rediswho_state_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	/*
+	 *	Reply will be discarded when it arrives
+	 */
+	if (state->cmd) {
+		fr_redis_async_cancel(state->cmd);
+		state->cmd = NULL;
+	}
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rediswho_t const	*inst = instance;
-	rlm_rcode_t		rcode;
 	VALUE_PAIR		*vp;
 	fr_dict_enum_t		*dv;
 	CONF_SECTION		*cs;
-	char const		*insert, *trim, *expire;
+	rediswho_state_t	*state;
 
 	vp = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_STATUS_TYPE, TAG_ANY);
 	if (!vp) {
@@ -192,13 +315,30 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 		return RLM_MODULE_NOOP;
 	}
 
-	insert = cf_pair_value(cf_pair_find(cs, "insert"));
-	trim = cf_pair_value(cf_pair_find(cs, "trim"));
-	expire = cf_pair_value(cf_pair_find(cs, "expire"));
+	MEM(state = talloc_zero(request, rediswho_state_t));
+	state->inst = inst;
+	state->thread = thread;
+	state->trim = cf_pair_value(cf_pair_find(cs, "trim"));
+	state->expire = cf_pair_value(cf_pair_find(cs, "expire"));
 
-	rcode = mod_accounting_all(inst, request, insert, trim, expire);
+	/*
+	 *	The insert, trim and expire commands are issued in
+	 *	sequence from the reply callbacks.
+	 */
+	switch (rediswho_command(state, request, cf_pair_value(cf_pair_find(cs, "insert")), _rediswho_insert_reply)) {
+	case 0:
+		break;
 
-	return rcode;
+	case 1:
+		talloc_free(state);
+		return RLM_MODULE_OK;
+
+	default:
+		talloc_free(state);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_yield(request, mod_accounting_resume, mod_accounting_signal, state);
 }
 
 static int mod_bootstrap(CONF_SECTION *conf, void *instance)
@@ -216,12 +356,38 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_rediswho_t *inst = instance;
 
-	inst->cluster = fr_redis_cluster_alloc(inst, conf, inst->conf, true, NULL, NULL, NULL);
+	FR_INTEGER_BOUND_CHECK("async_connections", inst->conf.async_conns, >=, 1);
+
+	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = instance;
+	rlm_rediswho_thread_t	*t = thread;
+
+	t->async = fr_redis_async_alloc(t, el, inst->cluster, &inst->conf, inst->name);
+	if (!t->async) {
+		ERROR("Failed allocating asynchronous redis client");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_rediswho_thread_t	*t = thread;
+
+	TALLOC_FREE(t->async);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -231,14 +397,17 @@ static int mod_load(void)
 
 extern rad_module_t rlm_rediswho;
 rad_module_t rlm_rediswho = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "rediswho",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_rediswho_t),
-	.config		= module_config,
-	.load		= mod_load,
-	.instantiate	= mod_instantiate,
-	.bootstrap	= mod_bootstrap,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "rediswho",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_rediswho_t),
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.config			= module_config,
+	.load			= mod_load,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
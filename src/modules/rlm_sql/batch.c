@@ -0,0 +1,571 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file batch.c
+ * @brief Write-behind queue for accounting queries.
+ *
+ * Requests add their expanded queries to a queue and return immediately.
+ * A dedicated thread writes the queue out when it reaches batch.size
+ * entries, or when the oldest entry has been waiting batch.interval.
+ *
+ * Consecutive single row INSERTs which share the same "INSERT ... VALUES"
+ * prefix are written as one multi-row INSERT, in the same way radsqlrelay
+ * merges INSERTs when replaying a logfile.  Everything else is written
+ * individually, on a single connection, trying each alternative query in
+ * turn as acct_redundant() would.
+ *
+ * If the database is unavailable, queued queries are written to the
+ * journal file in logfile format, so they can be replayed with radsqlrelay.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <ctype.h>
+#include <pthread.h>
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_sql.h"
+
+typedef struct sql_batch_entry sql_batch_entry_t;
+
+/** A set of alternative queries waiting to be written
+ *
+ */
+struct sql_batch_entry {
+	sql_batch_entry_t	*next;				//!< Next entry in the queue.
+	struct timeval		when;				//!< When the entry was queued.
+
+	char			**query;			//!< Expanded queries, tried in order until
+								//!< one of them updates a row.
+
+	char const		*values;			//!< Values tuple of query[0], or NULL if
+								//!< query[0] can't be merged with other INSERTs.
+	size_t			values_len;			//!< Length of the values tuple.
+};
+
+struct sql_batch {
+	rlm_sql_t const		*inst;				//!< Instance the queue belongs to.
+
+	pthread_t		pthread_id;			//!< Writer thread.
+	pthread_mutex_t		mutex;				//!< Protects the queue.
+	pthread_cond_t		cond;				//!< Signalled to wake the writer.
+	bool			stop;				//!< Tells the writer to flush and exit.
+
+	sql_batch_entry_t	*head;				//!< Oldest entry.
+	sql_batch_entry_t	**tail;				//!< Where to append the next entry.
+	uint32_t		num_queued;			//!< Number of entries in the queue.
+};
+
+/** Find the values tuple of a single row INSERT
+ *
+ * The query must be of the form "INSERT ... VALUES (...)", optionally followed
+ * by a ';'.  Anything else (INSERT ... SELECT, ON CONFLICT, RETURNING, multiple
+ * tuples) is not merged.
+ *
+ * Quoted strings are skipped without interpreting escape sequences.  A value
+ * containing an escaped quote will confuse the scan, in which case the query
+ * is not merged.
+ *
+ * @param[out] len	Length of the values tuple, including the enclosing brackets.
+ * @param[in] query	to examine.
+ * @return
+ *	- A pointer to the opening bracket of the values tuple.
+ *	- NULL if the query can't be merged.
+ */
+static char const *sql_batch_values(size_t *len, char const *query)
+{
+	char const	*p, *values = NULL;
+	char		quote = '\0';
+	int		depth = 0;
+
+	for (p = query; isspace((uint8_t) *p); p++);
+	if ((strncasecmp(p, "INSERT", 6) != 0) || !isspace((uint8_t) p[6])) return NULL;
+
+	/*
+	 *	Find the VALUES keyword, ignoring anything quoted
+	 *	or bracketed, i.e. column lists.
+	 */
+	for (p += 6; *p; p++) {
+		if (quote) {
+			if (*p == quote) quote = '\0';
+			continue;
+		}
+
+		switch (*p) {
+		case '\'':
+		case '"':
+		case '`':
+			quote = *p;
+			continue;
+
+		case '(':
+			depth++;
+			continue;
+
+		case ')':
+			if (--depth < 0) return NULL;
+			continue;
+
+		default:
+			break;
+		}
+
+		if ((depth > 0) || (strncasecmp(p, "VALUES", 6) != 0)) continue;
+		if (!isspace((uint8_t) p[-1]) && (p[-1] != ')')) continue;
+		if (!isspace((uint8_t) p[6]) && (p[6] != '(')) continue;
+
+		for (p += 6; isspace((uint8_t) *p); p++);
+		if (*p != '(') return NULL;
+
+		values = p;
+		break;
+	}
+	if (!values) return NULL;
+
+	/*
+	 *	Find the bracket which closes the tuple
+	 */
+	for (p = values; *p; p++) {
+		if (quote) {
+			if (*p == quote) quote = '\0';
+			continue;
+		}
+
+		switch (*p) {
+		case '\'':
+		case '"':
+		case '`':
+			quote = *p;
+			break;
+
+		case '(':
+			depth++;
+			break;
+
+		case ')':
+			depth--;
+			break;
+
+		default:
+			break;
+		}
+
+		if (depth == 0) break;
+	}
+	if (!*p) return NULL;
+
+	*len = (p + 1) - values;
+
+	/*
+	 *	Only whitespace and a terminating ';' may follow
+	 */
+	for (p++; *p; p++) {
+		if (!isspace((uint8_t) *p) && (*p != ';')) return NULL;
+	}
+
+	return values;
+}
+
+/** Whether two entries can be written as a single multi-row INSERT
+ *
+ */
+static inline bool sql_batch_mergeable(sql_batch_entry_t const *a, sql_batch_entry_t const *b)
+{
+	size_t prefix_len;
+
+	if (!a->values || !b->values) return false;
+
+	prefix_len = a->values - a->query[0];
+	if (prefix_len != (size_t)(b->values - b->query[0])) return false;
+
+	return (memcmp(a->query[0], b->query[0], prefix_len) == 0);
+}
+
+/** Free a list of entries
+ *
+ */
+static void sql_batch_list_free(sql_batch_entry_t *head)
+{
+	sql_batch_entry_t *next;
+
+	while (head) {
+		next = head->next;
+		talloc_free(head);
+		head = next;
+	}
+}
+
+/** Write entries to the journal
+ *
+ * Only the first query of each entry is written, as replaying the journal
+ * executes every statement in it.
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] head	of the list of entries to write.  The entries are freed.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the entries could not be written, and were discarded.
+ */
+static int sql_batch_journal(rlm_sql_t const *inst, sql_batch_entry_t *head)
+{
+	sql_batch_entry_t	*entry;
+	uint32_t		count = 0;
+	int			fd;
+	bool			failed = false;
+
+	for (entry = head; entry; entry = entry->next) count++;
+
+	if (!inst->config->batch.journal || !*inst->config->batch.journal) {
+		ERROR("Discarding %u queued queries, no journal configured", count);
+		sql_batch_list_free(head);
+		return -1;
+	}
+
+	fd = exfile_open(inst->ef, NULL, inst->config->batch.journal, 0640, true);
+	if (fd < 0) {
+		ERROR("Discarding %u queued queries, couldn't open journal '%s': %s",
+		      count, inst->config->batch.journal, fr_syserror(errno));
+		sql_batch_list_free(head);
+		return -1;
+	}
+
+	for (entry = head; entry; entry = entry->next) {
+		if ((write(fd, entry->query[0], strlen(entry->query[0])) < 0) || (write(fd, ";\n", 2) < 0)) {
+			failed = true;
+			break;
+		}
+	}
+
+	if (failed) {
+		ERROR("Failed writing to journal '%s': %s", inst->config->batch.journal, fr_syserror(errno));
+	} else {
+		WARN("Wrote %u queued queries to journal '%s'", count, inst->config->batch.journal);
+	}
+
+	exfile_close(inst->ef, NULL, fd);
+	sql_batch_list_free(head);
+
+	return failed ? -1 : 0;
+}
+
+/** Write a single entry, trying each of its queries in turn
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in,out] handle	to write the entry with.  May be set to NULL if
+ *			the connection was lost.
+ * @param[in] entry	to write.
+ * @return
+ *	- 0 if the entry was written, or failed in a way that retrying won't fix.
+ *	- -1 if the connection was lost.
+ */
+static int sql_batch_write(rlm_sql_t const *inst, rlm_sql_handle_t **handle, sql_batch_entry_t *entry)
+{
+	size_t	i;
+	int	numaffected;
+
+	for (i = 0; i < talloc_array_length(entry->query); i++) {
+		switch (rlm_sql_query(inst, NULL, handle, entry->query[i])) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_ALT_QUERY:
+			continue;
+
+		case RLM_SQL_RECONNECT:
+			return -1;
+
+		/*
+		 *	The query itself is broken, or the server rejected
+		 *	it.  Either way the request would have failed if
+		 *	it had been written synchronously.
+		 */
+		default:
+			return 0;
+		}
+
+		numaffected = (inst->driver->sql_affected_rows)(*handle, inst->config);
+		(inst->driver->sql_finish_query)(*handle, inst->config);
+		if (numaffected > 0) return 0;
+	}
+
+	DEBUG2("No queries updated any rows");
+
+	return 0;
+}
+
+/** Write a run of INSERTs as a single multi-row INSERT
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in,out] handle	to write the entries with.  May be set to NULL if
+ *			the connection was lost.
+ * @param[in] head	first entry of the run.
+ * @param[in] count	number of entries in the run.
+ * @return
+ *	- 0 if the entries were written.
+ *	- 1 if the INSERT failed, and the entries should be written individually.
+ *	- -1 if the connection was lost.
+ */
+static int sql_batch_write_merged(rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+				  sql_batch_entry_t *head, uint32_t count)
+{
+	sql_batch_entry_t	*entry = head;
+	char			*query;
+	uint32_t		i;
+	int			ret;
+
+	query = talloc_strndup(NULL, head->query[0], head->values - head->query[0]);
+	for (i = 0; i < count; i++, entry = entry->next) {
+		if (i > 0) query = talloc_strdup_append_buffer(query, ", ");
+		query = talloc_strndup_append_buffer(query, entry->values, entry->values_len);
+	}
+
+	DEBUG2("Writing %u INSERTs as a single query", count);
+
+	ret = rlm_sql_query(inst, NULL, handle, query);
+	talloc_free(query);
+
+	switch (ret) {
+	case RLM_SQL_OK:
+		(inst->driver->sql_finish_query)(*handle, inst->config);
+		return 0;
+
+	case RLM_SQL_RECONNECT:
+		return -1;
+
+	/*
+	 *	Usually a duplicate key.  Write the rows individually
+	 *	so the alternative queries are used.
+	 */
+	default:
+		return 1;
+	}
+}
+
+/** Write a list of entries to the database
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] head	of the list of entries to write.  The entries are freed.
+ */
+static void sql_batch_flush(rlm_sql_t const *inst, sql_batch_entry_t *head)
+{
+	rlm_sql_handle_t	*handle;
+	sql_batch_entry_t	*entry, *last, *next;
+	uint32_t		count, i;
+
+	handle = fr_connection_get(inst->pool, NULL);
+	if (!handle) {
+		sql_batch_journal(inst, head);
+		return;
+	}
+
+	while (head) {
+		/*
+		 *	Find the run of INSERTs which can be merged
+		 *	with this one.
+		 */
+		for (last = head, count = 1;
+		     last->next && (count < inst->config->batch.size) && sql_batch_mergeable(head, last->next);
+		     last = last->next, count++);
+
+		if (count > 1) {
+			switch (sql_batch_write_merged(inst, &handle, head, count)) {
+			case 0:
+				next = last->next;
+				last->next = NULL;
+				sql_batch_list_free(head);
+				head = next;
+				continue;
+
+			case 1:
+				break;
+
+			default:
+				goto journal;
+			}
+		}
+
+		/*
+		 *	Write the run one entry at a time
+		 */
+		for (i = 0; i < count; i++) {
+			entry = head;
+			if (sql_batch_write(inst, &handle, entry) < 0) goto journal;
+			head = entry->next;
+			talloc_free(entry);
+		}
+	}
+
+	fr_connection_release(inst->pool, NULL, handle);
+	return;
+
+journal:
+	if (handle) fr_connection_release(inst->pool, NULL, handle);
+	sql_batch_journal(inst, head);
+}
+
+/** Wait for the queue to fill, or for the oldest entry to expire, then write it out
+ *
+ */
+static void *sql_batch_thread(void *arg)
+{
+	sql_batch_t		*batch = talloc_get_type_abort(arg, sql_batch_t);
+	rlm_sql_t const		*inst = batch->inst;
+	sql_batch_entry_t	*head;
+	bool			stop;
+
+	pthread_mutex_lock(&batch->mutex);
+	for (;;) {
+		while (!batch->stop && (batch->num_queued < inst->config->batch.size)) {
+			struct timeval	when;
+			struct timespec	ts;
+
+			if (!batch->head) {
+				pthread_cond_wait(&batch->cond, &batch->mutex);
+				continue;
+			}
+
+			fr_timeval_add(&when, &batch->head->when, &inst->config->batch.interval);
+			ts.tv_sec = when.tv_sec;
+			ts.tv_nsec = when.tv_usec * 1000;
+
+			if (pthread_cond_timedwait(&batch->cond, &batch->mutex, &ts) == ETIMEDOUT) break;
+		}
+
+		head = batch->head;
+		batch->head = NULL;
+		batch->tail = &batch->head;
+		batch->num_queued = 0;
+		stop = batch->stop;
+		pthread_mutex_unlock(&batch->mutex);
+
+		if (head) sql_batch_flush(inst, head);
+		if (stop) break;
+
+		pthread_mutex_lock(&batch->mutex);
+	}
+
+	return NULL;
+}
+
+/** Add a set of expanded queries to the queue
+ *
+ * @param[in] batch	to add the queries to.
+ * @param[in] request	the queries were expanded for.
+ * @param[in] query	talloc array of queries, parented by the array.  Ownership
+ *			passes to the queue.
+ * @return
+ *	- 0 if the queries were queued.
+ *	- 1 if the queue was full and the queries were written to the journal.
+ *	- -1 if the queue was full and the queries could not be journaled.
+ */
+int sql_batch_enqueue(sql_batch_t *batch, REQUEST *request, char **query)
+{
+	rlm_sql_t const		*inst = batch->inst;
+	sql_batch_entry_t	*entry;
+
+	rad_assert(talloc_array_length(query) > 0);
+
+	entry = talloc_zero(NULL, sql_batch_entry_t);
+	entry->query = talloc_steal(entry, query);
+	entry->values = sql_batch_values(&entry->values_len, query[0]);
+	gettimeofday(&entry->when, NULL);
+
+	pthread_mutex_lock(&batch->mutex);
+	if (batch->num_queued >= inst->config->batch.max_queued) {
+		pthread_mutex_unlock(&batch->mutex);
+
+		RWARN("Batch queue is full (%u queries)", inst->config->batch.max_queued);
+		return (sql_batch_journal(inst, entry) < 0) ? -1 : 1;
+	}
+
+	*batch->tail = entry;
+	batch->tail = &entry->next;
+
+	/*
+	 *	Wake the writer if the queue is full, or if this is
+	 *	the first entry, so it can set its deadline.
+	 */
+	if ((++batch->num_queued >= inst->config->batch.size) || (batch->head == entry)) {
+		pthread_cond_signal(&batch->cond);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+
+	return 0;
+}
+
+/** Stop the writer thread, flushing anything still queued
+ *
+ */
+static int _sql_batch_free(sql_batch_t *batch)
+{
+	pthread_mutex_lock(&batch->mutex);
+	batch->stop = true;
+	pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->mutex);
+
+	pthread_join(batch->pthread_id, NULL);
+
+	pthread_cond_destroy(&batch->cond);
+	pthread_mutex_destroy(&batch->mutex);
+
+	return 0;
+}
+
+/** Allocate a write-behind queue and start its writer thread
+ *
+ * The queue must be freed before the connection pool, so that anything
+ * still queued can be written.
+ *
+ * @param[in] ctx	to allocate the queue in.
+ * @param[in] inst	rlm_sql instance.
+ * @return
+ *	- New queue.
+ *	- NULL on error.
+ */
+sql_batch_t *sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst)
+{
+	sql_batch_t	*batch;
+	int		ret;
+
+	batch = talloc_zero(ctx, sql_batch_t);
+	if (!batch) return NULL;
+
+	batch->inst = inst;
+	batch->tail = &batch->head;
+
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+
+	ret = pthread_create(&batch->pthread_id, NULL, sql_batch_thread, batch);
+	if (ret != 0) {
+		ERROR("Failed creating batch writer thread: %s", fr_syserror(ret));
+		pthread_cond_destroy(&batch->cond);
+		pthread_mutex_destroy(&batch->mutex);
+		talloc_free(batch);
+		return NULL;
+	}
+	talloc_set_destructor(batch, _sql_batch_free);
+
+	return batch;
+}
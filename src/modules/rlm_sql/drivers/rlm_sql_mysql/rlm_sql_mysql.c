@@ -66,6 +66,12 @@ typedef struct rlm_sql_mysql_conn {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+
+	MYSQL_STMT	**stmts;	//!< Prepared statements, indexed by sql_stmt_t id.
+	MYSQL_STMT	*stmt;		//!< Statement currently being executed.
+	MYSQL_RES	*stmt_meta;	//!< Field information for the current statement's result.
+	MYSQL_BIND	*bind;		//!< Result bindings for the current statement.
+	unsigned long	*lengths;	//!< Lengths of the columns in the current row.
 } rlm_sql_mysql_conn_t;
 
 typedef struct rlm_sql_mysql_config {
@@ -103,11 +109,18 @@ static const CONF_PARSER driver_config[] = {
 
 /* Prototypes */
 static sql_rcode_t sql_free_result(rlm_sql_handle_t*, rlm_sql_config_t*);
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle);
 
 static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
+	size_t i;
+
 	DEBUG2("Socket destructor called, closing socket");
 
+	for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+		if (conn->stmts[i]) mysql_stmt_close(conn->stmts[i]);
+	}
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -377,6 +390,8 @@ static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *con
 	int num = 0;
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_field_count(conn->stmt);
+
 #if MYSQL_VERSION_ID >= 32224
 	/*
 	 *	Count takes a connection handle
@@ -419,6 +434,8 @@ static int sql_num_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *confi
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_num_rows(conn->stmt);
+
 	if (conn->result) {
 		return mysql_num_rows(conn->result);
 	}
@@ -446,7 +463,7 @@ static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, rlm_
 	 *	https://bugs.mysql.com/bug.php?id=32318
 	 * 	Hints that we don't have to free field_info.
 	 */
-	field_info = mysql_fetch_fields(conn->result);
+	field_info = mysql_fetch_fields(conn->stmt ? conn->stmt_meta : conn->result);
 	if (!field_info) return RLM_SQL_ERROR;
 
 	MEM(names = talloc_array(handle, char const *, fields));
@@ -468,6 +485,8 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, r
 
 	*out = NULL;
 
+	if (conn->stmt) return sql_stmt_fetch_row(out, handle);
+
 	/*
 	 *  Check pointer before de-referencing it.
 	 */
@@ -513,6 +532,17 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) {
+		if (conn->stmt_meta) {
+			mysql_free_result(conn->stmt_meta);
+			conn->stmt_meta = NULL;
+		}
+		mysql_stmt_free_result(conn->stmt);
+		TALLOC_FREE(conn->bind);
+		TALLOC_FREE(conn->lengths);
+		conn->stmt = NULL;
+	}
+
 	if (conn->result) {
 		mysql_free_result(conn->result);
 		conn->result = NULL;
@@ -615,6 +645,16 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 	rad_assert(conn && conn->sock);
 	rad_assert(outlen > 0);
 
+	/*
+	 *	Client side errors for prepared statements are only
+	 *	recorded against the statement.
+	 */
+	if (conn->stmt && mysql_stmt_errno(conn->stmt)) {
+		error = talloc_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt),
+					mysql_stmt_error(conn->stmt), mysql_stmt_sqlstate(conn->stmt));
+		goto done;
+	}
+
 	error = mysql_error(conn->sock);
 
 	/*
@@ -658,6 +698,7 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 		}
 	}
 
+done:
 	if (error) {
 		out[i].type = L_ERR;
 		out[i].msg = error;
@@ -681,6 +722,12 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	int			ret;
 	MYSQL_RES		*result;
 
+	/*
+	 *	Prepared statements only ever produce a single
+	 *	result set.
+	 */
+	if (conn->stmt) return sql_free_result(handle, config);
+
 	/*
 	 *	If there's no result associated with the
 	 *	connection handle, assume the first result in the
@@ -724,6 +771,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -742,6 +791,178 @@ static size_t sql_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 	return mysql_real_escape_string(conn->sock, out, in, inlen);
 }
 
+/** Execute a prepared statement, preparing it first if this connection hasn't seen it before
+ *
+ * All parameters are bound as strings, the server converts them as required.
+ */
+static sql_rcode_t sql_stmt_execute(rlm_sql_handle_t *handle, sql_stmt_t const *stmt,
+				    char const * const *params, bool select)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	size_t			num = talloc_array_length(conn->stmts);
+	MYSQL_BIND		*bind = NULL;
+	unsigned int		fields, i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (stmt->id >= num) {
+		MEM(conn->stmts = talloc_realloc(conn, conn->stmts, MYSQL_STMT *, stmt->id + 1));
+		memset(conn->stmts + num, 0, sizeof(*conn->stmts) * ((stmt->id + 1) - num));
+	}
+
+	if (!conn->stmts[stmt->id]) {
+		MYSQL_STMT *mstmt;
+
+		/*
+		 *	mysql_stmt_init only fails if it can't allocate memory
+		 */
+		mstmt = mysql_stmt_init(conn->sock);
+		if (!mstmt) return sql_check_error(NULL, CR_OUT_OF_MEMORY);
+
+		/*
+		 *	mysql_stmt_close clears the error, and the
+		 *	statement isn't around for sql_error to
+		 *	look at, so grab the error now.
+		 */
+		if (mysql_stmt_prepare(mstmt, stmt->query, strlen(stmt->query)) != 0) {
+			unsigned int stmt_errno = mysql_stmt_errno(mstmt);
+
+			ERROR("Failed preparing statement: ERROR %u (%s): %s", stmt_errno,
+			      mysql_stmt_error(mstmt), mysql_stmt_sqlstate(mstmt));
+			mysql_stmt_close(mstmt);
+
+			return sql_check_error(NULL, stmt_errno);
+		}
+		conn->stmts[stmt->id] = mstmt;
+	}
+	conn->stmt = conn->stmts[stmt->id];
+
+	if (stmt->num_params > 0) {
+		MEM(bind = talloc_zero_array(conn, MYSQL_BIND, stmt->num_params));
+		for (i = 0; i < (unsigned int)stmt->num_params; i++) {
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			memcpy(&bind[i].buffer, &params[i], sizeof(bind[i].buffer)); /* const */
+			bind[i].buffer_length = strlen(params[i]);
+		}
+
+		if (mysql_stmt_bind_param(conn->stmt, bind) != 0) {
+			talloc_free(bind);
+			return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+		}
+	}
+
+	/*
+	 *	The parameters are sent to the server by
+	 *	mysql_stmt_execute, so the bindings aren't
+	 *	needed afterwards.
+	 */
+	if (mysql_stmt_execute(conn->stmt) != 0) {
+		talloc_free(bind);
+		return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+	}
+	talloc_free(bind);
+
+	if (!select) return RLM_SQL_OK;
+
+	/*
+	 *	Buffer the result client side, so that the
+	 *	number of rows is available.
+	 */
+	if (mysql_stmt_store_result(conn->stmt) != 0) return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+
+	fields = mysql_stmt_field_count(conn->stmt);
+	if (fields == 0) return RLM_SQL_OK;
+
+	conn->stmt_meta = mysql_stmt_result_metadata(conn->stmt);
+
+	/*
+	 *	Bind zero length buffers, so that the length of
+	 *	each column is known before we copy it out in
+	 *	sql_stmt_fetch_row.
+	 */
+	MEM(conn->bind = talloc_zero_array(conn, MYSQL_BIND, fields));
+	MEM(conn->lengths = talloc_zero_array(conn, unsigned long, fields));
+	for (i = 0; i < fields; i++) {
+		conn->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		conn->bind[i].length = &conn->lengths[i];
+	}
+
+	if (mysql_stmt_bind_result(conn->stmt, conn->bind) != 0) {
+		return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	unsigned int		fields, i;
+	int			ret;
+
+	TALLOC_FREE(handle->row);		/* Clear previous row set */
+
+	if (!conn->bind) return RLM_SQL_NO_MORE_ROWS;
+
+	ret = mysql_stmt_fetch(conn->stmt);
+	switch (ret) {
+	case 0:
+	case MYSQL_DATA_TRUNCATED:		/* Expected, as the result buffers are zero length */
+		break;
+
+	case MYSQL_NO_DATA:
+		return RLM_SQL_NO_MORE_ROWS;
+
+	default:
+		return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+	}
+
+	fields = talloc_array_length(conn->bind);
+
+	MEM(handle->row = talloc_zero_array(handle, char *, fields + 1));
+	for (i = 0; i < fields; i++) {
+		MYSQL_BIND column;
+
+		/*
+		 *	is_null is pointed at storage internal to the
+		 *	binding by mysql_stmt_bind_result.
+		 */
+		if (*conn->bind[i].is_null) continue;
+
+		MEM(handle->row[i] = talloc_array(handle->row, char, conn->lengths[i] + 1));
+		handle->row[i][conn->lengths[i]] = '\0';
+		if (conn->lengths[i] == 0) continue;
+
+		memset(&column, 0, sizeof(column));
+		column.buffer_type = MYSQL_TYPE_STRING;
+		column.buffer = handle->row[i];
+		column.buffer_length = conn->lengths[i] + 1;
+
+		if (mysql_stmt_fetch_column(conn->stmt, &column, i, 0) != 0) {
+			TALLOC_FREE(handle->row);
+			return sql_check_error(NULL, mysql_stmt_errno(conn->stmt));
+		}
+	}
+	*out = handle->row;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				  sql_stmt_t const *stmt, char const * const *params)
+{
+	return sql_stmt_execute(handle, stmt, params, false);
+}
+
+static sql_rcode_t sql_select_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					 sql_stmt_t const *stmt, char const * const *params)
+{
+	return sql_stmt_execute(handle, stmt, params, true);
+}
+
 
 /* Exported to rlm_sql */
 extern rlm_sql_driver_t rlm_sql_mysql;
@@ -767,5 +988,7 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_stmt			= sql_query_stmt,
+	.sql_select_query_stmt		= sql_select_query_stmt
 };
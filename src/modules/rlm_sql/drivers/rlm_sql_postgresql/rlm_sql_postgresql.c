@@ -69,6 +69,7 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	bool		*prepared;	//!< Whether each statement has been prepared, indexed by sql_stmt_t id.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -192,28 +193,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/** Process the result of executing a query or statement
+ *
+ */
+static sql_rcode_t sql_result_process(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -283,6 +270,100 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	return sql_result_process(conn);
+}
+
+/** Prepare a statement on this connection, if it hasn't been already
+ *
+ * PostgreSQL uses numbered placeholders, so each '?' is rewritten as $1, $2 etc...
+ */
+static sql_rcode_t sql_stmt_prepare(rlm_sql_postgres_conn_t *conn, char const *name, sql_stmt_t const *stmt)
+{
+	size_t		num = talloc_array_length(conn->prepared);
+	char		*query;
+	char const	*p;
+	int		i = 0;
+
+	if (stmt->id >= num) {
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, bool, stmt->id + 1));
+		memset(conn->prepared + num, 0, sizeof(*conn->prepared) * ((stmt->id + 1) - num));
+	}
+
+	if (conn->prepared[stmt->id]) return RLM_SQL_OK;
+
+	MEM(query = talloc_strdup(conn, ""));
+	for (p = stmt->query; *p; p++) {
+		if (*p == '?') {
+			query = talloc_asprintf_append_buffer(query, "$%i", ++i);
+			continue;
+		}
+		query = talloc_strndup_append_buffer(query, p, 1);
+	}
+
+	conn->result = PQprepare(conn->db, name, query, stmt->num_params, NULL);
+	talloc_free(query);
+
+	if (!conn->result || (PQresultStatus(conn->result) != PGRES_COMMAND_OK)) return sql_result_process(conn);
+
+	PQclear(conn->result);
+	conn->result = NULL;
+	conn->prepared[stmt->id] = true;
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						   sql_stmt_t const *stmt, char const * const *params)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	char			name[32];
+	sql_rcode_t		rcode;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "freeradius_%u", stmt->id);
+
+	rcode = sql_stmt_prepare(conn, name, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/*
+	 *  All parameters are sent as text, and the server
+	 *  infers their types from the statement.
+	 */
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params, params, NULL, NULL, 0);
+
+	return sql_result_process(conn);
+}
+
+static sql_rcode_t sql_select_query_stmt(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					 sql_stmt_t const *stmt, char const * const *params)
+{
+	return sql_query_stmt(handle, config, stmt, params);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -542,5 +623,7 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_stmt			= sql_query_stmt,
+	.sql_select_query_stmt		= sql_select_query_stmt
 };
@@ -53,6 +53,8 @@ typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	sqlite3_stmt **stmts;		//!< Prepared statements, indexed by sql_stmt_t id.
+	bool statement_cached;		//!< statement is one of stmts, and must be reset, not finalized.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct rlm_sql_sqlite {
@@ -375,6 +377,16 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	DEBUG2("Socket destructor called, closing socket");
 
 	if (conn->db) {
+		size_t i;
+
+		/*
+		 *	Statements must be finalized before
+		 *	the database can be closed.
+		 */
+		for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+			if (conn->stmts[i]) (void) sqlite3_finalize(conn->stmts[i]);
+		}
+
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
 					      sqlite3_errmsg(conn->db));
@@ -490,6 +502,64 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+/** Find or prepare a statement, and bind parameters to it
+ *
+ * Statements are cached on the connection, and reset when the query is finished.
+ */
+static sql_rcode_t sql_stmt_bind(rlm_sql_sqlite_conn_t *conn, sql_stmt_t const *stmt, char const * const *params)
+{
+	size_t		num = talloc_array_length(conn->stmts);
+	sql_rcode_t	rcode;
+	int		status, i;
+
+	if (stmt->id >= num) {
+		MEM(conn->stmts = talloc_realloc(conn, conn->stmts, sqlite3_stmt *, stmt->id + 1));
+		memset(conn->stmts + num, 0, sizeof(*conn->stmts) * ((stmt->id + 1) - num));
+	}
+
+	if (!conn->stmts[stmt->id]) {
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &conn->stmts[stmt->id], NULL);
+#else
+		status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &conn->stmts[stmt->id], NULL);
+#endif
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	conn->statement = conn->stmts[stmt->id];
+	conn->statement_cached = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < stmt->num_params; i++) {
+		status = sqlite3_bind_text(conn->statement, i + 1, params[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_select_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					 sql_stmt_t const *stmt, char const * const *params)
+{
+	return sql_stmt_bind(handle->conn, stmt, params);
+}
+
+static sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				  sql_stmt_t const *stmt, char const * const *params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	int			status;
+
+	rcode = sql_stmt_bind(conn, stmt, params);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -610,7 +680,17 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Prepared statements are kept for
+		 *	the next query that uses them.
+		 */
+		if (conn->statement_cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->statement_cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -809,5 +889,7 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_stmt			= sql_query_stmt,
+	.sql_select_query_stmt		= sql_select_query_stmt
 };
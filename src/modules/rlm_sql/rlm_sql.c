@@ -81,6 +81,14 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_UINT32, rlm_sql_config_t, batch.size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIMEVAL, rlm_sql_config_t, batch.interval), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_sql_config_t, batch.max_queued), .dflt = "65536" },
+	{ FR_CONF_OFFSET("journal", FR_TYPE_STRING, rlm_sql_config_t, batch.journal) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", FR_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -98,6 +106,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("default_user_profile", FR_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("client_query", FR_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id,nasname,shortname,type,secret FROM nas" },
 	{ FR_CONF_OFFSET("open_query", FR_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("authorize_check_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
 	{ FR_CONF_OFFSET("authorize_reply_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
@@ -119,6 +128,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
+
+	{ FR_CONF_POINTER("batch", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -735,7 +746,6 @@ int sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username)
 static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, REQUEST *request,
 			     rlm_sql_grouplist_t **phead)
 {
-	char    *expanded = NULL;
 	int     num_groups = 0;
 	rlm_sql_row_t row;
 	rlm_sql_grouplist_t *entry;
@@ -746,11 +756,8 @@ static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, R
 	entry = *phead = NULL;
 
 	if (!inst->config->groupmemb_query || !*inst->config->groupmemb_query) return 0;
-	if (xlat_aeval(request, &expanded, request, inst->config->groupmemb_query,
-			 inst->sql_escape_func, *handle) < 0) return -1;
 
-	ret = rlm_sql_select_query(inst, request, handle, expanded);
-	talloc_free(expanded);
+	ret = rlm_sql_select_tmpl(inst, request, handle, inst->config->groupmemb_query);
 	if (ret != RLM_SQL_OK) return -1;
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
@@ -862,7 +869,6 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
-	char			*expanded = NULL;
 	int			rows;
 
 	rad_assert(request->packet != NULL);
@@ -918,18 +924,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			vp_cursor_t cursor;
 			VALUE_PAIR *vp;
 
-			/*
-			 *	Expand the group query
-			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &check_tmp,
+					     inst->config->authorize_group_check_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -971,15 +967,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp,
+					     inst->config->authorize_group_reply_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -1025,6 +1014,12 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_t	*inst = instance;
 
+	/*
+	 *	Flush any queued accounting queries while
+	 *	we still have connections to write them with.
+	 */
+	TALLOC_FREE(inst->batch);
+
 	if (inst->pool) fr_connection_pool_free(inst->pool);
 
 	/*
@@ -1209,6 +1204,17 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_subsection_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	/*
+	 *	Find the queries we can run as prepared statements.
+	 */
+	if (inst->config->prepared_statements) {
+		if (!inst->driver->sql_query_stmt || !inst->driver->sql_select_query_stmt) {
+			WARN("Ignoring prepared_statements, driver %s does not support them", inst->driver->name);
+		} else if (sql_stmt_init(inst) < 0) {
+			return -1;
+		}
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1248,6 +1254,22 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	/*
+	 *	Start the write-behind queue for accounting queries.
+	 *
+	 *	The queue is modified at runtime, so it can't be
+	 *	parented by the (read only) instance data.
+	 */
+	if (inst->config->batch.size > 0) {
+		FR_INTEGER_BOUND_CHECK("batch.max_queued", inst->config->batch.max_queued, >=,
+				       inst->config->batch.size);
+		FR_TIMEVAL_BOUND_CHECK("batch.interval", &inst->config->batch.interval, >=, 0, 1000);
+		FR_TIMEVAL_BOUND_CHECK("batch.interval", &inst->config->batch.interval, <=, 60, 0);
+
+		inst->batch = sql_batch_alloc(NULL, inst);
+		if (!inst->batch) return -1;
+	}
+
 	if (inst->config->do_clients) {
 		if (generate_sql_clients(inst) == -1){
 			ERROR("Failed to load clients from SQL");
@@ -1276,8 +1298,6 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 
 	int	rows;
 
-	char	*expanded = NULL;
-
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
 
@@ -1314,15 +1334,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
-			REDEBUG("Failed generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, inst->config->authorize_check_query);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1362,15 +1374,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, inst->config->authorize_reply_query);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1510,42 +1514,22 @@ error:
 }
 
 /*
- *	Generic function for failing between a bunch of queries.
- *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
- *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
- *
+ *	Expand a section's 'reference' config item, and find the first
+ *	query it points to.
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_query_pair(CONF_PAIR **out, REQUEST *request, sql_acct_section_t *section)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
 	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
-
-	rad_assert(section);
 
 	if (section->reference[0] != '.') {
 		*p++ = '.';
 	}
 
 	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
@@ -1555,18 +1539,49 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 	item = cf_reference_item(NULL, section->cs, path);
 	if (!item) {
 		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 	if (cf_item_is_section(item)){
 		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
-	pair = cf_item_to_pair(item);
+	*out = cf_item_to_pair(item);
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+	int			sql_ret;
+	int			numaffected = 0;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+	char const		*logfile;
+	bool			use_stmt = false;
+
+	char			*expanded = NULL;
+
+	rad_assert(section);
+
+	rcode = acct_query_pair(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
 	attr = cf_pair_attr(pair);
 
 	RDEBUG2("Using query template '%s'", attr);
@@ -1580,7 +1595,16 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	sql_set_user(inst, request, NULL);
 
+	/*
+	 *	Queries which are logged need to be expanded
+	 *	in full, so can't be run as prepared statements.
+	 */
+	logfile = section->logfile ? section->logfile : inst->config->logfile;
+	if (!logfile || !*logfile) use_stmt = true;
+
 	while (true) {
+		sql_stmt_t const *stmt;
+
 		value = cf_pair_value(pair);
 		if (!value) {
 			RDEBUG("Ignoring null query");
@@ -1589,24 +1613,28 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 			goto finish;
 		}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+		stmt = use_stmt ? sql_stmt_find(inst, value) : NULL;
+		if (stmt) {
+			sql_ret = rlm_sql_query_stmt(inst, request, &handle, stmt);
+		} else {
+			if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+				rcode = RLM_MODULE_FAIL;
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		if (!*expanded) {
-			RDEBUG("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
+			if (!*expanded) {
+				RDEBUG("Ignoring null query");
+				rcode = RLM_MODULE_NOOP;
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+			rlm_sql_query_log(inst, request, section, expanded);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
+			sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+			TALLOC_FREE(expanded);
+		}
 		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -1682,6 +1710,106 @@ finish:
 }
 
 #ifdef WITH_ACCOUNTING
+/*
+ *	Expand all the alternative queries a reference points to, and add
+ *	them to the write-behind queue.
+ *
+ *	The queries are tried in order by the writer, exactly as they
+ *	would be by acct_redundant().
+ */
+static rlm_rcode_t acct_batch(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+
+	char			**query = NULL;
+	char			*expanded = NULL;
+	size_t			num = 0;
+
+	rad_assert(section);
+
+	rcode = acct_query_pair(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	attr = cf_pair_attr(pair);
+
+	RDEBUG2("Using query template '%s'", attr);
+
+	/*
+	 *	We still need a connection, as some drivers
+	 *	use it to escape values.
+	 */
+	handle = fr_connection_get(inst->pool, request);
+	if (!handle) {
+		rcode = RLM_MODULE_FAIL;
+
+		goto finish;
+	}
+
+	sql_set_user(inst, request, NULL);
+
+	/*
+	 *	Allocated outside of the request, as it
+	 *	outlives it.
+	 */
+	query = talloc_array(NULL, char *, 0);
+
+	for (; pair; pair = cf_pair_find_next(section->cs, pair, attr)) {
+		value = cf_pair_value(pair);
+		if (!value) continue;
+
+		if (xlat_aeval(query, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+			rcode = RLM_MODULE_FAIL;
+
+			goto finish;
+		}
+
+		if (!*expanded) {
+			TALLOC_FREE(expanded);
+			continue;
+		}
+
+		if (num == 0) rlm_sql_query_log(inst, request, section, expanded);
+
+		query = talloc_realloc(NULL, query, char *, num + 1);
+		query[num++] = expanded;
+		expanded = NULL;
+	}
+
+	if (num == 0) {
+		RDEBUG("Ignoring null query");
+		rcode = RLM_MODULE_NOOP;
+
+		goto finish;
+	}
+
+	switch (sql_batch_enqueue(inst->batch, request, query)) {
+	case 0:
+		RDEBUG2("Queued %zu quer%s for writing", num, (num == 1) ? "y" : "ies");
+		break;
+
+	case 1:
+		RWDEBUG("Wrote query to journal");
+		break;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+	query = NULL;	/* Owned by the queue now */
+
+finish:
+	talloc_free(query);
+	fr_connection_release(inst->pool, request, handle);
+	sql_unset_user(inst, request);
+
+	return rcode;
+}
 
 /*
  *	Accounting: Insert or update session data in our sql table
@@ -1692,6 +1820,8 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->accounting.reference_cp) {
+		if (inst->batch) return acct_batch(inst, request, &inst->config->accounting);
+
 		return acct_redundant(inst, request, &inst->config->accounting);
 	}
 
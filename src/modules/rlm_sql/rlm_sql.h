@@ -84,6 +84,18 @@ typedef struct sql_acct_section {
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
+/*
+ *	Write-behind batching of accounting queries.
+ */
+typedef struct sql_batch_config {
+	uint32_t		size;				//!< Number of queued queries which triggers
+								//!< a write.  0 disables batching.
+	struct timeval		interval;			//!< Maximum time a query may be queued for.
+	uint32_t		max_queued;			//!< Maximum number of queries to hold in memory.
+	char const		*journal;			//!< File to write queries to if the database
+								//!< is unavailable.
+} sql_batch_config_t;
+
 typedef struct sql_config {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -136,6 +148,10 @@ typedef struct sql_config {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Run queries with a fixed structure as
+								//!< prepared statements, binding expanded
+								//!< values instead of escaping them.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -149,9 +165,12 @@ typedef struct sql_config {
 	 */
 	sql_acct_section_t	postauth;
 	sql_acct_section_t	accounting;
+
+	sql_batch_config_t	batch;				//!< Write-behind batching of accounting queries.
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
+typedef struct sql_batch sql_batch_t;
 
 typedef struct rlm_sql_handle {
 	void			*conn;				//!< Database specific connection handle.
@@ -161,6 +180,22 @@ typedef struct rlm_sql_handle {
 								//!< when log strings need to be copied.
 } rlm_sql_handle_t;
 
+/** A query template which can be executed as a prepared statement
+ *
+ * Only templates where every expansion forms a complete, single quoted,
+ * string literal (i.e. '%{User-Name}') can be prepared.  Each of those
+ * literals is replaced with a '?' placeholder, and the expansion is
+ * evaluated separately and bound to the placeholder as a string.
+ */
+typedef struct sql_stmt {
+	char const		*tmpl;				//!< Query template the statement was created from.
+	unsigned int		id;				//!< Unique across all instances.  Drivers use this
+								//!< to index their per-connection statement caches.
+	char const		*query;				//!< Query with '?' placeholders.
+	char const		**params;			//!< Expansion for each placeholder.
+	int			num_params;			//!< Number of placeholders.
+} sql_stmt_t;
+
 extern const FR_NAME_NUMBER sql_rcode_table[];
 /*
  *	Capabilities flags for drivers
@@ -218,6 +253,18 @@ typedef struct rlm_sql_driver_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional.  Prepare the statement on this connection, if it
+	 *	hasn't been already, and execute it with params bound to
+	 *	its placeholders, in order.  Results are then retrieved
+	 *	and released in the same way as for sql_query and
+	 *	sql_select_query.
+	 */
+	sql_rcode_t (*sql_query_stmt)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				      sql_stmt_t const *stmt, char const * const *params);
+	sql_rcode_t (*sql_select_query_stmt)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					     sql_stmt_t const *stmt, char const * const *params);
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -230,6 +277,10 @@ struct sql_inst {
 							//!< dictionary attribute.
 	exfile_t		*ef;
 
+	sql_batch_t		*batch;			//!< Write-behind queue for accounting queries.
+	rbtree_t		*stmts;			//!< Query templates which can be run as prepared
+							//!< statements, keyed by template.
+
 	dl_t const	*driver_handle;		//!< Driver's dl_handle.
 	void			*driver_inst;		//!< Driver's instance data.
 	rlm_sql_driver_t const	*driver;		//!< Driver's exported interface.
@@ -252,13 +303,26 @@ typedef struct sql_grouplist {
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *tmpl);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_select_tmpl(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *tmpl) CC_HINT(nonnull);
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+int		sql_stmt_init(rlm_sql_t *inst);
+sql_stmt_t const *sql_stmt_find(rlm_sql_t const *inst, char const *tmpl);
+sql_rcode_t	rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				   sql_stmt_t const *stmt) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_select_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					  sql_stmt_t const *stmt) CC_HINT(nonnull);
+
+/*
+ *	batch.c
+ */
+sql_batch_t	*sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst);
+int		sql_batch_enqueue(sql_batch_t *batch, REQUEST *request, char **query);
 #endif
@@ -483,6 +483,366 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	return RLM_SQL_ERROR;
 }
 
+/** Statement IDs are unique across all instances, as instances may share connections
+ *
+ */
+static unsigned int sql_stmt_id;
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	sql_stmt_t const *a = one, *b = two;
+
+	return (a->tmpl > b->tmpl) - (a->tmpl < b->tmpl);
+}
+
+/** Split a query template into a query with placeholders, and the expansions to bind to them
+ *
+ * @param[in] ctx	to allocate the statement in.
+ * @param[in] tmpl	to split.
+ * @return
+ *	- A new statement.
+ *	- NULL if the template contains expansions which aren't complete string literals.
+ */
+static sql_stmt_t *sql_stmt_alloc(TALLOC_CTX *ctx, char const *tmpl)
+{
+	sql_stmt_t	*stmt;
+	char		*query;
+	char const	*p, *q, *start;
+	bool		in_literal = false;
+	int		depth;
+
+	MEM(stmt = talloc_zero(ctx, sql_stmt_t));
+	stmt->tmpl = tmpl;
+	MEM(stmt->params = talloc_array(stmt, char const *, 0));
+	MEM(query = talloc_strdup(stmt, ""));
+
+	for (p = start = tmpl; *p; p++) {
+		switch (*p) {
+		/*
+		 *	Would be mistaken for a placeholder, or
+		 *	is an escape sequence we'd need to
+		 *	interpret.
+		 */
+		case '?':
+		case '\\':
+			goto error;
+
+		/*
+		 *	"%%" is a literal '%', anything else is an
+		 *	expansion which isn't a complete literal.
+		 */
+		case '%':
+			if (p[1] != '%') goto error;
+
+			query = talloc_strndup_append_buffer(query, start, (p + 1) - start);
+			start = p + 2;
+			p++;
+			break;
+
+		case '\'':
+			if (in_literal) {
+				in_literal = false;
+				break;
+			}
+
+			if ((p[1] != '%') || (p[2] != '{') ||
+			    ((p > tmpl) && (isalnum((uint8_t) p[-1]) || (p[-1] == '_')))) {
+				in_literal = true;
+				break;
+			}
+
+			/*
+			 *	The literal must end immediately after
+			 *	the expansion.
+			 */
+			for (q = p + 3, depth = 1; *q && (depth > 0); q++) {
+				if (*q == '{') depth++;
+				if (*q == '}') depth--;
+			}
+			if ((depth > 0) || (*q != '\'')) goto error;
+
+			query = talloc_strndup_append_buffer(query, start, p - start);
+			query = talloc_strdup_append_buffer(query, "?");
+
+			MEM(stmt->params = talloc_realloc(stmt, stmt->params, char const *, stmt->num_params + 1));
+			MEM(stmt->params[stmt->num_params++] = talloc_strndup(stmt->params, p + 1, q - (p + 1)));
+
+			start = q + 1;
+			p = q;
+			break;
+
+		default:
+			break;
+		}
+	}
+	if (in_literal) goto error;
+
+	stmt->query = talloc_strndup_append_buffer(query, start, p - start);
+
+	return stmt;
+
+error:
+	talloc_free(stmt);
+	return NULL;
+}
+
+/** Record that a query template can be run as a prepared statement
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] tmpl	Query template.  Must remain valid for the lifetime of the instance,
+ *			and is looked up by address, not by value.
+ */
+static void sql_stmt_register(rlm_sql_t *inst, char const *tmpl)
+{
+	sql_stmt_t	*stmt;
+
+	if (!tmpl || !*tmpl || sql_stmt_find(inst, tmpl)) return;
+
+	stmt = sql_stmt_alloc(inst->stmts, tmpl);
+	if (!stmt) {
+		DEBUG3("Not preparing query \"%s\", it contains expansions which aren't string literals", tmpl);
+		return;
+	}
+	stmt->id = sql_stmt_id++;
+
+	DEBUG3("Preparing query \"%s\" as \"%s\"", tmpl, stmt->query);
+
+	if (!rbtree_insert(inst->stmts, stmt)) talloc_free(stmt);
+}
+
+/** Register every query in an accounting or post-auth section
+ *
+ * Any pair may be the target of the section's reference, so all of them
+ * are checked.
+ */
+static void sql_stmt_register_section(rlm_sql_t *inst, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	char const	*attr;
+
+	if (!cs) return;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			sql_stmt_register_section(inst, cf_item_to_section(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		attr = cf_pair_attr(cp);
+		if ((strcmp(attr, "reference") == 0) || (strcmp(attr, "logfile") == 0)) continue;
+
+		sql_stmt_register(inst, cf_pair_value(cp));
+	}
+}
+
+/** Find all the queries which can be run as prepared statements
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_stmt_init(rlm_sql_t *inst)
+{
+	inst->stmts = rbtree_create(inst, sql_stmt_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!inst->stmts) return -1;
+
+	sql_stmt_register(inst, inst->config->authorize_check_query);
+	sql_stmt_register(inst, inst->config->authorize_reply_query);
+	sql_stmt_register(inst, inst->config->authorize_group_check_query);
+	sql_stmt_register(inst, inst->config->authorize_group_reply_query);
+	sql_stmt_register(inst, inst->config->groupmemb_query);
+
+	sql_stmt_register_section(inst, inst->config->accounting.cs);
+	sql_stmt_register_section(inst, inst->config->postauth.cs);
+
+	DEBUG2("%u queries will be run as prepared statements", rbtree_num_elements(inst->stmts));
+
+	return 0;
+}
+
+/** Find the prepared statement for a query template
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] tmpl	Query template, as passed to #sql_stmt_init.
+ * @return
+ *	- The statement.
+ *	- NULL if prepared statements are disabled, or the template can't be prepared.
+ */
+sql_stmt_t const *sql_stmt_find(rlm_sql_t const *inst, char const *tmpl)
+{
+	sql_stmt_t find = { .tmpl = tmpl };
+
+	if (!inst->stmts) return NULL;
+
+	return rbtree_finddata(inst->stmts, &find);
+}
+
+/** Expand a statement's parameters, and call the driver to execute it, reconnecting if necessary
+ *
+ */
+static sql_rcode_t sql_stmt_execute(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				    sql_stmt_t const *stmt, bool select)
+{
+	sql_rcode_t	ret = RLM_SQL_ERROR;
+	char		**params;
+	int		i, count;
+
+	/* Caller should check they have a valid handle */
+	rad_assert(*handle);
+
+	/*
+	 *	Values are bound, not interpolated, so
+	 *	they don't need escaping.
+	 */
+	MEM(params = talloc_zero_array(request, char *, stmt->num_params));
+	for (i = 0; i < stmt->num_params; i++) {
+		if (xlat_aeval(params, &params[i], request, stmt->params[i], NULL, NULL) < 0) {
+			REDEBUG("Error expanding query parameter %i", i + 1);
+			talloc_free(params);
+			return RLM_SQL_QUERY_INVALID;
+		}
+	}
+
+	count = fr_connection_pool_state(inst->pool)->num;
+
+	for (i = 0; i < (count + 1); i++) {
+		int j;
+
+		RDEBUG2("Executing prepared %squery: %s", select ? "select " : "", stmt->query);
+		RINDENT();
+		for (j = 0; j < stmt->num_params; j++) RDEBUG2("$%i = \"%s\"", j + 1, params[j]);
+		REXDENT();
+
+		if (select) {
+			ret = (inst->driver->sql_select_query_stmt)(*handle, inst->config, stmt,
+								    (char const * const *) params);
+		} else {
+			ret = (inst->driver->sql_query_stmt)(*handle, inst->config, stmt,
+							     (char const * const *) params);
+		}
+		switch (ret) {
+		case RLM_SQL_OK:
+			break;
+
+		/*
+		 *	Run through all available sockets until we exhaust all existing
+		 *	sockets in the pool and fail to establish a *new* connection.
+		 */
+		case RLM_SQL_RECONNECT:
+			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			/* Reconnection failed */
+			if (!*handle) {
+				talloc_free(params);
+				return RLM_SQL_RECONNECT;
+			}
+			/* Reconnection succeeded, try again with the new handle */
+			continue;
+
+		/*
+		 *	Same handling as rlm_sql_query and rlm_sql_select_query
+		 */
+		default:
+			if (!select && (ret == RLM_SQL_ERROR) &&
+			    !(inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY)) ret = RLM_SQL_ALT_QUERY;
+
+			rlm_sql_print_error(inst, request, *handle, !select && (ret == RLM_SQL_ALT_QUERY));
+			if (select) {
+				(inst->driver->sql_finish_select_query)(*handle, inst->config);
+			} else {
+				(inst->driver->sql_finish_query)(*handle, inst->config);
+			}
+			break;
+		}
+
+		talloc_free(params);
+		return ret;
+	}
+
+	talloc_free(params);
+
+	RERROR("Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+/** Execute a prepared statement, reconnecting if necessary
+ *
+ * The equivalent of #rlm_sql_query for statements returned by #sql_stmt_find.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute.
+ * @return as for #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			       sql_stmt_t const *stmt)
+{
+	return sql_stmt_execute(inst, request, handle, stmt, false);
+}
+
+/** Execute a prepared statement which returns rows, reconnecting if necessary
+ *
+ * The equivalent of #rlm_sql_select_query for statements returned by #sql_stmt_find.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute.
+ * @return as for #rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_select_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				      sql_stmt_t const *stmt)
+{
+	return sql_stmt_execute(inst, request, handle, stmt, true);
+}
+
+/** Expand a query template, and execute it as a select query
+ *
+ * Uses a prepared statement if the template can be prepared, otherwise
+ * expands the template, escaping values, and calls #rlm_sql_select_query.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param tmpl Query template to expand.
+ * @return as for #rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_select_tmpl(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *tmpl)
+{
+	sql_stmt_t const	*stmt;
+	char			*expanded = NULL;
+	sql_rcode_t		rcode;
+
+	stmt = sql_stmt_find(inst, tmpl);
+	if (stmt) return rlm_sql_select_query_stmt(inst, request, handle, stmt);
+
+	if (xlat_aeval(request, &expanded, request, tmpl, inst->sql_escape_func, *handle) < 0) {
+		REDEBUG("Error generating query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	rcode = rlm_sql_select_query(inst, request, handle, expanded);
+	talloc_free(expanded);
+
+	return rcode;
+}
 
 /*************************************************************************
  *
@@ -492,7 +852,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
  *
  *************************************************************************/
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
-		  VALUE_PAIR **pair, char const *query)
+		  VALUE_PAIR **pair, char const *tmpl)
 {
 	rlm_sql_row_t	row;
 	int		rows = 0;
@@ -500,8 +860,8 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 
 	rad_assert(request);
 
-	rcode = rlm_sql_select_query(inst, request, handle, query);
-	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
+	rcode = rlm_sql_select_tmpl(inst, request, handle, tmpl);
+	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_tmpl */
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
 		if (sql_fr_pair_list_afrom_str(ctx, request, pair, row) != 0) {
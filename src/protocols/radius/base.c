@@ -201,6 +201,27 @@ void fr_radius_ascend_secret(uint8_t *digest, uint8_t const *vector, char const
 	for (i = 0; i < AUTH_VECTOR_LEN; i++ ) digest[i] ^= value[i];
 }
 
+/** Start an MD5 digest with the shared secret
+ *
+ *  The password obfuscation functions all calculate MD5(secret + ...).
+ *  If there is a precomputed state for the secret, we copy it,
+ *  instead of hashing the secret again.
+ *
+ * @param[out] context to initialise.
+ * @param[in] secret the shared secret.  MUST be talloc'd.
+ * @param[in] key precomputed state for the secret, or NULL.
+ */
+void fr_radius_md5_secret_init(FR_MD5_CTX *context, char const *secret, fr_md5_key_t const *key)
+{
+	if (key) {
+		fr_md5_copy(context, &key->prefix);
+		return;
+	}
+
+	fr_md5_init(context);
+	fr_md5_update(context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+}
+
 /** Basic validation of RADIUS packet header
  *
  * @note fr_strerror errors are only available if fr_debug_lvl > 0. This is to reduce CPU time
@@ -276,22 +297,25 @@ invalid:
 	return packet_len;
 }
 
-/** Sign a previously encoded packet
+/** Prepare a packet for calculating the Message-Authenticator
  *
- * @param packet the raw RADIUS packet (request or response)
- * @param original the raw original request (if this is a response)
- * @param secret the shared secret
- * @param secret_len the length of the secret
+ *  Finds the Message-Authenticator, sets the authentication vector to
+ *  the value it must have when the HMAC is calculated, and zeroes
+ *  the Message-Authenticator.
+ *
+ * @param[in] packet the raw RADIUS packet (request or response)
+ * @param[in] original the raw original request (if this is a response)
+ * @param[out] p_msg where to write the Message-Authenticator attribute, or NULL if there isn't one.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+static int radius_sign_hmac_prepare(uint8_t *packet, uint8_t const *original, uint8_t **p_msg)
 {
 	uint8_t *msg, *end;
 	size_t packet_len = (packet[2] << 8) | packet[3];
-	FR_MD5_CTX	context;
+
+	*p_msg = NULL;
 
 	if (packet_len < RADIUS_HDR_LEN) {
 		fr_strerror_printf("Packet must be encoded before calling fr_radius_sign()");
@@ -339,7 +363,11 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		case PW_CODE_COA_REQUEST:
 		case PW_CODE_COA_ACK:
 		case PW_CODE_COA_NAK:
-			if (!original) goto need_original;
+			if (!original) {
+			need_original:
+				fr_strerror_printf("Cannot sign response packet without a request packet");
+				return -1;
+			}
 
 		do_response:
 			memset(packet + 4, 0, AUTH_VECTOR_LEN);
@@ -358,19 +386,37 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			break;
 
 		default:
-			goto bad_packet;
+			fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+			return -1;
 		}
 
 		/*
-		 *	Force Message-Authenticator to be zero,
-		 *	calculate the HMAC, and put it into the
-		 *	Message-Authenticator attribute.
+		 *	Force Message-Authenticator to be zero, so
+		 *	that the caller can calculate the HMAC, and
+		 *	put it into the Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, AUTH_VECTOR_LEN);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		*p_msg = msg;
 		break;
 	}
 
+	return 0;
+}
+
+/** Prepare a packet for calculating the Request / Response Authenticator
+ *
+ *  Sets the authentication vector to the value it must have when the
+ *  MD5 is calculated.
+ *
+ * @param[in] packet the raw RADIUS packet (request or response)
+ * @param[in] original the raw original request (if this is a response)
+ * @return
+ *	- <0 on error
+ *	- 0 if the packet doesn't need an MD5 signature
+ *	- 1 if the caller should write MD5(packet + secret) to the authentication vector
+ */
+static int radius_sign_md5_prepare(uint8_t *packet, uint8_t const *original)
+{
 	/*
 	 *	Initialize the request authenticator.
 	 */
@@ -390,7 +436,6 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	case PW_CODE_COA_ACK:
 	case PW_CODE_COA_NAK:
 		if (!original) {
-		need_original:
 			fr_strerror_printf("Cannot sign response packet without a request packet");
 			return -1;
 		}
@@ -407,11 +452,37 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		return 0;
 
 	default:
-	bad_packet:
 		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
 		return -1;
 	}
 
+	return 1;
+}
+
+/** Sign a previously encoded packet, with or without a precomputed key
+ *
+ */
+static int radius_sign(uint8_t *packet, uint8_t const *original,
+		       uint8_t const *secret, size_t secret_len, fr_md5_key_t const *key)
+{
+	int		rcode;
+	uint8_t		*msg;
+	size_t		packet_len = (packet[2] << 8) | packet[3];
+	FR_MD5_CTX	context;
+
+	if (radius_sign_hmac_prepare(packet, original, &msg) < 0) return -1;
+
+	if (msg) {
+		if (key) {
+			fr_hmac_md5_key(msg + 2, packet, packet_len, key);
+		} else {
+			fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		}
+	}
+
+	rcode = radius_sign_md5_prepare(packet, original);
+	if (rcode <= 0) return rcode;
+
 	/*
 	 *	Request / Response Authenticator = MD5(packet + secret)
 	 */
@@ -423,6 +494,127 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	return 0;
 }
 
+/** Sign a previously encoded packet
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign(uint8_t *packet, uint8_t const *original,
+		   uint8_t const *secret, size_t secret_len)
+{
+	return radius_sign(packet, original, secret, secret_len, NULL);
+}
+
+/** Sign a previously encoded packet, using a precomputed shared secret
+ *
+ *  The result is the same as calling fr_radius_sign() with the
+ *  secret passed to fr_md5_key_init().
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param key the precomputed shared secret
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign_key(uint8_t *packet, uint8_t const *original, fr_md5_key_t const *key)
+{
+	return radius_sign(packet, original, key->key, key->key_len, key);
+}
+
+/** Sign many previously encoded packets at once
+ *
+ *  The result is the same as calling fr_radius_sign() for each
+ *  packet.  But the MD5 and HMAC-MD5 calculations are done for many
+ *  packets at once, via the multi-buffer MD5 functions.
+ *
+ *  The result for each packet is written to its "rcode" field.  If
+ *  more than one packet fails, fr_strerror() has the error for the
+ *  last one.
+ *
+ * @param batch the packets to sign.
+ * @param num the number of packets.
+ * @return
+ *	- <0 if any packet could not be signed
+ *	- 0 on success
+ */
+int fr_radius_sign_batch(fr_radius_batch_t *batch, int num)
+{
+	int		i, j, k, chunk, rcode = 0;
+	uint8_t		*msg;
+	uint8_t		*hmac_digest[FR_RADIUS_BATCH_CHUNK];
+	uint8_t const	*hmac_text[FR_RADIUS_BATCH_CHUNK];
+	size_t		hmac_text_len[FR_RADIUS_BATCH_CHUNK];
+	uint8_t const	*hmac_key[FR_RADIUS_BATCH_CHUNK];
+	size_t		hmac_key_len[FR_RADIUS_BATCH_CHUNK];
+	fr_md5_mb_job_t	jobs[FR_RADIUS_BATCH_CHUNK];
+
+	for (i = 0; i < num; i += chunk) {
+		chunk = num - i;
+		if (chunk > FR_RADIUS_BATCH_CHUNK) chunk = FR_RADIUS_BATCH_CHUNK;
+
+		/*
+		 *	Calculate the Message-Authenticators first, as
+		 *	they're included in the MD5 signature.
+		 */
+		for (j = 0, k = 0; j < chunk; j++) {
+			fr_radius_batch_t *b = &batch[i + j];
+
+			b->rcode = radius_sign_hmac_prepare(b->packet, b->original, &msg);
+			if (b->rcode < 0) {
+				rcode = -1;
+				continue;
+			}
+
+			if (!msg) continue;
+
+			hmac_digest[k] = msg + 2;
+			hmac_text[k] = b->packet;
+			hmac_text_len[k] = (b->packet[2] << 8) | b->packet[3];
+			hmac_key[k] = b->secret;
+			hmac_key_len[k] = b->secret_len;
+			k++;
+		}
+		fr_hmac_md5_mb(hmac_digest, hmac_text, hmac_text_len, hmac_key, hmac_key_len, k);
+
+		/*
+		 *	Request / Response Authenticator = MD5(packet + secret)
+		 */
+		for (j = 0, k = 0; j < chunk; j++) {
+			fr_radius_batch_t *b = &batch[i + j];
+
+			if (b->rcode < 0) continue;
+
+			b->rcode = radius_sign_md5_prepare(b->packet, b->original);
+			if (b->rcode < 0) {
+				rcode = -1;
+				continue;
+			}
+
+			if (b->rcode == 0) continue;
+			b->rcode = 0;
+
+			jobs[k].in[0] = b->packet;
+			jobs[k].inlen[0] = (b->packet[2] << 8) | b->packet[3];
+			jobs[k].in[1] = b->secret;
+			jobs[k].inlen[1] = b->secret_len;
+			jobs[k].num_in = 2;
+			jobs[k].iv = NULL;
+			jobs[k].ivlen = 0;
+			jobs[k].out = b->packet + 4;
+			k++;
+		}
+		fr_md5_mb(jobs, k);
+	}
+
+	return rcode;
+}
+
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -687,35 +879,30 @@ finish:
 }
 
 
-/** Verify a request / response packet
- *
- *  This function does its work by calling fr_radius_sign(), and then
- *  comparing the signature in the packet with the one we calculated.
- *  If they differ, there's a problem.
+/** Save the authenticators of a packet, before it is signed again
  *
- * @param packet the raw RADIUS packet (request or response)
- * @param original the raw original request (if this is a response)
- * @param secret the shared secret
- * @param secret_len the length of the secret
+ * @param[in] packet the raw RADIUS packet (request or response)
+ * @param[out] request_authenticator where the authentication vector is saved.
+ * @param[out] message_authenticator where the Message-Authenticator (if any) is saved.
+ * @param[out] p_msg where to write the Message-Authenticator attribute, or NULL if there isn't one.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_verify(uint8_t *packet, uint8_t const *original,
-		     uint8_t const *secret, size_t secret_len)
+static int radius_verify_save(uint8_t *packet, uint8_t request_authenticator[AUTH_VECTOR_LEN],
+			      uint8_t message_authenticator[AUTH_VECTOR_LEN], uint8_t **p_msg)
 {
-	int rcode;
 	uint8_t *msg, *end;
 	size_t packet_len = (packet[2] << 8) | packet[3];
-	uint8_t request_authenticator[AUTH_VECTOR_LEN];
-	uint8_t message_authenticator[AUTH_VECTOR_LEN];
+
+	*p_msg = NULL;
 
 	if (packet_len < RADIUS_HDR_LEN) {
 		fr_strerror_printf("invalid packet length %zd", packet_len);
 		return -1;
 	}
 
-	memcpy(request_authenticator, packet + 4, sizeof(request_authenticator));
+	memcpy(request_authenticator, packet + 4, AUTH_VECTOR_LEN);
 
 	/*
 	 *	Find Message-Authenticator.  Its value has to be
@@ -748,22 +935,29 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 		/*
 		 *	Found it, save a copy.
 		 */
-		memcpy(message_authenticator, msg + 2, sizeof(message_authenticator));
+		memcpy(message_authenticator, msg + 2, AUTH_VECTOR_LEN);
+		*p_msg = msg;
 		break;
 	}
 
-	/*
-	 *	Implement verification as a signature, followed by
-	 *	checking our signature against the sent one.  This is
-	 *	slightly more CPU work than having verify-specific
-	 *	functions, but it ends up being cleaner in the code.
-	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
-	if (rcode < 0) {
-		fr_strerror_printf("unknown packet code");
-		return -1;
-	}
+	return 0;
+}
 
+/** Compare the signatures we calculated with the ones we saved
+ *
+ * @param[in] packet the raw RADIUS packet, after it has been signed.
+ * @param[in] original the raw original request (if this is a response)
+ * @param[in] request_authenticator the saved authentication vector.
+ * @param[in] message_authenticator the saved Message-Authenticator.
+ * @param[in] msg the Message-Authenticator attribute, or NULL if there isn't one.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int radius_verify_check(uint8_t *packet, uint8_t const *original,
+			       uint8_t const request_authenticator[AUTH_VECTOR_LEN],
+			       uint8_t const message_authenticator[AUTH_VECTOR_LEN], uint8_t *msg)
+{
 	/*
 	 *	Check the Message-Authenticator first.
 	 *
@@ -771,10 +965,9 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	Message-Authenticator and Request Authenticator
 	 *	fields.
 	 */
-	if ((msg < end) &&
-	    (fr_digest_cmp(message_authenticator, msg + 2, sizeof(message_authenticator)) != 0)) {
-		memcpy(msg + 2, message_authenticator, sizeof(message_authenticator));
-		memcpy(packet + 4, request_authenticator, sizeof(request_authenticator));
+	if (msg && (fr_digest_cmp(message_authenticator, msg + 2, AUTH_VECTOR_LEN) != 0)) {
+		memcpy(msg + 2, message_authenticator, AUTH_VECTOR_LEN);
+		memcpy(packet + 4, request_authenticator, AUTH_VECTOR_LEN);
 
 		fr_strerror_printf("invalid Message-Authenticator (shared secret is incorrect)");
 		return -1;
@@ -791,8 +984,8 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	/*
 	 *	Check the Request Authenticator.
 	 */
-	if (fr_digest_cmp(request_authenticator, packet + 4, sizeof(request_authenticator)) != 0) {
-		memcpy(packet + 4, request_authenticator, sizeof(request_authenticator));
+	if (fr_digest_cmp(request_authenticator, packet + 4, AUTH_VECTOR_LEN) != 0) {
+		memcpy(packet + 4, request_authenticator, AUTH_VECTOR_LEN);
 		if (original) {
 			fr_strerror_printf("invalid Response Authenticator (shared secret is incorrect)");
 		} else {
@@ -802,3 +995,136 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 
 	return 0;
 }
+
+/** Verify a request / response packet, with or without a precomputed key
+ *
+ */
+static int radius_verify(uint8_t *packet, uint8_t const *original,
+			 uint8_t const *secret, size_t secret_len, fr_md5_key_t const *key)
+{
+	int rcode;
+	uint8_t *msg;
+	uint8_t request_authenticator[AUTH_VECTOR_LEN];
+	uint8_t message_authenticator[AUTH_VECTOR_LEN];
+
+	if (radius_verify_save(packet, request_authenticator, message_authenticator, &msg) < 0) return -1;
+
+	/*
+	 *	Implement verification as a signature, followed by
+	 *	checking our signature against the sent one.  This is
+	 *	slightly more CPU work than having verify-specific
+	 *	functions, but it ends up being cleaner in the code.
+	 */
+	rcode = radius_sign(packet, original, secret, secret_len, key);
+	if (rcode < 0) {
+		fr_strerror_printf("unknown packet code");
+		return -1;
+	}
+
+	return radius_verify_check(packet, original, request_authenticator, message_authenticator, msg);
+}
+
+/** Verify a request / response packet
+ *
+ *  This function does its work by calling fr_radius_sign(), and then
+ *  comparing the signature in the packet with the one we calculated.
+ *  If they differ, there's a problem.
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_verify(uint8_t *packet, uint8_t const *original,
+		     uint8_t const *secret, size_t secret_len)
+{
+	return radius_verify(packet, original, secret, secret_len, NULL);
+}
+
+/** Verify a request / response packet, using a precomputed shared secret
+ *
+ *  The result is the same as calling fr_radius_verify() with the
+ *  secret passed to fr_md5_key_init().
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param key the precomputed shared secret
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_verify_key(uint8_t *packet, uint8_t const *original, fr_md5_key_t const *key)
+{
+	return radius_verify(packet, original, key->key, key->key_len, key);
+}
+
+/** Verify many request / response packets at once
+ *
+ *  The result is the same as calling fr_radius_verify() for each
+ *  packet, but the packets are signed via fr_radius_sign_batch().
+ *
+ *  The result for each packet is written to its "rcode" field.  If
+ *  more than one packet fails, fr_strerror() has the error for the
+ *  last one.
+ *
+ * @param batch the packets to verify.
+ * @param num the number of packets.
+ * @return
+ *	- <0 if any packet failed verification
+ *	- 0 on success
+ */
+int fr_radius_verify_batch(fr_radius_batch_t *batch, int num)
+{
+	int		i, j, k, chunk, rcode = 0;
+	uint8_t		*msg[FR_RADIUS_BATCH_CHUNK];
+	uint8_t		request_authenticator[FR_RADIUS_BATCH_CHUNK][AUTH_VECTOR_LEN];
+	uint8_t		message_authenticator[FR_RADIUS_BATCH_CHUNK][AUTH_VECTOR_LEN];
+	int		index[FR_RADIUS_BATCH_CHUNK];
+	fr_radius_batch_t sign[FR_RADIUS_BATCH_CHUNK];
+
+	for (i = 0; i < num; i += chunk) {
+		chunk = num - i;
+		if (chunk > FR_RADIUS_BATCH_CHUNK) chunk = FR_RADIUS_BATCH_CHUNK;
+
+		/*
+		 *	Save the signatures of the packets which look
+		 *	OK, and sign those packets again.
+		 */
+		for (j = 0, k = 0; j < chunk; j++) {
+			fr_radius_batch_t *b = &batch[i + j];
+
+			b->rcode = radius_verify_save(b->packet, request_authenticator[k],
+						      message_authenticator[k], &msg[k]);
+			if (b->rcode < 0) {
+				rcode = -1;
+				continue;
+			}
+
+			sign[k] = *b;
+			index[k] = i + j;
+			k++;
+		}
+
+		(void) fr_radius_sign_batch(sign, k);
+
+		for (j = 0; j < k; j++) {
+			fr_radius_batch_t *b = &batch[index[j]];
+
+			if (sign[j].rcode < 0) {
+				fr_strerror_printf("unknown packet code");
+				b->rcode = -1;
+				rcode = -1;
+				continue;
+			}
+
+			b->rcode = radius_verify_check(b->packet, b->original, request_authenticator[j],
+						       message_authenticator[j], msg[j]);
+			if (b->rcode < 0) rcode = -1;
+		}
+	}
+
+	return rcode;
+}
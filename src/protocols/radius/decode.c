@@ -29,17 +29,14 @@ RCSID("$Id$")
 
 bool fr_tunnel_password_zeros = true;
 
-/** Decode Tunnel-Password encrypted attributes
+/** Decode Tunnel-Password encrypted attributes, with an optional precomputed secret
  *
- * Defined in RFC-2868, this uses a two char SALT along with the
- * initial intermediate value, to differentiate it from the
- * above.
  */
-ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
+static ssize_t decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret,
+				      fr_md5_key_t const *key, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
-	int		secretlen;
 	size_t		i, n, encrypted_len, embedded_len;
 
 	encrypted_len = *pwlen;
@@ -73,10 +70,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_radius_md5_secret_init(&context, secret, key);
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -152,15 +146,27 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	return embedded_len;
 }
 
-/** Decode password
+/** Decode Tunnel-Password encrypted attributes
  *
+ * Defined in RFC-2868, this uses a two char SALT along with the
+ * initial intermediate value, to differentiate it from the
+ * above.
  */
-ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
+ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
+{
+	return decode_tunnel_password(passwd, pwlen, secret, NULL, vector);
+}
+
+/** Decode password, with an optional precomputed secret
+ *
+ */
+static ssize_t decode_password(char *passwd, size_t pwlen, char const *secret,
+			       fr_md5_key_t const *key, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		i;
-	size_t		n, secretlen;
+	size_t		n;
 
 	/*
 	 *	The RFC's say that the maximum is 128.
@@ -177,10 +183,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_radius_md5_secret_init(&context, secret, key);
 	fr_md5_copy(&old, &context);	/* save intermediate work */
 
 	/*
@@ -212,6 +215,14 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	return strlen(passwd);
 }
 
+/** Decode password
+ *
+ */
+ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
+{
+	return decode_password(passwd, pwlen, secret, NULL, vector);
+}
+
 /** Check if a set of RADIUS formatted TLVs are OK
  *
  */
@@ -982,8 +993,8 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		 *  User-Password
 		 */
 		case FLAG_ENCRYPT_USER_PASSWORD:
-			fr_radius_decode_password((char *)buffer, attr_len,
-						  packet_ctx->secret, packet_ctx->vector);
+			decode_password((char *)buffer, attr_len,
+					packet_ctx->secret, packet_ctx->key, packet_ctx->vector);
 			buffer[253] = '\0';
 
 			/*
@@ -1016,7 +1027,8 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		 *	so data_len is not the same as attrlen.
 		 */
 		case FLAG_ENCRYPT_TUNNEL_PASSWORD:
-			if (fr_radius_decode_tunnel_password(buffer, &data_len, packet_ctx->secret, packet_ctx->vector) < 0) {
+			if (decode_tunnel_password(buffer, &data_len, packet_ctx->secret,
+						   packet_ctx->key, packet_ctx->vector) < 0) {
 				goto raw;
 			}
 			break;
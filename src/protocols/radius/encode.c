@@ -272,7 +272,7 @@ int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, u
 }
 
 static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input, size_t inlen,
-			    char const *secret, uint8_t const *vector)
+			    char const *secret, fr_md5_key_t const *key, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
@@ -297,8 +297,7 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 	}
 	*outlen = len;
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	fr_radius_md5_secret_init(&context, secret, key);
 	fr_md5_copy(&old, &context);
 
 	/*
@@ -322,7 +321,7 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 
 static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 				   uint8_t const *input, size_t inlen, size_t freespace,
-				   char const *secret, uint8_t const *vector)
+				   char const *secret, fr_md5_key_t const *key, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
@@ -383,8 +382,7 @@ static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 	out[1] = fr_rand();
 	out[2] = inlen;	/* length of the password string */
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	fr_radius_md5_secret_init(&context, secret, key);
 	fr_md5_copy(&old, &context);
 
 	fr_md5_update(&context, vector, AUTH_VECTOR_LEN);
@@ -829,7 +827,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 */
 	if (da->type != FR_TYPE_STRUCT) switch (vp->da->flags.encrypt) {
 	case FLAG_ENCRYPT_USER_PASSWORD:
-		encode_password(ptr, &len, data, len, packet_ctx->secret, packet_ctx->vector);
+		encode_password(ptr, &len, data, len, packet_ctx->secret, packet_ctx->key, packet_ctx->vector);
 		break;
 
 	case FLAG_ENCRYPT_TUNNEL_PASSWORD:
@@ -848,7 +846,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		if (offset) ptr[0] = TAG_VALID(vp->tag) ? vp->tag : TAG_NONE;
 
 		encode_tunnel_password(ptr + offset, &len, data, len,
-				       outlen - offset, packet_ctx->secret, packet_ctx->vector);
+				       outlen - offset, packet_ctx->secret, packet_ctx->key, packet_ctx->vector);
 		len += offset;
 		break;
 
@@ -43,6 +43,25 @@ typedef struct radius_packet_t {
 	uint8_t	data[1];
 } radius_packet_t;
 
+/*
+ *	A rough guess at how much memory decoding a packet needs.  We
+ *	assume an attribute every 32 bytes, each needing a VALUE_PAIR,
+ *	and maybe a small value buffer, plus the talloc headers.  It's
+ *	better to guess low, as the pool lives as long as the packet.
+ *	Once the pool is used up, talloc allocates from the heap as
+ *	usual.
+ */
+#define DECODE_POOL_ATTR_LEN	32
+#define DECODE_POOL_PER_ATTR	(sizeof(VALUE_PAIR) + 48)
+#define DECODE_POOL_MAX		8192
+
+static inline size_t decode_pool_size(size_t len)
+{
+	size_t size = ((len / DECODE_POOL_ATTR_LEN) + 1) * DECODE_POOL_PER_ATTR;
+
+	return (size > DECODE_POOL_MAX) ? DECODE_POOL_MAX : size;
+}
+
 /*
  *	For request packets which have the Request Authenticator being
  *	all zeros.  We need to decode attributes using a Request
@@ -59,11 +78,11 @@ static uint8_t nullvector[AUTH_VECTOR_LEN] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
 
 
-/** Encode a packet
+/** Encode a packet, with an optional precomputed shared secret
  *
  */
-int fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-		     char const *secret)
+static int radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+				char const *secret, fr_md5_key_t const *key)
 {
 	radius_packet_t		*hdr;
 	uint8_t			*ptr;
@@ -79,6 +98,7 @@ int fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original
 	uint64_t	data[MAX_PACKET_LEN / sizeof(uint64_t)];
 
 	packet_ctx.secret = secret;
+	packet_ctx.key = key;
 	packet_ctx.vector = packet->vector;
 
 	switch (packet->code) {
@@ -244,24 +264,46 @@ int fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original
 	return 0;
 }
 
+/** Encode a packet
+ *
+ */
+int fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			    char const *secret)
+{
+	return radius_packet_encode(packet, original, secret, NULL);
+}
+
+/** Encode a packet, using a precomputed shared secret
+ *
+ *  key->key MUST be a talloc'd string.
+ */
+int fr_radius_packet_encode_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+				fr_md5_key_t const *key)
+{
+	return radius_packet_encode(packet, original, (char const *) key->key, key);
+}
 
-/** Calculate/check digest, and decode radius attributes
+
+/** Calculate/check digest, and decode radius attributes, with an optional precomputed secret
  *
  * @return
  *	- 0 on success
  *	- -1 on decoding error.
  */
-int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+static int radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+				char const *secret, fr_md5_key_t const *key)
 {
 	int			packet_length;
 	uint32_t		num_attributes;
 	uint8_t			*ptr;
 	radius_packet_t		*hdr;
-	VALUE_PAIR		*head = NULL;
+	VALUE_PAIR		*head = NULL, *vp;
 	vp_cursor_t		cursor, out;
 	fr_radius_ctx_t		packet_ctx;
+	TALLOC_CTX		*pool;
 
 	packet_ctx.secret = secret;
+	packet_ctx.key = key;
 	packet_ctx.vector = packet->vector;
 
 	switch (packet->code) {
@@ -313,6 +355,27 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 	packet_length = packet->data_len - RADIUS_HDR_LEN;
 	num_attributes = 0;
 
+	/*
+	 *	All of the VALUE_PAIRs (and their values) are carved
+	 *	from one pool, sized from the packet, instead of each
+	 *	being a separate allocation.  If we guessed too small,
+	 *	talloc just allocates the rest from the heap.
+	 */
+	pool = talloc_pool(packet, decode_pool_size(packet_length));
+	if (!pool) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	talloc_set_name_const(pool, "decode_pool");
+
+	/*
+	 *	Any pair which would keep the pool alive by being
+	 *	moved out of the packet is copied instead.  See
+	 *	fr_pair_list_move().
+	 */
+	packet->decode_pool = pool;
+	packet->decode_pool_size = decode_pool_size(packet_length);
+
 	fr_pair_cursor_init(&cursor, &head);
 
 	/*
@@ -324,12 +387,9 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 		/*
 		 *	This may return many VPs
 		 */
-		my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal),
+		my_len = fr_radius_decode_pair(pool, &cursor, fr_dict_root(fr_dict_internal),
 					       ptr, packet_length, &packet_ctx);
-		if (my_len < 0) {
-			fr_pair_list_free(&head);
-			return -1;
-		}
+		if (my_len < 0) goto error;
 
 		/*
 		 *	This should really be an assertion.
@@ -350,20 +410,27 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 		if ((fr_max_attributes > 0) && (num_attributes > fr_max_attributes)) {
 			char host_ipaddr[INET6_ADDRSTRLEN];
 
-			fr_pair_list_free(&head);
 			fr_strerror_printf("Possible DoS attack from host %s: Too many attributes in request "
 					   "(received %d, max %d are allowed)",
 					   inet_ntop(packet->src_ipaddr.af,
 						     &packet->src_ipaddr.addr,
 						     host_ipaddr, sizeof(host_ipaddr)),
 					   num_attributes, fr_max_attributes);
-			return -1;
+			goto error;
 		}
 
 		ptr += my_len;
 		packet_length -= my_len;
 	}
 
+	/*
+	 *	The VALUE_PAIRs are parented by the packet, as
+	 *	everything else expects.  Their memory stays in the
+	 *	pool, which is freed along with the packet, unless a
+	 *	pair is stolen directly into another context.
+	 */
+	for (vp = head; vp; vp = vp->next) (void) talloc_steal(packet, vp);
+
 	fr_pair_cursor_init(&out, &packet->vps);
 	fr_pair_cursor_last(&out);		/* Move insertion point to the end of the list */
 	fr_pair_cursor_merge(&out, head);
@@ -375,6 +442,37 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 	fr_rand_seed(packet->data, RADIUS_HDR_LEN);
 
 	return 0;
+
+error:
+	fr_pair_list_free(&head);
+	talloc_free(pool);
+	packet->decode_pool = NULL;
+	packet->decode_pool_size = 0;
+	return -1;
+}
+
+/** Calculate/check digest, and decode radius attributes
+ *
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	return radius_packet_decode(packet, original, secret, NULL);
+}
+
+/** Calculate/check digest, and decode radius attributes, using a precomputed shared secret
+ *
+ *  key->key MUST be a talloc'd string.
+ *
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+int fr_radius_packet_decode_key(RADIUS_PACKET *packet, RADIUS_PACKET *original, fr_md5_key_t const *key)
+{
+	return radius_packet_decode(packet, original, (char const *) key->key, key);
 }
 
 
@@ -413,11 +511,13 @@ bool fr_radius_packet_ok(RADIUS_PACKET *packet, bool require_ma, decode_fail_t *
 }
 
 
-/** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
+/** Verify the authenticators of a packet, with an optional precomputed shared secret
  *
  */
-int fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+static int radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+				char const *secret, fr_md5_key_t const *key)
 {
+	int		rcode;
 	uint8_t const	*original_data;
 	char		buffer[INET6_ADDRSTRLEN];
 
@@ -429,8 +529,13 @@ int fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 		original_data = NULL;
 	}
 
-	if (fr_radius_verify(packet->data, original_data,
-			     (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0) {
+	if (key) {
+		rcode = fr_radius_verify_key(packet->data, original_data, key);
+	} else {
+		rcode = fr_radius_verify(packet->data, original_data,
+					 (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	}
+	if (rcode < 0) {
 		fr_strerror_printf("Received packet from %s with %s",
 				   inet_ntop(packet->src_ipaddr.af, &packet->src_ipaddr.addr,
 					     buffer, sizeof(buffer)),
@@ -441,12 +546,28 @@ int fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 	return 0;
 }
 
+/** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
+ *
+ */
+int fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	return radius_packet_verify(packet, original, secret, NULL);
+}
 
-/** Sign a previously encoded packet
+/** Verify the authenticators of a packet, using a precomputed shared secret
  *
  */
-int fr_radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-			  char const *secret)
+int fr_radius_packet_verify_key(RADIUS_PACKET *packet, RADIUS_PACKET *original, fr_md5_key_t const *key)
+{
+	return radius_packet_verify(packet, original, (char const *) key->key, key);
+}
+
+
+/** Sign a previously encoded packet, with an optional precomputed shared secret
+ *
+ */
+static int radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			      char const *secret, fr_md5_key_t const *key)
 {
 	int rcode;
 	uint8_t const *original_data;
@@ -467,14 +588,36 @@ int fr_radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		memcpy(packet->data + 4, packet->vector, sizeof(packet->vector));
 	}
 
-	rcode = fr_radius_sign(packet->data, original_data,
-			       (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	if (key) {
+		rcode = fr_radius_sign_key(packet->data, original_data, key);
+	} else {
+		rcode = fr_radius_sign(packet->data, original_data,
+				       (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	}
 	if (rcode < 0) return rcode;
 
 	memcpy(packet->vector, packet->data + 4, AUTH_VECTOR_LEN);
 	return 0;
 }
 
+/** Sign a previously encoded packet
+ *
+ */
+int fr_radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			  char const *secret)
+{
+	return radius_packet_sign(packet, original, secret, NULL);
+}
+
+/** Sign a previously encoded packet, using a precomputed shared secret
+ *
+ */
+int fr_radius_packet_sign_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			      fr_md5_key_t const *key)
+{
+	return radius_packet_sign(packet, original, (char const *) key->key, key);
+}
+
 
 /** Wrapper for recvfrom, which handles recvfromto, IPv6, and all possible combinations
  *
@@ -597,12 +740,12 @@ RADIUS_PACKET *fr_radius_packet_recv(TALLOC_CTX *ctx, int fd, int flags, bool re
 	return packet;
 }
 
-/** Reply to the request
+/** Reply to the request, with an optional precomputed shared secret
  *
  * Also attach reply attribute value pairs and any user message provided.
  */
-int fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-			  char const *secret)
+static int radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			      char const *secret, fr_md5_key_t const *key)
 {
 	/*
 	 *	Maybe it's a fake packet.  Don't send it.
@@ -618,7 +761,7 @@ int fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		/*
 		 *	Encode the packet.
 		 */
-		if (fr_radius_packet_encode(packet, original, secret) < 0) {
+		if (radius_packet_encode(packet, original, secret, key) < 0) {
 			return -1;
 		}
 
@@ -626,7 +769,7 @@ int fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		 *	Re-sign it, including updating the
 		 *	Message-Authenticator.
 		 */
-		if (fr_radius_packet_sign(packet, original, secret) < 0) {
+		if (radius_packet_sign(packet, original, secret, key) < 0) {
 			return -1;
 		}
 
@@ -666,6 +809,26 @@ int fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 			&packet->dst_ipaddr, packet->dst_port);
 }
 
+/** Reply to the request
+ *
+ * Also attach reply attribute value pairs and any user message provided.
+ */
+int fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			  char const *secret)
+{
+	return radius_packet_send(packet, original, secret, NULL);
+}
+
+/** Reply to the request, using a precomputed shared secret
+ *
+ *  key->key MUST be a talloc'd string.
+ */
+int fr_radius_packet_send_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			      fr_md5_key_t const *key)
+{
+	return radius_packet_send(packet, original, (char const *) key->key, key);
+}
+
 static void print_hex_data(uint8_t const *ptr, int attrlen, int depth)
 {
 	int i;
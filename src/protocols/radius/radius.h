@@ -27,6 +27,7 @@
 #include <freeradius-devel/cursor.h>
 #include <freeradius-devel/packet.h>
 #include <freeradius-devel/fr_log.h>
+#include <freeradius-devel/md5.h>
 
 #define AUTH_VECTOR_LEN		16
 #define CHAP_VALUE_LENGTH       16
@@ -66,6 +67,23 @@ typedef enum {
 	DECODE_FAIL_MAX
 } decode_fail_t;
 
+/*
+ *	How many packets fr_radius_sign_batch() and
+ *	fr_radius_verify_batch() work on at once.
+ */
+#define FR_RADIUS_BATCH_CHUNK	(64)
+
+/** One packet for fr_radius_sign_batch() and fr_radius_verify_batch()
+ *
+ */
+typedef struct fr_radius_batch_t {
+	uint8_t			*packet;	//!< the raw RADIUS packet (request or response)
+	uint8_t const		*original;	//!< the raw original request (if this is a response)
+	uint8_t const		*secret;	//!< the shared secret
+	size_t			secret_len;	//!< the length of the secret
+	int			rcode;		//!< result of signing or verifying this packet
+} fr_radius_batch_t;
+
 /*
  *	protocols/radius/base.c
  */
@@ -75,11 +93,19 @@ int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
 				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_key(uint8_t *packet, uint8_t const *original,
+				   fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+int		fr_radius_verify_key(uint8_t *packet, uint8_t const *original,
+				     fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_batch(fr_radius_batch_t *batch, int num);
+int		fr_radius_verify_batch(fr_radius_batch_t *batch, int num);
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p, bool require_ma,
 			     decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
 void		fr_radius_ascend_secret(uint8_t *digest, uint8_t const *vector,
 					char const *secret, uint8_t const *value) CC_HINT(nonnull);
+void		fr_radius_md5_secret_init(FR_MD5_CTX *context, char const *secret,
+					  fr_md5_key_t const *key) CC_HINT(nonnull (1,2));
 
 ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code);
 /*
@@ -103,9 +129,20 @@ int		fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 int		fr_radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 				      char const *secret) CC_HINT(nonnull (1,3));
 
+int		fr_radius_packet_encode_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+					    fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+int		fr_radius_packet_decode_key(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+					    fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+int		fr_radius_packet_verify_key(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+					    fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+int		fr_radius_packet_sign_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+					  fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
+
 RADIUS_PACKET	*fr_radius_packet_recv(TALLOC_CTX *ctx, int fd, int flags, bool require_ma);
 int		fr_radius_packet_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 				      char const *secret) CC_HINT(nonnull (1,3));
+int		fr_radius_packet_send_key(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+					  fr_md5_key_t const *key) CC_HINT(nonnull (1,3));
 
 void		fr_radius_print_hex(RADIUS_PACKET const *packet) CC_HINT(nonnull);
 
@@ -113,6 +150,7 @@ void		fr_radius_print_hex(RADIUS_PACKET const *packet) CC_HINT(nonnull);
 typedef struct fr_radius_ctx {
 	uint8_t const		*vector;		//!< vector for encryption / decryption of data
 	char const		*secret;		//!< shared secret.  MUST be talloc'd
+	fr_md5_key_t const	*key;			//!< precomputed state for "secret", or NULL.
 } fr_radius_ctx_t;
 
 /*
@@ -25,20 +25,32 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/transport.h>
+#include <freeradius-devel/io/track.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/token.h>
 #include <freeradius-devel/inet.h>
 #include <freeradius-devel/radius/radius.h>
 
+/*
+ *	Only print debug messages when debugging is enabled.  These
+ *	are called for every packet.
+ */
 #ifndef RDEBUG
-#define RDEBUG(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)
+#define RDEBUG(fmt, ...) do { if (fr_debug_lvl) fprintf(stderr, fmt, ## __VA_ARGS__); } while (0)
 #endif
 
 #ifndef DEBUG
-#define DEBUG(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)
+#define DEBUG(fmt, ...) do { if (fr_debug_lvl) fprintf(stderr, fmt, ## __VA_ARGS__); } while (0)
 #endif
 
+/*
+ *	How many requests we track per socket, and how long we answer
+ *	retransmissions from the cached reply.
+ */
+#define TRACKING_ENTRIES	(16384)
+#define TRACKING_LIFETIME	((fr_time_t) 5 * NANOSEC)
+
 typedef struct fr_packet_ctx_t {
 	int		sockfd;
 
@@ -50,6 +62,8 @@ typedef struct fr_packet_ctx_t {
 
 	struct sockaddr_storage src;
 	socklen_t	salen;
+
+	fr_tracking_t	*ft;		//!< requests we've seen, and their replies
 } fr_packet_ctx_t;
 
 
@@ -75,11 +89,49 @@ static ssize_t mod_encode(void const *ctx, REQUEST *request, uint8_t *buffer, si
 	buffer[2] = 0;
 	buffer[3] = 20;
 
-	(void) fr_radius_sign(buffer, pc->original, pc->secret, pc->secret_len);
+	/*
+	 *	The reply is signed when it's written, as that's when
+	 *	we know which request it's for.
+	 */
+	memset(buffer + 4, 0, AUTH_VECTOR_LEN);
 
 	return 20;
 }
 
+/** Find the original request for a reply
+ *
+ *  The tracking table has the code, ID and vector of every request
+ *  we're answering.  If the request isn't tracked, use the last one
+ *  we read.
+ *
+ * @param pc the packet context
+ * @param reply the encoded reply
+ * @param dst where the reply is going
+ * @param dstlen length of the destination address, or 0 if it's not known
+ * @param original where to build the original request
+ * @return the original request (header only)
+ */
+static uint8_t const *mod_original(fr_packet_ctx_t *pc, uint8_t const *reply,
+				   struct sockaddr_storage const *dst, socklen_t dstlen, uint8_t *original)
+{
+	fr_ipaddr_t ipaddr;
+	uint16_t port;
+	fr_tracking_entry_t *entry;
+
+	if (!pc->ft || !dstlen) return pc->original;
+
+	if (fr_ipaddr_from_sockaddr(dst, dstlen, &ipaddr, &port) < 0) return pc->original;
+
+	entry = fr_radius_tracking_entry_find(pc->ft, &ipaddr, port, reply[1]);
+	if (!entry) return pc->original;
+
+	original[0] = entry->code;
+	original[1] = entry->id;
+	memcpy(original + 2, &entry->data[0], sizeof(entry->data));
+
+	return original;
+}
+
 static size_t mod_nak(void const *ctx, uint8_t *const packet, size_t packet_len, UNUSED uint8_t *reply, UNUSED size_t reply_len)
 {
 	DEBUG("\t\tNAK !!! request %d - data %p %p size %zd\n", packet[1], ctx, packet, packet_len);
@@ -118,7 +170,7 @@ static ssize_t mod_read(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_le
 	/*
 	 *	If the signature fails validation, ignore it.
 	 */
-	if (!fr_radius_verify(buffer, NULL, pc->secret, pc->secret_len)) {
+	if (fr_radius_verify(buffer, NULL, pc->secret, pc->secret_len) < 0) {
 		return 0;
 	}
 
@@ -128,14 +180,241 @@ static ssize_t mod_read(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_le
 	return packet_len;
 }
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+/*
+ *	The most datagrams we read or write in one system call.
+ */
+#define MAX_BATCH	(64)
+
+/** Read many packets at once
+ *
+ *  Each datagram keeps the address it came from.  Datagrams which
+ *  aren't valid RADIUS packets are left in place with zero length,
+ *  and the network side skips them.
+ */
+static int mod_read_batch(int sockfd, void *ctx, fr_transport_dgram_t *dgram, unsigned int num)
+{
+	int i, rcode, last, num_ok;
+	int index[MAX_BATCH];
+	size_t packet_len;
+	uint8_t *packet;
+	fr_packet_ctx_t *pc = ctx;
+	decode_fail_t reason;
+	struct mmsghdr msgs[MAX_BATCH];
+	fr_radius_batch_t batch[MAX_BATCH];
+
+	if (num > MAX_BATCH) num = MAX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < (int) num; i++) {
+		msgs[i].msg_hdr.msg_name = &dgram[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(dgram[i].addr);
+		msgs[i].msg_hdr.msg_iov = &dgram[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	rcode = recvmmsg(sockfd, msgs, num, MSG_DONTWAIT, NULL);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+		return -1;
+	}
+
+	/*
+	 *	If it's not a RADIUS packet, ignore it.
+	 */
+	num_ok = 0;
+	for (i = 0; i < rcode; i++) {
+		packet = dgram[i].iov.iov_base;
+		packet_len = msgs[i].msg_len;
+
+		dgram[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+		dgram[i].iov.iov_len = 0;
+
+		if (!fr_radius_ok(packet, &packet_len, false, &reason)) continue;
+
+		dgram[i].iov.iov_len = packet_len;
+
+		batch[num_ok].packet = packet;
+		batch[num_ok].original = NULL;
+		batch[num_ok].secret = pc->secret;
+		batch[num_ok].secret_len = pc->secret_len;
+		index[num_ok] = i;
+		num_ok++;
+	}
+
+	/*
+	 *	If the signature fails validation, ignore it.  The
+	 *	signatures are all checked at once.
+	 */
+	(void) fr_radius_verify_batch(batch, num_ok);
+
+	last = -1;
+	for (i = 0; i < num_ok; i++) {
+		if (batch[i].rcode < 0) {
+			dgram[index[i]].iov.iov_len = 0;
+			continue;
+		}
+		last = index[i];
+	}
+
+	/*
+	 *	The network side tracks where each packet came from.
+	 *	The packet context only holds one ID and vector, so we
+	 *	keep the ones from the last packet.
+	 */
+	if (last >= 0) {
+		packet = dgram[last].iov.iov_base;
+		pc->id = packet[1];
+		memcpy(pc->original, packet, sizeof(pc->original));
+		memcpy(&pc->src, &dgram[last].addr, dgram[last].addrlen);
+		pc->salen = dgram[last].addrlen;
+	}
+
+	return rcode;
+}
+
+/** Write many packets at once
+ *
+ *  Each datagram goes to its own address.  If the network doesn't
+ *  know where a reply goes, it goes to where the last packet came
+ *  from.
+ */
+static int mod_write_batch(int sockfd, void *ctx, fr_transport_dgram_t *dgram, unsigned int num)
+{
+	int i, j;
+	fr_packet_ctx_t *pc = ctx;
+	struct mmsghdr msgs[MAX_BATCH];
+	fr_radius_batch_t batch[MAX_BATCH];
+	uint8_t original[MAX_BATCH][20];
+
+	if (num > MAX_BATCH) num = MAX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < (int) num; i++) {
+		if (dgram[i].addrlen) {
+			msgs[i].msg_hdr.msg_name = &dgram[i].addr;
+			msgs[i].msg_hdr.msg_namelen = dgram[i].addrlen;
+		} else {
+			msgs[i].msg_hdr.msg_name = &pc->src;
+			msgs[i].msg_hdr.msg_namelen = pc->salen;
+		}
+		msgs[i].msg_hdr.msg_iov = &dgram[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		batch[i].packet = dgram[i].iov.iov_base;
+		batch[i].original = mod_original(pc, batch[i].packet, msgs[i].msg_hdr.msg_name,
+						 msgs[i].msg_hdr.msg_namelen, original[i]);
+		batch[i].secret = pc->secret;
+		batch[i].secret_len = pc->secret_len;
+	}
+
+	/*
+	 *	Sign all of the replies at once.  Any which can't be
+	 *	signed aren't sent.
+	 */
+	if (fr_radius_sign_batch(batch, num) < 0) {
+		for (i = 0, j = 0; i < (int) num; i++) {
+			if (batch[i].rcode < 0) continue;
+
+			if (i != j) msgs[j] = msgs[i];
+			j++;
+		}
+
+		if (!j) return 0;
+		return sendmmsg(sockfd, msgs, j, 0);
+	}
+
+	return sendmmsg(sockfd, msgs, num, 0);
+}
+#endif
+
+/** Check a request for retransmissions before it goes to a worker
+ *
+ *  A retransmission of a request which has been answered gets the
+ *  cached reply.  One which is still being processed is ignored.
+ */
+static int mod_recv_packet(void *ctx, int sockfd, fr_channel_data_t *cd)
+{
+	fr_packet_ctx_t *pc = ctx;
+	fr_tracking_entry_t *entry;
+	struct sockaddr_storage dst;
+	socklen_t dstlen;
+
+	if (!pc->ft) return 0;
+
+	/*
+	 *	The network only knows where batched reads came from.
+	 *	For single reads, we do.
+	 */
+	if (!cd->src_port &&
+	    (fr_ipaddr_from_sockaddr(&pc->src, pc->salen, &cd->src_ipaddr, &cd->src_port) < 0)) {
+		return 0;
+	}
+
+	if (cd->m.when > TRACKING_LIFETIME) {
+		(void) fr_radius_tracking_expire(pc->ft, cd->m.when - TRACKING_LIFETIME);
+	}
+
+	switch (fr_radius_tracking_entry_insert(pc->ft, cd->m.data, cd->m.when,
+						&cd->src_ipaddr, cd->src_port, &entry)) {
+	case FR_TRACKING_NEW:
+	case FR_TRACKING_DIFFERENT:
+	case FR_TRACKING_UNUSED:	/* we can't track it, but we can still process it */
+		return 0;
+
+	case FR_TRACKING_SAME:
+		break;
+	}
+
+	/*
+	 *	Still being processed, the worker will reply.
+	 */
+	if (!entry->reply) return 1;
+
+	if (fr_ipaddr_to_sockaddr(&cd->src_ipaddr, cd->src_port, &dst, &dstlen) < 0) return 1;
+
+	(void) sendto(sockfd, entry->reply, entry->reply_len, 0, (struct sockaddr *) &dst, dstlen);
+
+	return 1;
+}
+
+/** Cache a reply, so that we can answer retransmissions of the request
+ *
+ *  The tracking table keeps a copy of the reply, so the message
+ *  goes back to the worker's message set as soon as it's written.
+ *  The copy is freed when the entry expires, or when the client
+ *  re-uses the ID for a new request.
+ */
+static int mod_recv_reply(void *ctx, fr_channel_data_t *cd)
+{
+	fr_packet_ctx_t *pc = ctx;
+	fr_tracking_entry_t *entry;
+
+	if (!pc->ft || (cd->m.data_size < 20)) return 0;
+
+	entry = fr_radius_tracking_entry_find(pc->ft, &cd->src_ipaddr, cd->src_port, cd->m.data[1]);
+	if (!entry) return 0;
+
+	(void) fr_radius_tracking_entry_reply(pc->ft, entry, cd->reply.request_time,
+					      cd->m.data, cd->m.data_size);
+
+	return 0;
+}
+
 
 static ssize_t mod_write(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_len)
 {
 	ssize_t data_size;
 	fr_packet_ctx_t *pc = ctx;
+	uint8_t original[20];
 
 	pc->salen = sizeof(pc->src);
 
+	if (fr_radius_sign(buffer, mod_original(pc, buffer, &pc->src, pc->salen, original),
+			   pc->secret, pc->secret_len) < 0) {
+		return -1;
+	}
+
 	/*
 	 *	@todo - do more stuff
 	 */
@@ -149,6 +428,37 @@ static ssize_t mod_write(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_l
 	return data_size;
 }
 
+/** Allocate a packet context for a RADIUS server socket
+ *
+ * @param ctx the talloc ctx
+ * @param sockfd the socket
+ * @param secret shared by all clients of the socket
+ * @param secret_len length of the secret
+ * @return
+ *	- NULL on error
+ *	- the packet context, to add along with the socket
+ */
+extern void *fr_radius_server_udp_ctx_alloc(TALLOC_CTX *ctx, int sockfd, uint8_t const *secret, size_t secret_len);
+void *fr_radius_server_udp_ctx_alloc(TALLOC_CTX *ctx, int sockfd, uint8_t const *secret, size_t secret_len)
+{
+	fr_packet_ctx_t *pc;
+
+	pc = talloc_zero(ctx, fr_packet_ctx_t);
+	if (!pc) return NULL;
+
+	pc->sockfd = sockfd;
+	pc->secret = secret;
+	pc->secret_len = secret_len;
+
+	pc->ft = fr_radius_tracking_create(pc, TRACKING_ENTRIES);
+	if (!pc->ft) {
+		talloc_free(pc);
+		return NULL;
+	}
+
+	return pc;
+}
+
 extern fr_transport_t fr_radius_server_udp;
 fr_transport_t fr_radius_server_udp = {
 	.name			= "radius_server_udp",
@@ -156,6 +466,13 @@ fr_transport_t fr_radius_server_udp = {
 	.default_message_size	= 4096,
 	.read			= mod_read,
 	.write			= mod_write,
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	.batch_size		= MAX_BATCH,
+	.read_batch		= mod_read_batch,
+	.write_batch		= mod_write_batch,
+#endif
+	.recv_packet		= mod_recv_packet,
+	.recv_reply		= mod_recv_reply,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
 	.nak			= mod_nak,
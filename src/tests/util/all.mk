@@ -1,8 +1,20 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk spsc_queue_test.mk track_test.mk md5_mb_test.mk lpm_test.mk radius_decode_test.mk pair_index_test.mk cache_serialize_test.mk timer_test.mk
+
+#
+#  These call kqueue() and kevent() directly, so they can't be
+#  built with the epoll backend.
+#
+ifneq "$(WITH_EPOLL)" "yes"
+SUBMAKEFILES += control_test.mk
+endif
 
 #
 #  These require pthread.
 #
 ifneq "$(findstring thread,${CFLAGS})" ""
-SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk
+SUBMAKEFILES += schedule_test.mk radius_schedule_test.mk event_test.mk exfile_test.mk connection_pool_test.mk
+
+ifneq "$(WITH_EPOLL)" "yes"
+SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk
+endif
 endif
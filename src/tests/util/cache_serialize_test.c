@@ -0,0 +1,282 @@
+/*
+ * cache_serialize_test.c	Tests and benchmarks for serializing cache entries
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../../modules/rlm_cache/rlm_cache.h"
+#include "../../modules/rlm_cache/serialize.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_entries = 100000;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cache_serialize_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to share).\n");
+	fprintf(stderr, "  -n <num>               Number of entries for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Attributes in the cached entry, chosen to cover the fixed
+ *	width, variable length, and vendor specific encodings.
+ */
+static struct {
+	char const	*attr;
+	FR_TOKEN	op;
+	char const	*value;
+} entry_maps[] = {
+	{ "&reply:Framed-IP-Address",		T_OP_SET,	"192.0.2.1" },
+	{ "&reply:Framed-IPv6-Prefix",		T_OP_SET,	"2001:db8::/32" },
+	{ "&reply:Session-Timeout",		T_OP_SET,	"3600" },
+	{ "&reply:Service-Type",		T_OP_SET,	"Framed-User" },
+	{ "&reply:Class",			T_OP_ADD,	"0x00112233445566778899aabbccddeeff" },
+	{ "&reply:Reply-Message",		T_OP_ADD,	"Hello \"world\"\n" },
+	{ "&control:Tmp-Integer-0",		T_OP_SET,	"42" },
+	{ "&control:Tmp-Date-0",		T_OP_SET,	"1500000000" },
+	{ "&session-state:Tmp-String-0",	T_OP_SET,	"admins" },
+	{ "&session-state:Tmp-Octets-0",	T_OP_SET,	"0xdeadbeef" },
+	{ "&reply:Cisco-AVPair",		T_OP_ADD,	"shell:priv-lvl=15" },
+};
+
+static rlm_cache_entry_t *entry_alloc(TALLOC_CTX *ctx)
+{
+	rlm_cache_entry_t	*c;
+	vp_map_t		**last;
+	size_t			i;
+
+	c = talloc_zero(ctx, rlm_cache_entry_t);
+	if (!rad_cond_assert(c != NULL)) exit(1);
+
+	c->created = 1500000000;
+	c->expires = 1500003600;
+	last = &c->maps;
+
+	for (i = 0; i < sizeof(entry_maps) / sizeof(*entry_maps); i++) {
+		vp_map_t	*map;
+		fr_type_t	type;
+
+		map = talloc_zero(c, vp_map_t);
+		if (!rad_cond_assert(map != NULL)) exit(1);
+		map->op = entry_maps[i].op;
+
+		if (tmpl_afrom_attr_str(map, &map->lhs, entry_maps[i].attr,
+					REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false) <= 0) {
+			fr_perror("cache_serialize_test");
+			exit(1);
+		}
+		if (!rad_cond_assert(map->lhs->type == TMPL_TYPE_ATTR)) exit(1);
+
+		map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA,
+				     entry_maps[i].value, -1, T_SINGLE_QUOTED_STRING);
+		type = map->lhs->tmpl_da->type;
+		if (fr_value_box_from_str(map->rhs, &map->rhs->tmpl_value_box, &type, map->lhs->tmpl_da,
+					  entry_maps[i].value, -1, '\0') < 0) {
+			fr_perror("cache_serialize_test");
+			exit(1);
+		}
+
+		*last = map;
+		last = &map->next;
+	}
+
+	return c;
+}
+
+static void entry_cmp(rlm_cache_entry_t const *a, rlm_cache_entry_t const *b)
+{
+	vp_map_t const *x, *y;
+
+	if (!rad_cond_assert(a->created == b->created)) exit(1);
+	if (!rad_cond_assert(a->expires == b->expires)) exit(1);
+
+	for (x = a->maps, y = b->maps; x && y; x = x->next, y = y->next) {
+		if (!rad_cond_assert(x->op == y->op)) exit(1);
+		if (!rad_cond_assert(y->lhs->type == TMPL_TYPE_ATTR)) exit(1);
+		if (!rad_cond_assert(x->lhs->tmpl_da == y->lhs->tmpl_da)) exit(1);
+		if (!rad_cond_assert(x->lhs->tmpl_list == y->lhs->tmpl_list)) exit(1);
+		if (!rad_cond_assert(x->lhs->tmpl_request == y->lhs->tmpl_request)) exit(1);
+		if (!rad_cond_assert(x->lhs->tmpl_tag == y->lhs->tmpl_tag)) exit(1);
+		if (!rad_cond_assert(y->rhs->type == TMPL_TYPE_DATA)) exit(1);
+		if (!rad_cond_assert(x->rhs->tmpl_value_box.type == y->rhs->tmpl_value_box.type)) exit(1);
+		if (!rad_cond_assert(fr_value_box_cmp(&x->rhs->tmpl_value_box, &y->rhs->tmpl_value_box) == 0)) exit(1);
+	}
+	if (!rad_cond_assert(!x && !y)) exit(1);
+}
+
+/*
+ *	Both formats must give back the entry we started with, and
+ *	cache_deserialize() must recognise binary entries.
+ */
+static void test_serialize(void)
+{
+	rlm_cache_entry_t	*c, *out;
+	char			*text;
+	uint8_t			*bin;
+	size_t			len;
+
+	c = entry_alloc(NULL);
+
+	if (!rad_cond_assert(cache_serialize(c, &text, c) == 0)) exit(1);
+	MPRINT1("Text entry is %zu bytes\n%s", talloc_array_length(text) - 1, text);
+
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize(out, text, talloc_array_length(text) - 1) == 0)) exit(1);
+	entry_cmp(c, out);
+
+	if (!rad_cond_assert(cache_serialize_binary(c, &bin, &len, c) == 0)) exit(1);
+	MPRINT1("Binary entry is %zu bytes\n", len);
+
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize_binary(out, bin, len) == 0)) exit(1);
+	entry_cmp(c, out);
+
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize(out, (char *)bin, len) == 0)) exit(1);
+	entry_cmp(c, out);
+
+	/*
+	 *	Truncated entries must be rejected, not read past the end.
+	 */
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize_binary(out, bin, len - 1) < 0)) exit(1);
+
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize_binary(out, bin, 10) < 0)) exit(1);
+
+	/*
+	 *	An empty entry is just a header
+	 */
+	talloc_free(c->maps);
+	c->maps = NULL;
+	if (!rad_cond_assert(cache_serialize_binary(c, &bin, &len, c) == 0)) exit(1);
+
+	out = talloc_zero(c, rlm_cache_entry_t);
+	if (!rad_cond_assert(cache_deserialize_binary(out, bin, len) == 0)) exit(1);
+	entry_cmp(c, out);
+
+	talloc_free(c);
+}
+
+static void test_benchmark(void)
+{
+	int			i, j;
+	rlm_cache_entry_t	*c, *out;
+	char			*text, *copy;
+	uint8_t			*bin;
+	size_t			text_len, bin_len;
+	fr_time_t		start, end;
+
+	c = entry_alloc(NULL);
+
+	if (!rad_cond_assert(cache_serialize(c, &text, c) == 0)) exit(1);
+	text_len = talloc_array_length(text) - 1;
+	if (!rad_cond_assert(cache_serialize_binary(c, &bin, &bin_len, c) == 0)) exit(1);
+
+	copy = talloc_array(c, char, text_len + 1);
+	if (!rad_cond_assert(copy != NULL)) exit(1);
+
+	for (i = 0; i < 2; i++) {
+		start = fr_time();
+
+		for (j = 0; j < num_entries; j++) {
+			out = talloc_zero(NULL, rlm_cache_entry_t);
+
+			if (i == 0) {
+				memcpy(copy, text, text_len + 1);	/* cache_deserialize() modifies its input */
+				if (!rad_cond_assert(cache_deserialize(out, copy, text_len) == 0)) exit(1);
+			} else {
+				if (!rad_cond_assert(cache_deserialize_binary(out, bin, bin_len) == 0)) exit(1);
+			}
+
+			talloc_free(out);
+		}
+
+		end = fr_time();
+
+		printf("%s: entries = %d  size = %zu\n", (i == 0) ? "text" : "binary", num_entries,
+		       (i == 0) ? text_len : bin_len);
+		if (end > start) printf("\tentries/s = %" PRIu64 "\n", ((uint64_t) num_entries * NANOSEC) / (end - start));
+	}
+
+	talloc_free(c);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*dict_dir = "share";
+	fr_dict_t	*dict = NULL;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_entries = atoi(optarg);
+			if (num_entries <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("cache_serialize_test");
+		exit(1);
+	}
+
+	test_serialize();
+	MPRINT1("Serialize tests passed\n");
+
+	test_benchmark();
+
+	talloc_free(autofree);
+
+	return 0;
+}
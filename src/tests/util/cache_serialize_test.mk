@@ -0,0 +1,6 @@
+TARGET := cache_serialize_test
+
+SOURCES		:= cache_serialize_test.c ../../modules/rlm_cache/serialize.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
@@ -24,6 +24,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/channel.h>
+#include <freeradius-devel/io/spsc_queue.h>
 #include <freeradius-devel/rad_assert.h>
 
 #ifdef HAVE_GETOPT_H
@@ -34,8 +35,15 @@ RCSID("$Id$")
 #include <pthread.h>
 #endif
 
+#include <sched.h>
 #include <sys/event.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
 #define MAX_KEVENTS		(10)
@@ -51,6 +59,7 @@ static int		max_messages = 10;
 static int		max_control_plane = 0;
 static int		max_outstanding = 1;
 static bool		touch_memory = false;
+static bool		queue_only = false;
 
 static void NEVER_RETURNS usage(void)
 {
@@ -58,6 +67,7 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -c <control-plane>     Size of the control plane queue.\n");
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
 	fprintf(stderr, "  -o <outstanding>       Keep number of messages outstanding.\n");
+	fprintf(stderr, "  -q                     Compare the SPSC and atomic queues, without a channel.\n");
 	fprintf(stderr, "  -t                     Touch memory for fake packets.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -469,18 +479,204 @@ static void *channel_worker(void *arg)
 }
 
 
+/*
+ *	Count cache misses for this process, and for any threads it
+ *	creates after the counter is opened.
+ */
+static int cache_misses_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.inherit = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void cache_misses_start(int fd)
+{
+#ifdef __linux__
+	if (fd < 0) return;
+
+	(void) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	(void) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+/*
+ *	Inherited counts are only added to the parent when the
+ *	threads exit, so this MUST be called after they've been joined.
+ */
+static void cache_misses_print(int fd)
+{
+	uint64_t misses;
+
+	if (fd < 0) {
+		printf("cache misses = unavailable\n");
+		return;
+	}
+
+#ifdef __linux__
+	(void) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+
+	if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+		printf("cache misses = unavailable\n");
+		return;
+	}
+
+	printf("cache misses = %" PRIu64 "\n", misses);
+}
+
+static void rate_print(char const *what, fr_time_t start, fr_time_t end)
+{
+	printf("%s messages = %d\n", what, max_messages);
+	printf("elapsed = %" PRIu64 "ns\n", end - start);
+	if (end > start) {
+		printf("messages/s = %" PRIu64 "\n", ((uint64_t) max_messages * NANOSEC) / (end - start));
+	}
+}
+
+/*
+ *	Push the same stream of pointers through each kind of queue,
+ *	from one thread to another.  This is what a channel does in
+ *	each direction, without the control plane.
+ */
+typedef struct queue_test_t {
+	char const	*name;
+	void		*(*create)(TALLOC_CTX *ctx, int size);
+	bool		(*push)(void *q, void *data);
+	bool		(*pop)(void *q, void **p_data);
+	void		*q;
+} queue_test_t;
+
+static void *atomic_create(TALLOC_CTX *ctx, int size)
+{
+	return fr_atomic_queue_create(ctx, size);
+}
+
+static bool atomic_push(void *q, void *data)
+{
+	return fr_atomic_queue_push(q, data);
+}
+
+static bool atomic_pop(void *q, void **p_data)
+{
+	return fr_atomic_queue_pop(q, p_data);
+}
+
+static void *spsc_create(TALLOC_CTX *ctx, int size)
+{
+	return fr_spsc_queue_create(ctx, size);
+}
+
+static bool spsc_push(void *q, void *data)
+{
+	return fr_spsc_queue_push(q, data);
+}
+
+static bool spsc_pop(void *q, void **p_data)
+{
+	return fr_spsc_queue_pop(q, p_data);
+}
+
+static queue_test_t queue_tests[] = {
+	{ "atomic", atomic_create, atomic_push, atomic_pop, NULL },
+	{ "spsc", spsc_create, spsc_push, spsc_pop, NULL },
+};
+
+static void *queue_producer(void *arg)
+{
+	int i;
+	queue_test_t *qt = arg;
+
+	for (i = 1; i <= max_messages; i++) {
+		while (!qt->push(qt->q, (void *) (uintptr_t) i)) sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *queue_consumer(void *arg)
+{
+	int i;
+	void *data;
+	queue_test_t *qt = arg;
+
+	for (i = 1; i <= max_messages; i++) {
+		while (!qt->pop(qt->q, &data)) sched_yield();
+
+		if ((uintptr_t) data != (uintptr_t) i) {
+			fprintf(stderr, "channel_test: %s queue returned %" PRIuPTR ", expected %d\n",
+				qt->name, (uintptr_t) data, i);
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+static void queue_compare(TALLOC_CTX *ctx)
+{
+	size_t i;
+	int fd;
+	fr_time_t start, end;
+	pthread_attr_t attr;
+	pthread_t producer_id, consumer_id;
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	for (i = 0; i < sizeof(queue_tests) / sizeof(queue_tests[0]); i++) {
+		queue_test_t *qt = &queue_tests[i];
+
+		qt->q = qt->create(ctx, max_control_plane);
+		if (!qt->q) {
+			fprintf(stderr, "channel_test: Failed creating %s queue\n", qt->name);
+			exit(1);
+		}
+
+		fd = cache_misses_open();
+		cache_misses_start(fd);
+
+		start = fr_time();
+		(void) pthread_create(&consumer_id, &attr, queue_consumer, qt);
+		(void) pthread_create(&producer_id, &attr, queue_producer, qt);
+
+		(void) pthread_join(producer_id, NULL);
+		(void) pthread_join(consumer_id, NULL);
+		end = fr_time();
+
+		rate_print(qt->name, start, end);
+		cache_misses_print(fd);
+		if (fd >= 0) close(fd);
+
+		talloc_free(qt->q);
+	}
+}
 
 int main(int argc, char *argv[])
 {
-	int c;
+	int c, fd;
 	fr_channel_t	*channel;
+	fr_time_t	start, end;
 	TALLOC_CTX	*autofree = talloc_init("main");
 	pthread_attr_t	attr;
 	pthread_t	master_id, worker_id;
 
 	fr_time_start();
 
-	while ((c = getopt(argc, argv, "c:hm:o:tx")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "c:hm:o:qtx")) != EOF) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
@@ -497,6 +693,10 @@ int main(int argc, char *argv[])
 			max_outstanding = atoi(optarg);
 			break;
 
+		case 'q':
+			queue_only = true;
+			break;
+
 		case 't':
 			touch_memory = true;
 			break;
@@ -518,6 +718,12 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
+	if (queue_only) {
+		queue_compare(autofree);
+		talloc_free(autofree);
+		return 0;
+	}
+
 	kq_master = kqueue();
 	rad_assert(kq_master >= 0);
 
@@ -548,17 +754,26 @@ int main(int argc, char *argv[])
 	(void) pthread_attr_init(&attr);
 	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	fd = cache_misses_open();
+	cache_misses_start(fd);
+
+	start = fr_time();
 	(void) pthread_create(&master_id, &attr, channel_master, channel);
 	(void) pthread_create(&worker_id, &attr, channel_worker, channel);
 
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
+	end = fr_time();
 
 	close(kq_master);
 	close(kq_worker);
 
 	fr_channel_debug(channel, stdout);
 
+	rate_print("channel", start, end);
+	cache_misses_print(fd);
+	if (fd >= 0) close(fd);
+
 	talloc_free(autofree);
 
 	return 0;
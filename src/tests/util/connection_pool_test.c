@@ -0,0 +1,237 @@
+/*
+ * connection_pool_test.c	Tests for the connection pool's thread caches
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/connection.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_created = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: connection_pool_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Connections are just numbers.  Spawning is serialised by the
+ *	pool, so the counter doesn't need a lock.
+ */
+static void *test_create(TALLOC_CTX *ctx, UNUSED void *opaque, UNUSED struct timeval const *timeout)
+{
+	int *conn;
+
+	conn = talloc(ctx, int);
+	if (!conn) return NULL;
+
+	*conn = ++num_created;
+
+	MPRINT1("Created connection %d\n", *conn);
+
+	return conn;
+}
+
+static void pool_add(CONF_SECTION *cs, char const *attr, char const *value)
+{
+	CONF_PAIR *cp;
+
+	cp = cf_pair_alloc(cs, attr, value, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	if (!rad_cond_assert(cp != NULL)) exit(1);
+	cf_pair_add(cs, cp);
+}
+
+/*
+ *	Reserve a connection in another thread, and release it to
+ *	that thread's cache.
+ */
+typedef struct connection_pool_test_thread_t {
+	fr_connection_pool_t	*pool;
+	void			*conn;		//!< The connection the thread reserved.
+	int			num_created;	//!< Connections created before the thread released its own.
+} connection_pool_test_thread_t;
+
+static void *connection_pool_test_thread(void *arg)
+{
+	connection_pool_test_thread_t *thread = arg;
+
+	thread->conn = fr_connection_get(thread->pool, NULL);
+	if (!thread->conn) return NULL;
+
+	thread->num_created = num_created;
+	fr_connection_release(thread->pool, NULL, thread->conn);
+
+	return NULL;
+}
+
+static void run_thread(connection_pool_test_thread_t *thread)
+{
+	pthread_t	pthread_id;
+
+	if (!rad_cond_assert(pthread_create(&pthread_id, NULL, connection_pool_test_thread, thread) == 0)) exit(1);
+	(void) pthread_join(pthread_id, NULL);
+}
+
+static void test_thread_cache(TALLOC_CTX *ctx)
+{
+	CONF_SECTION				*cs;
+	fr_connection_pool_t			*pool;
+	fr_connection_pool_state_t const	*state;
+	connection_pool_test_thread_t		thread;
+	void					*conn, *first;
+
+	cs = cf_section_alloc(NULL, "pool", NULL);
+	if (!rad_cond_assert(cs != NULL)) exit(1);
+
+	pool_add(cs, "start", "0");
+	pool_add(cs, "min", "0");
+	pool_add(cs, "max", "4");
+	pool_add(cs, "spare", "0");
+	pool_add(cs, "thread_cache", "2");
+
+	pool = fr_connection_pool_init(ctx, cs, ctx, test_create, NULL, "connection_pool_test");
+	if (!rad_cond_assert(pool != NULL)) exit(1);
+
+	/*
+	 *	The first reservation opens a connection.  Releasing
+	 *	it puts it in this thread's cache, where it's still
+	 *	counted as active.
+	 */
+	first = fr_connection_get(pool, NULL);
+	if (!rad_cond_assert(first != NULL)) exit(1);
+	fr_connection_release(pool, NULL, first);
+
+	state = fr_connection_pool_state(pool);
+	if (!rad_cond_assert(state->num == 1)) exit(1);
+	if (!rad_cond_assert(state->active == 1)) exit(1);
+	if (!rad_cond_assert(state->thread_caches == 1)) exit(1);
+	if (!rad_cond_assert(state->thread_cached == 1)) exit(1);
+
+	/*
+	 *	The next reservation comes from the cache.
+	 */
+	conn = fr_connection_get(pool, NULL);
+	if (!rad_cond_assert(conn == first)) exit(1);
+
+	state = fr_connection_pool_state(pool);
+	if (!rad_cond_assert(state->thread_hits == 1)) exit(1);
+	if (!rad_cond_assert(state->thread_cached == 0)) exit(1);
+
+	fr_connection_release(pool, NULL, conn);
+	MPRINT1("Cache hit test passed\n");
+
+	/*
+	 *	Another thread takes the connection from our cache,
+	 *	rather than opening a new one, even though the pool
+	 *	isn't at max.
+	 */
+	memset(&thread, 0, sizeof(thread));
+	thread.pool = pool;
+	run_thread(&thread);
+
+	if (!rad_cond_assert(thread.conn == first)) exit(1);
+	if (!rad_cond_assert(thread.num_created == 1)) exit(1);
+	MPRINT1("Steal test passed\n");
+
+	/*
+	 *	When the thread exited, the connection it had cached
+	 *	went back to the pool.
+	 */
+	state = fr_connection_pool_state(pool);
+	if (!rad_cond_assert(state->num == 1)) exit(1);
+	if (!rad_cond_assert(state->active == 0)) exit(1);
+	if (!rad_cond_assert(state->thread_caches == 1)) exit(1);
+	if (!rad_cond_assert(state->thread_cached == 0)) exit(1);
+
+	/*
+	 *	Our cache is empty, so we get it from the pool.
+	 */
+	conn = fr_connection_get(pool, NULL);
+	if (!rad_cond_assert(conn == first)) exit(1);
+
+	state = fr_connection_pool_state(pool);
+	if (!rad_cond_assert(state->thread_misses == 1)) exit(1);
+	if (!rad_cond_assert(state->active == 1)) exit(1);
+
+	/*
+	 *	With the connection reserved, a new one has to be
+	 *	opened for the other thread.
+	 */
+	memset(&thread, 0, sizeof(thread));
+	thread.pool = pool;
+	run_thread(&thread);
+
+	if (!rad_cond_assert(thread.conn != NULL)) exit(1);
+	if (!rad_cond_assert(thread.conn != first)) exit(1);
+	if (!rad_cond_assert(num_created == 2)) exit(1);
+
+	fr_connection_release(pool, NULL, conn);
+
+	state = fr_connection_pool_state(pool);
+	if (!rad_cond_assert(state->num == 2)) exit(1);
+	if (!rad_cond_assert(state->active == 1)) exit(1);
+	if (!rad_cond_assert(state->thread_cached == 1)) exit(1);
+	MPRINT1("Thread exit test passed\n");
+
+	fr_connection_pool_free(pool);
+	talloc_free(cs);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			if (debug_lvl > 1) fr_debug_lvl = rad_debug_lvl = debug_lvl;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_thread_cache(autofree);
+
+	talloc_free(autofree);
+
+	return 0;
+}
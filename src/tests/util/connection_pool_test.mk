@@ -0,0 +1,6 @@
+TARGET := connection_pool_test
+
+SOURCES		:= connection_pool_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,187 @@
+/*
+ * event_test.c	Benchmark cross-thread wakeups through the event loop
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	Ping-pong a user event between two event lists, each
+ *	running in its own thread.  Every user callback is one
+ *	wakeup, which is what the network and worker threads pay
+ *	for every control-plane message.
+ */
+#define EVENT_TEST_IDENT (1)
+
+typedef struct event_test_thread_t {
+	int			id;		//!< 0 or 1
+	fr_event_list_t		*el;		//!< this threads event list
+	int			kq;		//!< where other threads signal us
+	size_t			wakeups;	//!< number of user callbacks we've seen
+	struct event_test_thread_t *peer;	//!< the other thread
+	pthread_t		pthread_id;
+} event_test_thread_t;
+
+static int			debug_lvl = 0;
+static size_t			max_wakeups = 1000000;
+static event_test_thread_t	threads[2];
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: event_test [OPTS]\n");
+	fprintf(stderr, "  -m <wakeups>           Number of wakeups per thread.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void event_test_user(UNUSED int kq, UNUSED struct kevent const *kev, void *ctx)
+{
+	event_test_thread_t *et = ctx;
+
+	et->wakeups++;
+	MPRINT1("%d got wakeup %zu\n", et->id, et->wakeups);
+
+	/*
+	 *	Whoever gets there first stops both loops.  The
+	 *	exit signal wakes the peer, which then sees its exit
+	 *	flag.
+	 */
+	if (et->wakeups >= max_wakeups) {
+		fr_event_loop_exit(et->el, 1);
+		fr_event_loop_exit(et->peer->el, 1);
+		return;
+	}
+
+	if (fr_event_user_trigger(et->peer->kq, EVENT_TEST_IDENT) < 0) {
+		fprintf(stderr, "event_test: Failed triggering peer: %s\n", fr_strerror());
+		exit(1);
+	}
+}
+
+static void *event_test_thread(void *arg)
+{
+	event_test_thread_t *et = arg;
+
+	MPRINT1("%d started.\n", et->id);
+
+	(void) fr_event_loop(et->el);
+
+	MPRINT1("%d exiting.\n", et->id);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i;
+	TALLOC_CTX	*autofree = talloc_init("main");
+	pthread_attr_t	attr;
+	fr_time_t	start, end;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "hm:x")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'm':
+			max_wakeups = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	for (i = 0; i < 2; i++) {
+		threads[i].id = i;
+		threads[i].peer = &threads[1 - i];
+
+		threads[i].el = fr_event_list_alloc(autofree, NULL, NULL);
+		if (!threads[i].el) {
+			fprintf(stderr, "event_test: Failed creating event list\n");
+			exit(1);
+		}
+
+		threads[i].kq = fr_event_list_kq(threads[i].el);
+		rad_assert(threads[i].kq >= 0);
+
+		if (fr_event_user_listen(threads[i].kq, EVENT_TEST_IDENT) < 0) {
+			fprintf(stderr, "event_test: Failed adding user event: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		(void) fr_event_user_insert(threads[i].el, event_test_user, &threads[i]);
+	}
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	for (i = 0; i < 2; i++) {
+		(void) pthread_create(&threads[i].pthread_id, &attr, event_test_thread, &threads[i]);
+	}
+
+	/*
+	 *	Serve the first ball.
+	 */
+	start = fr_time();
+	(void) fr_event_user_trigger(threads[0].kq, EVENT_TEST_IDENT);
+
+	for (i = 0; i < 2; i++) {
+		(void) pthread_join(threads[i].pthread_id, NULL);
+	}
+	end = fr_time();
+
+#ifdef WITH_EVENT_EPOLL
+	printf("backend = epoll\n");
+#else
+	printf("backend = kqueue\n");
+#endif
+	printf("wakeups = %zu\n", threads[0].wakeups + threads[1].wakeups);
+	printf("elapsed = %" PRIu64 "ns\n", end - start);
+	if (end > start) {
+		printf("wakeups/s = %" PRIu64 "\n",
+		       ((uint64_t) (threads[0].wakeups + threads[1].wakeups) * NANOSEC) / (end - start));
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * exfile_test.c	Benchmark many threads writing to many files via exfile
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/exfile.h>
+#include <freeradius-devel/io/time.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	Each thread appends lines to files picked at random, the
+ *	way rlm_detail does with one detail file per NAS.
+ */
+typedef struct exfile_test_thread_t {
+	int			id;
+	uint32_t		seed;		//!< for picking files
+	int			errors;
+	pthread_t		pthread_id;
+} exfile_test_thread_t;
+
+static int		debug_lvl = 0;
+static int		num_threads = 8;
+static int		num_files = 2000;
+static int		num_writes = 20000;
+static int		max_entries = 256;
+static char const	*dir = NULL;
+static exfile_t		*ef;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: exfile_test [OPTS]\n");
+	fprintf(stderr, "  -d <dir>               Directory to write files to.\n");
+	fprintf(stderr, "  -e <num>               Number of file descriptors to cache.\n");
+	fprintf(stderr, "  -f <num>               Number of files.\n");
+	fprintf(stderr, "  -n <num>               Number of writes per thread.\n");
+	fprintf(stderr, "  -t <num>               Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static uint32_t exfile_test_rand(uint32_t *seed)
+{
+	/*
+	 *	xorshift.  We don't want the threads contending
+	 *	on a shared random pool.
+	 */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	return *seed;
+}
+
+static void *exfile_test_thread(void *arg)
+{
+	exfile_test_thread_t	*thread = arg;
+	int			i, fd;
+	char			filename[PATH_MAX];
+	char			line[64];
+	size_t			len;
+
+	len = snprintf(line, sizeof(line), "thread %d\n", thread->id);
+
+	for (i = 0; i < num_writes; i++) {
+		snprintf(filename, sizeof(filename), "%s/nas-%u/detail", dir,
+			 exfile_test_rand(&thread->seed) % num_files);
+
+		fd = exfile_open(ef, NULL, filename, 0600, true);
+		if (fd < 0) {
+			fprintf(stderr, "exfile_test: Failed opening %s: %s\n", filename, fr_strerror());
+			thread->errors++;
+			continue;
+		}
+
+		if (write(fd, line, len) != (ssize_t) len) {
+			fprintf(stderr, "exfile_test: Failed writing %s: %s\n", filename, fr_syserror(errno));
+			thread->errors++;
+		}
+
+		if (exfile_close(ef, NULL, fd) < 0) {
+			fprintf(stderr, "exfile_test: Failed closing %s: %s\n", filename, fr_strerror());
+			thread->errors++;
+		}
+	}
+
+	MPRINT1("Thread %d finished\n", thread->id);
+
+	return NULL;
+}
+
+/*
+ *	Every line must have made it to a file, and no line may
+ *	have been interleaved with another.
+ */
+static int exfile_test_verify(void)
+{
+	int		i;
+	size_t		lines = 0;
+	char		filename[PATH_MAX];
+	char		buffer[64];
+	FILE		*fp;
+
+	for (i = 0; i < num_files; i++) {
+		snprintf(filename, sizeof(filename), "%s/nas-%u/detail", dir, i);
+
+		fp = fopen(filename, "r");
+		if (!fp) continue;
+
+		while (fgets(buffer, sizeof(buffer), fp)) {
+			if (strncmp(buffer, "thread ", 7) != 0) {
+				fprintf(stderr, "exfile_test: Corrupt line in %s: %s", filename, buffer);
+				fclose(fp);
+				return -1;
+			}
+			lines++;
+		}
+		fclose(fp);
+
+		unlink(filename);
+		snprintf(filename, sizeof(filename), "%s/nas-%u", dir, i);
+		rmdir(filename);
+	}
+
+	if (lines != ((size_t) num_threads * num_writes)) {
+		fprintf(stderr, "exfile_test: Expected %zu lines, got %zu\n",
+			(size_t) num_threads * num_writes, lines);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i, errors = 0;
+	char			tmpdir[] = "/tmp/exfile_test.XXXXXX";
+	exfile_test_thread_t	*threads;
+	pthread_attr_t		attr;
+	fr_time_t		start, end;
+	TALLOC_CTX		*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "d:e:f:hn:t:x")) != EOF) switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+
+		case 'e':
+			max_entries = atoi(optarg);
+			if (max_entries <= 0) usage();
+			break;
+
+		case 'f':
+			num_files = atoi(optarg);
+			if (num_files <= 0) usage();
+			break;
+
+		case 'n':
+			num_writes = atoi(optarg);
+			if (num_writes <= 0) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!dir) {
+		dir = mkdtemp(tmpdir);
+		if (!dir) {
+			fprintf(stderr, "exfile_test: Failed creating temporary directory: %s\n", fr_syserror(errno));
+			exit(1);
+		}
+	}
+
+	ef = exfile_init(autofree, max_entries, 30, true);
+	if (!ef) {
+		fprintf(stderr, "exfile_test: Failed creating exfile handle\n");
+		exit(1);
+	}
+
+	threads = talloc_zero_array(autofree, exfile_test_thread_t, num_threads);
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	start = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].seed = (2654435761U * (i + 1)) | 1;
+		(void) pthread_create(&threads[i].pthread_id, &attr, exfile_test_thread, &threads[i]);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		(void) pthread_join(threads[i].pthread_id, NULL);
+		errors += threads[i].errors;
+	}
+	end = fr_time();
+
+	talloc_free(ef);
+
+	printf("threads = %d  files = %d  entries = %d\n", num_threads, num_files, max_entries);
+	printf("writes = %d\n", num_threads * num_writes);
+	printf("elapsed = %" PRIu64 "ns\n", end - start);
+	if (end > start) {
+		printf("writes/s = %" PRIu64 "\n", ((uint64_t) num_threads * num_writes * NANOSEC) / (end - start));
+	}
+
+	if (exfile_test_verify() < 0) errors++;
+	if (dir == tmpdir) rmdir(tmpdir);
+
+	talloc_free(autofree);
+
+	if (errors) {
+		fprintf(stderr, "exfile_test: %d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * lpm_test.c	Tests and benchmarks for the longest prefix match tables
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/lpm.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_clients = 50000;
+static int		num_lookups = 1000000;
+static uint32_t		seed = 0x12345678;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: lpm_test [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Number of clients for the benchmark.\n");
+	fprintf(stderr, "  -n <num>               Number of lookups for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static uint32_t lpm_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+/*
+ *	Addresses are drawn from a few networks, so that the prefixes
+ *	nest inside each other.
+ */
+static void make_ipaddr(fr_ipaddr_t *ipaddr, int af, uint8_t prefix)
+{
+	int i;
+
+	memset(ipaddr, 0, sizeof(*ipaddr));
+	ipaddr->af = af;
+
+	if (af == AF_INET) {
+		ipaddr->addr.v4.s_addr = htonl(((0x0a + (lpm_rand() & 0x03)) << 24) | (lpm_rand() & 0x00ffffff));
+	} else {
+		ipaddr->addr.v6.s6_addr[0] = 0x20;
+		ipaddr->addr.v6.s6_addr[1] = 0x01;
+		ipaddr->addr.v6.s6_addr[2] = lpm_rand() & 0x03;
+		for (i = 3; i < 16; i++) ipaddr->addr.v6.s6_addr[i] = lpm_rand();
+	}
+
+	fr_ipaddr_mask(ipaddr, prefix);
+}
+
+typedef struct {
+	fr_ipaddr_t	ipaddr;
+	bool		present;
+} lpm_entry_t;
+
+/*
+ *	The slow way.
+ */
+static lpm_entry_t *lpm_reference(lpm_entry_t *entries, int num, fr_ipaddr_t const *ipaddr)
+{
+	int		i;
+	fr_ipaddr_t	masked;
+	lpm_entry_t	*best = NULL;
+
+	for (i = 0; i < num; i++) {
+		if (!entries[i].present) continue;
+		if (entries[i].ipaddr.af != ipaddr->af) continue;
+		if (entries[i].ipaddr.prefix > ipaddr->prefix) continue;
+		if (best && (best->ipaddr.prefix >= entries[i].ipaddr.prefix)) continue;
+
+		masked = *ipaddr;
+		fr_ipaddr_mask(&masked, entries[i].ipaddr.prefix);
+		if (fr_ipaddr_cmp(&masked, &entries[i].ipaddr) != 0) continue;
+
+		best = &entries[i];
+	}
+
+	return best;
+}
+
+static void lpm_verify(fr_lpm_t *lpm, lpm_entry_t *entries, int num, int queries)
+{
+	int		i, present = 0;
+	fr_ipaddr_t	ipaddr;
+	lpm_entry_t	*entry;
+
+	for (i = 0; i < num; i++) {
+		if (!entries[i].present) {
+			if (!rad_cond_assert(fr_lpm_find_exact(lpm, &entries[i].ipaddr) != &entries[i])) exit(1);
+			continue;
+		}
+
+		if (!rad_cond_assert(fr_lpm_find_exact(lpm, &entries[i].ipaddr) == &entries[i])) exit(1);
+		if (!rad_cond_assert(fr_lpm_find(lpm, &entries[i].ipaddr) == &entries[i])) exit(1);
+		present++;
+	}
+	if (!rad_cond_assert(fr_lpm_num_entries(lpm) == (uint32_t) present)) exit(1);
+
+	/*
+	 *	Mostly hosts, and sometimes networks.
+	 */
+	for (i = 0; i < queries; i++) {
+		int af = (lpm_rand() & 0x01) ? AF_INET : AF_INET6;
+		int max = (af == AF_INET) ? 32 : 128;
+
+		make_ipaddr(&ipaddr, af, max);
+		if ((lpm_rand() & 0x03) == 0) fr_ipaddr_mask(&ipaddr, lpm_rand() % (max + 1));
+
+		entry = lpm_reference(entries, num, &ipaddr);
+		if (!rad_cond_assert(fr_lpm_find(lpm, &ipaddr) == entry)) exit(1);
+	}
+}
+
+/*
+ *	Random prefixes of mixed lengths, checked against a linear
+ *	search.  Then remove half of them, and check again.
+ */
+static void test_random(TALLOC_CTX *ctx, int num)
+{
+	int		i;
+	fr_lpm_t	*lpm;
+	lpm_entry_t	*entries;
+
+	lpm = fr_lpm_create(ctx);
+	if (!rad_cond_assert(lpm != NULL)) exit(1);
+
+	entries = talloc_zero_array(ctx, lpm_entry_t, num);
+	if (!rad_cond_assert(entries != NULL)) exit(1);
+
+	for (i = 0; i < num; i++) {
+		int af = (lpm_rand() & 0x01) ? AF_INET : AF_INET6;
+
+		make_ipaddr(&entries[i].ipaddr, af, lpm_rand() % ((af == AF_INET) ? 33 : 129));
+
+		/*
+		 *	Duplicates are refused.
+		 */
+		if (fr_lpm_find_exact(lpm, &entries[i].ipaddr)) {
+			if (!rad_cond_assert(fr_lpm_insert(lpm, &entries[i].ipaddr, &entries[i]) < 0)) exit(1);
+			continue;
+		}
+
+		if (!rad_cond_assert(fr_lpm_insert(lpm, &entries[i].ipaddr, &entries[i]) == 0)) exit(1);
+		entries[i].present = true;
+	}
+
+	lpm_verify(lpm, entries, num, 10000);
+
+	for (i = 0; i < num; i += 2) {
+		if (!entries[i].present) continue;
+
+		if (!rad_cond_assert(fr_lpm_remove(lpm, &entries[i].ipaddr) == &entries[i])) exit(1);
+		if (!rad_cond_assert(fr_lpm_remove(lpm, &entries[i].ipaddr) == NULL)) exit(1);
+		entries[i].present = false;
+	}
+
+	lpm_verify(lpm, entries, num, 10000);
+
+	/*
+	 *	And put them back again.
+	 */
+	for (i = 0; i < num; i += 2) {
+		if (fr_lpm_find_exact(lpm, &entries[i].ipaddr)) continue;
+
+		if (!rad_cond_assert(fr_lpm_insert(lpm, &entries[i].ipaddr, &entries[i]) == 0)) exit(1);
+		entries[i].present = true;
+	}
+
+	lpm_verify(lpm, entries, num, 10000);
+
+	talloc_free(entries);
+	talloc_free(lpm);
+}
+
+static int ipaddr_cmp(void const *one, void const *two)
+{
+	return fr_ipaddr_cmp(one, two);
+}
+
+/*
+ *	Mostly hosts, with some networks of various sizes, the way a
+ *	large clients file looks.  Compare against one tree per
+ *	prefix length, which is how client_find() used to work.
+ */
+static void test_benchmark(TALLOC_CTX *ctx)
+{
+	int		i, prefix, min_prefix = 32, found = 0;
+	fr_lpm_t	*lpm;
+	fr_ipaddr_t	*entries, ipaddr;
+	rbtree_t	*trees[33];
+	fr_time_t	start, end;
+
+	lpm = fr_lpm_create(ctx);
+	if (!rad_cond_assert(lpm != NULL)) exit(1);
+
+	entries = talloc_array(ctx, fr_ipaddr_t, num_clients);
+	if (!rad_cond_assert(entries != NULL)) exit(1);
+
+	memset(trees, 0, sizeof(trees));
+
+	for (i = 0; i < num_clients; i++) {
+		uint32_t r = lpm_rand() % 100;
+
+		if (r < 70) {
+			prefix = 32;
+		} else if (r < 90) {
+			prefix = 24 + (lpm_rand() % 8);
+		} else {
+			prefix = 8 + (lpm_rand() % 16);
+		}
+
+		make_ipaddr(&entries[i], AF_INET, prefix);
+		if (fr_lpm_find_exact(lpm, &entries[i])) continue;
+
+		if (!rad_cond_assert(fr_lpm_insert(lpm, &entries[i], &entries[i]) == 0)) exit(1);
+
+		if (!trees[prefix]) {
+			trees[prefix] = rbtree_create(ctx, ipaddr_cmp, NULL, 0);
+			if (!rad_cond_assert(trees[prefix] != NULL)) exit(1);
+		}
+		if (!rad_cond_assert(rbtree_insert(trees[prefix], &entries[i]))) exit(1);
+
+		if (prefix < min_prefix) min_prefix = prefix;
+	}
+
+	start = fr_time();
+	for (i = 0; i < num_lookups; i++) {
+		ipaddr = entries[lpm_rand() % num_clients];
+		ipaddr.addr.v4.s_addr |= htonl(lpm_rand() & ((((uint32_t) 1) << (32 - ipaddr.prefix)) - 1));
+		ipaddr.prefix = 32;
+
+		if (fr_lpm_find(lpm, &ipaddr)) found++;
+	}
+	end = fr_time();
+
+	printf("prefixes = %u  lookups = %d  found = %d\n", fr_lpm_num_entries(lpm), num_lookups, found);
+	if (end > start) printf("lpm lookups/s = %" PRIu64 "\n", ((uint64_t) num_lookups * NANOSEC) / (end - start));
+
+	found = 0;
+	start = fr_time();
+	for (i = 0; i < num_lookups; i++) {
+		fr_ipaddr_t masked;
+
+		ipaddr = entries[lpm_rand() % num_clients];
+		ipaddr.addr.v4.s_addr |= htonl(lpm_rand() & ((((uint32_t) 1) << (32 - ipaddr.prefix)) - 1));
+		ipaddr.prefix = 32;
+
+		for (prefix = 32; prefix >= min_prefix; prefix--) {
+			if (!trees[prefix]) continue;
+
+			masked = ipaddr;
+			fr_ipaddr_mask(&masked, prefix);
+			if (rbtree_finddata(trees[prefix], &masked)) {
+				found++;
+				break;
+			}
+		}
+	}
+	end = fr_time();
+
+	printf("rbtree lookups = %d  found = %d\n", num_lookups, found);
+	if (end > start) printf("rbtree lookups/s = %" PRIu64 "\n", ((uint64_t) num_lookups * NANOSEC) / (end - start));
+
+	for (prefix = 0; prefix <= 32; prefix++) talloc_free(trees[prefix]);
+	talloc_free(entries);
+	talloc_free(lpm);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:hn:x")) != EOF) switch (c) {
+		case 'c':
+			num_clients = atoi(optarg);
+			if (num_clients <= 0) usage();
+			break;
+
+		case 'n':
+			num_lookups = atoi(optarg);
+			if (num_lookups <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	/*
+	 *	Below, and then above the size where the IPv4 table
+	 *	is used.
+	 */
+	test_random(autofree, 40);
+	test_random(autofree, 2000);
+	MPRINT1("Random tests passed\n");
+
+	test_benchmark(autofree);
+
+	talloc_free(autofree);
+
+	return 0;
+}
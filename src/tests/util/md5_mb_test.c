@@ -0,0 +1,496 @@
+/*
+ * md5_mb_test.c	Tests and benchmarks for multi-buffer MD5, precomputed keys, and batched RADIUS signing
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#ifndef RADIUS_HDR_LEN
+#  define RADIUS_HDR_LEN	(20)
+#endif
+
+#define NUM_PACKETS	(256)
+#define PACKET_SIZE	(256)
+
+static int		debug_lvl = 0;
+static int		num_loops = 2000;
+static int		batch_size = 32;
+
+static uint8_t		packets[NUM_PACKETS][PACKET_SIZE];
+static uint8_t		expected[NUM_PACKETS][PACKET_SIZE];
+static uint8_t		originals[NUM_PACKETS][RADIUS_HDR_LEN];
+static fr_radius_batch_t batch[NUM_PACKETS];
+
+static char const	*engines[] = { "avx2", "vector", "scalar", NULL };
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: md5_mb_test [OPTS]\n");
+	fprintf(stderr, "  -b <num>               Number of packets to sign in one batch.\n");
+	fprintf(stderr, "  -n <num>               Number of times to sign all packets, for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	RFC 1321 and RFC 2104 test vectors.
+ */
+static void test_vectors(void)
+{
+	int		i;
+	uint8_t		digest[4][MD5_DIGEST_LENGTH];
+	uint8_t		*out[4];
+	uint8_t const	*text[4], *key[4];
+	size_t		text_len[4], key_len[4];
+	fr_md5_mb_job_t	jobs[4];
+
+	static char const *md5_in[4] = {
+		"",
+		"abc",
+		"abcdefghijklmnopqrstuvwxyz",
+		"12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+	};
+	static uint8_t const md5_out[4][MD5_DIGEST_LENGTH] = {
+		{ 0xd4, 0x1d, 0x8c, 0xd9, 0x8f, 0x00, 0xb2, 0x04, 0xe9, 0x80, 0x09, 0x98, 0xec, 0xf8, 0x42, 0x7e },
+		{ 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72 },
+		{ 0xc3, 0xfc, 0xd3, 0xd7, 0x61, 0x92, 0xe4, 0x00, 0x7d, 0xfb, 0x49, 0x6c, 0xca, 0x67, 0xe1, 0x3b },
+		{ 0x57, 0xed, 0xf4, 0xa2, 0x2b, 0xe3, 0xc9, 0x55, 0xac, 0x49, 0xda, 0x2e, 0x21, 0x07, 0xb6, 0x7a }
+	};
+
+	static uint8_t const hmac_key1[16] = {
+		0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b
+	};
+	static uint8_t const hmac_out[2][MD5_DIGEST_LENGTH] = {
+		{ 0x92, 0x94, 0x72, 0x7a, 0x36, 0x38, 0xbb, 0x1c, 0x13, 0xf4, 0x8e, 0xf8, 0x15, 0x8b, 0xfc, 0x9d },
+		{ 0x75, 0x0c, 0x78, 0x3e, 0x6a, 0xb0, 0xb5, 0x03, 0xea, 0xa8, 0x6e, 0x31, 0x0a, 0x5d, 0xb7, 0x38 }
+	};
+
+	for (i = 0; i < 4; i++) {
+		jobs[i].in[0] = (uint8_t const *) md5_in[i];
+		jobs[i].inlen[0] = strlen(md5_in[i]);
+		jobs[i].num_in = 1;
+		jobs[i].iv = NULL;
+		jobs[i].ivlen = 0;
+		jobs[i].out = digest[i];
+	}
+
+	fr_md5_mb(jobs, 4);
+	for (i = 0; i < 4; i++) {
+		if (!rad_cond_assert(memcmp(digest[i], md5_out[i], MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+
+	/*
+	 *	One job at a time goes through a different path.
+	 */
+	for (i = 0; i < 4; i++) {
+		memset(digest[i], 0, MD5_DIGEST_LENGTH);
+		fr_md5_mb(&jobs[i], 1);
+		if (!rad_cond_assert(memcmp(digest[i], md5_out[i], MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+
+	text[0] = (uint8_t const *) "Hi There";
+	text_len[0] = 8;
+	key[0] = hmac_key1;
+	key_len[0] = sizeof(hmac_key1);
+	out[0] = digest[0];
+
+	text[1] = (uint8_t const *) "what do ya want for nothing?";
+	text_len[1] = 28;
+	key[1] = (uint8_t const *) "Jefe";
+	key_len[1] = 4;
+	out[1] = digest[1];
+
+	fr_hmac_md5_mb(out, text, text_len, key, key_len, 2);
+	for (i = 0; i < 2; i++) {
+		if (!rad_cond_assert(memcmp(digest[i], hmac_out[i], MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+}
+
+/*
+ *	Hash messages of every length from 0 to 200 bytes, split into
+ *	fragments, and compare with the normal MD5 functions.
+ */
+static void test_lengths(void)
+{
+	int		i, len;
+	uint8_t		data[200];
+	uint8_t		key[100];
+	uint8_t		digest[201][MD5_DIGEST_LENGTH];
+	uint8_t		reference[MD5_DIGEST_LENGTH];
+	uint8_t		*out[201];
+	uint8_t const	*text[201], *keys[201];
+	size_t		text_len[201], key_len[201];
+	fr_md5_mb_job_t	jobs[201];
+	FR_MD5_CTX	ctx;
+
+	for (i = 0; i < (int) sizeof(data); i++) data[i] = fr_rand();
+	for (i = 0; i < (int) sizeof(key); i++) key[i] = fr_rand();
+
+	for (len = 0; len <= 200; len++) {
+		jobs[len].in[0] = data;
+		jobs[len].inlen[0] = len / 3;
+		jobs[len].in[1] = data + (len / 3);
+		jobs[len].inlen[1] = len - (len / 3);
+		jobs[len].in[2] = key;
+		jobs[len].inlen[2] = len % 17;
+		jobs[len].num_in = 3;
+		jobs[len].iv = NULL;
+		jobs[len].ivlen = 0;
+		jobs[len].out = digest[len];
+	}
+	fr_md5_mb(jobs, 201);
+
+	for (len = 0; len <= 200; len++) {
+		fr_md5_init(&ctx);
+		fr_md5_update(&ctx, data, len);
+		fr_md5_update(&ctx, key, len % 17);
+		fr_md5_final(reference, &ctx);
+
+		if (!rad_cond_assert(memcmp(digest[len], reference, MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+
+	/*
+	 *	Keys shorter and longer than one block, and repeated
+	 *	keys, which re-use the key pads.
+	 */
+	for (len = 0; len <= 200; len++) {
+		text[len] = data;
+		text_len[len] = len;
+		keys[len] = key;
+		key_len[len] = (len / 4) % sizeof(key);
+		out[len] = digest[len];
+	}
+	fr_hmac_md5_mb(out, text, text_len, keys, key_len, 201);
+
+	for (len = 0; len <= 200; len++) {
+		fr_hmac_md5(reference, data, len, key, key_len[len]);
+
+		if (!rad_cond_assert(memcmp(digest[len], reference, MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+}
+
+/*
+ *	Make some packets.  Half of them have a Message-Authenticator.
+ */
+static void make_packets(void)
+{
+	int		i, j, k, num, len;
+	uint8_t		*p;
+
+	static int const codes[] = {
+		PW_CODE_ACCESS_REQUEST, PW_CODE_ACCESS_ACCEPT, PW_CODE_ACCOUNTING_REQUEST,
+		PW_CODE_ACCOUNTING_RESPONSE, PW_CODE_COA_REQUEST, PW_CODE_DISCONNECT_ACK
+	};
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		p = packets[i];
+
+		for (j = 0; j < RADIUS_HDR_LEN; j++) originals[i][j] = fr_rand();
+		originals[i][0] = PW_CODE_ACCOUNTING_REQUEST;
+
+		len = RADIUS_HDR_LEN;
+		for (j = 0; j < len; j++) p[j] = fr_rand();
+
+		p[0] = codes[i % (sizeof(codes) / sizeof(codes[0]))];
+		p[1] = i;
+
+		/*
+		 *	Some random attributes, and maybe a
+		 *	Message-Authenticator.
+		 */
+		num = fr_rand() % ((PACKET_SIZE - RADIUS_HDR_LEN - 18) / 10);
+		for (j = 0; j < num; j++) {
+			p[len] = PW_VENDOR_SPECIFIC;
+			p[len + 1] = 10;
+			for (k = 2; k < 10; k++) p[len + k] = fr_rand();
+			len += 10;
+		}
+
+		if ((i & 0x02) != 0) {
+			p[len] = PW_MESSAGE_AUTHENTICATOR;
+			p[len + 1] = 18;
+			len += 18;
+		}
+
+		p[2] = len >> 8;
+		p[3] = len & 0xff;
+	}
+}
+
+static void make_batch(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		batch[i].packet = packets[i];
+		batch[i].original = originals[i];
+
+		/*
+		 *	A few clients, each with its own secret.
+		 */
+		batch[i].secret = (uint8_t const *) (((i % 3) == 0) ? "testing123" : "a much longer secret");
+		batch[i].secret_len = strlen((char const *) batch[i].secret);
+		batch[i].rcode = 1;
+	}
+}
+
+/*
+ *	Batched signing gives the same packets as signing them one at
+ *	a time.  Then verify them, and break a few.
+ */
+static void test_sign(void)
+{
+	int			i;
+
+	make_packets();
+	memcpy(expected, packets, sizeof(expected));
+
+	make_batch();
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		if (!rad_cond_assert(fr_radius_sign(expected[i], originals[i], batch[i].secret,
+						    batch[i].secret_len) == 0)) exit(1);
+	}
+
+	if (!rad_cond_assert(fr_radius_sign_batch(batch, NUM_PACKETS) == 0)) exit(1);
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		if (!rad_cond_assert(batch[i].rcode == 0)) exit(1);
+		if (!rad_cond_assert(memcmp(packets[i], expected[i], PACKET_SIZE) == 0)) exit(1);
+	}
+
+	if (!rad_cond_assert(fr_radius_verify_batch(batch, NUM_PACKETS) == 0)) exit(1);
+	for (i = 0; i < NUM_PACKETS; i++) {
+		if (!rad_cond_assert(batch[i].rcode == 0)) exit(1);
+	}
+
+	/*
+	 *	Wrong secret, for the packets with a Message-Authenticator.
+	 */
+	for (i = 0; i < NUM_PACKETS; i += 7) {
+		batch[i].secret = (uint8_t const *) "wrong";
+		batch[i].secret_len = 5;
+	}
+
+	if (!rad_cond_assert(fr_radius_verify_batch(batch, NUM_PACKETS) < 0)) exit(1);
+	for (i = 0; i < NUM_PACKETS; i++) {
+		bool bad = ((i % 7) == 0) && ((i & 0x02) != 0);
+
+		if (!rad_cond_assert((batch[i].rcode < 0) == bad)) exit(1);
+
+		/*
+		 *	A failed verification restores the packet.
+		 */
+		if (!rad_cond_assert(memcmp(packets[i], expected[i], PACKET_SIZE) == 0)) exit(1);
+	}
+}
+
+/*
+ *	Precomputed keys give the same results as hashing the key
+ *	every time.
+ */
+static void test_keys(void)
+{
+	int			i;
+	size_t			len;
+	uint8_t			key[100], text[100];
+	uint8_t			digest[MD5_DIGEST_LENGTH], reference[MD5_DIGEST_LENGTH];
+	FR_MD5_CTX		context;
+	fr_md5_key_t		mk[2];
+
+	for (i = 0; i < (int) sizeof(key); i++) {
+		key[i] = fr_rand();
+		text[i] = fr_rand();
+	}
+
+	/*
+	 *	Short keys, keys which fill the pad, and keys which
+	 *	are hashed before they're used.
+	 */
+	for (len = 0; len <= sizeof(key); len++) {
+		fr_md5_key_init(&mk[0], key, len);
+		if (!rad_cond_assert(mk[0].key == key)) exit(1);
+		if (!rad_cond_assert(mk[0].key_len == len)) exit(1);
+
+		fr_hmac_md5(reference, text, sizeof(text) - len, key, len);
+		fr_hmac_md5_key(digest, text, sizeof(text) - len, &mk[0]);
+		if (!rad_cond_assert(memcmp(digest, reference, MD5_DIGEST_LENGTH) == 0)) exit(1);
+
+		fr_md5_init(&context);
+		fr_md5_update(&context, key, len);
+		fr_md5_update(&context, text, 16);
+		fr_md5_final(reference, &context);
+
+		fr_md5_copy(&context, &mk[0].prefix);
+		fr_md5_update(&context, text, 16);
+		fr_md5_final(digest, &context);
+		if (!rad_cond_assert(memcmp(digest, reference, MD5_DIGEST_LENGTH) == 0)) exit(1);
+	}
+
+	make_packets();
+	memcpy(expected, packets, sizeof(expected));
+
+	fr_md5_key_init(&mk[0], (uint8_t const *) "testing123", 10);
+	fr_md5_key_init(&mk[1], (uint8_t const *) "a much longer secret", 20);
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		fr_md5_key_t const *k = &mk[(i % 3) != 0];
+
+		if (!rad_cond_assert(fr_radius_sign(expected[i], originals[i], k->key, k->key_len) == 0)) exit(1);
+		if (!rad_cond_assert(fr_radius_sign_key(packets[i], originals[i], k) == 0)) exit(1);
+		if (!rad_cond_assert(memcmp(packets[i], expected[i], PACKET_SIZE) == 0)) exit(1);
+
+		if (!rad_cond_assert(fr_radius_verify_key(packets[i], originals[i], k) == 0)) exit(1);
+		if (!rad_cond_assert(memcmp(packets[i], expected[i], PACKET_SIZE) == 0)) exit(1);
+
+		/*
+		 *	The wrong key fails for packets with a
+		 *	Message-Authenticator.
+		 */
+		k = &mk[(i % 3) == 0];
+		if (!rad_cond_assert((fr_radius_verify_key(packets[i], originals[i],
+				      k) < 0) == ((i & 0x02) != 0))) exit(1);
+		if (!rad_cond_assert(memcmp(packets[i], expected[i], PACKET_SIZE) == 0)) exit(1);
+	}
+}
+
+/*
+ *	Sign the packets over and over, one at a time, and in batches.
+ */
+static void test_benchmark(void)
+{
+	int			i, j, k;
+	fr_time_t		start, end;
+	uint64_t		num = (uint64_t) num_loops * NUM_PACKETS;
+	fr_md5_key_t		mk[NUM_PACKETS];
+
+	make_packets();
+	make_batch();
+
+	printf("packets = %" PRIu64 "  batch = %d\n", num, batch_size);
+
+	start = fr_time();
+	for (i = 0; i < num_loops; i++) {
+		for (j = 0; j < NUM_PACKETS; j++) {
+			(void) fr_radius_sign(packets[j], originals[j], batch[j].secret, batch[j].secret_len);
+		}
+	}
+	end = fr_time();
+
+	if (end > start) printf("%-8s packets/s = %" PRIu64 "\n", "single", (num * NANOSEC) / (end - start));
+
+	for (j = 0; j < NUM_PACKETS; j++) fr_md5_key_init(&mk[j], batch[j].secret, batch[j].secret_len);
+
+	start = fr_time();
+	for (i = 0; i < num_loops; i++) {
+		for (j = 0; j < NUM_PACKETS; j++) {
+			(void) fr_radius_sign_key(packets[j], originals[j], &mk[j]);
+		}
+	}
+	end = fr_time();
+
+	if (end > start) printf("%-8s packets/s = %" PRIu64 "\n", "keyed", (num * NANOSEC) / (end - start));
+
+	for (k = 0; engines[k] != NULL; k++) {
+		if (fr_md5_mb_engine_set(engines[k]) < 0) continue;
+
+		start = fr_time();
+		for (i = 0; i < num_loops; i++) {
+			for (j = 0; j < NUM_PACKETS; j += batch_size) {
+				(void) fr_radius_sign_batch(&batch[j], (NUM_PACKETS - j) < batch_size ?
+							    (NUM_PACKETS - j) : batch_size);
+			}
+		}
+		end = fr_time();
+
+		if (end > start) printf("%-8s packets/s = %" PRIu64 "\n", engines[k], (num * NANOSEC) / (end - start));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i;
+	char const	*engine;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "b:hn:x")) != EOF) switch (c) {
+		case 'b':
+			batch_size = atoi(optarg);
+			if (batch_size <= 0) usage();
+			break;
+
+		case 'n':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	engine = fr_md5_mb_engine();
+	MPRINT1("Default engine is %s\n", engine);
+
+	/*
+	 *	Run the tests with every engine this CPU supports.
+	 */
+	for (i = 0; engines[i] != NULL; i++) {
+		if (fr_md5_mb_engine_set(engines[i]) < 0) {
+			MPRINT1("Engine %s is not available\n", engines[i]);
+			continue;
+		}
+
+		test_vectors();
+		test_lengths();
+		test_sign();
+
+		MPRINT1("Engine %s passed\n", engines[i]);
+	}
+
+	test_keys();
+
+	test_benchmark();
+
+	(void) fr_md5_mb_engine_set(engine);
+
+	return 0;
+}
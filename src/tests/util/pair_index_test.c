@@ -0,0 +1,345 @@
+/*
+ * pair_index_test.c	Tests and benchmarks for indexed pair list lookups
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define NUM_PAIRS	(150)
+
+static int		debug_lvl = 0;
+static int		num_loops = 1000;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: pair_index_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to share).\n");
+	fprintf(stderr, "  -n <num>               Number of loops for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static VALUE_PAIR *add_pair(TALLOC_CTX *ctx, VALUE_PAIR **head, unsigned int attr, int8_t tag)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_pair_afrom_num(ctx, 0, attr);
+	if (!rad_cond_assert(vp != NULL)) exit(1);
+	vp->tag = tag;
+
+	fr_pair_add(head, vp);
+
+	return vp;
+}
+
+/*
+ *	Something like an accounting request, with some attributes
+ *	repeated, and some tagged attributes.
+ */
+static void make_list(TALLOC_CTX *ctx, VALUE_PAIR **head)
+{
+	int		i;
+	unsigned int	attr = 1;
+
+	for (i = 0; i < NUM_PAIRS; i++) {
+		if ((i % 10) == 0) {
+			add_pair(ctx, head, PW_TUNNEL_TYPE, (i / 10) % 4);
+			continue;
+		}
+
+		if ((i % 7) == 0) {
+			add_pair(ctx, head, PW_CLASS, TAG_ANY);
+			continue;
+		}
+
+		/*
+		 *	Skip numbers which aren't in the dictionary.
+		 */
+		while (!fr_dict_attr_by_num(NULL, 0, attr)) attr++;
+		add_pair(ctx, head, attr++, TAG_ANY);
+	}
+}
+
+/*
+ *	fr_pair_find_by_da() uses the index, so walk the list
+ *	ourselves.
+ */
+static VALUE_PAIR *walk_find(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
+{
+	VALUE_PAIR *vp;
+
+	for (vp = head; vp; vp = vp->next) {
+		if ((vp->da == da) && (!da->flags.has_tag || TAG_EQ(tag, vp->tag))) return vp;
+	}
+
+	return NULL;
+}
+
+/*
+ *	The index, and everything which uses it, must always give
+ *	the same answer as walking the list.
+ */
+static void check_all(fr_pair_list_index_t *index, VALUE_PAIR *head)
+{
+	unsigned int		attr;
+	int8_t			tag;
+	fr_dict_attr_t const	*da;
+	vp_cursor_t		cursor;
+
+	for (attr = 1; attr < 256; attr++) {
+		da = fr_dict_attr_by_num(NULL, 0, attr);
+		if (!da) continue;
+
+		if (!rad_cond_assert(fr_pair_list_index_find(index, da, TAG_ANY) == walk_find(head,
+							     da, TAG_ANY))) exit(1);
+		if (!rad_cond_assert(fr_pair_find_by_da(head, da, TAG_ANY) == walk_find(head,
+							     da, TAG_ANY))) exit(1);
+
+		fr_pair_cursor_init(&cursor, &head);
+		if (!rad_cond_assert(fr_pair_cursor_next_by_da(&cursor, da, TAG_ANY) == walk_find(head,
+							     da, TAG_ANY))) exit(1);
+	}
+
+	da = fr_dict_attr_by_num(NULL, 0, PW_TUNNEL_TYPE);
+	if (!rad_cond_assert(da != NULL)) exit(1);
+
+	for (tag = 0; tag < 5; tag++) {
+		if (!rad_cond_assert(fr_pair_list_index_find(index, da, tag) == walk_find(head, da,
+							     tag))) exit(1);
+		if (!rad_cond_assert(fr_pair_find_by_da(head, da, tag) == walk_find(head, da,
+							     tag))) exit(1);
+	}
+
+	/*
+	 *	Later pairs are found by walking on from the first.
+	 */
+	fr_pair_cursor_init(&cursor, &head);
+	for (tag = 0; fr_pair_cursor_next_by_da(&cursor, da, TAG_ANY); tag++);
+	if (!rad_cond_assert(tag == (NUM_PAIRS / 10))) exit(1);
+}
+
+static void test_index(void)
+{
+	VALUE_PAIR		*head = NULL, *vp;
+	fr_pair_list_index_t	*index;
+	TALLOC_CTX		*ctx = talloc_init("test_index");
+
+	/*
+	 *	Start with an empty list.
+	 */
+	index = fr_pair_list_index_alloc(ctx, &head);
+	if (!rad_cond_assert(index != NULL)) exit(1);
+	if (!rad_cond_assert(fr_pair_list_index_find(index, fr_dict_attr_by_num(NULL, 0, PW_USER_NAME),
+						     TAG_ANY) == NULL)) exit(1);
+
+	make_list(ctx, &head);
+	check_all(index, head);
+
+	/*
+	 *	Appended pairs are found, and duplicates don't change
+	 *	which pair is first.
+	 */
+	vp = add_pair(ctx, &head, PW_FALL_THROUGH, TAG_ANY);
+	if (!rad_cond_assert(fr_pair_list_index_find(index, vp->da, TAG_ANY) == vp)) exit(1);
+
+	vp = add_pair(ctx, &head, PW_CLASS, TAG_ANY);
+	if (!rad_cond_assert(fr_pair_list_index_find(index, vp->da, TAG_ANY) != vp)) exit(1);
+	check_all(index, head);
+
+	/*
+	 *	A new head pair means the index is rebuilt.
+	 */
+	vp = fr_pair_afrom_num(ctx, 0, PW_CLASS);
+	if (!rad_cond_assert(vp != NULL)) exit(1);
+	vp->next = head;
+	head = vp;
+	if (!rad_cond_assert(fr_pair_list_index_find(index, vp->da, TAG_ANY) == vp)) exit(1);
+	check_all(index, head);
+
+	/*
+	 *	Deleting pairs invalidates the index.  Without that,
+	 *	the index would return freed pairs.
+	 */
+	vp = fr_pair_find_by_num(head, 0, PW_FALL_THROUGH, TAG_ANY);
+	if (!rad_cond_assert(vp != NULL)) exit(1);
+	fr_pair_delete_by_num(&head, 0, PW_FALL_THROUGH, TAG_ANY);
+	if (!rad_cond_assert(fr_pair_find_by_da(head, fr_dict_attr_by_num(NULL, 0, PW_FALL_THROUGH),
+						TAG_ANY) == NULL)) exit(1);
+	check_all(index, head);
+
+	/*
+	 *	Deleting the last pair in the list, which the index
+	 *	has as its tail.
+	 */
+	vp = add_pair(ctx, &head, PW_FALL_THROUGH, TAG_ANY);
+	if (!rad_cond_assert(fr_pair_find_by_da(head, vp->da, TAG_ANY) == vp)) exit(1);
+	fr_pair_delete_by_num(&head, 0, PW_FALL_THROUGH, TAG_ANY);
+	vp = add_pair(ctx, &head, PW_FALL_THROUGH, TAG_ANY);
+	if (!rad_cond_assert(fr_pair_find_by_da(head, vp->da, TAG_ANY) == vp)) exit(1);
+	check_all(index, head);
+
+	/*
+	 *	Replaced pairs are found, and the old ones aren't.
+	 */
+	vp = fr_pair_afrom_num(ctx, 0, PW_FALL_THROUGH);
+	if (!rad_cond_assert(vp != NULL)) exit(1);
+	fr_pair_replace(&head, vp);
+	if (!rad_cond_assert(fr_pair_find_by_da(head, vp->da, TAG_ANY) == vp)) exit(1);
+	check_all(index, head);
+
+	/*
+	 *	Pairs removed with a cursor.
+	 */
+	{
+		vp_cursor_t cursor;
+
+		fr_pair_cursor_init(&cursor, &head);
+		vp = fr_pair_cursor_next_by_da(&cursor, fr_dict_attr_by_num(NULL, 0, PW_CLASS), TAG_ANY);
+		if (!rad_cond_assert(vp != NULL)) exit(1);
+		talloc_free(fr_pair_cursor_remove(&cursor));
+		check_all(index, head);
+	}
+
+	/*
+	 *	Lists without an index are walked.
+	 */
+	{
+		VALUE_PAIR *other = NULL;
+
+		vp = add_pair(ctx, &other, PW_CLASS, TAG_ANY);
+		if (!rad_cond_assert(fr_pair_find_by_da(other, vp->da, TAG_ANY) == vp)) exit(1);
+		fr_pair_list_free(&other);
+	}
+	check_all(index, head);
+
+	MPRINT1("Index tests passed\n");
+
+	talloc_free(ctx);
+}
+
+static void test_benchmark(void)
+{
+	int			i, j, found;
+	unsigned int		attr;
+	VALUE_PAIR		*head = NULL;
+	fr_dict_attr_t const	*da[256];
+	int			num_da = 0;
+	fr_pair_list_index_t	*index;
+	fr_time_t		start, end;
+	TALLOC_CTX		*ctx = talloc_init("test_benchmark");
+
+	make_list(ctx, &head);
+
+	for (attr = 1; attr < 256; attr++) {
+		da[num_da] = fr_dict_attr_by_num(NULL, 0, attr);
+		if (da[num_da]) num_da++;
+	}
+
+	for (i = 0; i < 2; i++) {
+		found = 0;
+		start = fr_time();
+
+		for (j = 0; j < num_loops; j++) {
+			int k;
+
+			/*
+			 *	One index per loop, as a module would
+			 *	allocate one per request.
+			 */
+			index = (i == 0) ? NULL : fr_pair_list_index_alloc(ctx, &head);
+
+			for (k = 0; k < num_da; k++) {
+				if (i == 0) {
+					if (fr_pair_find_by_da(head, da[k], TAG_ANY)) found++;
+				} else {
+					if (fr_pair_list_index_find(index, da[k], TAG_ANY)) found++;
+				}
+			}
+
+			talloc_free(index);
+		}
+
+		end = fr_time();
+
+		printf("%s: pairs = %d  lookups = %d  found = %d\n", (i == 0) ? "list" : "index",
+		       NUM_PAIRS, num_loops * num_da, found);
+		if (end > start) printf("\tlookups/s = %" PRIu64 "\n",
+					((uint64_t) num_loops * num_da * NANOSEC) / (end - start));
+	}
+
+	talloc_free(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*dict_dir = "share";
+	fr_dict_t	*dict = NULL;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("pair_index_test");
+		exit(1);
+	}
+
+	test_index();
+	test_benchmark();
+
+	talloc_free(autofree);
+
+	return 0;
+}
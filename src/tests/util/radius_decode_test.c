@@ -0,0 +1,367 @@
+/*
+ * radius_decode_test.c	Tests and benchmarks for decoding RADIUS packets
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#ifndef RADIUS_HDR_LEN
+#  define RADIUS_HDR_LEN	(20)
+#endif
+
+#define PACKET_SIZE	(4000)
+#define VENDOR_3GPP	(10415)
+
+static int		debug_lvl = 0;
+static int		num_packets = 1000;
+
+/*
+ *	Count calls to malloc(), so that we can see how many
+ *	allocations decoding a packet needs.  This only works where we
+ *	can call the real malloc() directly, and not under ASAN, which
+ *	has its own.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#  define COUNT_MALLOC
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t		num_malloc = 0;
+
+void *malloc(size_t size)
+{
+	num_malloc++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	num_malloc++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	num_malloc++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: radius_decode_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to share).\n");
+	fprintf(stderr, "  -n <num>               Number of packets for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static uint8_t *add_attr(uint8_t *p, uint8_t attr, void const *data, size_t len)
+{
+	p[0] = attr;
+	p[1] = len + 2;
+	memcpy(p + 2, data, len);
+
+	return p + p[1];
+}
+
+static uint8_t *add_int(uint8_t *p, uint8_t attr, uint32_t value)
+{
+	value = htonl(value);
+
+	return add_attr(p, attr, &value, sizeof(value));
+}
+
+static uint8_t *add_3gpp(uint8_t *p, uint8_t attr, void const *data, size_t len)
+{
+	uint32_t vendor = htonl(VENDOR_3GPP);
+
+	p[0] = PW_VENDOR_SPECIFIC;
+	p[1] = len + 8;
+	memcpy(p + 2, &vendor, sizeof(vendor));
+	p[6] = attr;
+	p[7] = len + 2;
+	memcpy(p + 8, data, len);
+
+	return p + p[1];
+}
+
+/*
+ *	An interim update from a GGSN, with the same set of attributes
+ *	repeated until the packet is nearly 4K.
+ */
+static size_t make_packet(uint8_t *packet)
+{
+	int		i = 0;
+	uint8_t		*p, *end;
+	uint32_t	ggsn = htonl(0xc0000201);
+	uint8_t		class[32];
+	char		buffer[64];
+
+	memset(class, 0x5a, sizeof(class));
+
+	packet[0] = PW_CODE_ACCOUNTING_REQUEST;
+	packet[1] = 1;
+	memset(packet + 4, 0, 16);
+
+	p = packet + RADIUS_HDR_LEN;
+	end = packet + PACKET_SIZE - 256;
+
+	while (p < end) {
+		snprintf(buffer, sizeof(buffer), "user%d@example.com", i);
+		p = add_attr(p, PW_USER_NAME, buffer, strlen(buffer));
+		p = add_int(p, PW_ACCT_STATUS_TYPE, 3);
+		snprintf(buffer, sizeof(buffer), "%08x-%04x", 0x12345678, i);
+		p = add_attr(p, PW_ACCT_SESSION_ID, buffer, strlen(buffer));
+		p = add_int(p, PW_ACCT_INPUT_OCTETS, 1000 * i);
+		p = add_int(p, PW_ACCT_OUTPUT_OCTETS, 2000 * i);
+		p = add_int(p, PW_ACCT_SESSION_TIME, 60 * i);
+		p = add_attr(p, PW_CALLING_STATION_ID, "447700900123", 12);
+		p = add_attr(p, PW_CALLED_STATION_ID, "internet.example.com", 20);
+		p = add_attr(p, PW_CLASS, class, sizeof(class));
+
+		p = add_3gpp(p, 1, "234150123456789", 15);	/* 3GPP-IMSI */
+		p = add_3gpp(p, 2, &ggsn, sizeof(ggsn));	/* 3GPP-Charging-ID */
+		p = add_3gpp(p, 7, &ggsn, sizeof(ggsn));	/* 3GPP-GGSN-Address */
+		p = add_3gpp(p, 8, "23415", 5);			/* 3GPP-IMSI-MCC-MNC */
+		p = add_3gpp(p, 10, "5", 1);			/* 3GPP-NSAPI */
+		p = add_3gpp(p, 12, "0", 1);			/* 3GPP-Selection-Mode */
+		p = add_3gpp(p, 13, "0800", 4);			/* 3GPP-Charging-Characteristics */
+		i++;
+	}
+
+	packet[2] = ((p - packet) >> 8) & 0xff;
+	packet[3] = (p - packet) & 0xff;
+
+	return p - packet;
+}
+
+/*
+ *	The old way, with every VALUE_PAIR and value allocated
+ *	separately from the packet.
+ */
+static int decode_pairs(RADIUS_PACKET *packet)
+{
+	uint8_t const	*p, *end;
+	vp_cursor_t	cursor;
+	fr_radius_ctx_t	packet_ctx;
+
+	memset(&packet_ctx, 0, sizeof(packet_ctx));
+	packet_ctx.vector = packet->vector;
+	packet_ctx.secret = "testing123";
+
+	fr_pair_cursor_init(&cursor, &packet->vps);
+
+	p = packet->data + RADIUS_HDR_LEN;
+	end = packet->data + packet->data_len;
+
+	while (p < end) {
+		ssize_t len;
+
+		len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal), p, end - p, &packet_ctx);
+		if (len <= 0) return -1;
+
+		p += len;
+	}
+
+	return 0;
+}
+
+static RADIUS_PACKET *packet_alloc(uint8_t *data, size_t data_len)
+{
+	RADIUS_PACKET *packet;
+
+	packet = fr_radius_alloc(NULL, false);
+	if (!rad_cond_assert(packet != NULL)) exit(1);
+
+	packet->data = data;
+	packet->data_len = data_len;
+	packet->code = data[0];
+	packet->id = data[1];
+
+	return packet;
+}
+
+/*
+ *	Both ways must give the same pairs, and the pairs must be
+ *	parented by the packet.
+ */
+static void test_decode(uint8_t *data, size_t data_len)
+{
+	int		count = 0;
+	RADIUS_PACKET	*old, *new;
+	VALUE_PAIR	*a, *b;
+	void		*pool;
+	uint8_t		*pool_end;
+
+	old = packet_alloc(data, data_len);
+	if (!rad_cond_assert(decode_pairs(old) == 0)) exit(1);
+
+	new = packet_alloc(data, data_len);
+	if (!rad_cond_assert(fr_radius_packet_decode(new, NULL, "testing123") == 0)) exit(1);
+
+	for (a = old->vps, b = new->vps; a && b; a = a->next, b = b->next) {
+		if (!rad_cond_assert(a->da == b->da)) exit(1);
+		if (!rad_cond_assert(fr_value_box_cmp(&a->data, &b->data) == 0)) exit(1);
+		if (!rad_cond_assert(talloc_parent(b) == new)) exit(1);
+		VERIFY_VP(b);
+		count++;
+	}
+	if (!rad_cond_assert(!a && !b)) exit(1);
+
+	MPRINT1("Decoded %d attributes from %zu bytes\n", count, data_len);
+
+	talloc_free(old);
+
+	/*
+	 *	Pairs must survive being moved out of the packet, and
+	 *	the packet being freed.  Pairs which are moved are
+	 *	copied out of the decode pool, so that they don't keep
+	 *	it allocated.
+	 */
+	old = fr_radius_alloc(NULL, false);
+	if (!rad_cond_assert(old != NULL)) exit(1);
+
+	pool = new->decode_pool;
+	pool_end = (uint8_t *) pool + new->decode_pool_size;
+	if (!rad_cond_assert(pool != NULL)) exit(1);
+
+	fr_pair_list_move_by_num(old, &old->vps, &new->vps, 0, 0, TAG_ANY);
+	if (!rad_cond_assert(new->vps == NULL)) exit(1);
+
+	for (b = old->vps; b; b = b->next) {
+		if (!rad_cond_assert(talloc_parent(b) == old)) exit(1);
+		if (!rad_cond_assert(((uint8_t *) b < (uint8_t *) pool) || ((uint8_t *) b >= pool_end))) exit(1);
+	}
+	talloc_free(new);
+
+	for (a = old->vps; a; a = a->next) {
+		VERIFY_VP(a);
+		count--;
+	}
+	if (!rad_cond_assert(count == 0)) exit(1);
+
+	fr_radius_free(&old);
+}
+
+static void test_benchmark(uint8_t *data, size_t data_len)
+{
+	int		i, j;
+	RADIUS_PACKET	*packet;
+	fr_time_t	start, end;
+#ifdef COUNT_MALLOC
+	uint64_t	mallocs;
+#endif
+
+	for (i = 0; i < 2; i++) {
+#ifdef COUNT_MALLOC
+		mallocs = num_malloc;
+#endif
+		start = fr_time();
+
+		for (j = 0; j < num_packets; j++) {
+			packet = packet_alloc(data, data_len);
+
+			if (i == 0) {
+				if (!rad_cond_assert(decode_pairs(packet) == 0)) exit(1);
+			} else {
+				if (!rad_cond_assert(fr_radius_packet_decode(packet, NULL, "testing123") == 0)) exit(1);
+			}
+
+			talloc_free(packet);
+		}
+
+		end = fr_time();
+
+		printf("%s: packets = %d  size = %zu\n", (i == 0) ? "per-pair" : "pool", num_packets, data_len);
+#ifdef COUNT_MALLOC
+		printf("\tallocations/packet = %.1f\n", (double) (num_malloc - mallocs) / num_packets);
+#endif
+		if (end > start) printf("\tpackets/s = %" PRIu64 "\n", ((uint64_t) num_packets * NANOSEC) / (end - start));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*dict_dir = "share";
+	fr_dict_t	*dict = NULL;
+	uint8_t		*data;
+	size_t		data_len;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("radius_decode_test");
+		exit(1);
+	}
+
+	data = talloc_array(autofree, uint8_t, PACKET_SIZE);
+	if (!rad_cond_assert(data != NULL)) exit(1);
+
+	data_len = make_packet(data);
+	if (!rad_cond_assert(data_len <= PACKET_SIZE)) exit(1);
+
+	test_decode(data, data_len);
+	MPRINT1("Decode tests passed\n");
+
+	test_benchmark(data, data_len);
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+TARGET := radius_decode_test
+
+SOURCES		:= radius_decode_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
+
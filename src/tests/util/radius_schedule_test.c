@@ -27,10 +27,18 @@ RCSID("$Id$")
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/threads.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -58,6 +66,20 @@ static int		my_port;
 static char const	*secret = "testing123";
 static fr_packet_ctx_t  packet_ctx = { 0 };
 
+/*
+ *	For the work stealing benchmark.  Worker 0 is periodically
+ *	blocked, and we record how long each request waited.
+ */
+static int			slow_interval = 0;
+static fr_time_t		slow_delay = 20 * (NANOSEC / 1000);
+static atomic_int		num_worker_threads;
+static _Thread_local int	worker_id = -1;
+static _Thread_local int	worker_processed = 0;
+
+static fr_time_t		*latency = NULL;
+static uint64_t			max_latency = 0;
+static atomic_uint_fast64_t	num_latency;
+
 /*
  *	@todo fix this...
  *
@@ -110,9 +132,39 @@ static size_t test_nak(void const *ctx, uint8_t *const packet, size_t packet_len
 static fr_transport_final_t test_process(REQUEST *request, fr_transport_action_t action)
 {
 	MPRINT1("\t\tPROCESS --- request %zd action %d\n", request->number, action);
+
+	/*
+	 *	How long the request waited before a worker got to it.
+	 */
+	if (latency) {
+		uint64_t i;
+
+		i = atomic_fetch_add_explicit(&num_latency, 1, memory_order_relaxed);
+		if (i < max_latency) latency[i] = fr_time() - request->recv_time;
+	}
+
+	/*
+	 *	Worker 0 is stuck on a slow request every so often.
+	 */
+	if (slow_interval && (worker_id == 0) && ((++worker_processed % slow_interval) == 0)) {
+		struct timespec ts;
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = slow_delay;
+		nanosleep(&ts, NULL);
+	}
+
 	return FR_TRANSPORT_REPLY;
 }
 
+static int test_worker_instantiate(UNUSED void *ctx)
+{
+	worker_id = atomic_fetch_add_explicit(&num_worker_threads, 1, memory_order_relaxed);
+	worker_processed = 0;
+
+	return 0;
+}
+
 static ssize_t test_read(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_len)
 {
 	ssize_t data_size;
@@ -132,6 +184,104 @@ static ssize_t test_read(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_l
 	return data_size;
 }
 
+static int test_recv_dgram(void *ctx, uint8_t const *buffer, size_t data_len,
+			   struct sockaddr_storage const *src, socklen_t salen)
+{
+	fr_packet_ctx_t *pc = ctx;
+
+	if (data_len < 20) return -1;
+
+	memcpy(&pc->src, src, salen);
+	pc->salen = salen;
+
+	pc->id = buffer[1];
+	memcpy(pc->vector, buffer + 4, sizeof(pc->vector));
+
+	return 0;
+}
+
+static socklen_t test_send_dgram(void const *ctx, struct sockaddr_storage *dst)
+{
+	fr_packet_ctx_t const *pc = ctx;
+
+	memcpy(dst, &pc->src, pc->salen);
+
+	return pc->salen;
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define MAX_BATCH (64)
+
+static int test_read_batch(int sockfd, void *ctx, fr_transport_dgram_t *dgram, unsigned int num)
+{
+	int i, rcode;
+	uint8_t const *packet;
+	fr_packet_ctx_t *pc = ctx;
+	struct mmsghdr msgs[MAX_BATCH];
+
+	if (num > MAX_BATCH) num = MAX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < (int) num; i++) {
+		msgs[i].msg_hdr.msg_name = &dgram[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(dgram[i].addr);
+		msgs[i].msg_hdr.msg_iov = &dgram[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	rcode = recvmmsg(sockfd, msgs, num, MSG_DONTWAIT, NULL);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+		return -1;
+	}
+
+	for (i = 0; i < rcode; i++) {
+		dgram[i].iov.iov_len = msgs[i].msg_len;
+		dgram[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+		if (msgs[i].msg_len < 20) dgram[i].iov.iov_len = 0;
+	}
+
+	if (!rcode) return 0;
+
+	/*
+	 *	The network side tracks where each packet came from.
+	 *	The packet context only holds the ID and vector, so
+	 *	we keep the ones from the last packet.
+	 */
+	packet = dgram[rcode - 1].iov.iov_base;
+	if (dgram[rcode - 1].iov.iov_len) {
+		pc->id = packet[1];
+		memcpy(pc->vector, packet + 4, sizeof(pc->vector));
+	}
+
+	return rcode;
+}
+
+static int test_write_batch(int sockfd, void *ctx, fr_transport_dgram_t *dgram, unsigned int num)
+{
+	int i;
+	fr_packet_ctx_t *pc = ctx;
+	struct mmsghdr msgs[MAX_BATCH];
+
+	if (num > MAX_BATCH) num = MAX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < (int) num; i++) {
+		if (dgram[i].addrlen) {
+			msgs[i].msg_hdr.msg_name = &dgram[i].addr;
+			msgs[i].msg_hdr.msg_namelen = dgram[i].addrlen;
+		} else {
+			msgs[i].msg_hdr.msg_name = &pc->src;
+			msgs[i].msg_hdr.msg_namelen = pc->salen;
+		}
+		msgs[i].msg_hdr.msg_iov = &dgram[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return sendmmsg(sockfd, msgs, num, 0);
+}
+#endif
+
 
 static ssize_t test_write(int sockfd, void *ctx, uint8_t *buffer, size_t buffer_len)
 {
@@ -157,6 +307,8 @@ static fr_transport_t transport = {
 	.default_message_size = 4096,
 	.read = test_read,
 	.write = test_write,
+	.recv_dgram = test_recv_dgram,
+	.send_dgram = test_send_dgram,
 	.decode = test_decode,
 	.encode = test_encode,
 	.nak = test_nak,
@@ -165,12 +317,228 @@ static fr_transport_t transport = {
 
 static fr_transport_t *transports = &transport;
 
+static int test_socket(void)
+{
+	int sockfd;
+
+	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
+	if (sockfd < 0) {
+		fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
+		fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	return sockfd;
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define WINDOW (256)
+
+/*
+ *	Send packets to the server as fast as it answers them, keeping
+ *	up to WINDOW packets outstanding.  Packets which haven't been
+ *	answered after 100ms are counted as lost.
+ */
+static uint64_t test_load(uint64_t num_packets, uint64_t *lost)
+{
+	int sockfd;
+	uint64_t sent, received;
+	uint8_t packet[20];
+	uint8_t reply[4096];
+	struct sockaddr_in sin;
+	struct pollfd pfd;
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0) {
+		fprintf(stderr, "radius_test: Failed creating client socket: %s\n", fr_syserror(errno));
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(my_port);
+	sin.sin_addr = my_ipaddr.addr.v4;
+
+	if (connect(sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		fprintf(stderr, "radius_test: Failed connecting client socket: %s\n", fr_syserror(errno));
+		exit(1);
+	}
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = PW_CODE_ACCESS_REQUEST;
+	packet[3] = sizeof(packet);
+
+	sent = received = *lost = 0;
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+
+	while ((received + *lost) < num_packets) {
+		while ((sent < num_packets) && ((sent - received - *lost) < WINDOW)) {
+			packet[1] = sent & 0xff;
+			memcpy(packet + 4, &sent, sizeof(sent));
+
+			if (send(sockfd, packet, sizeof(packet), 0) < 0) break;
+			sent++;
+		}
+
+		if (poll(&pfd, 1, 100) <= 0) {
+			*lost += sent - received - *lost;
+			continue;
+		}
+
+		while (recv(sockfd, reply, sizeof(reply), MSG_DONTWAIT) > 0) received++;
+	}
+
+	close(sockfd);
+
+	return received;
+}
+
+/*
+ *	Run the scheduler with one batch size, and print how fast it
+ *	answered packets.
+ */
+static void test_batch(TALLOC_CTX *ctx, int num_networks, int num_workers, unsigned int batch_size, bool uring,
+		       bool coalesce, uint64_t num_packets)
+{
+	int sockfd;
+	fr_schedule_t *sched;
+	fr_time_t start, end;
+	uint64_t received, lost;
+	double elapsed;
+
+	transport.batch_size = batch_size;
+	transport.read_batch = test_read_batch;
+	transport.write_batch = test_write_batch;
+
+	if (uring) {
+		transport.recv_dgram = test_recv_dgram;
+		transport.send_dgram = test_send_dgram;
+	} else {
+		transport.recv_dgram = NULL;
+		transport.send_dgram = NULL;
+	}
+
+	sched = fr_schedule_create(ctx, &default_log, num_networks, num_workers, 1, &transports, NULL, NULL);
+	if (!sched) {
+		fprintf(stderr, "radius_test: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	fr_schedule_signal_coalesce(sched, coalesce);
+
+	sockfd = test_socket();
+	packet_ctx.sockfd = sockfd;
+
+	(void) fr_schedule_socket_add(sched, sockfd, &packet_ctx, &transport);
+
+	start = fr_time();
+	received = test_load(num_packets, &lost);
+	end = fr_time();
+
+	(void) fr_schedule_destroy(sched);
+	close(sockfd);
+
+	elapsed = ((double) (end - start)) / NANOSEC;
+
+	if (uring) {
+		printf("%-10s", "io_uring");
+	} else if (coalesce) {
+		printf("%-10s", "coalesced");
+	} else {
+		printf("%-10u", batch_size);
+	}
+	printf("%10" PRIu64 " %10" PRIu64 " %10.3f %12.0f\n", received, lost, elapsed, received / elapsed);
+}
+
+static int latency_cmp(void const *one, void const *two)
+{
+	fr_time_t a = *(fr_time_t const *) one;
+	fr_time_t b = *(fr_time_t const *) two;
+
+	if (a < b) return -1;
+	if (a > b) return +1;
+
+	return 0;
+}
+
+/*
+ *	Run the scheduler with one worker which is periodically
+ *	blocked, and print the distribution of time that requests
+ *	waited before a worker started processing them.
+ */
+static void test_steal(TALLOC_CTX *ctx, int num_networks, int num_workers, bool stealing, uint64_t num_packets)
+{
+	int sockfd;
+	fr_schedule_t *sched;
+	uint64_t received, lost, num, stolen;
+
+	transport.batch_size = 0;
+	transport.read_batch = NULL;
+	transport.write_batch = NULL;
+	transport.recv_dgram = NULL;
+	transport.send_dgram = NULL;
+
+	latency = talloc_array(ctx, fr_time_t, num_packets);
+	max_latency = num_packets;
+	atomic_store(&num_latency, 0);
+	atomic_store(&num_worker_threads, 0);
+
+	sched = fr_schedule_create(ctx, &default_log, num_networks, num_workers, 1, &transports,
+				   test_worker_instantiate, NULL);
+	if (!sched) {
+		fprintf(stderr, "radius_test: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	fr_schedule_work_stealing(sched, stealing);
+
+	sockfd = test_socket();
+	packet_ctx.sockfd = sockfd;
+
+	(void) fr_schedule_socket_add(sched, sockfd, &packet_ctx, &transport);
+
+	received = test_load(num_packets, &lost);
+	stolen = fr_schedule_num_stolen(sched);
+
+	(void) fr_schedule_destroy(sched);
+	close(sockfd);
+
+	num = atomic_load(&num_latency);
+	if (num > max_latency) num = max_latency;
+	if (!num) {
+		fprintf(stderr, "radius_test: No requests were processed\n");
+		exit(1);
+	}
+
+	qsort(latency, num, sizeof(latency[0]), latency_cmp);
+
+#define PCT(_x) ((double) latency[(uint64_t) ((num - 1) * (_x))] / 1000)
+
+	printf("%-10s%10" PRIu64 " %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10" PRIu64 "\n",
+	       stealing ? "yes" : "no", received, lost,
+	       PCT(0.5), PCT(0.99), PCT(0.999), PCT(1.0), stolen);
+
+	TALLOC_FREE(latency);
+	max_latency = 0;
+}
+#endif
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark batched reads and writes.\n");
+	fprintf(stderr, "  -S                     Benchmark work stealing, with one worker periodically blocked.\n");
+	fprintf(stderr, "  -C                     Benchmark signaling workers once per batch, instead of per packet.\n");
+	fprintf(stderr, "  -c <num>               Send num packets for each benchmark.\n");
 	fprintf(stderr, "  -n <num>               Start num network threads\n");
 	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
 	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
+	fprintf(stderr, "  -w <num>               Start num worker threads\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 	exit(1);
@@ -183,6 +551,10 @@ int main(int argc, char *argv[])
 	int num_workers = 2;
 	uint16_t	port16 = 0;
 	int sockfd;
+	bool		benchmark = false;
+	bool		steal = false;
+	bool		coalesce = false;
+	uint64_t	num_packets = 100000;
 	TALLOC_CTX	*autofree = talloc_init("main");
 	fr_schedule_t	*sched;
 
@@ -197,7 +569,20 @@ int main(int argc, char *argv[])
 	my_ipaddr.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
 	my_port = 1812;
 
-	while ((c = getopt(argc, argv, "i:n:s:w:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "bCc:i:n:Ss:w:x")) != EOF) switch (c) {
+		case 'b':
+			benchmark = true;
+			break;
+
+		case 'C':
+			coalesce = true;
+			break;
+
+		case 'c':
+			num_packets = strtoull(optarg, NULL, 10);
+			if (!num_packets) usage();
+			break;
+
 		case 'i':
 			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
 				fprintf(stderr, "Failed parsing ipaddr: %s\n", fr_strerror());
@@ -211,6 +596,10 @@ int main(int argc, char *argv[])
 			if ((num_networks <= 0) || (num_networks > 16)) usage();
 			break;
 
+		case 'S':
+			steal = true;
+			break;
+
 		case 's':
 			secret = optarg;
 			break;
@@ -235,23 +624,87 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, 1, &transports, NULL, NULL);
-	if (!sched) {
-		fprintf(stderr, "schedule_test: Failed to create scheduler\n");
+	if (steal) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+		/*
+		 *	Only print the results.
+		 */
+		default_log.dst = L_DST_NULL;
+
+		/*
+		 *	We need at least one worker to steal from, and
+		 *	one to do the stealing.
+		 */
+		if (num_workers < 2) num_workers = 4;
+		slow_interval = 50;
+
+		printf("%-10s%10s %10s %10s %10s %10s %10s %10s\n", "stealing", "replies", "lost",
+		       "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "stolen");
+
+		test_steal(autofree, num_networks, num_workers, false, num_packets);
+		test_steal(autofree, num_networks, num_workers, true, num_packets);
+
+		talloc_free(autofree);
+		return 0;
+#else
+		fprintf(stderr, "radius_test: The work stealing benchmark is not supported on this system\n");
 		exit(1);
+#endif
 	}
 
-	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
-	if (sockfd < 0) {
-		fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
+	if (coalesce) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+		/*
+		 *	Only print the results.
+		 */
+		default_log.dst = L_DST_NULL;
+
+		printf("%-10s%10s %10s %10s %12s\n", "batch", "replies", "lost", "seconds", "packets/s");
+
+		test_batch(autofree, num_networks, num_workers, 32, false, false, num_packets);
+		test_batch(autofree, num_networks, num_workers, 32, false, true, num_packets);
+
+		talloc_free(autofree);
+		return 0;
+#else
+		fprintf(stderr, "radius_test: The signal coalescing benchmark is not supported on this system\n");
 		exit(1);
+#endif
 	}
 
-	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
-		fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
+	if (benchmark) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+		static unsigned int const batch_sizes[] = { 1, 8, 32, 64 };
+		size_t i;
+
+		/*
+		 *	Only print the results.
+		 */
+		default_log.dst = L_DST_NULL;
+
+		printf("%-10s%10s %10s %10s %12s\n", "batch", "replies", "lost", "seconds", "packets/s");
+
+		for (i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]); i++) {
+			test_batch(autofree, num_networks, num_workers, batch_sizes[i], false, false, num_packets);
+		}
+		test_batch(autofree, num_networks, num_workers, 1, true, false, num_packets);
+
+		talloc_free(autofree);
+		return 0;
+#else
+		fprintf(stderr, "radius_test: Batched reads and writes are not supported on this system\n");
 		exit(1);
+#endif
 	}
 
+	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, 1, &transports, NULL, NULL);
+	if (!sched) {
+		fprintf(stderr, "schedule_test: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	sockfd = test_socket();
+
 #if 0
 	/*
 	 *	Set up the KQ filter for reading.
@@ -28,8 +28,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
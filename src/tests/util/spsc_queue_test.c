@@ -0,0 +1,182 @@
+/*
+ * spsc_queue_test.c	Tests for single producer, single consumer queues
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/spsc_queue.h>
+#include <stdint.h>
+#include <string.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define OFFSET	(1024)
+
+static int		debug_lvl = 0;
+
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: spsc_queue_test [OPTS]\n");
+	fprintf(stderr, "  -s size                set queue size.  Must be a power of 2.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void spsc_queue_debug(fr_spsc_queue_t *sq, char const *what)
+{
+#ifndef NDEBUG
+	if (!debug_lvl) return;
+
+	printf("%s\n", what);
+	fr_spsc_queue_debug(sq, stdout);
+#endif
+}
+
+/*
+ *	Pop everything, and check that it comes out in order.
+ */
+static void spsc_queue_drain(fr_spsc_queue_t *sq, int size, int start)
+{
+	int i;
+	intptr_t val;
+	void *data;
+
+	for (i = 0; i < size; i++) {
+		if (!fr_spsc_queue_pop(sq, &data)) {
+			fprintf(stderr, "Failed popping at %d\n", i);
+			exit(1);
+		}
+
+		val = (intptr_t) data;
+		if (val != (start + i + OFFSET)) {
+			fprintf(stderr, "Pop expected %d, got %d\n",
+				start + i + OFFSET, (int) val);
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Queue is empty.  No more pops are allowed.
+	 */
+	if (fr_spsc_queue_pop(sq, &data)) {
+		fprintf(stderr, "Popped an entry past the end of the queue.\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+	int size;
+	intptr_t val;
+	void *data, **array;
+	fr_spsc_queue_t *sq;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	size = 4;
+
+	while ((c = getopt(argc, argv, "hs:x")) != EOF) switch (c) {
+		case 's':
+			size = atoi(optarg);
+			if ((size <= 0) || ((size & (size - 1)) != 0)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	sq = fr_spsc_queue_create(autofree, size);
+	rad_assert(sq != NULL);
+
+	spsc_queue_debug(sq, "Start");
+
+	/*
+	 *	Fill it one entry at a time.
+	 */
+	for (i = 0; i < size; i++) {
+		val = i + OFFSET;
+		data = (void *) val;
+
+		if (!fr_spsc_queue_push(sq, data)) {
+			fprintf(stderr, "Failed pushing at %d\n", i);
+			exit(1);
+		}
+	}
+
+	val = size + OFFSET;
+	data = (void *) val;
+
+	/*
+	 *	Queue is full.  No more pushes are allowed.
+	 */
+	if (fr_spsc_queue_push(sq, data)) {
+		fprintf(stderr, "Pushed an entry past the end of the queue.\n");
+		exit(1);
+	}
+
+	spsc_queue_debug(sq, "Full");
+
+	spsc_queue_drain(sq, size, 0);
+
+	spsc_queue_debug(sq, "Empty");
+
+	/*
+	 *	Fill it again in one batch, so that the indexes wrap.
+	 *	The queue should take only as many as it has room for.
+	 */
+	array = talloc_array(autofree, void *, size + 1);
+	for (i = 0; i <= size; i++) {
+		val = i + OFFSET;
+		array[i] = (void *) val;
+	}
+
+	i = fr_spsc_queue_push_batch(sq, array, size + 1);
+	if (i != size) {
+		fprintf(stderr, "Batch push expected %d, got %d\n", size, i);
+		exit(1);
+	}
+
+	spsc_queue_debug(sq, "Full after batch");
+
+	/*
+	 *	Other threads may pop from a shared queue, so each pop
+	 *	goes through the CAS path.  The order must not change.
+	 */
+	fr_spsc_queue_share(sq);
+
+	spsc_queue_drain(sq, size, 0);
+
+	spsc_queue_debug(sq, "Empty after sharing");
+
+	talloc_free(autofree);
+
+	return 0;
+}
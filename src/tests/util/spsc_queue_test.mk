@@ -0,0 +1,7 @@
+TARGET := spsc_queue_test
+
+SOURCES		:= spsc_queue_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
+
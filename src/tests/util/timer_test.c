@@ -0,0 +1,268 @@
+/*
+ * timer_test.c	Tests and benchmarks for event list timers
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/io/time.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	Timers are spread over this many usec.  That covers
+ *	retransmits, request cleanup, and state expiry.
+ */
+#define MAX_DELAY	(120 * USEC)
+
+/*
+ *	How far we move the clock on each call to
+ *	fr_event_timer_run_all().
+ */
+#define STEP		(10000)
+
+typedef struct timer_test_t {
+	struct timeval		when;		//!< when the timer should fire
+	fr_event_timer_t	*ev;		//!< the timer
+} timer_test_t;
+
+static int		debug_lvl = 0;
+static int		max_timers = 100000;
+static fr_randctx	rand_pool;
+
+static struct timeval	last;		//!< previous run time
+static int		fired;
+static int		errors;
+
+static uint32_t timer_rand(void)
+{
+	uint32_t num;
+
+	num = rand_pool.randrsl[rand_pool.randcnt++];
+	if (rand_pool.randcnt == 256) {
+		fr_isaac(&rand_pool);
+		rand_pool.randcnt = 0;
+	}
+
+	return num;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: timer_test [OPTS]\n");
+	fprintf(stderr, "  -n <num>               Number of timers.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void timer_set(timer_test_t *t, struct timeval const *now)
+{
+	uint32_t delay;
+
+	delay = 1000 + (timer_rand() % MAX_DELAY);
+
+	t->when.tv_sec = now->tv_sec + (delay / USEC);
+	t->when.tv_usec = now->tv_usec + (delay % USEC);
+	if (t->when.tv_usec >= USEC) {
+		t->when.tv_sec++;
+		t->when.tv_usec -= USEC;
+	}
+}
+
+static void timer_fire(UNUSED fr_event_list_t *el, struct timeval *now, void *ctx)
+{
+	timer_test_t *t = ctx;
+
+	MPRINT1("%d.%06d fired at %d.%06d\n",
+		(int) t->when.tv_sec, (int) t->when.tv_usec, (int) now->tv_sec, (int) now->tv_usec);
+
+	/*
+	 *	Timers must fire after they're due, but not
+	 *	later than the run after that.
+	 */
+	if (fr_timeval_cmp(&t->when, now) > 0) {
+		fprintf(stderr, "timer_test: Timer fired early\n");
+		errors++;
+	}
+
+	if (fr_timeval_cmp(&t->when, &last) <= 0) {
+		fprintf(stderr, "timer_test: Timer fired late\n");
+		errors++;
+	}
+
+	fired++;
+}
+
+static uint64_t timer_ns(fr_time_t start, fr_time_t end)
+{
+	return (end - start) / max_timers;
+}
+
+static void timer_bench(TALLOC_CTX *ctx, bool wheel)
+{
+	int		i;
+	fr_event_list_t	*el;
+	timer_test_t	*array;
+	struct timeval	now, when;
+	fr_time_t	start, inserted, rearmed, deleted, end;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	if (!el) {
+		fprintf(stderr, "timer_test: Failed creating event list\n");
+		exit(1);
+	}
+
+	if (wheel && (fr_event_list_timer_wheel(el) < 0)) {
+		fprintf(stderr, "timer_test: Failed creating timer wheel: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	array = talloc_zero_array(ctx, timer_test_t, max_timers);
+
+	gettimeofday(&now, NULL);
+	fired = 0;
+
+	start = fr_time();
+	for (i = 0; i < max_timers; i++) {
+		timer_set(&array[i], &now);
+		if (fr_event_timer_insert(el, timer_fire, &array[i], &array[i].when, &array[i].ev) < 0) {
+			fprintf(stderr, "timer_test: Failed inserting timer: %s\n", fr_strerror());
+			exit(1);
+		}
+	}
+	inserted = fr_time();
+
+	/*
+	 *	Move every timer, which is what happens to
+	 *	retransmit and cleanup timers.
+	 */
+	for (i = 0; i < max_timers; i++) {
+		timer_set(&array[i], &now);
+		(void) fr_event_timer_insert(el, timer_fire, &array[i], &array[i].when, &array[i].ev);
+	}
+	rearmed = fr_time();
+
+	/*
+	 *	Delete every 4th timer, as if the request finished.
+	 */
+	for (i = 0; i < max_timers; i += 4) {
+		(void) fr_event_timer_delete(el, &array[i].ev);
+	}
+	deleted = fr_time();
+
+	/*
+	 *	Nothing is due yet.
+	 */
+	last = now;
+	when = now;
+	if (fr_event_timer_run_all(el, &when) != 0) {
+		fprintf(stderr, "timer_test: Timers fired before they were due\n");
+		errors++;
+	}
+
+	/*
+	 *	Move the clock forward until everything has fired.
+	 */
+	for (i = 0; i <= (MAX_DELAY / STEP) + 1; i++) {
+		when = last;
+		when.tv_usec += STEP;
+		if (when.tv_usec >= USEC) {
+			when.tv_sec++;
+			when.tv_usec -= USEC;
+		}
+		now = when;
+
+		(void) fr_event_timer_run_all(el, &when);
+		last = now;
+	}
+	end = fr_time();
+
+	if (fr_event_list_num_elements(el) != 0) {
+		fprintf(stderr, "timer_test: %d timers did not fire\n", fr_event_list_num_elements(el));
+		errors++;
+	}
+
+	if (fired != (max_timers - ((max_timers + 3) / 4))) {
+		fprintf(stderr, "timer_test: Expected %d timers to fire, got %d\n",
+			max_timers - ((max_timers + 3) / 4), fired);
+		errors++;
+	}
+
+	printf("%-6s insert %5" PRIu64 "ns  rearm %5" PRIu64 "ns  delete %5" PRIu64 "ns  run %5" PRIu64 "ns\n",
+	       wheel ? "wheel" : "heap",
+	       timer_ns(start, inserted), timer_ns(inserted, rearmed),
+	       timer_ns(rearmed, deleted) * 4, timer_ns(deleted, end));
+
+	talloc_free(array);
+	talloc_free(el);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "hn:x")) != EOF) switch (c) {
+		case 'n':
+			max_timers = atoi(optarg);
+			if (max_timers <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	memset(&rand_pool, 0, sizeof(rand_pool));
+	rand_pool.randrsl[1] = time(NULL);
+
+	fr_randinit(&rand_pool, 1);
+	rand_pool.randcnt = 0;
+
+	printf("timers = %d\n", max_timers);
+
+	timer_bench(autofree, false);
+	timer_bench(autofree, true);
+
+	talloc_free(autofree);
+
+	if (errors) {
+		fprintf(stderr, "timer_test: %d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := timer_test
+
+SOURCES		:= timer_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,312 @@
+/*
+ * track_test.c	Tests and benchmarks for the RADIUS tracking table
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/track.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_clients = 4000;
+static int		num_packets = 1000000;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: track_test [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Number of clients for the benchmark.\n");
+	fprintf(stderr, "  -n <num>               Number of packets for the benchmark.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Build a fake packet.  We only care about the ID, length, and
+ *	authentication vector.
+ */
+static void make_packet(uint8_t *packet, uint8_t id, uint32_t vector)
+{
+	memset(packet, 0, 20);
+	packet[0] = 1;
+	packet[1] = id;
+	packet[3] = 20;
+	memcpy(packet + 4, &vector, sizeof(vector));
+}
+
+static void make_ipaddr(fr_ipaddr_t *ipaddr, uint32_t addr)
+{
+	memset(ipaddr, 0, sizeof(*ipaddr));
+	ipaddr->af = AF_INET;
+	ipaddr->prefix = 32;
+	ipaddr->addr.v4.s_addr = htonl(0x0a000000 | addr);
+}
+
+static void test_basic(TALLOC_CTX *ctx)
+{
+	fr_tracking_t		*ft;
+	fr_tracking_entry_t	*entry, *first;
+	fr_ipaddr_t		ipaddr, other;
+	uint8_t			packet[20], reply[20];
+
+	ft = fr_radius_tracking_create(ctx, 16);
+	if (!rad_cond_assert(ft != NULL)) exit(1);
+
+	make_ipaddr(&ipaddr, 1);
+	make_ipaddr(&other, 2);
+
+	make_packet(packet, 1, 0x1234);
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 100, &ipaddr, 1024,
+							     &first) == FR_TRACKING_NEW)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 101, &ipaddr, 1024,
+							     &entry) == FR_TRACKING_SAME)) exit(1);
+	if (!rad_cond_assert(entry == first)) exit(1);
+	if (!rad_cond_assert(entry->timestamp == 100)) exit(1);
+
+	/*
+	 *	Same ID from a different port, or a different client,
+	 *	is a different packet.
+	 */
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 102, &ipaddr, 1025,
+							     &entry) == FR_TRACKING_NEW)) exit(1);
+	if (!rad_cond_assert(entry != first)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 103, &other, 1024,
+							     &entry) == FR_TRACKING_NEW)) exit(1);
+	if (!rad_cond_assert(entry != first)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_num_entries(ft) == 3)) exit(1);
+
+	/*
+	 *	Replies are matched to their request by source and ID.
+	 */
+	if (!rad_cond_assert(fr_radius_tracking_entry_find(ft, &ipaddr, 1024, 1) == first)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_entry_find(ft, &ipaddr, 1024, 2) == NULL)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_entry_find(ft, &ipaddr, 1026, 1) == NULL)) exit(1);
+
+	/*
+	 *	Cache a reply, and get it back for a retransmission.
+	 */
+	make_packet(reply, 1, 0x4321);
+	reply[0] = 2;
+
+	if (!rad_cond_assert(fr_radius_tracking_entry_reply(ft, first, 100, reply, sizeof(reply)) == 0)) exit(1);
+
+	/*
+	 *	The reply is a copy, so the caller's buffer can be re-used.
+	 */
+	memset(reply, 0, sizeof(reply));
+
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 104, &ipaddr, 1024,
+							     &entry) == FR_TRACKING_SAME)) exit(1);
+	if (!rad_cond_assert(entry == first)) exit(1);
+	if (!rad_cond_assert(entry->reply != NULL)) exit(1);
+	if (!rad_cond_assert(entry->reply_len == sizeof(reply))) exit(1);
+	if (!rad_cond_assert((entry->reply[0] == 2) && (entry->reply[1] == 1))) exit(1);
+
+	/*
+	 *	A new packet with the same ID throws away the old reply.
+	 */
+	make_packet(packet, 1, 0x5678);
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 105, &ipaddr, 1024,
+							     &entry) == FR_TRACKING_DIFFERENT)) exit(1);
+	if (!rad_cond_assert(entry == first)) exit(1);
+	if (!rad_cond_assert(entry->reply == NULL)) exit(1);
+	if (!rad_cond_assert(entry->reply_len == 0)) exit(1);
+
+	/*
+	 *	A reply for the old packet is no longer relevant.
+	 */
+	if (!rad_cond_assert(fr_radius_tracking_entry_reply(ft, first, 100, reply, sizeof(reply)) == 0)) exit(1);
+	if (!rad_cond_assert(first->reply == NULL)) exit(1);
+
+	/*
+	 *	Everything but the most recent packet is expired.
+	 */
+	if (!rad_cond_assert(fr_radius_tracking_expire(ft, 105) == 2)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_num_entries(ft) == 1)) exit(1);
+
+	if (!rad_cond_assert(fr_radius_tracking_entry_delete(ft, first) == 0)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_entry_delete(ft, first) < 0)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_num_entries(ft) == 0)) exit(1);
+
+	talloc_free(ft);
+}
+
+/*
+ *	Fill the table past the end, so that the oldest entries are
+ *	evicted, and check that everything else can still be found.
+ */
+static void test_evict(TALLOC_CTX *ctx)
+{
+	int			i, found;
+	fr_tracking_t		*ft;
+	fr_tracking_entry_t	*entry;
+	fr_ipaddr_t		ipaddr;
+	uint8_t			packet[20];
+
+	ft = fr_radius_tracking_create(ctx, 100);
+	if (!rad_cond_assert(ft != NULL)) exit(1);
+
+	for (i = 0; i < 1000; i++) {
+		make_ipaddr(&ipaddr, i / 256);
+		make_packet(packet, i & 0xff, i);
+		if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, i + 1, &ipaddr, 1812,
+								     &entry) == FR_TRACKING_NEW)) exit(1);
+
+		/*
+		 *	Delete some in the middle, to exercise the
+		 *	backwards shift.
+		 */
+		if ((i % 7) == 0) {
+			if (!rad_cond_assert(fr_radius_tracking_entry_delete(ft, entry) == 0)) exit(1);
+		}
+	}
+
+	if (!rad_cond_assert(fr_radius_tracking_num_entries(ft) == 100)) exit(1);
+
+	/*
+	 *	The table holds the 100 most recent packets which
+	 *	weren't deleted.  Retransmissions of those are found.
+	 */
+	for (i = 999, found = 0; found < 100; i--) {
+		if ((i % 7) == 0) continue;
+
+		make_ipaddr(&ipaddr, i / 256);
+		make_packet(packet, i & 0xff, i);
+
+		if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 2000, &ipaddr, 1812,
+								     &entry) == FR_TRACKING_SAME)) exit(1);
+		if (!rad_cond_assert(entry->timestamp == (fr_time_t) (i + 1))) exit(1);
+		found++;
+	}
+
+	/*
+	 *	Older ones have been evicted.
+	 */
+	make_ipaddr(&ipaddr, i / 256);
+	make_packet(packet, i & 0xff, i);
+	if (!rad_cond_assert(fr_radius_tracking_entry_insert(ft, packet, 2000, &ipaddr, 1812,
+							     &entry) == FR_TRACKING_NEW)) exit(1);
+
+	if (!rad_cond_assert(fr_radius_tracking_expire(ft, 2000) == 99)) exit(1);
+	if (!rad_cond_assert(fr_radius_tracking_num_entries(ft) == 1)) exit(1);
+
+	talloc_free(ft);
+}
+
+/*
+ *	Many clients each sending a stream of packets, with a few
+ *	retransmissions.  Old entries are expired as we go.
+ */
+static void test_benchmark(TALLOC_CTX *ctx)
+{
+	int			i, same = 0;
+	uint32_t		client = 0;
+	fr_tracking_t		*ft;
+	fr_tracking_entry_t	*entry;
+	fr_ipaddr_t		ipaddr;
+	uint8_t			packet[20];
+	uint32_t		seed = 0x12345678;
+	fr_time_t		start, end;
+
+	ft = fr_radius_tracking_create(ctx, num_clients * 256);
+	if (!rad_cond_assert(ft != NULL)) exit(1);
+
+	start = fr_time();
+	for (i = 0; i < num_packets; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		/*
+		 *	One packet in 16 is a retransmission of the
+		 *	previous one.
+		 */
+		if ((i == 0) || ((seed & 0x0f0000) != 0)) {
+			client = seed % num_clients;
+			make_ipaddr(&ipaddr, client);
+			make_packet(packet, i & 0xff, i);
+		}
+
+		if (fr_radius_tracking_entry_insert(ft, packet, i + 1, &ipaddr, 1024 + (client & 0xff),
+						    &entry) == FR_TRACKING_SAME) same++;
+
+		if ((i & 0xfff) == 0) (void) fr_radius_tracking_expire(ft, (i > 65536) ? i - 65536 : 0);
+	}
+	end = fr_time();
+
+	printf("clients = %d  packets = %d  retransmits = %d  entries = %u\n",
+	       num_clients, num_packets, same, fr_radius_tracking_num_entries(ft));
+	printf("elapsed = %" PRIu64 "ns\n", end - start);
+	if (end > start) printf("packets/s = %" PRIu64 "\n", ((uint64_t) num_packets * NANOSEC) / (end - start));
+
+	talloc_free(ft);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:hn:x")) != EOF) switch (c) {
+		case 'c':
+			num_clients = atoi(optarg);
+			if (num_clients <= 0) usage();
+			break;
+
+		case 'n':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_basic(autofree);
+	MPRINT1("Basic tests passed\n");
+
+	test_evict(autofree);
+	MPRINT1("Eviction tests passed\n");
+
+	test_benchmark(autofree);
+
+	talloc_free(autofree);
+
+	return 0;
+}